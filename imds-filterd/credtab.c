@@ -0,0 +1,312 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "warnp.h"
+
+#include "imds-filterd.h"
+
+/*
+ * When a process opens a connection to the IMDS, we see its SYN on its way
+ * into the jail; we look up who owns the connection then, and publish the
+ * answer in a table in a file which imds-proxy maps into its address space,
+ * so that when imds-proxy accepts the connection it can find out who made it
+ * without asking us.  The table is direct-mapped -- each connection has one
+ * slot, determined by a hash of its addresses and ports, and a new
+ * connection evicts whatever was in its slot -- so a reader needs only one
+ * probe, and falls back to asking us if the connection isn't there.
+ *
+ * We are the only writer.  Each slot is protected by a sequence number which
+ * is odd while we're writing the slot; a reader copies the slot and then
+ * checks that the sequence number was even and hasn't changed.  If imds-proxy
+ * is still using a table when we exit (or when we start and find a table
+ * left behind by a previous instance which didn't exit cleanly), we mark it
+ * as dead, so that imds-proxy won't trust it any longer.
+ *
+ * Both processes are on the same host, so values are in host byte order.
+ */
+
+/* Identifies a credential table, and its layout. */
+#define CREDTAB_MAGIC "IMDSCRED"
+#define CREDTAB_VERSION 1
+
+/* Number of slots; must be a power of 2. */
+#define CREDTAB_NSLOTS 4096
+
+/* Table header. */
+struct credtab_hdr {
+	uint8_t magic[8];
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t dead;
+	uint32_t pad;
+};
+
+/* A slot in the table. */
+struct credtab_slot {
+	uint32_t seq;
+	uint8_t query[12];
+	uint32_t uid;
+	uint32_t ngroups;	/* 0 if the slot is empty. */
+	uint32_t groups[IDENT_NGROUPS];
+};
+
+/* A credential table which we're publishing. */
+struct credtab {
+	int fd;
+	size_t len;
+	struct credtab_hdr * hdr;
+	struct credtab_slot * slots;
+	struct getcred * G;
+};
+
+/* Return the slot for the connection described by ${query}. */
+static struct credtab_slot *
+slot(struct credtab * T, const uint8_t * query)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	/* FNV-1a hash of the addresses and ports. */
+	for (i = 0; i < 12; i++) {
+		h ^= query[i];
+		h *= 16777619U;
+	}
+
+	/* Pick the slot. */
+	return (&T->slots[h & (CREDTAB_NSLOTS - 1)]);
+}
+
+/* Start writing to the slot ${S}. */
+static void
+write_begin(struct credtab_slot * S)
+{
+
+	/* Readers must see that the slot is in flux before anything else. */
+	__atomic_store_n(&S->seq, S->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Finish writing to the slot ${S}. */
+static void
+write_end(struct credtab_slot * S)
+{
+
+	/* Readers must see everything we wrote before they see this. */
+	__atomic_store_n(&S->seq, S->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Mark the table mapped at ${hdr} as dead. */
+static void
+markdead(struct credtab_hdr * hdr)
+{
+
+	__atomic_store_n(&hdr->dead, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * credtab_kill(path):
+ * If there is a credential table at ${path}, mark it as dead (so that
+ * imds-proxy stops using it) and remove it.
+ */
+void
+credtab_kill(const char * path)
+{
+	struct credtab_hdr * hdr;
+	int fd;
+
+	/* Is there a table there? */
+	if ((fd = open(path, O_RDWR)) == -1) {
+		if (errno != ENOENT)
+			warnp("open(%s)", path);
+		return;
+	}
+
+	/* Mark it as dead, if it's big enough to be a table. */
+	if ((hdr = mmap(NULL, sizeof(struct credtab_hdr),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		warnp("mmap(%s)", path);
+	} else {
+		markdead(hdr);
+		munmap(hdr, sizeof(struct credtab_hdr));
+	}
+
+	/* Remove it. */
+	close(fd);
+	if (unlink(path))
+		warnp("unlink(%s)", path);
+}
+
+/**
+ * credtab_init(path):
+ * Create a credential table at ${path}, replacing (and killing) any table
+ * already there.
+ */
+struct credtab *
+credtab_init(const char * path)
+{
+	struct credtab * T;
+
+	/* Allocate a structure. */
+	if ((T = malloc(sizeof(struct credtab))) == NULL)
+		goto err0;
+	T->len = sizeof(struct credtab_hdr) +
+	    CREDTAB_NSLOTS * sizeof(struct credtab_slot);
+
+	/* We need to look up the owners of connections. */
+	if ((T->G = getcred_init(1)) == NULL) {
+		warnp("getcred_init");
+		goto err1;
+	}
+
+	/* Get rid of any existing table. */
+	credtab_kill(path);
+
+	/* Create the file; only imds-proxy should be able to read it. */
+	if ((T->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+		warnp("open(%s)", path);
+		goto err2;
+	}
+	if (ftruncate(T->fd, (off_t)T->len)) {
+		warnp("ftruncate(%s)", path);
+		goto err3;
+	}
+
+	/* Map it; the file is zero-filled, so every slot is empty. */
+	if ((T->hdr = mmap(NULL, T->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    T->fd, 0)) == MAP_FAILED) {
+		warnp("mmap(%s)", path);
+		goto err3;
+	}
+	T->slots = (struct credtab_slot *)&T->hdr[1];
+
+	/* Fill in the header. */
+	memcpy(T->hdr->magic, CREDTAB_MAGIC, 8);
+	T->hdr->version = CREDTAB_VERSION;
+	T->hdr->nslots = CREDTAB_NSLOTS;
+	T->hdr->dead = 0;
+
+	/* Success! */
+	return (T);
+
+err3:
+	close(T->fd);
+	unlink(path);
+err2:
+	getcred_free(T->G);
+err1:
+	free(T);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * credtab_add(T, query):
+ * Look up the owner of the new TCP connection described by the 12-byte
+ * ${query} and publish its credentials in the table ${T}.
+ */
+void
+credtab_add(struct credtab * T, const uint8_t * query)
+{
+	struct credtab_slot * S = slot(T, query);
+	struct getcred_cred cred;
+	size_t i;
+
+	/* Whatever was in this slot before, it isn't valid now. */
+	write_begin(S);
+
+	/* Look up the owner of the connection. */
+	if (getcred_lookup(T->G, query, &cred)) {
+		/* imds-proxy will have to ask us later. */
+		S->ngroups = 0;
+		goto done;
+	}
+
+	/* Fill in the slot. */
+	memcpy(S->query, query, 12);
+	S->uid = (uint32_t)cred.uid;
+	S->ngroups = (uint32_t)cred.ngroups;
+	for (i = 0; i < IDENT_NGROUPS; i++)
+		S->groups[i] =
+		    (i < cred.ngroups) ? (uint32_t)cred.groups[i] : 0;
+
+done:
+	/* The slot is consistent again. */
+	write_end(S);
+}
+
+/**
+ * credtab_remove(T, query):
+ * Remove the TCP connection described by the 12-byte ${query} from the
+ * table ${T}, if it is there.
+ */
+void
+credtab_remove(struct credtab * T, const uint8_t * query)
+{
+	struct credtab_slot * S = slot(T, query);
+
+	/* Is this connection in the slot? */
+	if ((S->ngroups == 0) || memcmp(S->query, query, 12))
+		return;
+
+	/* Empty the slot. */
+	write_begin(S);
+	S->ngroups = 0;
+	write_end(S);
+}
+
+/**
+ * credtab_lookup(T, query, cred):
+ * If the TCP connection described by the 12-byte ${query} is in the table
+ * ${T}, return its credentials via ${cred}; otherwise, return -1.
+ */
+int
+credtab_lookup(struct credtab * T, const uint8_t * query,
+    struct getcred_cred * cred)
+{
+	struct credtab_slot * S = slot(T, query);
+	size_t i;
+
+	/* Is this connection in the slot? */
+	if ((S->ngroups == 0) || memcmp(S->query, query, 12))
+		return (-1);
+
+	/* Copy out the credentials. */
+	cred->uid = (uid_t)S->uid;
+	cred->ngroups = S->ngroups;
+	for (i = 0; i < cred->ngroups; i++)
+		cred->groups[i] = (gid_t)S->groups[i];
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * credtab_free(T):
+ * Mark the credential table ${T} as dead and free it.  The caller should
+ * remove the file.
+ */
+void
+credtab_free(struct credtab * T)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (T == NULL)
+		return;
+
+	/* Tell imds-proxy not to trust the table any more. */
+	markdead(T->hdr);
+
+	/* Unmap and close the file, and free the structure. */
+	munmap(T->hdr, T->len);
+	close(T->fd);
+	getcred_free(T->G);
+	free(T);
+}
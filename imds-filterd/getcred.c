@@ -0,0 +1,703 @@
+#define __BSD_VISIBLE	1	/* Needed for sys/ucred.h header. */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#if defined(__linux__)
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#else
+#include <sys/sysctl.h>
+#include <sys/ucred.h>
+
+#include <assert.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctassert.h"
+#include "warnp.h"
+
+#include "imds-filterd.h"
+
+#if defined(__linux__)
+/*
+ * On Linux, the kernel tells us (via NETLINK_SOCK_DIAG) the uid which owns a
+ * TCP connection, and the inode number of its socket; but finding the
+ * groups of the process holding the socket means finding the process, and
+ * the only way to do that is to look through the file descriptors in /proc.
+ * With thousands of sockets open, doing that for every query is slow, so we
+ * remember which process held each socket we saw the last time we looked
+ * through all of /proc, and which processes recently made the connections we
+ * were asked about.  A process which connects to the IMDS once will usually
+ * do so again, so we look through the (probably few) file descriptors of
+ * those processes before resorting to looking through all of them.
+ *
+ * The uid comes from the socket, but the groups come from whichever process
+ * holds it now, which need not be the process which created it: a socket
+ * can be passed to another process (with SCM_RIGHTS) or kept across an exec
+ * of a setgid program.  Rather than report one user's uid with another
+ * process' groups, we refuse to answer unless the process holding the
+ * socket is running as the uid which owns it, without a setgid gid.  (On
+ * FreeBSD the kernel gives us the credentials the socket was created with,
+ * so this can't happen.)
+ */
+
+/* Number of processes which recently made connections to remember. */
+#define NRECENT 8
+
+/* A socket seen in /proc, and where we saw it. */
+struct sockent {
+	ino_t ino;		/* 0 if this slot is empty. */
+	pid_t pid;
+	int fd;
+};
+
+/* State for looking up connection owners. */
+struct getcred {
+	int nl;
+	int cache;
+	uint32_t seq;
+
+	/* Hash table of sockets, keyed by inode number. */
+	struct sockent * tab;
+	size_t tabsize;
+	size_t tabcount;
+
+	/* Processes which recently made connections, most recent first. */
+	pid_t recent[NRECENT];
+	size_t nrecent;
+};
+
+/* Initial size of the hash table of sockets; must be a power of 2. */
+#define TABSIZE_INIT 1024
+
+/* Slot in which the socket ${ino} is, or should be, in the table. */
+static struct sockent *
+tab_slot(struct getcred * G, ino_t ino)
+{
+	size_t i;
+
+	/* Linear probing from the slot given by a multiplicative hash. */
+	i = (size_t)(((uint64_t)ino * 0x9e3779b97f4a7c15ULL) >> 32);
+	for (i &= G->tabsize - 1; ; i = (i + 1) & (G->tabsize - 1)) {
+		if ((G->tab[i].ino == ino) || (G->tab[i].ino == 0))
+			return (&G->tab[i]);
+	}
+}
+
+/* Record that ${pid} holds the socket ${ino} as file descriptor ${fd}. */
+static int
+tab_insert(struct getcred * G, ino_t ino, pid_t pid, int fd)
+{
+	struct sockent * otab = G->tab;
+	struct sockent * E;
+	size_t otabsize = G->tabsize;
+	size_t i;
+
+	/* Keep the table no more than half full. */
+	if ((G->tabcount + 1) * 2 > G->tabsize) {
+		if ((G->tab = calloc(otabsize * 2,
+		    sizeof(struct sockent))) == NULL) {
+			G->tab = otab;
+			goto err0;
+		}
+		G->tabsize = otabsize * 2;
+		for (i = 0; i < otabsize; i++) {
+			if (otab[i].ino != 0)
+				*tab_slot(G, otab[i].ino) = otab[i];
+		}
+		free(otab);
+	}
+
+	/* Add (or update) the entry. */
+	E = tab_slot(G, ino);
+	if (E->ino == 0)
+		G->tabcount++;
+	E->ino = ino;
+	E->pid = pid;
+	E->fd = fd;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Forget every socket in the table. */
+static void
+tab_clear(struct getcred * G)
+{
+
+	memset(G->tab, 0, G->tabsize * sizeof(struct sockent));
+	G->tabcount = 0;
+}
+
+/*
+ * Ask the kernel about the TCP connection described by ${query}, and return
+ * the uid which owns it via ${uid} and the inode number of its socket via
+ * ${ino}.
+ */
+static int
+diag(struct getcred * G, const uint8_t * query, uid_t * uid, ino_t * ino)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+	} req;
+	long buf[1024];
+	struct nlmsghdr * nlh;
+	struct nlmsgerr * e;
+	struct inet_diag_msg * m;
+	ssize_t len;
+
+	/* Construct a request for the one connection we want. */
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = ++G->seq;
+	req.r.sdiag_family = AF_INET;
+	req.r.sdiag_protocol = IPPROTO_TCP;
+	req.r.idiag_states = ~0U;
+	memcpy(&req.r.id.idiag_src[0], &query[0], 4);
+	memcpy(&req.r.id.idiag_sport, &query[4], 2);
+	memcpy(&req.r.id.idiag_dst[0], &query[6], 4);
+	memcpy(&req.r.id.idiag_dport, &query[10], 2);
+	req.r.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+	req.r.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+	/* Send the request. */
+	if (send(G->nl, &req, sizeof(req), 0) != (ssize_t)sizeof(req)) {
+		warnp("send(NETLINK_SOCK_DIAG)");
+		goto err0;
+	}
+
+	/* Read responses until we get the one for our request. */
+	do {
+		if ((len = recv(G->nl, buf, sizeof(buf), 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warnp("recv(NETLINK_SOCK_DIAG)");
+			goto err0;
+		}
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		    nlh = NLMSG_NEXT(nlh, len)) {
+			/* Ignore stale responses to earlier requests. */
+			if (nlh->nlmsg_seq != G->seq)
+				continue;
+
+			/* Did the kernel find the connection? */
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				e = NLMSG_DATA(nlh);
+				errno = -e->error;
+				goto err0;
+			}
+			if (nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+				continue;
+			m = NLMSG_DATA(nlh);
+
+			/* A socket which has been closed has no inode. */
+			if (m->idiag_inode == 0) {
+				errno = ENOENT;
+				goto err0;
+			}
+
+			/* We have what we need. */
+			*uid = (uid_t)m->idiag_uid;
+			*ino = (ino_t)m->idiag_inode;
+			return (0);
+		}
+	} while (1);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Look through the file descriptors of ${pid} for the socket ${ino}, and
+ * return 1 if we find it or 0 if not; if ${record} is non-zero, record every
+ * socket we see in the table.  Return -1 if the process has gone away or
+ * can't be inspected.
+ */
+static int
+fdscan(struct getcred * G, pid_t pid, ino_t ino, int record)
+{
+	char path[64];
+	char link[64];
+	struct dirent * de;
+	DIR * d;
+	ssize_t len;
+	unsigned long long n;
+	int found = 0;
+	int fd;
+
+	/* Open the directory of file descriptors. */
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	if ((d = opendir(path)) == NULL)
+		return (-1);
+
+	/* Look at each file descriptor in turn. */
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if ((len = readlinkat(dirfd(d), de->d_name, link,
+		    sizeof(link) - 1)) == -1)
+			continue;
+		link[len] = '\0';
+
+		/* We only care about sockets. */
+		if (sscanf(link, "socket:[%llu]", &n) != 1)
+			continue;
+		fd = atoi(de->d_name);
+
+		/* Record the socket, if wanted. */
+		if (record && tab_insert(G, (ino_t)n, pid, fd))
+			record = 0;
+
+		/* Is this the one we're looking for? */
+		if ((ino_t)n == ino) {
+			found = 1;
+			if (!record)
+				break;
+		}
+	}
+
+	/* Clean up. */
+	closedir(d);
+
+	/* Tell the caller if we found it. */
+	return (found);
+}
+
+/*
+ * Look through the file descriptors of every process for the socket ${ino},
+ * and return the process holding it via ${pid}.  If we are caching, record
+ * every socket we see in the table instead of what we recorded last time.
+ */
+static int
+walk(struct getcred * G, ino_t ino, pid_t * pid)
+{
+	struct dirent * de;
+	DIR * d;
+	char * end;
+	long p;
+	int found = 0;
+
+	/* Start again from scratch. */
+	if (G->cache)
+		tab_clear(G);
+
+	/* Look at each process. */
+	if ((d = opendir("/proc")) == NULL) {
+		warnp("opendir(/proc)");
+		goto err0;
+	}
+	while ((de = readdir(d)) != NULL) {
+		p = strtol(de->d_name, &end, 10);
+		if ((end == de->d_name) || (*end != '\0') || (p <= 0))
+			continue;
+		if (fdscan(G, (pid_t)p, ino, G->cache) != 1)
+			continue;
+		*pid = (pid_t)p;
+		found = 1;
+		if (!G->cache)
+			break;
+	}
+	closedir(d);
+
+	/* Did we find it? */
+	if (!found) {
+		errno = ENOENT;
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Remember that ${pid} recently made a connection. */
+static void
+recent_add(struct getcred * G, pid_t pid)
+{
+	size_t i;
+
+	/* Find it, or the end of the list (dropping the oldest if full). */
+	for (i = 0; i < G->nrecent; i++) {
+		if (G->recent[i] == pid)
+			break;
+	}
+	if (i == G->nrecent) {
+		if (G->nrecent < NRECENT)
+			G->nrecent++;
+		else
+			i--;
+	}
+
+	/* Move everything before it down, and put it at the front. */
+	memmove(&G->recent[1], &G->recent[0], i * sizeof(pid_t));
+	G->recent[0] = pid;
+}
+
+/* Find the process holding the socket ${ino}, and return it via ${pid}. */
+static int
+findpid(struct getcred * G, ino_t ino, pid_t * pid)
+{
+	struct sockent * E;
+	char path[64];
+	char link[64];
+	char want[64];
+	ssize_t len;
+	size_t i;
+
+	/* Without a cache, we can only look everywhere. */
+	if (!G->cache)
+		return (walk(G, ino, pid));
+
+	/* Did we see the socket last time we looked everywhere? */
+	E = tab_slot(G, ino);
+	if (E->ino == ino) {
+		/* Make sure the process still has it. */
+		snprintf(path, sizeof(path), "/proc/%d/fd/%d",
+		    (int)E->pid, E->fd);
+		snprintf(want, sizeof(want), "socket:[%llu]",
+		    (unsigned long long)ino);
+		if (((len = readlink(path, link, sizeof(link) - 1)) != -1) &&
+		    ((size_t)len == strlen(want)) &&
+		    (memcmp(link, want, (size_t)len) == 0)) {
+			*pid = E->pid;
+			goto found;
+		}
+	}
+
+	/* Did one of the processes which recently made connections? */
+	for (i = 0; i < G->nrecent; i++) {
+		if (fdscan(G, G->recent[i], ino, 0) == 1) {
+			*pid = G->recent[i];
+			goto found;
+		}
+	}
+
+	/* Look everywhere. */
+	if (walk(G, ino, pid))
+		goto err0;
+
+found:
+	/* This process may well make more connections. */
+	recent_add(G, *pid);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Check that ${pid} is running as the uid in ${cred} and isn't setgid, and
+ * read its effective and supplementary groups into ${cred}.
+ */
+static int
+readgroups(pid_t pid, struct getcred_cred * cred)
+{
+	char path[64];
+	char line[4096];
+	FILE * f;
+	char * p;
+	char * end;
+	unsigned long r, e, g;
+	int haveuid = 0;
+	int haveegid = 0;
+
+	/* Open the process' status file. */
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		warnp("fopen(%s)", path);
+		goto err0;
+	}
+
+	/* Find the "Uid:", "Gid:", and "Groups:" lines, in that order. */
+	cred->ngroups = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "Uid:", 4) == 0) {
+			/* Real, effective, saved set, and filesystem uids. */
+			if (sscanf(line, "Uid:\t%lu\t%lu", &r, &e) != 2)
+				break;
+			if ((r != (unsigned long)cred->uid) ||
+			    (e != (unsigned long)cred->uid)) {
+				warn0("Process %d is not running as uid %lu",
+				    (int)pid, (unsigned long)cred->uid);
+				goto err1;
+			}
+			haveuid = 1;
+		} else if (haveuid && (strncmp(line, "Gid:", 4) == 0)) {
+			/* Real, effective, saved set, and filesystem gids. */
+			if (sscanf(line, "Gid:\t%lu\t%lu", &r, &g) != 2)
+				break;
+			if (r != g) {
+				warn0("Process %d is running setgid", (int)pid);
+				goto err1;
+			}
+			cred->groups[cred->ngroups++] = (gid_t)g;
+			haveegid = 1;
+		} else if (haveegid && (strncmp(line, "Groups:", 7) == 0)) {
+			for (p = &line[7]; ; p = end) {
+				g = strtoul(p, &end, 10);
+				if (end == p)
+					break;
+
+				/*
+				 * We can't drop groups: a rule denying access
+				 * to one of them would be silently bypassed.
+				 */
+				if (cred->ngroups == IDENT_NGROUPS) {
+					warn0("Process %d is in too many "
+					    "groups", (int)pid);
+					goto err1;
+				}
+				cred->groups[cred->ngroups++] = (gid_t)g;
+			}
+			break;
+		}
+	}
+	if (!haveegid) {
+		warn0("Could not read groups from %s", path);
+		goto err1;
+	}
+
+	/* Clean up. */
+	fclose(f);
+
+	/* Success! */
+	return (0);
+
+err1:
+	fclose(f);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * getcred_init(cache):
+ * Prepare to look up the owners of TCP connections.  On Linux, if ${cache}
+ * is non-zero, remember which processes hold which sockets rather than
+ * searching /proc for every lookup; elsewhere, ${cache} is ignored.
+ */
+struct getcred *
+getcred_init(int cache)
+{
+	struct getcred * G;
+
+	/* Allocate a structure. */
+	if ((G = malloc(sizeof(struct getcred))) == NULL)
+		goto err0;
+	G->cache = cache;
+	G->seq = 0;
+	G->tabsize = TABSIZE_INIT;
+	G->tabcount = 0;
+	G->nrecent = 0;
+
+	/* Allocate the (empty) hash table. */
+	if ((G->tab = calloc(G->tabsize, sizeof(struct sockent))) == NULL)
+		goto err1;
+
+	/* Open a socket for asking the kernel about TCP connections. */
+	if ((G->nl = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+	    NETLINK_SOCK_DIAG)) == -1) {
+		warnp("socket(NETLINK_SOCK_DIAG)");
+		goto err2;
+	}
+
+	/* Success! */
+	return (G);
+
+err2:
+	free(G->tab);
+err1:
+	free(G);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * getcred_lookup(G, query, cred):
+ * Look up the owner of the TCP connection described by the 12-byte ${query}
+ * [4 byte src IP][2 byte src port][4 byte dst IP][2 byte dst port] (in
+ * network byte order, with the source being the owner's end), and return
+ * its credentials via ${cred}.
+ */
+int
+getcred_lookup(struct getcred * G, const uint8_t * query,
+    struct getcred_cred * cred)
+{
+	ino_t ino;
+	pid_t pid;
+
+	/* Who owns the connection, and what is its socket? */
+	if (diag(G, query, &cred->uid, &ino)) {
+		/* Not fatal; we might have lost a race against a close. */
+		warnp("NETLINK_SOCK_DIAG");
+		goto err0;
+	}
+
+	/* Which process holds the socket? */
+	if (findpid(G, ino, &pid)) {
+		warnp("Could not find process holding socket %llu",
+		    (unsigned long long)ino);
+		goto err0;
+	}
+
+	/* Is it running as the owner, and what groups is it in? */
+	if (readgroups(pid, cred))
+		goto err0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * getcred_free(G):
+ * Free the state ${G}.
+ */
+void
+getcred_free(struct getcred * G)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (G == NULL)
+		return;
+
+	/* Close the socket and free the table and the structure. */
+	close(G->nl);
+	free(G->tab);
+	free(G);
+}
+#else
+/* The credentials returned by the kernel fit in the ones we return. */
+CTASSERT(XU_NGROUPS <= IDENT_NGROUPS);
+
+/* State for looking up connection owners. */
+struct getcred {
+	int mib[CTL_MAXNAME];	/* MIB for net.inet.tcp.getcred. */
+	size_t miblen;
+};
+
+/**
+ * getcred_init(cache):
+ * Prepare to look up the owners of TCP connections.  On Linux, if ${cache}
+ * is non-zero, remember which processes hold which sockets rather than
+ * searching /proc for every lookup; elsewhere, ${cache} is ignored.
+ */
+struct getcred *
+getcred_init(int cache)
+{
+	struct getcred * G;
+
+	/* Allocate a structure. */
+	if ((G = malloc(sizeof(struct getcred))) == NULL)
+		goto err0;
+
+	/* Look up the MIB once, rather than by name for every query. */
+	G->miblen = CTL_MAXNAME;
+	if (sysctlnametomib("net.inet.tcp.getcred", G->mib, &G->miblen)) {
+		warnp("sysctlnametomib(net.inet.tcp.getcred)");
+		goto err1;
+	}
+
+	/* Success! */
+	return (G);
+
+err1:
+	free(G);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * getcred_lookup(G, query, cred):
+ * Look up the owner of the TCP connection described by the 12-byte ${query}
+ * [4 byte src IP][2 byte src port][4 byte dst IP][2 byte dst port] (in
+ * network byte order, with the source being the owner's end), and return
+ * its credentials via ${cred}.
+ */
+int
+getcred_lookup(struct getcred * G, const uint8_t * query,
+    struct getcred_cred * cred)
+{
+	struct sockaddr_in addrs[2];
+	struct xucred uc;
+	size_t size = sizeof(struct xucred);
+	size_t i;
+
+	/* Parse the query. */
+	addrs[0].sin_len = sizeof(struct sockaddr_in);
+	addrs[0].sin_family = AF_INET;
+	memcpy(&addrs[0].sin_addr, &query[0], 4);
+	memcpy(&addrs[0].sin_port, &query[4], 2);
+	addrs[1].sin_len = sizeof(struct sockaddr_in);
+	addrs[1].sin_family = AF_INET;
+	memcpy(&addrs[1].sin_addr, &query[6], 4);
+	memcpy(&addrs[1].sin_port, &query[10], 2);
+
+	/* Ask the kernel who owns this TCP connection. */
+	if (sysctl(G->mib, (u_int)G->miblen, &uc, &size,
+	    addrs, sizeof(addrs))) {
+		/* Not fatal; we might have lost a race against a close. */
+		warnp("sysctl(net.inet.tcp.getcred)");
+		goto err0;
+	}
+
+	/* Sanity-check. */
+	assert(uc.cr_ngroups <= XU_NGROUPS);
+
+	/* Copy out the credentials. */
+	cred->uid = uc.cr_uid;
+	cred->ngroups = (size_t)uc.cr_ngroups;
+	for (i = 0; i < cred->ngroups; i++)
+		cred->groups[i] = uc.cr_groups[i];
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * getcred_free(G):
+ * Free the state ${G}.
+ */
+void
+getcred_free(struct getcred * G)
+{
+
+	/* Behave consistently with free(NULL). */
+	free(G);
+}
+#endif
@@ -1,43 +1,146 @@
-#define __BSD_VISIBLE	1	/* Needed for sys/ucred.h header. */
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/sysctl.h>
-#include <sys/ucred.h>
 
+#include <arpa/inet.h>
 #include <netinet/in.h>
 
-#include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "ctassert.h"
 #include "network.h"
 #include "sock.h"
 #include "warnp.h"
 
 #include "imds-filterd.h"
 
+/*
+ * Each connection normally carries a single query.  A client which sends a
+ * query with a source and destination address of 0.0.0.0:0 -- which can't
+ * identify a real TCP connection -- instead gets a persistent channel, and
+ * the last 4 bytes of the query (in network byte order) select the format
+ * of the responses.  The client then sends any number of queries, each
+ * preceded by a 4-byte tag of its choice, and we answer them in order:
+ * - In version 0, with a line "tag uid gid[,gid]*\n", or "tag -\n" if we
+ *   can't identify the connection, where the tag is printed as an unsigned
+ *   integer in host byte order.
+ * - In version 1, with a fixed-size record: the tag as it was sent, then
+ *   a 32-bit status (0 if we identified the connection, 1 if not), uid, and
+ *   group count, then IDENT_NGROUPS 32-bit gids of which the unused ones are
+ *   zero, all in network byte order.
+ * In version 2, the client instead sends batches of up to IDENT_MAXBATCH
+ * tagged queries, each batch preceded by a 32-bit count in network byte
+ * order, and we answer each batch with a single write of version 1 records,
+ * one per query, in order.
+ * This saves the client from connecting to us (and us from accepting a
+ * connection) for every query, version 1 saves us both from formatting and
+ * parsing text, and version 2 lets a client which has several connections
+ * to identify do so in a single round trip.
+ */
+
+/* Length of a query, and of a tag on a persistent channel. */
+#define QUERYLEN 12
+#define TAGLEN 4
+
+/* Response formats on a persistent channel. */
+#define CHAN_NONE -1	/* Not a persistent channel. */
+#define CHAN_TEXT 0
+#define CHAN_BINARY 1
+#define CHAN_BATCH 2
+
+/* Most queries in a batch. */
+#define IDENT_MAXBATCH 64
+
+/* Length of a binary response. */
+#define RECLEN (TAGLEN + 12 + IDENT_NGROUPS * 4)
+
+/* Status codes in binary responses. */
+#define STATUS_OK 0
+#define STATUS_UNKNOWN 1
+
+/* Longest text response. */
+#define TEXTLEN (sizeof(uint32_t) * 3 + 1 + \
+    sizeof(uid_t) * 3 + 1 + IDENT_NGROUPS * (sizeof(gid_t) * 3 + 1) + 1)
+
+/* The response buffer is sized for batches, but is used for text too. */
+CTASSERT(TEXTLEN <= IDENT_MAXBATCH * RECLEN);
+
 /* State for connection accepting. */
 struct astate {
 	int s;
+	struct getcred * G;
+	struct credtab * T;
 };
 
 /* State for a single connection. */
 struct cstate {
+	const struct astate * as;
 	int s;
-	uint8_t inbuf[12];
-	char outbuf[sizeof(uid_t) * 3 + 1 + XU_NGROUPS * (sizeof(gid_t) * 3 + 1) + 1];
+	int chan;
+	uint32_t tag;
+	size_t nbatch;
+	uint8_t inbuf[IDENT_MAXBATCH * (TAGLEN + QUERYLEN)];
+	char outbuf[IDENT_MAXBATCH * RECLEN];
 	size_t olen;
 };
 
+/* Forward declaration. */
+static int gotdata(void *, ssize_t);
+
+/*
+ * Look up the owner of the connection described by ${query}, from the
+ * credential table if we have one and the connection is in it.
+ */
+static int
+lookup(const struct astate * as, const uint8_t * query,
+    struct getcred_cred * cred)
+{
+
+	/* Try the credential table first. */
+	if ((as->T != NULL) && (credtab_lookup(as->T, query, cred) == 0))
+		return (0);
+
+	/* Ask the kernel. */
+	return (getcred_lookup(as->G, query, cred));
+}
+
+/* Read the next query (or batch of queries) from a persistent channel. */
+static int
+readquery(struct cstate * cs)
+{
+	size_t len;
+
+	/* Read the tag and the query, or the size of the next batch. */
+	if (cs->chan == CHAN_BATCH) {
+		cs->nbatch = 0;
+		len = 4;
+	} else {
+		len = TAGLEN + QUERYLEN;
+	}
+	if (network_read(cs->s, cs->inbuf, len, len, gotdata, cs) == NULL) {
+		warnp("network_read");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
 /* We have sent a response. */
 static int
 sentdata(void * cookie, ssize_t len)
 {
 	struct cstate * cs = cookie;
 
-	/* Don't care if we succeeded. */
-	(void)len; /* UNUSED */
+	/* On a persistent channel, wait for the next query. */
+	if ((cs->chan != CHAN_NONE) && (len != -1) && (readquery(cs) == 0))
+		return (0);
 
 	/* Clean up the connection. */
 	close(cs->s);
@@ -47,58 +150,198 @@ sentdata(void * cookie, ssize_t len)
 	return (0);
 }
 
+/*
+ * Write "uid${sep}gid[,gid]*\n" for the credentials ${cred} to ${buf}; return
+ * the length written.
+ */
+static int
+fmttext(const struct getcred_cred * cred, char * buf, char sep)
+{
+	int printlen;
+	int len;
+	size_t i;
+
+	/* Construct a response. */
+	if ((len = sprintf(buf, "%u%c", (unsigned int)cred->uid, sep)) < 0) {
+		warnp("sprintf");
+		goto err0;
+	}
+	for (i = 0; i < cred->ngroups; i++) {
+		if ((printlen = sprintf(&buf[len], "%u,",
+		    (unsigned int)cred->groups[i])) < 0) {
+			warnp("sprintf");
+			goto err0;
+		}
+		len += printlen;
+	}
+	buf[len - 1] = '\n';
+
+	/* Success! */
+	return (len);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Read a 32-bit value in network byte order from ${buf}. */
+static uint32_t
+get32(const uint8_t * buf)
+{
+	uint32_t x;
+
+	memcpy(&x, buf, 4);
+	return (ntohl(x));
+}
+
+/* Store the 32-bit value ${x} at ${buf} in network byte order. */
+static void
+put32(uint8_t * buf, uint32_t x)
+{
+
+	x = htonl(x);
+	memcpy(buf, &x, 4);
+}
+
+/*
+ * Write a binary response with the tag ${tag} to ${buf}, for the credentials
+ * ${cred}, or for an unidentified connection if ${cred} is NULL.
+ */
+static void
+fmtbinary(const uint8_t * tag, const struct getcred_cred * cred,
+    uint8_t * buf)
+{
+	size_t i;
+
+	/* The tag goes back exactly as it came. */
+	memcpy(buf, tag, TAGLEN);
+	buf += TAGLEN;
+
+	/* Status, uid, and number of groups. */
+	put32(&buf[0], (cred != NULL) ? STATUS_OK : STATUS_UNKNOWN);
+	put32(&buf[4], (cred != NULL) ? (uint32_t)cred->uid : 0);
+	put32(&buf[8], (cred != NULL) ? (uint32_t)cred->ngroups : 0);
+	buf += 12;
+
+	/* Groups, padded with zeroes. */
+	for (i = 0; i < IDENT_NGROUPS; i++) {
+		if ((cred != NULL) && (i < cred->ngroups))
+			put32(&buf[i * 4], (uint32_t)cred->groups[i]);
+		else
+			put32(&buf[i * 4], 0);
+	}
+}
+
+/*
+ * If ${query} asks for a persistent channel, return the version of the
+ * response format it asks for; otherwise return CHAN_NONE.
+ */
+static int
+chanhello(const uint8_t * query)
+{
+	size_t i;
+
+	/* A hello has addresses and ports of zero. */
+	for (i = 0; i < 8; i++) {
+		if (query[i] != 0)
+			return (CHAN_NONE);
+	}
+
+	/* Which version? */
+	return ((int)get32(&query[8]));
+}
+
 /* We have data from the client. */
 static int
 gotdata(void * cookie, ssize_t len)
 {
 	struct cstate * cs = cookie;
-	struct sockaddr_in addrs[2];
-	struct xucred uc;
-	int printlen;
-	size_t size = sizeof(struct xucred);
+	struct getcred_cred cred;
+	uint8_t * query;
 	size_t i;
+	int printlen;
+	int rlen;
+	int found;
 
 	/* Did the read succeed? */
 	if ((len == -1) || (len == 0))
 		goto drop;
 
-	/* Parse the query. */
-	addrs[0].sin_len = sizeof(struct sockaddr_in);
-	addrs[0].sin_family = AF_INET;
-	memcpy(&addrs[0].sin_addr, &cs->inbuf[0], 4);
-	memcpy(&addrs[0].sin_port, &cs->inbuf[4], 2);
-	addrs[1].sin_len = sizeof(struct sockaddr_in);
-	addrs[1].sin_family = AF_INET;
-	memcpy(&addrs[1].sin_addr, &cs->inbuf[6], 4);
-	memcpy(&addrs[1].sin_port, &cs->inbuf[10], 2);
-
-	/* Ask the kernel who owns this TCP connection. */
-	if (sysctlbyname("net.inet.tcp.getcred", &uc, &size,
-	    addrs, sizeof(addrs))) {
-		/* Not fatal; we might have lost a race against a close. */
-		warnp("sysctlbyname");
-		goto drop;
+	/* A client asking for a persistent channel has no query yet. */
+	if (cs->chan == CHAN_NONE) {
+		if ((cs->chan = chanhello(cs->inbuf)) != CHAN_NONE) {
+			if ((cs->chan != CHAN_TEXT) &&
+			    (cs->chan != CHAN_BINARY) &&
+			    (cs->chan != CHAN_BATCH)) {
+				warn0("Unsupported ident channel version: %d",
+				    cs->chan);
+				goto drop;
+			}
+			if (readquery(cs))
+				goto drop;
+			return (0);
+		}
 	}
 
-	/* Sanity-check. */
-	assert(uc.cr_ngroups <= XU_NGROUPS);
-
-	/* Construct and send a response. */
-	if ((printlen = sprintf(cs->outbuf, "%u\n",
-	    (unsigned int)uc.cr_uid)) < 0) {
-		warnp("sprintf");
-		goto drop;
+	/* A batch starts with the number of queries in it. */
+	if ((cs->chan == CHAN_BATCH) && (cs->nbatch == 0)) {
+		cs->nbatch = get32(cs->inbuf);
+		if ((cs->nbatch == 0) || (cs->nbatch > IDENT_MAXBATCH)) {
+			warn0("Invalid ident batch size: %zu", cs->nbatch);
+			goto drop;
+		}
+		if (network_read(cs->s, cs->inbuf,
+		    cs->nbatch * (TAGLEN + QUERYLEN),
+		    cs->nbatch * (TAGLEN + QUERYLEN), gotdata, cs) == NULL) {
+			warnp("network_read");
+			goto drop;
+		}
+		return (0);
 	}
-	cs->olen = (size_t)printlen;
-	for (i = 0; i < (size_t)uc.cr_ngroups; i++) {
-		if ((printlen = sprintf(&cs->outbuf[cs->olen], "%u,",
-		    (unsigned int)uc.cr_groups[i])) < 0) {
+
+	/* Look up the owner of the connection and construct a response. */
+	switch (cs->chan) {
+	case CHAN_BATCH:
+		for (i = 0; i < cs->nbatch; i++) {
+			query = &cs->inbuf[i * (TAGLEN + QUERYLEN)];
+			found = (lookup(cs->as, &query[TAGLEN], &cred) == 0);
+			fmtbinary(query, found ? &cred : NULL,
+			    (uint8_t *)&cs->outbuf[i * RECLEN]);
+		}
+		cs->olen = cs->nbatch * RECLEN;
+		break;
+	case CHAN_BINARY:
+		found = (lookup(cs->as, &cs->inbuf[TAGLEN], &cred) == 0);
+		fmtbinary(cs->inbuf, found ? &cred : NULL,
+		    (uint8_t *)cs->outbuf);
+		cs->olen = RECLEN;
+		break;
+	case CHAN_TEXT:
+		memcpy(&cs->tag, cs->inbuf, TAGLEN);
+		if ((printlen = sprintf(cs->outbuf, "%u ",
+		    (unsigned int)cs->tag)) < 0) {
 			warnp("sprintf");
 			goto drop;
 		}
-		cs->olen += (size_t)printlen;
+		cs->olen = (size_t)printlen;
+		if (lookup(cs->as, &cs->inbuf[TAGLEN], &cred) ||
+		    ((rlen = fmttext(&cred, &cs->outbuf[cs->olen], ' ')) ==
+		    -1)) {
+			/* Tell the client we couldn't find the owner. */
+			memcpy(&cs->outbuf[cs->olen], "-\n", 2);
+			rlen = 2;
+		}
+		cs->olen += (size_t)rlen;
+		break;
+	default:
+		if (lookup(cs->as, cs->inbuf, &cred) ||
+		    ((rlen = fmttext(&cred, cs->outbuf, '\n')) == -1))
+			goto drop;
+		cs->olen = (size_t)rlen;
+		break;
 	}
-	cs->outbuf[cs->olen - 1] = '\n';
+
+	/* Send the response. */
 	if (network_write(cs->s, (uint8_t *)cs->outbuf, cs->olen, cs->olen,
 	    sentdata, cs) == NULL) {
 		warnp("network_write");
@@ -132,10 +375,14 @@ gotconn(void * cookie, int s)
 		goto err1;
 
 	/* Record the incoming connection. */
+	cs->as = as;
 	cs->s = s;
+	cs->chan = CHAN_NONE;
+	cs->nbatch = 0;
 
 	/* Read the TCP source and destination IP addresses and ports. */
-	if (network_read(cs->s, cs->inbuf, 12, 12, gotdata, cs) == NULL) {
+	if (network_read(cs->s, cs->inbuf, QUERYLEN, QUERYLEN, gotdata,
+	    cs) == NULL) {
 		warnp("network_read");
 		goto err2;
 	}
@@ -159,13 +406,21 @@ err0:
 }
 
 /**
- * ident_setup(path):
+ * ident_setup(path, T):
  * Create a socke at ${path}.  Receive connections and read 12 bytes
  * [4 byte src IP][2 byte src port][4 byte dst IP][2 byte dst port]
- * (in network byte order) then write back "uid\ngid[,gid]*\n".
+ * (in network byte order) then write back "uid\ngid[,gid]*\n".  If the
+ * addresses and ports are all zero, the last 4 bytes select a version of
+ * the response format, and we instead read any number of such queries, each
+ * preceded by a 4-byte tag, and write back for each either a line
+ * "tag uid gid[,gid]*\n" (or "tag -\n" on failure) in version 0, or a
+ * fixed-size binary record in version 1; in version 2, read batches of
+ * tagged queries, each preceded by a 4-byte count, and write back a binary
+ * record for each query in a batch at once.  If ${T} is not NULL, answer
+ * from the credential table ${T} when possible.
  */
 int
-ident_setup(const char * path)
+ident_setup(const char * path, struct credtab * T)
 {
 	struct sock_addr ** sas_s;
 	struct astate * as;
@@ -173,21 +428,28 @@ ident_setup(const char * path)
 	/* Allocate a state structure. */
 	if ((as = malloc(sizeof(struct astate))) == NULL)
 		goto err0;
+	as->T = T;
+
+	/* Prepare to look up the owners of connections. */
+	if ((as->G = getcred_init(1)) == NULL) {
+		warnp("getcred_init");
+		goto err1;
+	}
 
 	/* Resolve the listening path and target address. */
 	if ((sas_s = sock_resolve(path)) == NULL) {
 		warnp("sock_resolve");
-		goto err1;
+		goto err2;
 	}
 
 	/* Listen for incoming connections. */
 	if ((as->s = sock_listener(sas_s[0])) == -1) {
 		warnp("sock_listener");
-		goto err2;
+		goto err3;
 	}
 	if (network_accept(as->s, gotconn, as) == NULL) {
 		warnp("network_accept");
-		goto err3;
+		goto err4;
 	}
 
 	/* Free the source addresses; we don't need them any more. */
@@ -196,10 +458,12 @@ ident_setup(const char * path)
 	/* Success! */
 	return (0);
 
-err3:
+err4:
 	close(as->s);
-err2:
+err3:
 	sock_addr_freelist(sas_s);
+err2:
+	getcred_free(as->G);
 err1:
 	free(as);
 err0:
@@ -1,8 +1,27 @@
 #ifndef IMDS_FILTER_H
 #define IMDS_FILTER_H
 
+#include <sys/types.h>
+
 #include <netinet/in.h>
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most groups reported for the owner of a connection. */
+#define IDENT_NGROUPS 16
+
+/* Credentials of the owner of a TCP connection. */
+struct getcred_cred {
+	uid_t uid;
+	size_t ngroups;
+	gid_t groups[IDENT_NGROUPS];
+};
+
+/* Opaque types. */
+struct credtab;
+struct getcred;
+
 /**
  * netconfig_getif(srcaddr, gwaddr, host, ifname):
  * Find the IPv4 route used for sending packets to ${host}; return via
@@ -50,12 +69,14 @@ int tunsetup(int *, int *, struct sockaddr_in *, struct sockaddr_in *, int);
 void tuncleanup(int, int, int);
 
 /**
- * outpath(tunin, tunout, dstaddr, ifname, srcmac, gwmac):
+ * outpath(tunin, tunout, dstaddr, ifname, srcmac, gwmac, T):
  * Read packets from ${tunin} and either write them to ${tunout} or wrap them
- * into ethernet frames and send them via ${ifname}.
+ * into ethernet frames and send them via ${ifname}.  If ${T} is not NULL,
+ * record the owners of connections opened into the jail in the credential
+ * table ${T}.
  */
 int outpath(int, int, struct sockaddr_in *, const char *,
-    uint8_t[6], uint8_t[6]);
+    uint8_t[6], uint8_t[6], struct credtab *);
 
 /**
  * inpath(tunin, tunout):
@@ -78,11 +99,84 @@ int conns_setup(const char *, const char *);
 int conns_isours(in_addr_t, uint16_t);
 
 /**
- * ident_setup(path):
+ * getcred_init(cache):
+ * Prepare to look up the owners of TCP connections.  On Linux, if ${cache}
+ * is non-zero, remember which processes hold which sockets rather than
+ * searching /proc for every lookup; elsewhere, ${cache} is ignored.
+ */
+struct getcred * getcred_init(int);
+
+/**
+ * getcred_lookup(G, query, cred):
+ * Look up the owner of the TCP connection described by the 12-byte ${query}
+ * [4 byte src IP][2 byte src port][4 byte dst IP][2 byte dst port] (in
+ * network byte order, with the source being the owner's end), and return
+ * its credentials via ${cred}.
+ */
+int getcred_lookup(struct getcred *, const uint8_t *, struct getcred_cred *);
+
+/**
+ * getcred_free(G):
+ * Free the state ${G}.
+ */
+void getcred_free(struct getcred *);
+
+/**
+ * credtab_kill(path):
+ * If there is a credential table at ${path}, mark it as dead (so that
+ * imds-proxy stops using it) and remove it.
+ */
+void credtab_kill(const char *);
+
+/**
+ * credtab_init(path):
+ * Create a credential table at ${path}, replacing (and killing) any table
+ * already there.
+ */
+struct credtab * credtab_init(const char *);
+
+/**
+ * credtab_add(T, query):
+ * Look up the owner of the new TCP connection described by the 12-byte
+ * ${query} and publish its credentials in the table ${T}.
+ */
+void credtab_add(struct credtab *, const uint8_t *);
+
+/**
+ * credtab_remove(T, query):
+ * Remove the TCP connection described by the 12-byte ${query} from the
+ * table ${T}, if it is there.
+ */
+void credtab_remove(struct credtab *, const uint8_t *);
+
+/**
+ * credtab_lookup(T, query, cred):
+ * If the TCP connection described by the 12-byte ${query} is in the table
+ * ${T}, return its credentials via ${cred}; otherwise, return -1.
+ */
+int credtab_lookup(struct credtab *, const uint8_t *, struct getcred_cred *);
+
+/**
+ * credtab_free(T):
+ * Mark the credential table ${T} as dead and free it.  The caller should
+ * remove the file.
+ */
+void credtab_free(struct credtab *);
+
+/**
+ * ident_setup(path, T):
  * Create a socke at ${path}.  Receive connections and read 12 bytes
  * [4 byte src IP][2 byte src port][4 byte dst IP][2 byte dst port]
-* (in network byte order) then write back "uid\ngid[,gid]*\n".
+* (in network byte order) then write back "uid\ngid[,gid]*\n".  If the
+ * addresses and ports are all zero, the last 4 bytes select a version of
+ * the response format, and we instead read any number of such queries, each
+ * preceded by a 4-byte tag, and write back for each either a line
+ * "tag uid gid[,gid]*\n" (or "tag -\n" on failure) in version 0, or a
+ * fixed-size binary record in version 1; in version 2, read batches of
+ * tagged queries, each preceded by a 4-byte count, and write back a binary
+ * record for each query in a batch at once.  If ${T} is not NULL, answer
+ * from the credential table ${T} when possible.
   */
-int ident_setup(const char *);
+int ident_setup(const char *, struct credtab *);
 
 #endif /* !IMDS_FILTER_H */
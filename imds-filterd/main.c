@@ -5,18 +5,23 @@
 #include <arpa/inet.h>
 
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "daemonize.h"
 #include "events.h"
+#include "getopt.h"
 #include "warnp.h"
 
 #include "imds-filterd.h"
 
 #define IMDSIP "169.254.169.254"
 
+/* Where we publish connection credentials for imds-proxy, if asked to. */
+#define CREDTAB_PATH "/var/run/imds-creds"
+
 static sig_atomic_t got_sigterm = 0;
 
 static void
@@ -32,9 +37,19 @@ sigterm_handler(int signo)
 	events_interrupt();
 }
 
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: imds-filterd [-c]\n");
+	exit(1);
+}
+
 int
 main(int argc, char * argv[])
 {
+	struct credtab * T = NULL;
+	const char * ch;
 	char * ifname;
 	struct sockaddr_in srcaddr;
 	struct sockaddr_in gwaddr;
@@ -44,12 +59,29 @@ main(int argc, char * argv[])
 	int jid;
 	int tunin;
 	int tunout;
-
-	(void)argc; /* UNUSED */
-	(void)argv; /* UNUSED */
+	int opt_c = 0;
 
 	WARNP_INIT;
 
+	/* Parse command line. */
+	while ((ch = GETOPT(argc, argv)) != NULL) {
+		GETOPT_SWITCH(ch) {
+		GETOPT_OPT("-c"):
+		GETOPT_OPT("--cred-table"):
+			if (opt_c)
+				usage();
+			opt_c = 1;
+			break;
+		GETOPT_DEFAULT:
+			warn0("illegal option -- %s", ch);
+			usage();
+		}
+	}
+
+	/* Check for unused arguments. */
+	if (argc > optind)
+		usage();
+
 	/* Construct a sockaddr for the IMDS address. */
 	memset(&dstaddr, 0, sizeof(dstaddr));
 	dstaddr.sin_len = sizeof(dstaddr);
@@ -80,43 +112,57 @@ main(int argc, char * argv[])
 		goto err0;
 	}
 
+	/*
+	 * Publish the credentials of connections into the jail if asked to;
+	 * either way, make sure that imds-proxy stops trusting any table left
+	 * behind by a previous run.
+	 */
+	if (opt_c) {
+		if ((T = credtab_init(CREDTAB_PATH)) == NULL) {
+			warnp("Failed to create credential table");
+			goto err0;
+		}
+	} else {
+		credtab_kill(CREDTAB_PATH);
+	}
+
 	/* Create a jail for the IMDS filtering proxy. */
 	if (makejail("imds", &jid)) {
 		warnp("Failed to create jail");
-		goto err0;
+		goto err1;
 	}
 
 	/* Create tunnels in and out of the jail. */
 	if (tunsetup(&tunin, &tunout, &srcaddr, &dstaddr, jid)) {
 		warnp("Failed to set up tunnel devices");
-		goto err1;
+		goto err2;
 	}
 
 	/*
 	 * Read packets destined for the Instance Metadata Service and either
 	 * forward them into the jail or pass them out the network interface.
 	 */
-	if (outpath(tunin, tunout, &dstaddr, ifname, srcmac, gwmac)) {
+	if (outpath(tunin, tunout, &dstaddr, ifname, srcmac, gwmac, T)) {
 		warnp("Failed to set up packet forwarding");
-		goto err2;
+		goto err3;
 	}
 
 	/* Read packets coming out of the jail and pass them to the host. */
 	if (inpath(tunin, tunout)) {
 		warnp("Failed to set up packet forwarding");
-		goto err2;
+		goto err3;
 	}
 
 	/* Accept connections from the proxy and forward them out. */
 	if (conns_setup("/var/run/imds.sock", "[" IMDSIP "]:80")) {
 		warnp("Failed to set up connection forwarding");
-		goto err2;
+		goto err3;
 	}
 
 	/* Answer TCP connection ownership queries. */
-	if (ident_setup("/var/run/imds-ident.sock")) {
+	if (ident_setup("/var/run/imds-ident.sock", T)) {
 		warnp("Failed to set up connection identification");
-		goto err3;
+		goto err4;
 	}
 
 	/*
@@ -125,13 +171,13 @@ main(int argc, char * argv[])
 	 */
 	if (signal(SIGTERM, sigterm_handler) == SIG_ERR) {
 		warnp("signal(SIGTERM)");
-		goto err4;
+		goto err5;
 	}
 
 	/* Daemonize. */
 	if (daemonize("/var/run/imds-filterd.pid")) {
 		warnp("daemonize");
-		goto err4;
+		goto err5;
 	}
 
 	/* Loop until an error occurs or we get SIGTERM. */
@@ -142,23 +188,35 @@ main(int argc, char * argv[])
 		}
 	}
 
-	/* Clean up the pidfile, sockets, tunnels and jail. */
+	/*
+	 * Clean up the pidfile, sockets, tunnels, jail, and credential
+	 * table.
+	 */
 	unlink("/var/run/imds-filterd.pid");
 	unlink("/var/run/imds-ident.sock");
 	unlink("/var/run/imds.sock");
 	tuncleanup(tunin, tunout, jid);
 	rmjail(jid);
+	if (T != NULL) {
+		credtab_free(T);
+		unlink(CREDTAB_PATH);
+	}
 
 	exit(0);
 
-err4:
+err5:
 	unlink("/var/run/imds-ident.sock");
-err3:
+err4:
 	unlink("/var/run/imds.sock");
-err2:
+err3:
 	tuncleanup(tunin, tunout, jid);
-err1:
+err2:
 	rmjail(jid);
+err1:
+	if (T != NULL) {
+		credtab_free(T);
+		unlink(CREDTAB_PATH);
+	}
 err0:
 	exit(1);
 }
@@ -31,6 +31,7 @@ struct outpath_state {
 	int extif;
 	in_addr_t dstaddr;
 	uint16_t dstport;
+	struct credtab * T;
 	uint8_t etherframe[14 + MAXPACKET];
 };
 
@@ -43,6 +44,7 @@ outpkt(void * cookie)
 	ssize_t rlen, wlen;
 	in_addr_t srcaddr, dstaddr;
 	uint16_t srcport, dstport;
+	uint8_t query[12];
 
 	/* Read a packet. */
 	rlen = read(os->rdtun, &os->etherframe[14], MAXPACKET);
@@ -89,6 +91,24 @@ outpkt(void * cookie)
 			goto err0;
 		}
 	} else {
+		/*
+		 * If we're publishing a credential table, record the owners
+		 * of new connections into the jail as we see them open, and
+		 * forget them when they close.  We do this before passing
+		 * the SYN along, so that the entry is there by the time
+		 * imds-proxy accepts the connection.
+		 */
+		if (os->T != NULL) {
+			memcpy(&query[0], &pkt_ip->ip_src.s_addr, 4);
+			memcpy(&query[4], &pkt_tcp->th_sport, 2);
+			memcpy(&query[6], &pkt_ip->ip_dst.s_addr, 4);
+			memcpy(&query[10], &pkt_tcp->th_dport, 2);
+			if ((pkt_tcp->th_flags & (TH_SYN | TH_ACK)) == TH_SYN)
+				credtab_add(os->T, query);
+			else if (pkt_tcp->th_flags & (TH_FIN | TH_RST))
+				credtab_remove(os->T, query);
+		}
+
 		/* Write the IPv4 packet into the other tunnel. */
 		if (write(os->wrtun, &os->etherframe[14], (size_t)rlen)
 		    != rlen) {
@@ -114,13 +134,16 @@ err0:
 }
 
 /**
- * outpath(tunin, tunout, dstaddr, ifname, srcmac, gwmac):
+ * outpath(tunin, tunout, dstaddr, ifname, srcmac, gwmac, T):
  * Read packets from ${tunin} and either write them to ${tunout} or wrap them
- * into ethernet frames and send them via ${ifname}.
+ * into ethernet frames and send them via ${ifname}.  If ${T} is not NULL,
+ * record the owners of connections opened into the jail in the credential
+ * table ${T}.
  */
 int
 outpath(int tunin, int tunout, struct sockaddr_in * dstaddr,
-    const char * ifname, uint8_t srcmac[6], uint8_t gwmac[6])
+    const char * ifname, uint8_t srcmac[6], uint8_t gwmac[6],
+    struct credtab * T)
 {
 	struct outpath_state * os;
 	struct ifreq ifr;
@@ -132,6 +155,7 @@ outpath(int tunin, int tunout, struct sockaddr_in * dstaddr,
 	os->wrtun = tunout;
 	os->dstaddr = ntohl(dstaddr->sin_addr.s_addr);
 	os->dstport = ntohs(dstaddr->sin_port);
+	os->T = T;
 
 	/* Open BPF. */
 	if ((os->extif = open("/dev/bpf", O_WRONLY)) == -1) {
@@ -0,0 +1,397 @@
+#include <sys/time.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Responses are cached keyed on the complete request which we send to the
+ * IMDS (method, path, and forwarded headers, including any session token),
+ * so a cached response is only ever returned for a request which would
+ * have produced it.  Whether the client is allowed to make the request is
+ * checked before the cache is consulted, so the cache plays no part in
+ * access control.
+ *
+ * Entries are kept in a hash table and on a least-recently-used list; when
+ * the cache is full, we evict from the tail of the list.  Entries which
+ * have expired are kept until their stale period has also ended (or they
+ * are evicted), in case the IMDS fails and we need them.
+ */
+
+/* Number of hash buckets. */
+#define NBUCKETS 1024
+
+/* A cached response. */
+struct entry {
+	struct entry * hnext;
+	struct entry * prev;
+	struct entry * next;
+	uint32_t hash;
+	char * key;
+	uint8_t * data;
+	size_t len;
+	size_t size;
+	double t_expire;
+	double t_discard;
+};
+
+/* Response cache. */
+struct cache {
+	pthread_mutex_t mtx;
+	struct entry * buckets[NBUCKETS];
+	struct entry * head;
+	struct entry * tail;
+	size_t maxmem;
+	size_t mem;
+	size_t nentries;
+
+	/* Statistics. */
+	uint64_t nhits;
+	uint64_t nmisses;
+	uint64_t nstale;
+	uint64_t nstored;
+	uint64_t nevicted;
+	uint64_t nexpired;
+};
+
+/* Return the current time in seconds, or -1 on failure. */
+static double
+now(void)
+{
+	struct timeval tv;
+
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		return (-1.0);
+	}
+	return ((double)tv.tv_sec + (double)tv.tv_usec * 0.000001);
+}
+
+/* Unlink the entry ${E} from the LRU list. */
+static void
+lru_unlink(struct cache * C, struct entry * E)
+{
+
+	if (E->prev != NULL)
+		E->prev->next = E->next;
+	else
+		C->head = E->next;
+	if (E->next != NULL)
+		E->next->prev = E->prev;
+	else
+		C->tail = E->prev;
+}
+
+/* Link the entry ${E} at the head of the LRU list. */
+static void
+lru_link(struct cache * C, struct entry * E)
+{
+
+	E->prev = NULL;
+	E->next = C->head;
+	if (C->head != NULL)
+		C->head->prev = E;
+	else
+		C->tail = E;
+	C->head = E;
+}
+
+/* Remove the entry ${E} from the cache and free it. */
+static void
+removeentry(struct cache * C, struct entry * E)
+{
+	struct entry ** ep;
+
+	/* Remove it from its hash chain. */
+	for (ep = &C->buckets[E->hash % NBUCKETS]; *ep != E; ep = &(*ep)->hnext)
+		continue;
+	*ep = E->hnext;
+
+	/* Remove it from the LRU list. */
+	lru_unlink(C, E);
+
+	/* Update memory usage and free the entry. */
+	C->mem -= E->size;
+	C->nentries--;
+	free(E);
+}
+
+/* Find the entry for ${key}, if any. */
+static struct entry *
+findentry(struct cache * C, const char * key, uint32_t h)
+{
+	struct entry * E;
+
+	for (E = C->buckets[h % NBUCKETS]; E != NULL; E = E->hnext) {
+		if ((E->hash == h) && (strcmp(E->key, key) == 0))
+			return (E);
+	}
+	return (NULL);
+}
+
+/**
+ * cache_init(maxmem):
+ * Create a cache of IMDS responses which uses at most ${maxmem} bytes.
+ */
+struct cache *
+cache_init(size_t maxmem)
+{
+	struct cache * C;
+	size_t i;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((C = malloc(sizeof(struct cache))) == NULL)
+		goto err0;
+	for (i = 0; i < NBUCKETS; i++)
+		C->buckets[i] = NULL;
+	C->head = C->tail = NULL;
+	C->maxmem = maxmem;
+	C->mem = 0;
+	C->nentries = 0;
+	C->nhits = 0;
+	C->nmisses = 0;
+	C->nstale = 0;
+	C->nstored = 0;
+	C->nevicted = 0;
+	C->nexpired = 0;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&C->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Success! */
+	return (C);
+
+err1:
+	free(C);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * cache_get(C, key, stale, buf, len):
+ * Look in the cache ${C} for a response to the request ${key} which has not
+ * expired or, if ${stale} is non-zero, which is still within its stale
+ * period.  If one is found, return 1 and a malloced copy of the response via
+ * ${buf} and ${len}; otherwise, return 0.  Return -1 on error.
+ */
+int
+cache_get(struct cache * C, const char * key, int stale, uint8_t ** buf,
+    size_t * len)
+{
+	struct entry * E;
+	uint32_t h = fnv_hash_str(FNV_INIT, key);
+	double t;
+	int found = 0;
+	int rc;
+
+	/* Find out what time it is. */
+	if ((t = now()) < 0)
+		goto err0;
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Look for the entry, and throw it away if it is too old. */
+	if (((E = findentry(C, key, h)) != NULL) && (t >= E->t_discard)) {
+		removeentry(C, E);
+		C->nexpired++;
+		E = NULL;
+	}
+
+	/* Can we use this entry? */
+	if ((E != NULL) && ((t < E->t_expire) || stale)) {
+		/* Copy out the response. */
+		if ((*buf = malloc(E->len)) == NULL)
+			goto err1;
+		memcpy(*buf, E->data, E->len);
+		*len = E->len;
+		found = 1;
+
+		/* This is now the most recently used entry. */
+		lru_unlink(C, E);
+		lru_link(C, E);
+	}
+
+	/* Record statistics. */
+	if (stale)
+		C->nstale += (uint64_t)found;
+	else if (found)
+		C->nhits++;
+	else
+		C->nmisses++;
+
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		if (found)
+			free(*buf);
+		goto err0;
+	}
+
+	/* Did we find something? */
+	return (found);
+
+err1:
+	pthread_mutex_unlock(&C->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * cache_put(C, key, buf, len, ttl, stale):
+ * Store the ${len}-byte response ${buf} to the request ${key} in the cache
+ * ${C} for ${ttl} seconds, plus a further ${stale} seconds during which it
+ * may be returned by cache_get with ${stale} non-zero.  Evict the least
+ * recently used responses if necessary to keep within the memory limit.
+ */
+int
+cache_put(struct cache * C, const char * key, const uint8_t * buf,
+    size_t len, int ttl, int stale)
+{
+	struct entry * E;
+	struct entry * oldE;
+	size_t keylen = strlen(key);
+	size_t size;
+	uint32_t h = fnv_hash_str(FNV_INIT, key);
+	double t;
+	int rc;
+
+	/* How much memory does this need? */
+	size = sizeof(struct entry) + keylen + 1 + len;
+
+	/* Don't bother if it would push everything else out. */
+	if (size > C->maxmem / 2)
+		goto done;
+
+	/* Find out what time it is. */
+	if ((t = now()) < 0)
+		goto err0;
+
+	/* Allocate and fill in an entry. */
+	if ((E = malloc(size)) == NULL)
+		goto err0;
+	E->hash = h;
+	E->key = (char *)&E[1];
+	memcpy(E->key, key, keylen + 1);
+	E->data = (uint8_t *)&E->key[keylen + 1];
+	memcpy(E->data, buf, len);
+	E->len = len;
+	E->size = size;
+	E->t_expire = t + ttl;
+	E->t_discard = E->t_expire + stale;
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Replace any existing entry. */
+	if ((oldE = findentry(C, key, h)) != NULL)
+		removeentry(C, oldE);
+
+	/* Evict entries until there is room. */
+	while (C->mem + size > C->maxmem) {
+		removeentry(C, C->tail);
+		C->nevicted++;
+	}
+
+	/* Add the new entry. */
+	E->hnext = C->buckets[h % NBUCKETS];
+	C->buckets[h % NBUCKETS] = E;
+	lru_link(C, E);
+	C->mem += size;
+	C->nentries++;
+	C->nstored++;
+
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	free(E);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * cache_stats_log(C):
+ * Log statistics about the cache ${C}.
+ */
+void
+cache_stats_log(struct cache * C)
+{
+	uint64_t nhits, nmisses, nstale, nstored, nevicted, nexpired;
+	size_t nentries, mem;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nhits = C->nhits;
+	nmisses = C->nmisses;
+	nstale = C->nstale;
+	nstored = C->nstored;
+	nevicted = C->nevicted;
+	nexpired = C->nexpired;
+	nentries = C->nentries;
+	mem = C->mem;
+	if ((rc = pthread_mutex_unlock(&C->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: cache: %ju hits, %ju misses, "
+	    "%ju served stale; %ju stored, %ju evicted, %ju expired; "
+	    "%zu entries using %zu of %zu bytes",
+	    (uintmax_t)nhits, (uintmax_t)nmisses, (uintmax_t)nstale,
+	    (uintmax_t)nstored, (uintmax_t)nevicted, (uintmax_t)nexpired,
+	    nentries, mem, C->maxmem);
+}
+
+/**
+ * cache_free(C):
+ * Free the cache ${C}.
+ */
+void
+cache_free(struct cache * C)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (C == NULL)
+		return;
+
+	/* Free all the entries. */
+	while (C->head != NULL)
+		removeentry(C, C->head);
+
+	/* Free the mutex and the structure. */
+	pthread_mutex_destroy(&C->mtx);
+	free(C);
+}
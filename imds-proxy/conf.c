@@ -1,12 +1,19 @@
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include <grp.h>
-#include <pwd.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
+#include <unistd.h>
 
+#include "asprintf.h"
 #include "elasticarray.h"
+#include "noeintr.h"
+#include "parsenum.h"
 #include "warnp.h"
 
 #include "imds-proxy.h"
@@ -22,113 +29,549 @@ struct rule {
 	int allow;
 };
 
-/* IMDS access rules. */
+/* A caching rule. */
+struct cacherule {
+	char * prefix;
+	int ttl;
+	int stale;
+};
+
+/* A priority rule. */
+struct priorule {
+	int rtype;
+	id_t id;
+	int prio;
+};
+
+/* A rate limiting rule. */
+struct limitrule {
+	int rtype;
+	id_t id;
+	int rate;
+	int burst;
+};
+
+/* How often an access rule has been used. */
+struct rulecount {
+	uint64_t examined;
+	uint64_t matched;
+	uint64_t decided;
+};
+
+/* IMDS access, caching, pacing, and rate limiting rules, and timeouts. */
 struct imds_conf {
 	struct rule * rs;
 	size_t nrs;
+	struct pathtrie * rtrie;
+	struct princache * views;
+	struct decisions * decisions;
+	struct rulecount * rcounts;
+	uint64_t * nscanned;
+	struct cacherule * crs;
+	size_t ncrs;
+	struct pathtrie * ctrie;
+	struct priorule * prs;
+	size_t nprs;
+	struct limitrule * lrs;
+	size_t nlrs;
+	int pace_rate;
+	int pace_burst;
+	int timeouts[NDEADLINE];
+
+	/* Compiled configuration which the prefixes point into, or NULL. */
+	void * map;
+	size_t maplen;
+
+	/* User and group names looked up while reading it, and how long. */
+	size_t nnames;
+	double nametime;
 };
 
 ELASTICARRAY_DECL(RULELIST, rulelist, struct rule);
+ELASTICARRAY_DECL(CACHERULELIST, cacherulelist, struct cacherule);
+ELASTICARRAY_DECL(PRIORULELIST, priorulelist, struct priorule);
+ELASTICARRAY_DECL(LIMITRULELIST, limitrulelist, struct limitrule);
+
+/* The access rules which can apply to a particular principal. */
+struct view {
+	struct pathtrie * trie;
+	size_t * rnums;
+};
+
+/* Number of principals for which we keep views of the access rules. */
+#define NVIEWS 256
+
+/* Number of access decisions we remember. */
+#define NDECISIONS 4096
+
+/*
+ * Buckets for the number of access rules examined per decision made (not
+ * remembered): 0, 1, 2-3, 4-7, 8-15, and 16 or more.
+ */
+#define NSCANBUCKETS 6
+
+/*
+ * A compiled configuration file holds a header, the access, caching,
+ * priority, and rate limiting rules as arrays of fixed-size records, and a
+ * table of NUL-terminated path prefixes which the records refer to by
+ * offset.  User and group names have already been looked up, and the file
+ * is in host byte order, so it should be compiled on the host (or in the
+ * jail) where it will be used.  The header records the size and
+ * modification time of the text file it was compiled from, so that we can
+ * tell when it is out of date.
+ */
+#define CONFBIN_MAGIC "IMDSRULE"
+#define CONFBIN_VERSION 1
+
+/* Compiled configuration header. */
+struct confbin_hdr {
+	uint8_t magic[8];
+	uint32_t version;
+	int32_t pace_rate;
+	uint64_t srcsize;
+	int64_t srcsec;
+	int64_t srcnsec;
+	uint64_t nrs;
+	uint64_t ncrs;
+	uint64_t nprs;
+	uint64_t nlrs;
+	uint64_t strsize;
+	int32_t pace_burst;
+	int32_t timeouts[NDEADLINE];
+	uint32_t pad;
+};
+
+/* Compiled access rule. */
+struct confbin_rule {
+	uint32_t rtype;
+	uint32_t allow;
+	int64_t id;
+	uint64_t prefix;
+};
+
+/* Compiled caching rule. */
+struct confbin_cacherule {
+	uint64_t prefix;
+	int32_t ttl;
+	int32_t stale;
+};
+
+/* Compiled priority rule. */
+struct confbin_priorule {
+	uint32_t rtype;
+	int32_t prio;
+	int64_t id;
+};
+
+/* Compiled rate limiting rule. */
+struct confbin_limitrule {
+	uint32_t rtype;
+	int32_t rate;
+	int64_t id;
+	int32_t burst;
+	uint32_t pad;
+};
+
+/* Maximum cache TTL and stale period: one day. */
+#define CACHE_TTLMAX 86400
+
+/* Maximum timeout: one hour. */
+#define TIMEOUT_MAX 3600
+
+/* Default timeouts for each stage of handling a request. */
+static const int timeouts_default[NDEADLINE] = {
+	10,	/* DEADLINE_HEADER */
+	60,	/* DEADLINE_REQUEST */
+	5,	/* DEADLINE_CONNECT */
+	30	/* DEADLINE_RELAY */
+};
 
-/* Buffer length for getpwnam_r and getgrnam_r. */
-#define PWBUFLEN 4096
+/* Maximum request rate and burst size. */
+#define RATE_MAX 1000000
 
-/* Parse a user name to a uid. */
+/*
+ * Parse an optional "user <name> " or "group <name> " from ${*p}, where the
+ * name may instead be followed by the end of the line, and advance ${*p}
+ * past it.  Return the type of rule via ${rtype} and the uid or gid (looked
+ * up via ${N}) via ${id}.
+ */
 static int
-parseuid(char * p, size_t len, uid_t * u)
+parsewho(struct names * N, char ** p, int * rtype, id_t * id)
 {
-	struct passwd pwd;
-	struct passwd * res;
-	char buf[PWBUFLEN];
-	char * s;
+	char * sp;
+	uid_t u;
+	gid_t g;
 
-	/* Create a NUL-terminated string with the name. */
-	if ((s = malloc(len + 1)) == NULL)
-		goto err0;
-	memcpy(s, p, len);
-	s[len] = '\0';
+	/* Is there a user/group restriction? */
+	if (strncmp(*p, "user ", 5) == 0) {
+		*p = &(*p)[5];
+		*rtype = RTYPE_UID;
+	} else if (strncmp(*p, "group ", 6) == 0) {
+		*p = &(*p)[6];
+		*rtype = RTYPE_GID;
+	} else {
+		*rtype = RTYPE_ANY;
+		return (0);
+	}
 
-	/* Look up the user. */
-	if (getpwnam_r(s, &pwd, buf, PWBUFLEN, &res)) {
-		warnp("getpwnam_r(%s)", s);
-		goto err1;
+	/* Find the end of the name. */
+	if ((sp = strchr(*p, ' ')) == NULL)
+		sp = &(*p)[strlen(*p)];
+
+	/* Look it up. */
+	if (*rtype == RTYPE_UID) {
+		if (names_uid(N, *p, (size_t)(sp - *p), &u))
+			goto err0;
+		*id = u;
+	} else {
+		if (names_gid(N, *p, (size_t)(sp - *p), &g))
+			goto err0;
+		*id = g;
 	}
 
-	/* Does the user exist? */
-	if (res == NULL) {
-		warn0("User not found: %s", s);
-		goto err1;
+	/* Advance past the name and the following space (if any). */
+	*p = (*sp == ' ') ? &sp[1] : sp;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Parse a rate of the form "<n>/s [burst <m>]" which ends the line, ${p}.
+ * Return 1 if the rate is invalid.
+ */
+static int
+parserate(char * p, int * rate, int * burst)
+{
+	char * sp;
+
+	/* Parse the number of requests per second. */
+	if ((sp = strchr(p, '/')) == NULL)
+		return (1);
+	*sp = '\0';
+	if (PARSENUM(rate, p, 1, RATE_MAX)) {
+		*sp = '/';
+		return (1);
+	}
+	*sp = '/';
+	if (strncmp(sp, "/s", 2) != 0)
+		return (1);
+	p = &sp[2];
+
+	/* Parse the burst size, if any; by default, one second's worth. */
+	if (*p == '\0')
+		*burst = *rate;
+	else if (strncmp(p, " burst ", 7) == 0) {
+		if (PARSENUM(burst, &p[7], 1, RATE_MAX))
+			return (1);
+	} else
+		return (1);
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Parse the rest of a "Priority" line, ${p}, and append the rule to ${prs}.
+ * Return 1 if the line is invalid.
+ */
+static int
+parseprio(struct names * N, char * p, PRIORULELIST prs)
+{
+	struct priorule pr;
+
+	/* Which priority class? */
+	if (strncmp(p, "high", 4) == 0) {
+		pr.prio = PRIO_HIGH;
+		p = &p[4];
+	} else if (strncmp(p, "normal", 6) == 0) {
+		pr.prio = PRIO_NORMAL;
+		p = &p[6];
+	} else if (strncmp(p, "low", 3) == 0) {
+		pr.prio = PRIO_LOW;
+		p = &p[3];
+	} else {
+		return (1);
 	}
 
-	/* Free the duplicated name. */
-	free(s);
+	/* Which clients does it apply to? */
+	if (*p == ' ') {
+		p = &p[1];
+		if (parsewho(N, &p, &pr.rtype, &pr.id))
+			return (-1);
+		if ((pr.rtype == RTYPE_ANY) || (*p != '\0'))
+			return (1);
+	} else if (*p == '\0') {
+		pr.rtype = RTYPE_ANY;
+	} else {
+		return (1);
+	}
 
-	/* Return the user ID. */
-	*u = res->pw_uid;
+	/* Add this rule to our list. */
+	if (priorulelist_append(prs, &pr, 1))
+		return (-1);
 
 	/* Success! */
 	return (0);
+}
+
+/*
+ * Parse the rest of a "Limit" line, ${p}, and append the rule to ${lrs}.
+ * Return 1 if the line is invalid.
+ */
+static int
+parselimit(struct names * N, char * p, LIMITRULELIST lrs)
+{
+	struct limitrule lr;
+
+	/* Which clients does it apply to? */
+	if (parsewho(N, &p, &lr.rtype, &lr.id))
+		return (-1);
+
+	/* Parse the rate. */
+	if (parserate(p, &lr.rate, &lr.burst))
+		return (1);
+
+	/* Add this rule to our list. */
+	if (limitrulelist_append(lrs, &lr, 1))
+		return (-1);
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Parse the rest of a "Timeout" line, ${p}, into the appropriate element of
+ * ${timeouts}.  Return 1 if the line is invalid.
+ */
+static int
+parsetimeout(char * p, int * timeouts)
+{
+	static const char * stages[NDEADLINE] = {
+		"header", "request", "connect", "relay"
+	};
+	size_t len = 0;
+	int i;
+
+	/* Which stage? */
+	for (i = 0; i < NDEADLINE; i++) {
+		len = strlen(stages[i]);
+		if ((strncmp(p, stages[i], len) == 0) && (p[len] == ' '))
+			break;
+	}
+	if (i == NDEADLINE)
+		return (1);
+
+	/* Parse the number of seconds. */
+	if (PARSENUM(&timeouts[i], &p[len + 1], 0, TIMEOUT_MAX))
+		return (1);
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Parse the quoted path prefix ${p} which ends the ${linelen}-byte line
+ * ${line}, and return a copy of it (without the quotes) via ${prefix}.
+ * Return 1 if the prefix is invalid.
+ */
+static int
+parseprefix(const char * line, size_t linelen, const char * p, char ** prefix)
+{
+	size_t i;
+
+	/* We should have a quoted string. */
+	if ((p[0] != '"') ||
+	    (strchr(&p[1], '"') != &line[linelen - 1]))
+		goto invalid;
+
+	/* Make sure that there aren't any bogus wildcards. */
+	for (i = 0; p[i]; i++) {
+		if (p[i] == '*') {
+			/* Must follow a '/' character. */
+			if (p[i - 1] != '/')
+				goto invalid;
+
+			/*
+			 * Must precede a '/' character or be at the
+			 * end of the string (which is nonetheless
+			 * pointless, since we match prefixes).
+			 */
+			 if ((p[i + 1] != '/') &&
+			     (p[i + 1] != '"'))
+				goto invalid;
+		}
+	}
+
+	/* Record the prefix string, without the endquote char. */
+	if ((*prefix = strdup(&p[1])) == NULL)
+		goto err0;
+	(*prefix)[strlen(*prefix) - 1] = '\0';
+
+	/* Success! */
+	return (0);
+
+invalid:
+	/* Invalid prefix. */
+	return (1);
 
-err1:
-	free(s);
 err0:
 	/* Failure! */
 	return (-1);
 }
 
-/* Parse a group name to a gid. */
+/* Parse a number of seconds from ${p}, and advance ${p} past it. */
 static int
-parsegid(char * p, size_t len, gid_t * g)
+parsesecs(char ** p, int * secs)
 {
-	struct group grp;
-	struct group * res;
-	char buf[PWBUFLEN];
-	char * s;
+	char * sp;
 
-	/* Create a NUL-terminated string with the name. */
-	if ((s = malloc(len + 1)) == NULL)
-		goto err0;
-	memcpy(s, p, len);
-	s[len] = '\0';
+	/* Find the end of the number. */
+	if ((sp = strchr(*p, ' ')) == NULL)
+		return (-1);
+	*sp = '\0';
 
-	/* Look up the group. */
-	if (getgrnam_r(s, &grp, buf, PWBUFLEN, &res)) {
-		warnp("getgrnam_r(%s)", s);
-		goto err1;
+	/* Parse it. */
+	if (PARSENUM(secs, *p, 0, CACHE_TTLMAX)) {
+		*sp = ' ';
+		return (-1);
 	}
 
-	/* Does the group exist? */
-	if (res == NULL) {
-		warn0("Group not found: %s", s);
-		goto err1;
+	/* Advance past it. */
+	*sp = ' ';
+	*p = &sp[1];
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Parse the rest of a "Cache" line, ${p}, and append the rule to ${crs}.
+ * Return 1 if the line is invalid.
+ */
+static int
+parsecache(const char * line, size_t linelen, char * p, CACHERULELIST crs)
+{
+	struct cacherule cr;
+	int rc;
+
+	/* Parse the TTL. */
+	if (parsesecs(&p, &cr.ttl))
+		return (1);
+
+	/* Parse the stale period, if any. */
+	if (strncmp(p, "stale ", 6) == 0) {
+		p = &p[6];
+		if (parsesecs(&p, &cr.stale))
+			return (1);
+	} else {
+		cr.stale = 0;
+	}
+
+	/* Parse the prefix. */
+	if ((rc = parseprefix(line, linelen, p, &cr.prefix)) != 0)
+		return (rc);
+
+	/* Add this rule to our list. */
+	if (cacherulelist_append(crs, &cr, 1)) {
+		free(cr.prefix);
+		return (-1);
 	}
 
-	/* Free the duplicated name. */
-	free(s);
+	/* Success! */
+	return (0);
+}
+
+/* Forward declarations. */
+static void * view_build(void *, uid_t, const gid_t *, size_t);
+static void view_free(void *);
+
+/*
+ * Compile the prefixes of the access and caching rules into tries, and
+ * prepare to build views of the access rules for each principal, to
+ * remember access decisions, and to count how the access rules are used.
+ */
+static int
+compile(struct imds_conf * imdsc)
+{
+	char ** prefixes;
+	size_t i;
+
+	/* Make room for the prefixes of either set of rules. */
+	if ((prefixes = malloc((imdsc->nrs + imdsc->ncrs + 1) *
+	    sizeof(char *))) == NULL)
+		goto err0;
+
+	/* Access rules. */
+	for (i = 0; i < imdsc->nrs; i++)
+		prefixes[i] = imdsc->rs[i].prefix;
+	if ((imdsc->rtrie = pathtrie_init(prefixes, imdsc->nrs)) == NULL)
+		goto err1;
+
+	/* Caching rules. */
+	for (i = 0; i < imdsc->ncrs; i++)
+		prefixes[i] = imdsc->crs[i].prefix;
+	if ((imdsc->ctrie = pathtrie_init(prefixes, imdsc->ncrs)) == NULL)
+		goto err2;
+
+	/* Views of the access rules are built as they're needed. */
+	if ((imdsc->views = princache_init(NVIEWS, view_build, view_free,
+	    imdsc)) == NULL)
+		goto err3;
+
+	/* Decisions are remembered as they're made. */
+	if ((imdsc->decisions = decisions_init(NDECISIONS)) == NULL)
+		goto err4;
+
+	/* Count uses of each rule, and of no rule (NORULE), from zero. */
+	if ((imdsc->rcounts = calloc(imdsc->nrs + 1,
+	    sizeof(struct rulecount))) == NULL)
+		goto err5;
+	if ((imdsc->nscanned = calloc(NSCANBUCKETS, sizeof(uint64_t))) ==
+	    NULL)
+		goto err6;
 
-	/* Return the group ID. */
-	*g = res->gr_gid;
+	/* We don't need the list of prefixes any more. */
+	free(prefixes);
 
 	/* Success! */
 	return (0);
 
+err6:
+	free(imdsc->rcounts);
+	imdsc->rcounts = NULL;
+err5:
+	decisions_free(imdsc->decisions);
+	imdsc->decisions = NULL;
+err4:
+	princache_free(imdsc->views);
+	imdsc->views = NULL;
+err3:
+	pathtrie_free(imdsc->ctrie);
+	imdsc->ctrie = NULL;
+err2:
+	pathtrie_free(imdsc->rtrie);
+	imdsc->rtrie = NULL;
 err1:
-	free(s);
+	free(prefixes);
 err0:
 	/* Failure! */
 	return (-1);
 }
 
-/**
- * conf_read(path):
- * Read the imds-proxy configuration file ${path} and return a state which
- * can be passed to conf_check or conf_free.
- */
-struct imds_conf *
-conf_read(const char * path)
+/* Read the configuration file ${path}, looking up names via ${N}. */
+static struct imds_conf *
+readconf(const char * path, struct names * N)
 {
 	struct imds_conf * imdsc;
 	RULELIST rs;
+	CACHERULELIST crs;
+	PRIORULELIST prs;
+	LIMITRULELIST lrs;
 	struct rule r;
 	FILE * f;
 	char * line = NULL;
@@ -136,9 +579,14 @@ conf_read(const char * path)
 	ssize_t linelen;
 	size_t i;
 	char * p;
-	char * sp;
-	uid_t u;
-	gid_t g;
+	int pace_rate = 0;
+	int pace_burst = 0;
+	int timeouts[NDEADLINE];
+	int rc;
+
+	/* Use the default timeouts unless we're told otherwise. */
+	for (i = 0; i < NDEADLINE; i++)
+		timeouts[i] = timeouts_default[i];
 
 	/* Open the configuration file. */
 	if ((f = fopen(path, "r")) == NULL) {
@@ -146,9 +594,15 @@ conf_read(const char * path)
 		goto err0;
 	}
 
-	/* Create an elastic array of rules. */
+	/* Create elastic arrays of rules. */
 	if ((rs = rulelist_init(0)) == NULL)
 		goto err1;
+	if ((crs = cacherulelist_init(0)) == NULL)
+		goto err2;
+	if ((prs = priorulelist_init(0)) == NULL)
+		goto err3;
+	if ((lrs = limitrulelist_init(0)) == NULL)
+		goto err4;
 
 	/* Read lines and construct rules. */
 	while ((linelen = getline(&line, &linecap, f)) > 0) {
@@ -163,6 +617,52 @@ conf_read(const char * path)
 		if ((line[0] == '#') || (line[0] == '\0'))
 			continue;
 
+		/* Caching rule? */
+		if (strncmp(line, "Cache ", 6) == 0) {
+			if ((rc = parsecache(line, (size_t)linelen, &line[6],
+			    crs)) == 1)
+				goto invalid;
+			else if (rc)
+				goto err5;
+			continue;
+		}
+
+		/* Global request rate? */
+		if (strncmp(line, "Pace ", 5) == 0) {
+			if (pace_rate != 0) {
+				warn0("Duplicate Pace directive");
+				goto invalid;
+			}
+			if (parserate(&line[5], &pace_rate, &pace_burst))
+				goto invalid;
+			continue;
+		}
+
+		/* Timeout? */
+		if (strncmp(line, "Timeout ", 8) == 0) {
+			if (parsetimeout(&line[8], timeouts))
+				goto invalid;
+			continue;
+		}
+
+		/* Priority class? */
+		if (strncmp(line, "Priority ", 9) == 0) {
+			if ((rc = parseprio(N, &line[9], prs)) == 1)
+				goto invalid;
+			else if (rc)
+				goto err5;
+			continue;
+		}
+
+		/* Rate limit? */
+		if (strncmp(line, "Limit ", 6) == 0) {
+			if ((rc = parselimit(N, &line[6], lrs)) == 1)
+				goto invalid;
+			else if (rc)
+				goto err5;
+			continue;
+		}
+
 		/* Allow or Deny? */
 		if (strncmp(line, "Deny ", 5) == 0) {
 			p = &line[5];
@@ -175,60 +675,20 @@ conf_read(const char * path)
 		}
 
 		/* Is there a user/group restriction? */
-		if (strncmp(p, "user ", 5) == 0) {
-			p = &p[5];
-			r.rtype = RTYPE_UID;
-			if ((sp = strchr(p, ' ')) == NULL)
-				goto invalid;
-			if (parseuid(p, (size_t)(sp - p), &u))
-				goto err2;
-			p = &sp[1];
-			r.id = u;
-		} else if (strncmp(p, "group ", 6) == 0) {
-			p = &p[6];
-			r.rtype = RTYPE_GID;
-			if ((sp = strchr(p, ' ')) == NULL)
-				goto invalid;
-			if (parsegid(p, (size_t)(sp - p), &g))
-				goto err2;
-			p = &sp[1];
-			r.id = g;
-		} else {
-			r.rtype = RTYPE_ANY;
-		}
+		if (parsewho(N, &p, &r.rtype, &r.id))
+			goto err5;
 
-		/* We should have a quoted string. */
-		if ((p[0] != '"') ||
-		    (strchr(&p[1], '"') != &line[linelen - 1]))
+		/* Parse the prefix. */
+		if ((rc = parseprefix(line, (size_t)linelen, p,
+		    &r.prefix)) == 1)
 			goto invalid;
-
-		/* Make sure that there aren't any bogus wildcards. */
-		for (i = 0; p[i]; i++) {
-			if (p[i] == '*') {
-				/* Must follow a '/' character. */
-				if (p[i - 1] != '/')
-					goto invalid;
-
-				/*
-				 * Must precede a '/' character or be at the
-				 * end of the string (which is nonetheless
-				 * pointless, since we match prefixes).
-				 */
-				 if ((p[i + 1] != '/') &&
-				     (p[i + 1] != '"'))
-					goto invalid;
-			}
-		}
-
-		/* Record the prefix string, without the endquote char. */
-		if ((r.prefix = strdup(&p[1])) == NULL)
-			goto err2;
-		r.prefix[strlen(r.prefix) - 1] = '\0';
+		else if (rc)
+			goto err5;
 
 		/* Add this rule to our ruleset. */
 		if (rulelist_append(rs, &r, 1)) {
 			free(r.prefix);
-			goto err2;
+			goto err5;
 		}
 
 		/* Move onto the next line. */
@@ -236,27 +696,82 @@ conf_read(const char * path)
 
 invalid:
 		warn0("Invalid configuration rule: %s", line);
-		goto err2;
+		goto err5;
 
 	}
 
 	/* We should have reached EOF. */
 	if (!feof(f)) {
 		warnp("Error reading configuration file: %s", path);
-		goto err2;
+		goto err5;
 	}
 
-	/* Create a state structure and export the list. */
+	/* Create a state structure and export the lists. */
 	if ((imdsc = malloc(sizeof(struct imds_conf))) == NULL)
-		goto err2;
+		goto err5;
+	imdsc->pace_rate = pace_rate;
+	imdsc->pace_burst = pace_burst;
+	memcpy(imdsc->timeouts, timeouts, sizeof(imdsc->timeouts));
+	if (limitrulelist_export(lrs, &imdsc->lrs, &imdsc->nlrs))
+		goto err6;
+	if (priorulelist_export(prs, &imdsc->prs, &imdsc->nprs))
+		goto err7;
+	if (cacherulelist_export(crs, &imdsc->crs, &imdsc->ncrs))
+		goto err8;
 	if (rulelist_export(rs, &imdsc->rs, &imdsc->nrs))
-		goto err3;
+		goto err9;
+
+	/* Compile the path prefixes so that we can match them quickly. */
+	imdsc->rtrie = imdsc->ctrie = NULL;
+	imdsc->views = NULL;
+	imdsc->decisions = NULL;
+	imdsc->rcounts = NULL;
+	imdsc->nscanned = NULL;
+	imdsc->map = NULL;
+	imdsc->nnames = 0;
+	imdsc->nametime = 0.0;
+	if (compile(imdsc))
+		goto err10;
+
+	/* We're done with the file. */
+	free(line);
+	fclose(f);
 
 	/* Success! */
 	return (imdsc);
 
-err3:
+err10:
+	conf_free(imdsc);
+	free(line);
+	goto err1;
+
+err9:
+	for (i = 0; i < imdsc->ncrs; i++)
+		free(imdsc->crs[i].prefix);
+	free(imdsc->crs);
+	free(imdsc->prs);
+	free(imdsc->lrs);
 	free(imdsc);
+	goto err2;
+err8:
+	free(imdsc->prs);
+	free(imdsc->lrs);
+	free(imdsc);
+	goto err3;
+err7:
+	free(imdsc->lrs);
+	free(imdsc);
+	goto err4;
+err6:
+	free(imdsc);
+err5:
+	limitrulelist_free(lrs);
+err4:
+	priorulelist_free(prs);
+err3:
+	for (i = 0; i < cacherulelist_getsize(crs); i++)
+		free(cacherulelist_get(crs, i)->prefix);
+	cacherulelist_free(crs);
 err2:
 	free(line);
 	for (i = 0; i < rulelist_getsize(rs); i++)
@@ -269,72 +784,937 @@ err0:
 	return (NULL);
 }
 
-/* Check whether the path matches. */
+/**
+ * conf_read(path):
+ * Read the imds-proxy configuration file ${path} and return a state which
+ * can be passed to conf_check or conf_free.
+ */
+struct imds_conf *
+conf_read(const char * path)
+{
+	struct imds_conf * imdsc;
+	struct names * N;
+
+	/* Look up each user and group name only once. */
+	if ((N = names_init()) == NULL) {
+		warnp("names_init");
+		goto err0;
+	}
+
+	/* Read the file, and record how long looking up names took. */
+	if ((imdsc = readconf(path, N)) == NULL)
+		goto err1;
+	names_stats(N, &imdsc->nnames, &imdsc->nametime);
+
+	/* We don't need the names any more. */
+	names_free(N);
+
+	/* Success! */
+	return (imdsc);
+
+err1:
+	names_free(N);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Append ${str} to the string table ${S}, returning its offset via ${off}. */
 static int
-pathmatch(const char * path, const char * prefix)
+addstr(struct elasticarray * S, const char * str, uint64_t * off)
 {
 
-	/* Scan through the prefix one character at a time. */
-	for (; *prefix; prefix++) {
-		/* A '*' matches until the next '/' or the end. */
-		if (*prefix == '*') {
-			while ((*path != '/') && (*path != '\0'))
-				path++;
-			continue;
-		}
+	*off = elasticarray_getsize(S, 1);
+	return (elasticarray_append(S, str, strlen(str) + 1, 1));
+}
 
-		/* Anything else only matches itself. */
-		if (*prefix != *path++)
-			return (0);
-	}
+/* Write ${len} bytes from ${buf} to ${fd}. */
+static int
+writeall(int fd, const void * buf, size_t len)
+{
 
-	/* The entire prefix matches the provided path. */
-	return (1);
+	if (noeintr_write(fd, buf, len) != (ssize_t)len)
+		return (-1);
+	return (0);
 }
 
 /**
- * conf_check(imdsc, path, uid, gids, ngid):
- * Check whether the specified uid/gids is allowed to make this request;
- * return nonzero if the request is allowed.
+ * conf_compile(in, out):
+ * Read the imds-proxy configuration file ${in} and write it to ${out} in
+ * compiled form, which conf_load can use without parsing it or looking up
+ * user and group names.
  */
 int
-conf_check(const struct imds_conf * imdsc, const char * path,
-    uid_t uid, gid_t * gids, size_t ngid)
+conf_compile(const char * in, const char * out)
 {
-	size_t rnum, i;
-	int allow = 0;
-
-	/* Scan through the rules looking for any which match. */
-	for (rnum = 0; rnum < imdsc->nrs; rnum++) {
-		/* Does the id match (if relevant)? */
-		if (imdsc->rs[rnum].rtype == RTYPE_UID) {
-			if (imdsc->rs[rnum].id != uid)
-				continue;
-//			warn0("XXX UID match rule %zu", rnum);
-		} else if (imdsc->rs[rnum].rtype == RTYPE_GID) {
-			for (i = 0; i < ngid; i++) {
-				if (imdsc->rs[rnum].id == gids[i])
-					break;
-			}
-			if (i == ngid)
-				continue;
-//			warn0("XXX GID match rule %zu", rnum);
-		}
+	struct imds_conf * imdsc;
+	struct elasticarray * R;
+	struct elasticarray * S;
+	struct confbin_hdr hdr;
+	struct confbin_rule br;
+	struct confbin_cacherule bcr;
+	struct confbin_priorule bpr;
+	struct confbin_limitrule blr;
+	struct stat sb;
+	char * tmp;
+	size_t i;
+	int fd;
 
-		/* Does the path match? */
-		if (!pathmatch(path, imdsc->rs[rnum].prefix))
+	/*
+	 * Note the size and modification time of the file before we read it;
+	 * if it changes while we're reading it, the compiled file will be out
+	 * of date rather than silently wrong.
+	 */
+	if (stat(in, &sb)) {
+		warnp("stat(%s)", in);
+		goto err0;
+	}
+
+	/* Read the configuration. */
+	if ((imdsc = conf_read(in)) == NULL)
+		goto err0;
+
+	/* Create buffers for the records and the strings. */
+	if ((R = elasticarray_init(0, 1)) == NULL)
+		goto err1;
+	if ((S = elasticarray_init(0, 1)) == NULL)
+		goto err2;
+
+	/* The string table starts with an empty string, so it's never empty. */
+	if (elasticarray_append(S, "", 1, 1))
+		goto err3;
+
+	/* Construct the records. */
+	for (i = 0; i < imdsc->nrs; i++) {
+		memset(&br, 0, sizeof(br));
+		br.rtype = (uint32_t)imdsc->rs[i].rtype;
+		br.allow = (uint32_t)imdsc->rs[i].allow;
+		br.id = (int64_t)imdsc->rs[i].id;
+		if (addstr(S, imdsc->rs[i].prefix, &br.prefix) ||
+		    elasticarray_append(R, &br, sizeof(br), 1))
+			goto err3;
+	}
+	for (i = 0; i < imdsc->ncrs; i++) {
+		memset(&bcr, 0, sizeof(bcr));
+		bcr.ttl = imdsc->crs[i].ttl;
+		bcr.stale = imdsc->crs[i].stale;
+		if (addstr(S, imdsc->crs[i].prefix, &bcr.prefix) ||
+		    elasticarray_append(R, &bcr, sizeof(bcr), 1))
+			goto err3;
+	}
+	for (i = 0; i < imdsc->nprs; i++) {
+		memset(&bpr, 0, sizeof(bpr));
+		bpr.rtype = (uint32_t)imdsc->prs[i].rtype;
+		bpr.prio = imdsc->prs[i].prio;
+		bpr.id = (int64_t)imdsc->prs[i].id;
+		if (elasticarray_append(R, &bpr, sizeof(bpr), 1))
+			goto err3;
+	}
+	for (i = 0; i < imdsc->nlrs; i++) {
+		memset(&blr, 0, sizeof(blr));
+		blr.rtype = (uint32_t)imdsc->lrs[i].rtype;
+		blr.rate = imdsc->lrs[i].rate;
+		blr.burst = imdsc->lrs[i].burst;
+		blr.id = (int64_t)imdsc->lrs[i].id;
+		if (elasticarray_append(R, &blr, sizeof(blr), 1))
+			goto err3;
+	}
+
+	/* Fill in the header. */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CONFBIN_MAGIC, 8);
+	hdr.version = CONFBIN_VERSION;
+	hdr.srcsize = (uint64_t)sb.st_size;
+	hdr.srcsec = (int64_t)sb.st_mtim.tv_sec;
+	hdr.srcnsec = (int64_t)sb.st_mtim.tv_nsec;
+	hdr.nrs = imdsc->nrs;
+	hdr.ncrs = imdsc->ncrs;
+	hdr.nprs = imdsc->nprs;
+	hdr.nlrs = imdsc->nlrs;
+	hdr.strsize = elasticarray_getsize(S, 1);
+	hdr.pace_rate = imdsc->pace_rate;
+	hdr.pace_burst = imdsc->pace_burst;
+	for (i = 0; i < NDEADLINE; i++)
+		hdr.timeouts[i] = imdsc->timeouts[i];
+
+	/*
+	 * Write the file under a temporary name and then move it into place,
+	 * so that imds-proxy never sees (or has mapped) a partial file.
+	 */
+	if (asprintf(&tmp, "%s.XXXXXX", out) == -1) {
+		warnp("asprintf");
+		goto err3;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warnp("mkstemp(%s)", tmp);
+		goto err4;
+	}
+	if (writeall(fd, &hdr, sizeof(hdr)) ||
+	    writeall(fd, elasticarray_get(R, 0, 1),
+	    elasticarray_getsize(R, 1)) ||
+	    writeall(fd, elasticarray_get(S, 0, 1),
+	    elasticarray_getsize(S, 1))) {
+		warnp("write(%s)", tmp);
+		goto err5;
+	}
+	if (fchmod(fd, 0644)) {
+		warnp("fchmod(%s)", tmp);
+		goto err5;
+	}
+	if (fsync(fd)) {
+		warnp("fsync(%s)", tmp);
+		goto err5;
+	}
+	if (close(fd)) {
+		warnp("close(%s)", tmp);
+		goto err6;
+	}
+	if (rename(tmp, out)) {
+		warnp("rename(%s, %s)", tmp, out);
+		goto err6;
+	}
+
+	/* Clean up. */
+	free(tmp);
+	elasticarray_free(S);
+	elasticarray_free(R);
+	conf_free(imdsc);
+
+	/* Success! */
+	return (0);
+
+err5:
+	close(fd);
+err6:
+	unlink(tmp);
+err4:
+	free(tmp);
+err3:
+	elasticarray_free(S);
+err2:
+	elasticarray_free(R);
+err1:
+	conf_free(imdsc);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Check that the compiled configuration ${hdr}, which is ${len} bytes long,
+ * is complete and up to date with the configuration file ${path}.
+ */
+static int
+checkhdr(const struct confbin_hdr * hdr, size_t len, const char * binpath,
+    const char * path)
+{
+	struct stat sb;
+	uint64_t explen;
+
+	/* Is it a compiled configuration which we understand? */
+	if ((len < sizeof(struct confbin_hdr)) ||
+	    memcmp(hdr->magic, CONFBIN_MAGIC, 8) ||
+	    (hdr->version != CONFBIN_VERSION)) {
+		warn0("Not a compiled configuration: %s", binpath);
+		return (-1);
+	}
+
+	/* Has the configuration file changed since it was compiled? */
+	if (stat(path, &sb)) {
+		warnp("stat(%s)", path);
+		return (-1);
+	}
+	if (((uint64_t)sb.st_size != hdr->srcsize) ||
+	    ((int64_t)sb.st_mtim.tv_sec != hdr->srcsec) ||
+	    ((int64_t)sb.st_mtim.tv_nsec != hdr->srcnsec)) {
+		warn0("Compiled configuration is out of date: %s", binpath);
+		return (-1);
+	}
+
+	/* Is it the right size?  (The counts can't overflow if it is.) */
+	if ((hdr->nrs > len) || (hdr->ncrs > len) || (hdr->nprs > len) ||
+	    (hdr->nlrs > len) || (hdr->strsize > len))
+		goto bad;
+	explen = sizeof(struct confbin_hdr) +
+	    hdr->nrs * sizeof(struct confbin_rule) +
+	    hdr->ncrs * sizeof(struct confbin_cacherule) +
+	    hdr->nprs * sizeof(struct confbin_priorule) +
+	    hdr->nlrs * sizeof(struct confbin_limitrule) + hdr->strsize;
+	if ((explen != len) || (hdr->strsize == 0))
+		goto bad;
+
+	/* Success! */
+	return (0);
+
+bad:
+	warn0("Compiled configuration is corrupt: %s", binpath);
+	return (-1);
+}
+
+/*
+ * Create a configuration from the ${len}-byte compiled configuration ${map}
+ * (read from ${binpath}), whose header has been checked; the prefixes point
+ * into ${map}.
+ */
+static struct imds_conf *
+unpack(void * map, size_t len, const char * binpath)
+{
+	const struct confbin_hdr * hdr = map;
+	const struct confbin_rule * brs;
+	const struct confbin_cacherule * bcrs;
+	const struct confbin_priorule * bprs;
+	const struct confbin_limitrule * blrs;
+	struct imds_conf * imdsc;
+	char * strs;
+	size_t i;
+
+	/* Find the records and the strings. */
+	brs = (const struct confbin_rule *)&hdr[1];
+	bcrs = (const struct confbin_cacherule *)&brs[hdr->nrs];
+	bprs = (const struct confbin_priorule *)&bcrs[hdr->ncrs];
+	blrs = (const struct confbin_limitrule *)&bprs[hdr->nprs];
+	strs = (char *)map + (len - hdr->strsize);
+
+	/* The last string must be terminated. */
+	if (strs[hdr->strsize - 1] != '\0') {
+		warn0("Compiled configuration is corrupt: %s", binpath);
+		goto err0;
+	}
+
+	/* Allocate a structure and the arrays of rules. */
+	if ((imdsc = malloc(sizeof(struct imds_conf))) == NULL)
+		goto err0;
+	imdsc->nrs = hdr->nrs;
+	imdsc->ncrs = hdr->ncrs;
+	imdsc->nprs = hdr->nprs;
+	imdsc->nlrs = hdr->nlrs;
+	if ((imdsc->rs = malloc((imdsc->nrs + 1) * sizeof(struct rule))) ==
+	    NULL)
+		goto err1;
+	if ((imdsc->crs = malloc((imdsc->ncrs + 1) *
+	    sizeof(struct cacherule))) == NULL)
+		goto err2;
+	if ((imdsc->prs = malloc((imdsc->nprs + 1) *
+	    sizeof(struct priorule))) == NULL)
+		goto err3;
+	if ((imdsc->lrs = malloc((imdsc->nlrs + 1) *
+	    sizeof(struct limitrule))) == NULL)
+		goto err4;
+
+	/* Fill in the rules, checking that they're valid. */
+	for (i = 0; i < imdsc->nrs; i++) {
+		if ((brs[i].rtype > RTYPE_GID) || (brs[i].allow > 1) ||
+		    (brs[i].prefix >= hdr->strsize))
+			goto bad;
+		imdsc->rs[i].rtype = (int)brs[i].rtype;
+		imdsc->rs[i].id = (id_t)brs[i].id;
+		imdsc->rs[i].prefix = &strs[brs[i].prefix];
+		imdsc->rs[i].allow = (int)brs[i].allow;
+	}
+	for (i = 0; i < imdsc->ncrs; i++) {
+		if ((bcrs[i].prefix >= hdr->strsize) ||
+		    (bcrs[i].ttl < 0) || (bcrs[i].ttl > CACHE_TTLMAX) ||
+		    (bcrs[i].stale < 0) || (bcrs[i].stale > CACHE_TTLMAX))
+			goto bad;
+		imdsc->crs[i].prefix = &strs[bcrs[i].prefix];
+		imdsc->crs[i].ttl = bcrs[i].ttl;
+		imdsc->crs[i].stale = bcrs[i].stale;
+	}
+	for (i = 0; i < imdsc->nprs; i++) {
+		if ((bprs[i].rtype > RTYPE_GID) ||
+		    (bprs[i].prio < PRIO_HIGH) || (bprs[i].prio > PRIO_LOW))
+			goto bad;
+		imdsc->prs[i].rtype = (int)bprs[i].rtype;
+		imdsc->prs[i].id = (id_t)bprs[i].id;
+		imdsc->prs[i].prio = bprs[i].prio;
+	}
+	for (i = 0; i < imdsc->nlrs; i++) {
+		if ((blrs[i].rtype > RTYPE_GID) ||
+		    (blrs[i].rate < 1) || (blrs[i].rate > RATE_MAX) ||
+		    (blrs[i].burst < 1) || (blrs[i].burst > RATE_MAX))
+			goto bad;
+		imdsc->lrs[i].rtype = (int)blrs[i].rtype;
+		imdsc->lrs[i].id = (id_t)blrs[i].id;
+		imdsc->lrs[i].rate = blrs[i].rate;
+		imdsc->lrs[i].burst = blrs[i].burst;
+	}
+
+	/* Global settings. */
+	if ((hdr->pace_rate < 0) || (hdr->pace_rate > RATE_MAX) ||
+	    (hdr->pace_burst < 0) || (hdr->pace_burst > RATE_MAX))
+		goto bad;
+	imdsc->pace_rate = hdr->pace_rate;
+	imdsc->pace_burst = hdr->pace_burst;
+	for (i = 0; i < NDEADLINE; i++) {
+		if ((hdr->timeouts[i] < 0) || (hdr->timeouts[i] > TIMEOUT_MAX))
+			goto bad;
+		imdsc->timeouts[i] = hdr->timeouts[i];
+	}
+
+	/* Success! */
+	return (imdsc);
+
+bad:
+	warn0("Compiled configuration is corrupt: %s", binpath);
+	free(imdsc->lrs);
+err4:
+	free(imdsc->prs);
+err3:
+	free(imdsc->crs);
+err2:
+	free(imdsc->rs);
+err1:
+	free(imdsc);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/*
+ * Map the compiled configuration ${binpath}, if it is up to date with the
+ * configuration file ${path}.
+ */
+static struct imds_conf *
+mapconf(const char * binpath, const char * path)
+{
+	struct imds_conf * imdsc;
+	struct stat sb;
+	void * map;
+	size_t len;
+	int fd;
+
+	/* Open the file and map it. */
+	if ((fd = open(binpath, O_RDONLY)) == -1) {
+		warnp("open(%s)", binpath);
+		goto err0;
+	}
+	if (fstat(fd, &sb)) {
+		warnp("fstat(%s)", binpath);
+		goto err1;
+	}
+	if ((sb.st_size <= 0) || ((uintmax_t)sb.st_size > SIZE_MAX)) {
+		warn0("Compiled configuration is the wrong size: %s", binpath);
+		goto err1;
+	}
+	len = (size_t)sb.st_size;
+	if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		warnp("mmap(%s)", binpath);
+		goto err1;
+	}
+
+	/* Make sure we can use it. */
+	if (checkhdr(map, len, binpath, path))
+		goto err2;
+	if ((imdsc = unpack(map, len, binpath)) == NULL)
+		goto err2;
+	imdsc->map = map;
+	imdsc->maplen = len;
+
+	/* Compile the path prefixes; conf_free unmaps the file on failure. */
+	imdsc->rtrie = imdsc->ctrie = NULL;
+	imdsc->views = NULL;
+	imdsc->decisions = NULL;
+	imdsc->rcounts = NULL;
+	imdsc->nscanned = NULL;
+	imdsc->nnames = 0;
+	imdsc->nametime = 0.0;
+	if (compile(imdsc)) {
+		conf_free(imdsc);
+		goto err1;
+	}
+
+	/* We don't need the file descriptor any more. */
+	close(fd);
+
+	/* Success! */
+	return (imdsc);
+
+err2:
+	munmap(map, len);
+err1:
+	close(fd);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * conf_load(path, binpath):
+ * If ${binpath} is not NULL, and is a compiled configuration which is up to
+ * date with the imds-proxy configuration file ${path}, use it; otherwise,
+ * read ${path}.  Return a state as conf_read does.
+ */
+struct imds_conf *
+conf_load(const char * path, const char * binpath)
+{
+	struct imds_conf * imdsc;
+
+	/* Use the compiled configuration if we can. */
+	if (binpath != NULL) {
+		if ((imdsc = mapconf(binpath, path)) != NULL)
+			return (imdsc);
+		warn0("Reading configuration file instead: %s", path);
+	}
+
+	/* Read the configuration file. */
+	return (conf_read(path));
+}
+
+/* Check whether the uid/gids match a rule of type ${rtype} for ${id}. */
+static int
+idmatch(int rtype, id_t id, uid_t uid, const gid_t * gids, size_t ngid)
+{
+	size_t i;
+
+	switch (rtype) {
+	case RTYPE_UID:
+		return (id == uid);
+	case RTYPE_GID:
+		for (i = 0; i < ngid; i++) {
+			if (id == gids[i])
+				return (1);
+		}
+		return (0);
+	default:
+		return (1);
+	}
+}
+
+/* Build a view of the access rules which can apply to ${uid}/${gids}. */
+static void *
+view_build(void * cookie, uid_t uid, const gid_t * gids, size_t ngid)
+{
+	const struct imds_conf * imdsc = cookie;
+	struct view * V;
+	char ** prefixes;
+	size_t rnum, n = 0;
+
+	/* Allocate a structure and space for the rule numbers and prefixes. */
+	if ((V = malloc(sizeof(struct view))) == NULL)
+		goto err0;
+	if ((V->rnums = malloc((imdsc->nrs + 1) * sizeof(size_t))) == NULL)
+		goto err1;
+	if ((prefixes = malloc((imdsc->nrs + 1) * sizeof(char *))) == NULL)
+		goto err2;
+
+	/* Pick out the rules which can apply, in order. */
+	for (rnum = 0; rnum < imdsc->nrs; rnum++) {
+		if (!idmatch(imdsc->rs[rnum].rtype, imdsc->rs[rnum].id,
+		    uid, gids, ngid))
 			continue;
+		V->rnums[n] = rnum;
+		prefixes[n] = imdsc->rs[rnum].prefix;
+		n++;
+	}
 
-//		warn0("XXX path match rule %zu", rnum);
+	/* Compile their prefixes. */
+	if ((V->trie = pathtrie_init(prefixes, n)) == NULL)
+		goto err3;
+
+	/* We don't need the list of prefixes any more. */
+	free(prefixes);
+
+	/* Success! */
+	return (V);
 
-		/* Do what this rule says. */
-		allow = imdsc->rs[rnum].allow;
+err3:
+	free(prefixes);
+err2:
+	free(V->rnums);
+err1:
+	free(V);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Free the view ${cookie}. */
+static void
+view_free(void * cookie)
+{
+	struct view * V = cookie;
+
+	pathtrie_free(V->trie);
+	free(V->rnums);
+	free(V);
+}
+
+/*
+ * The uid/gids making a request, for matching against access rules; the
+ * numbers of the rules in its view, if we have one; and whether to count
+ * the rules we examine, and how many we've examined.
+ */
+struct who {
+	const struct imds_conf * imdsc;
+	uid_t uid;
+	gid_t * gids;
+	size_t ngid;
+	const size_t * rnums;
+	int counting;
+	size_t nscanned;
+};
+
+/* Add one to the counter ${n}, which other threads may be updating. */
+#define COUNT(n) __atomic_fetch_add(&(n), 1, __ATOMIC_RELAXED)
+
+/* Count examining access rule ${rnum}, and whether it ${matched}. */
+static void
+examined(struct who * W, size_t rnum, int matched)
+{
+
+	W->nscanned++;
+	if (!W->counting)
+		return;
+	COUNT(W->imdsc->rcounts[rnum].examined);
+	if (matched)
+		COUNT(W->imdsc->rcounts[rnum].matched);
+}
+
+/* Check whether the uid/gids ${cookie} match access rule ${rnum}. */
+static int
+rulematch(void * cookie, size_t rnum)
+{
+	struct who * W = cookie;
+	int matched;
+
+	matched = idmatch(W->imdsc->rs[rnum].rtype, W->imdsc->rs[rnum].id,
+	    W->uid, W->gids, W->ngid);
+	examined(W, rnum, matched);
+	return (matched);
+}
+
+/* Rule ${vnum} in the view of uid/gids ${cookie} matches them. */
+static int
+viewmatch(void * cookie, size_t vnum)
+{
+	struct who * W = cookie;
+
+	examined(W, W->rnums[vnum], 1);
+	return (1);
+}
+
+/* Count a decision made by rule ${rnum} (or by no rule, if NORULE). */
+static void
+decided(const struct imds_conf * imdsc, size_t rnum)
+{
+
+	COUNT(imdsc->rcounts[(rnum == NORULE) ? imdsc->nrs : rnum].decided);
+}
+
+/* Count a decision made after examining ${n} rules. */
+static void
+scanned(const struct imds_conf * imdsc, size_t n)
+{
+	size_t b;
+
+	for (b = 0; (n > 0) && (b < NSCANBUCKETS - 1); b++)
+		n >>= 1;
+	COUNT(imdsc->nscanned[b]);
+}
+
+/*
+ * Check whether ${uid}/${gids} may request ${path}, and return via ${rnum}
+ * the number of the access rule which decided, or NORULE if none matched.
+ * If ${counting} is non-zero, count the rules examined (and how many there
+ * were) and the rule which decided.
+ */
+static int
+decide(const struct imds_conf * imdsc, const char * path,
+    uid_t uid, gid_t * gids, size_t ngid, size_t * rnum, int counting)
+{
+	const struct view * V;
+	struct who W;
+	void * handle;
+	size_t vnum;
+
+	/* If no rule matches, the request is denied. */
+	*rnum = NORULE;
+	W.imdsc = imdsc;
+	W.uid = uid;
+	W.gids = gids;
+	W.ngid = ngid;
+	W.counting = counting;
+	W.nscanned = 0;
+
+	/*
+	 * Look at the rules which can apply to this uid/gids; we usually
+	 * have a view of them from an earlier request by the same principal.
+	 * We only need a filter for the trie if we're counting rules.
+	 */
+	V = princache_get(imdsc->views, uid, gids, ngid, &handle);
+	if (V != NULL) {
+		W.rnums = V->rnums;
+		if (pathtrie_match(V->trie, path, counting ? viewmatch : NULL,
+		    &W, &vnum))
+			*rnum = V->rnums[vnum];
+		princache_release(imdsc->views, handle);
+		goto done;
+	}
+
+	/*
+	 * If we couldn't get a view, find the last rule which matches both
+	 * the path and the uid/gids.
+	 */
+	warnp("Could not build view of access rules");
+	if (pathtrie_match(imdsc->rtrie, path, rulematch, &W, &vnum))
+		*rnum = vnum;
+
+done:
+	/* Count how many rules we examined, and the one which decided. */
+	if (counting) {
+		scanned(imdsc, W.nscanned);
+		decided(imdsc, *rnum);
 	}
 
-	/* Return status from the last matched rule. */
+	/* Do what the rule says. */
+	if (*rnum == NORULE)
+		return (0);
+	return (imdsc->rs[*rnum].allow);
+}
+
+/**
+ * conf_check(imdsc, path, uid, gids, ngid):
+ * Check whether the specified uid/gids is allowed to make this request;
+ * return nonzero if the request is allowed.
+ */
+int
+conf_check(const struct imds_conf * imdsc, const char * path,
+    uid_t uid, gid_t * gids, size_t ngid)
+{
+	size_t rnum;
+	int allow;
+
+	/*
+	 * Have we made this decision before?  If so, the rule which made it
+	 * has decided another request (but we didn't examine any rules).
+	 */
+	allow = decisions_get(imdsc->decisions, uid, gids, ngid, path, &rnum);
+	if (allow != -1) {
+		decided(imdsc, rnum);
+		return (allow);
+	}
+
+	/* Make the decision, and remember it. */
+	allow = decide(imdsc, path, uid, gids, ngid, &rnum, 1);
+	if (decisions_put(imdsc->decisions, uid, gids, ngid, path, allow,
+	    rnum))
+		warnp("Could not remember access decision");
+
+	/* Return the decision. */
 	return (allow);
 }
 
+/**
+ * conf_explain(imdsc, path, uid, gids, ngid, rnum):
+ * Check whether the specified uid/gids is allowed to make this request as
+ * conf_check does, but without using or remembering earlier decisions or
+ * counting it in the statistics logged by conf_stats_log; and return via
+ * ${rnum} the number (starting from 0) of the access rule which decided, or
+ * NORULE if no access rule matched.
+ */
+int
+conf_explain(const struct imds_conf * imdsc, const char * path,
+    uid_t uid, gid_t * gids, size_t ngid, size_t * rnum)
+{
+
+	return (decide(imdsc, path, uid, gids, ngid, rnum, 0));
+}
+
+/**
+ * conf_cache(imdsc, path, ttl, stale):
+ * Return via ${ttl} the number of seconds for which responses to requests
+ * for ${path} may be cached, and via ${stale} the number of seconds after
+ * that for which they may be served if the IMDS is failing.
+ */
+void
+conf_cache(const struct imds_conf * imdsc, const char * path,
+    int * ttl, int * stale)
+{
+	size_t rnum;
+
+	/* By default we don't cache anything. */
+	*ttl = *stale = 0;
+
+	/* The last matching rule applies. */
+	if (pathtrie_match(imdsc->ctrie, path, NULL, NULL, &rnum)) {
+		*ttl = imdsc->crs[rnum].ttl;
+		*stale = imdsc->crs[rnum].stale;
+	}
+}
+
+/**
+ * conf_pace(imdsc, rate, burst):
+ * Return via ${rate} the maximum number of requests per second which should
+ * be sent to the IMDS, and via ${burst} the number which may be sent at
+ * once; or zero for both if requests should not be paced.
+ */
+void
+conf_pace(const struct imds_conf * imdsc, int * rate, int * burst)
+{
+
+	*rate = imdsc->pace_rate;
+	*burst = imdsc->pace_burst;
+}
+
+/**
+ * conf_priority(imdsc, uid, gids, ngid):
+ * Return the priority class (PRIO_*) of requests from the specified uid/gids.
+ */
+int
+conf_priority(const struct imds_conf * imdsc, uid_t uid, gid_t * gids,
+    size_t ngid)
+{
+	size_t rnum;
+	int prio = PRIO_NORMAL;
+
+	/* The last matching rule applies. */
+	for (rnum = 0; rnum < imdsc->nprs; rnum++) {
+		if (idmatch(imdsc->prs[rnum].rtype, imdsc->prs[rnum].id,
+		    uid, gids, ngid))
+			prio = imdsc->prs[rnum].prio;
+	}
+
+	/* Return the priority class. */
+	return (prio);
+}
+
+/**
+ * conf_limit(imdsc, uid, gids, ngid, lim):
+ * If requests from the specified uid/gids are subject to a rate limit, return
+ * it via ${lim} and return nonzero; otherwise, return zero.
+ */
+int
+conf_limit(const struct imds_conf * imdsc, uid_t uid, gid_t * gids,
+    size_t ngid, struct limit * lim)
+{
+	const struct limitrule * lr = NULL;
+	size_t rnum;
+
+	/* The last matching rule applies. */
+	for (rnum = 0; rnum < imdsc->nlrs; rnum++) {
+		if (idmatch(imdsc->lrs[rnum].rtype, imdsc->lrs[rnum].id,
+		    uid, gids, ngid))
+			lr = &imdsc->lrs[rnum];
+	}
+
+	/* No limit? */
+	if (lr == NULL)
+		return (0);
+
+	/* Members of a group share a limit; otherwise each user has one. */
+	if (lr->rtype == RTYPE_GID) {
+		lim->type = LIMIT_GID;
+		lim->id = lr->id;
+	} else {
+		lim->type = LIMIT_UID;
+		lim->id = uid;
+	}
+	lim->rate = lr->rate;
+	lim->burst = lr->burst;
+
+	/* There is a limit. */
+	return (1);
+}
+
+/**
+ * conf_deadline(imdsc, stage):
+ * Return the number of seconds allowed for the stage ${stage} (one of the
+ * DEADLINE_* values) of handling a request, or zero if there is no limit.
+ */
+int
+conf_deadline(const struct imds_conf * imdsc, int stage)
+{
+
+	return (imdsc->timeouts[stage]);
+}
+
+/**
+ * conf_nrules(imdsc):
+ * Return the number of rules of all kinds in ${imdsc}.
+ */
+size_t
+conf_nrules(const struct imds_conf * imdsc)
+{
+
+	return (imdsc->nrs + imdsc->ncrs + imdsc->nprs + imdsc->nlrs);
+}
+
+/**
+ * conf_names(imdsc, nnames, t):
+ * Return via ${nnames} the number of user and group names which were looked
+ * up when ${imdsc} was read, and via ${t} the number of seconds this took.
+ */
+void
+conf_names(const struct imds_conf * imdsc, size_t * nnames, double * t)
+{
+
+	*nnames = imdsc->nnames;
+	*t = imdsc->nametime;
+}
+
+/**
+ * conf_stats_log(imdsc):
+ * Log statistics about access decisions made using ${imdsc}, and about how
+ * often each access rule was examined, matched, and decided a request.
+ */
+void
+conf_stats_log(const struct imds_conf * imdsc)
+{
+	const struct rule * r;
+	char who[32];
+	uint64_t n[NSCANBUCKETS];
+	uint64_t nexamined, nmatched, ndecided;
+	size_t rnum, b;
+
+	/* Statistics about remembered decisions. */
+	decisions_stats_log(imdsc->decisions);
+
+	/*
+	 * How many rules we examined for each decision we made; remembered
+	 * decisions (the hits above) didn't examine any.
+	 */
+	for (b = 0; b < NSCANBUCKETS; b++)
+		n[b] = __atomic_load_n(&imdsc->nscanned[b], __ATOMIC_RELAXED);
+	syslog(LOG_INFO, "imds-proxy: access rules examined per decision: "
+	    "0: %ju; 1: %ju; 2-3: %ju; 4-7: %ju; 8-15: %ju; 16+: %ju",
+	    (uintmax_t)n[0], (uintmax_t)n[1], (uintmax_t)n[2],
+	    (uintmax_t)n[3], (uintmax_t)n[4], (uintmax_t)n[5]);
+
+	/* How each rule was used, counting from 1 as the file lists them. */
+	for (rnum = 0; rnum < imdsc->nrs; rnum++) {
+		r = &imdsc->rs[rnum];
+		nexamined = __atomic_load_n(&imdsc->rcounts[rnum].examined,
+		    __ATOMIC_RELAXED);
+		nmatched = __atomic_load_n(&imdsc->rcounts[rnum].matched,
+		    __ATOMIC_RELAXED);
+		ndecided = __atomic_load_n(&imdsc->rcounts[rnum].decided,
+		    __ATOMIC_RELAXED);
+		switch (r->rtype) {
+		case RTYPE_UID:
+			snprintf(who, sizeof(who), " uid %jd", (intmax_t)r->id);
+			break;
+		case RTYPE_GID:
+			snprintf(who, sizeof(who), " gid %jd", (intmax_t)r->id);
+			break;
+		default:
+			who[0] = '\0';
+			break;
+		}
+		syslog(LOG_INFO, "imds-proxy: access rule %zu (%s%s \"%s\"): "
+		    "%ju examined, %ju matched, %ju decided", rnum + 1,
+		    r->allow ? "Allow" : "Deny", who, r->prefix,
+		    (uintmax_t)nexamined, (uintmax_t)nmatched,
+		    (uintmax_t)ndecided);
+	}
+
+	/* Requests which no access rule matched. */
+	ndecided = __atomic_load_n(&imdsc->rcounts[imdsc->nrs].decided,
+	    __ATOMIC_RELAXED);
+	syslog(LOG_INFO, "imds-proxy: no access rule matched: %ju decided",
+	    (uintmax_t)ndecided);
+}
+
 /**
  * conf_free(imdsc):
  * Free the configuration state ${imdsc}.
@@ -344,12 +1724,29 @@ conf_free(struct imds_conf * imdsc)
 {
 	size_t rnum;
 
-	/* Free the prefix strings. */
-	for (rnum = 0; rnum < imdsc->nrs; rnum++)
-		free(imdsc->rs[rnum].prefix);
+	/* Free the counters, the decisions, the views, and the tries. */
+	free(imdsc->nscanned);
+	free(imdsc->rcounts);
+	decisions_free(imdsc->decisions);
+	princache_free(imdsc->views);
+	pathtrie_free(imdsc->rtrie);
+	pathtrie_free(imdsc->ctrie);
+
+	/* Free the prefix strings, or unmap the file they're in. */
+	if (imdsc->map != NULL) {
+		munmap(imdsc->map, imdsc->maplen);
+	} else {
+		for (rnum = 0; rnum < imdsc->nrs; rnum++)
+			free(imdsc->rs[rnum].prefix);
+		for (rnum = 0; rnum < imdsc->ncrs; rnum++)
+			free(imdsc->crs[rnum].prefix);
+	}
 
-	/* Free the array of rules. */
+	/* Free the arrays of rules. */
 	free(imdsc->rs);
+	free(imdsc->crs);
+	free(imdsc->prs);
+	free(imdsc->lrs);
 
 	/* Free the structure. */
 	free(imdsc);
@@ -0,0 +1,329 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * If imds-filterd is run with -c, it looks up the owner of each connection
+ * into the jail when it sees the connection open, and publishes the answer
+ * in a table in a file which we map into our address space.  Looking up a
+ * connection in the table takes a single probe, without any locks or system
+ * calls; if the connection isn't there (or the table isn't) we ask the
+ * ident service instead.
+ *
+ * The table is direct-mapped: a hash of the connection's addresses and
+ * ports picks its slot.  imds-filterd is the only writer; each slot has a
+ * sequence number which is odd while the slot is being written, so we copy
+ * the slot and then check that the sequence number was even and hasn't
+ * changed.  When imds-filterd exits, or a new instance starts, the table is
+ * marked as dead; we then stop using it and (at most once a second) try to
+ * map whichever table is there now.  Other threads may still be reading a
+ * table which we've stopped using, so we don't unmap old tables until we're
+ * shutting down; imds-filterd rarely restarts, so there are few of them.
+ *
+ * This layout must match the one in imds-filterd.
+ */
+
+/* Identifies a credential table, and its layout. */
+#define CREDTAB_MAGIC "IMDSCRED"
+#define CREDTAB_VERSION 1
+
+/* Table header. */
+struct credtab_hdr {
+	uint8_t magic[8];
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t dead;
+	uint32_t pad;
+};
+
+/* A slot in the table. */
+struct credtab_slot {
+	uint32_t seq;
+	uint8_t query[12];
+	uint32_t uid;
+	uint32_t ngroups;	/* 0 if the slot is empty. */
+	uint32_t groups[IDENT_NGROUPS];
+};
+
+/* A mapping of a credential table. */
+struct credmap {
+	const struct credtab_hdr * hdr;
+	const struct credtab_slot * slots;
+	size_t len;
+	struct credmap * prev;
+};
+
+/* Credential tables published by imds-filterd. */
+struct credtab {
+	char * path;
+
+	/* The table we're using, or NULL. */
+	struct credmap * M;
+
+	/* Serializes attempts to map a table. */
+	pthread_mutex_t mtx;
+	struct timeval lastopen;
+	int opened;
+};
+
+/* Map the table at ${path}, or return NULL if there isn't a usable one. */
+static struct credmap *
+mapfile(const char * path)
+{
+	struct credmap * M;
+	struct stat sb;
+	void * p;
+	int fd;
+
+	/* Allocate a structure. */
+	if ((M = malloc(sizeof(struct credmap))) == NULL) {
+		warnp("malloc");
+		goto err0;
+	}
+
+	/* Open the file, if it's there. */
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			warnp("open(%s)", path);
+		goto err1;
+	}
+
+	/* Map it. */
+	if (fstat(fd, &sb)) {
+		warnp("fstat(%s)", path);
+		goto err2;
+	}
+	if ((sb.st_size < (off_t)sizeof(struct credtab_hdr)) ||
+	    ((uintmax_t)sb.st_size > SIZE_MAX)) {
+		warn0("Credential table is the wrong size: %s", path);
+		goto err2;
+	}
+	M->len = (size_t)sb.st_size;
+	if ((p = mmap(NULL, M->len, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		warnp("mmap(%s)", path);
+		goto err2;
+	}
+	M->hdr = p;
+	M->slots = (const struct credtab_slot *)&M->hdr[1];
+
+	/* Make sure it's a table we understand. */
+	if (memcmp(M->hdr->magic, CREDTAB_MAGIC, 8) ||
+	    (M->hdr->version != CREDTAB_VERSION) ||
+	    (M->hdr->nslots == 0) ||
+	    (M->hdr->nslots & (M->hdr->nslots - 1)) ||
+	    (M->len != sizeof(struct credtab_hdr) +
+	    (size_t)M->hdr->nslots * sizeof(struct credtab_slot))) {
+		warn0("Invalid credential table: %s", path);
+		goto err3;
+	}
+
+	/* Don't bother with a table which is already dead. */
+	if (__atomic_load_n(&M->hdr->dead, __ATOMIC_ACQUIRE))
+		goto err3;
+
+	/* We don't need the file descriptor any more. */
+	close(fd);
+
+	/* Success! */
+	return (M);
+
+err3:
+	munmap(p, M->len);
+err2:
+	close(fd);
+err1:
+	free(M);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/*
+ * Try to replace the table ${M} which we've been using (if any) with the
+ * table which is there now, unless another thread is doing so or we tried
+ * within the past second.
+ */
+static void
+reopen(struct credtab * T, struct credmap * M)
+{
+	struct credmap * N;
+	struct timeval tv;
+	int rc;
+
+	/* If another thread is trying, let it. */
+	if (pthread_mutex_trylock(&T->mtx) != 0)
+		return;
+
+	/* Has another thread already replaced the table? */
+	if (__atomic_load_n(&T->M, __ATOMIC_ACQUIRE) != M)
+		goto done;
+
+	/* Don't try too often. */
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		goto done;
+	}
+	if (T->opened && (timeval_diff(T->lastopen, tv) < 1.0))
+		goto done;
+	T->lastopen = tv;
+	T->opened = 1;
+
+	/* Map the table which is there now, if there is one. */
+	if ((N = mapfile(T->path)) == NULL)
+		goto done;
+
+	/* Start using it; keep the old one until we're shutting down. */
+	N->prev = M;
+	__atomic_store_n(&T->M, N, __ATOMIC_RELEASE);
+
+done:
+	/* Unlock. */
+	if ((rc = pthread_mutex_unlock(&T->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/* Return the slot in ${M} for the connection described by ${query}. */
+static const struct credtab_slot *
+slot(const struct credmap * M, const uint8_t * query)
+{
+	uint32_t h;
+
+	/* Hash the addresses and ports, just as imds-filterd does. */
+	h = fnv_hash(FNV_INIT, query, 12);
+
+	/* Pick the slot. */
+	return (&M->slots[h & (M->hdr->nslots - 1)]);
+}
+
+/**
+ * credtab_open(path):
+ * Prepare to look up connections in the credential table which imds-filterd
+ * publishes at ${path}.  The table need not exist yet.
+ */
+struct credtab *
+credtab_open(const char * path)
+{
+	struct credtab * T;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((T = malloc(sizeof(struct credtab))) == NULL)
+		goto err0;
+	if ((T->path = strdup(path)) == NULL)
+		goto err1;
+	T->M = NULL;
+	T->opened = 0;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&T->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+
+	/* Success! */
+	return (T);
+
+err2:
+	free(T->path);
+err1:
+	free(T);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * credtab_lookup(T, query, uid, gids, ngid):
+ * Look up the connection described by the 12-byte ident ${query} in the
+ * credential table ${T}.  If it is there, return the user ID via ${uid},
+ * the group IDs via the caller-provided array ${gids}, and the number of
+ * group IDs via ${ngid}; otherwise, return -1.  This may be called by
+ * several threads at once.
+ */
+int
+credtab_lookup(struct credtab * T, const uint8_t * query, uid_t * uid,
+    gid_t gids[IDENT_NGROUPS], size_t * ngid)
+{
+	const struct credtab_slot * S;
+	struct credtab_slot copy;
+	struct credmap * M;
+	uint32_t seq;
+	size_t i;
+
+	/* Make sure we have a live table. */
+	M = __atomic_load_n(&T->M, __ATOMIC_ACQUIRE);
+	if ((M == NULL) || __atomic_load_n(&M->hdr->dead, __ATOMIC_ACQUIRE)) {
+		reopen(T, M);
+		M = __atomic_load_n(&T->M, __ATOMIC_ACQUIRE);
+		if ((M == NULL) ||
+		    __atomic_load_n(&M->hdr->dead, __ATOMIC_ACQUIRE))
+			return (-1);
+	}
+
+	/* Copy the slot, unless it's being written. */
+	S = slot(M, query);
+	if ((seq = __atomic_load_n(&S->seq, __ATOMIC_ACQUIRE)) & 1)
+		return (-1);
+	memcpy(&copy, S, sizeof(struct credtab_slot));
+
+	/* If the slot changed while we were copying it, give up. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&S->seq, __ATOMIC_RELAXED) != seq)
+		return (-1);
+
+	/* Is this connection in the slot? */
+	if ((copy.ngroups == 0) || (copy.ngroups > IDENT_NGROUPS) ||
+	    memcmp(copy.query, query, 12))
+		return (-1);
+
+	/* Copy out the credentials. */
+	*uid = (uid_t)copy.uid;
+	for (i = 0; i < copy.ngroups; i++)
+		gids[i] = (gid_t)copy.groups[i];
+	*ngid = copy.ngroups;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * credtab_close(T):
+ * Unmap any credential tables and free ${T}.  There must be no lookups in
+ * progress.
+ */
+void
+credtab_close(struct credtab * T)
+{
+	struct credmap * M;
+
+	/* Behave consistently with free(NULL). */
+	if (T == NULL)
+		return;
+
+	/* Unmap the tables. */
+	while ((M = T->M) != NULL) {
+		T->M = M->prev;
+		munmap((void *)(uintptr_t)M->hdr, M->len);
+		free(M);
+	}
+
+	/* Free the mutex and the structure. */
+	pthread_mutex_destroy(&T->mtx);
+	free(T->path);
+	free(T);
+}
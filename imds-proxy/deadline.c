@@ -0,0 +1,382 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "monoclock.h"
+#include "timerqueue.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Worker threads read requests and relay responses with blocking I/O, so a
+ * client which sends its request one byte at a time (or stops reading the
+ * response) could otherwise tie up a thread, and perhaps a connection to
+ * the IMDS, forever.  Rather than setting a timeout on each system call --
+ * which a client can defeat by sending just enough data to keep resetting
+ * it -- workers register deadlines with a "reaper" thread, which shuts down
+ * the sockets involved when a deadline passes; any blocking read or write
+ * on them then fails, and the worker cleans up as it would for any other
+ * error.  In events mode, deadlines are events timers, and this code only
+ * keeps count of how many of them have expired.
+ */
+
+/* A deadline which has been set. */
+struct deadline {
+	void * cookie;		/* Timer queue cookie, or NULL if expired. */
+	int s[2];
+	int stage;
+};
+
+/* Deadlines, and the statistics about them. */
+struct deadlines {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	struct timerqueue * Q;
+	uint64_t ntimeouts[NDEADLINE];
+};
+
+/* Set ${tv} to ${secs} seconds from now. */
+static int
+later(struct timeval * tv, double secs)
+{
+
+	/* Find out what time it is. */
+	if (monoclock_get(tv)) {
+		warnp("monoclock_get");
+		return (-1);
+	}
+
+	/* Add the number of seconds. */
+	tv->tv_sec += (time_t)secs;
+	tv->tv_usec +=
+	    (suseconds_t)((secs - (double)(time_t)secs) * 1000000.0);
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec += 1;
+		tv->tv_usec -= 1000000;
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* Shut down the sockets of deadlines which have passed, forever. */
+static void *
+reaper(void * cookie)
+{
+	struct deadlines * DL = cookie;
+	struct deadline * D;
+	const struct timeval * tvmin;
+	struct timeval tv;
+	struct timespec ts;
+	double d;
+	int rc;
+
+	/* Lock the deadlines. */
+	if ((rc = pthread_mutex_lock(&DL->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+
+	do {
+		/* Find out what time it is. */
+		if (monoclock_get(&tv)) {
+			warnp("monoclock_get");
+			exit(1);
+		}
+
+		/* Enforce every deadline which has passed. */
+		while ((D = timerqueue_getptr(DL->Q, &tv)) != NULL) {
+			D->cookie = NULL;
+			shutdown(D->s[0], SHUT_RDWR);
+			if (D->s[1] != -1)
+				shutdown(D->s[1], SHUT_RDWR);
+			DL->ntimeouts[D->stage]++;
+		}
+
+		/* Wait until the next deadline, or until a new one is set. */
+		if ((tvmin = timerqueue_getmin(DL->Q)) == NULL) {
+			if ((rc = pthread_cond_wait(&DL->cv, &DL->mtx)) != 0) {
+				warn0("pthread_cond_wait: %s", strerror(rc));
+				exit(1);
+			}
+			continue;
+		}
+		d = timeval_diff(tv, (*tvmin));
+		if (clock_gettime(CLOCK_REALTIME, &ts)) {
+			warnp("clock_gettime");
+			exit(1);
+		}
+		ts.tv_sec += (time_t)d;
+		ts.tv_nsec += (long)((d - (double)(time_t)d) * 1000000000.0);
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (((rc = pthread_cond_timedwait(&DL->cv, &DL->mtx, &ts))
+		    != 0) && (rc != ETIMEDOUT)) {
+			warn0("pthread_cond_timedwait: %s", strerror(rc));
+			exit(1);
+		}
+	} while (1);
+
+	/* NOTREACHED */
+}
+
+/**
+ * deadline_init(reap):
+ * Create a state for tracking deadlines.  If ${reap} is non-zero, spawn a
+ * thread which enforces the deadlines passed to deadline_set.
+ */
+struct deadlines *
+deadline_init(int reap)
+{
+	struct deadlines * DL;
+	pthread_t thr;
+	size_t i;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((DL = malloc(sizeof(struct deadlines))) == NULL)
+		goto err0;
+	for (i = 0; i < NDEADLINE; i++)
+		DL->ntimeouts[i] = 0;
+
+	/* Create a queue of deadlines. */
+	if ((DL->Q = timerqueue_init()) == NULL)
+		goto err1;
+
+	/* Initialize the mutex and condition variable. */
+	if ((rc = pthread_mutex_init(&DL->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+	if ((rc = pthread_cond_init(&DL->cv, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err3;
+	}
+
+	/* Spawn the reaper, if wanted; like the workers, it never exits. */
+	if (reap) {
+		if ((rc = pthread_create(&thr, NULL, reaper, DL)) != 0) {
+			warn0("pthread_create: %s", strerror(rc));
+			goto err4;
+		}
+		if ((rc = pthread_detach(thr)) != 0) {
+			warn0("pthread_detach: %s", strerror(rc));
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (DL);
+
+err4:
+	pthread_cond_destroy(&DL->cv);
+err3:
+	pthread_mutex_destroy(&DL->mtx);
+err2:
+	timerqueue_free(DL->Q);
+err1:
+	free(DL);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * deadline_set(DL, s1, s2, stage, secs):
+ * In ${secs} seconds, shut down the socket ${s1} and, unless it is -1, the
+ * socket ${s2}, and record a timeout in the stage ${stage}.  Return a
+ * deadline which must be passed to deadline_clear before the sockets are
+ * closed.
+ */
+struct deadline *
+deadline_set(struct deadlines * DL, int s1, int s2, int stage, double secs)
+{
+	struct deadline * D;
+	struct timeval tv;
+	int rc;
+
+	/* When is the deadline? */
+	if (later(&tv, secs))
+		goto err0;
+
+	/* Allocate a structure. */
+	if ((D = malloc(sizeof(struct deadline))) == NULL)
+		goto err0;
+	D->s[0] = s1;
+	D->s[1] = s2;
+	D->stage = stage;
+
+	/* Lock the deadlines. */
+	if ((rc = pthread_mutex_lock(&DL->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Add the deadline to the queue. */
+	if ((D->cookie = timerqueue_add(DL->Q, &tv, D)) == NULL)
+		goto err2;
+
+	/* The reaper may need to wake up sooner than it planned. */
+	if ((rc = pthread_cond_signal(&DL->cv)) != 0) {
+		warn0("pthread_cond_signal: %s", strerror(rc));
+		goto err3;
+	}
+
+	/* Unlock the deadlines. */
+	if ((rc = pthread_mutex_unlock(&DL->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (D);
+
+err3:
+	timerqueue_delete(DL->Q, D->cookie);
+err2:
+	pthread_mutex_unlock(&DL->mtx);
+err1:
+	free(D);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * deadline_extend(DL, D, secs):
+ * Move the deadline ${D} to ${secs} seconds from now, unless it has already
+ * passed; ${secs} must be no less than the value used to set it.
+ */
+void
+deadline_extend(struct deadlines * DL, struct deadline * D, double secs)
+{
+	struct timeval tv;
+	int rc;
+
+	/* When is the new deadline? */
+	if (later(&tv, secs))
+		return;
+
+	/* Lock the deadlines. */
+	if ((rc = pthread_mutex_lock(&DL->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Move the deadline, if it's still pending. */
+	if (D->cookie != NULL)
+		timerqueue_increase(DL->Q, D->cookie, &tv);
+
+	/* Unlock the deadlines. */
+	if ((rc = pthread_mutex_unlock(&DL->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/**
+ * deadline_clear(DL, D):
+ * Cancel the deadline ${D} and free it.  Return non-zero if it had already
+ * passed.
+ */
+int
+deadline_clear(struct deadlines * DL, struct deadline * D)
+{
+	int expired;
+	int rc;
+
+	/* Behave consistently with free(NULL). */
+	if (D == NULL)
+		return (0);
+
+	/* Lock the deadlines. */
+	if ((rc = pthread_mutex_lock(&DL->mtx)) != 0) {
+		/*
+		 * We can't free a deadline which the reaper might still be
+		 * about to enforce, and there's no sensible way to recover
+		 * from a broken mutex.
+		 */
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Remove the deadline from the queue, if it's still there. */
+	if ((expired = (D->cookie == NULL)) == 0)
+		timerqueue_delete(DL->Q, D->cookie);
+
+	/* Unlock the deadlines. */
+	if ((rc = pthread_mutex_unlock(&DL->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+
+	/* Free the deadline. */
+	free(D);
+
+	/* Tell the caller whether it had passed. */
+	return (expired);
+}
+
+/**
+ * deadline_expired(DL, stage):
+ * Record in ${DL} that a deadline (which was not set via deadline_set) in
+ * the stage ${stage} has passed.
+ */
+void
+deadline_expired(struct deadlines * DL, int stage)
+{
+	int rc;
+
+	/* Lock the deadlines. */
+	if ((rc = pthread_mutex_lock(&DL->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Count the timeout. */
+	DL->ntimeouts[stage]++;
+
+	/* Unlock the deadlines. */
+	if ((rc = pthread_mutex_unlock(&DL->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/**
+ * deadline_stats_log(DL):
+ * Log the number of deadlines in each stage which have passed.
+ */
+void
+deadline_stats_log(struct deadlines * DL)
+{
+	uint64_t ntimeouts[NDEADLINE];
+	size_t i;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&DL->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	for (i = 0; i < NDEADLINE; i++)
+		ntimeouts[i] = DL->ntimeouts[i];
+	if ((rc = pthread_mutex_unlock(&DL->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: timeouts: %ju reading headers, "
+	    "%ju handling requests, %ju connecting to IMDS, "
+	    "%ju relaying responses",
+	    (uintmax_t)ntimeouts[DEADLINE_HEADER],
+	    (uintmax_t)ntimeouts[DEADLINE_REQUEST],
+	    (uintmax_t)ntimeouts[DEADLINE_CONNECT],
+	    (uintmax_t)ntimeouts[DEADLINE_RELAY]);
+}
@@ -0,0 +1,342 @@
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Most requests come from a few processes asking for the same few paths
+ * over and over again, so we remember the decisions we've made about
+ * whether a uid/gids may request a path.  Decisions are kept in a fixed
+ * array of entries, with a chained hash table for finding them; when the
+ * array is full, we pick an entry to replace using the CLOCK algorithm,
+ * which approximates least-recently-used without having to reorder a list
+ * on every hit.
+ *
+ * Decisions are keyed on the set of gids, sorted and without duplicates in
+ * the same way as princache does, so a process which lists its groups in a
+ * different order still finds the decisions made for the same principal.
+ */
+
+/* Number of hash buckets per entry. */
+#define BUCKETS_PER_ENTRY 2
+
+/* A decision. */
+struct decision {
+	uid_t uid;
+	gid_t gids[IDENT_NGROUPS];
+	size_t ngid;
+	char * path;
+	uint32_t hash;
+	int allow;
+	size_t rnum;
+	int ref;
+	struct decision * hnext;
+};
+
+/* A cache of decisions. */
+struct decisions {
+	pthread_mutex_t mtx;
+	struct decision * ds;
+	size_t max;
+	size_t n;
+	size_t hand;
+	struct decision ** buckets;
+	size_t nbuckets;
+
+	/* Statistics. */
+	uint64_t nhits;
+	uint64_t nmisses;
+	uint64_t nevicted;
+};
+
+/*
+ * Copy the ${*ngid} gids ${gids} into ${cgids} in canonical form, updating
+ * ${*ngid}, and return the hash of ${uid}/${cgids} and the path ${path}.
+ */
+static uint32_t
+key(uid_t uid, const gid_t * gids, gid_t * cgids, size_t * ngid,
+    const char * path)
+{
+	uint32_t h;
+
+	/* Canonicalize the gids. */
+	memcpy(cgids, gids, *ngid * sizeof(gid_t));
+	*ngid = princache_canon(cgids, *ngid);
+
+	/* Hash the ids and the path. */
+	h = fnv_hash(FNV_INIT, &uid, sizeof(uid_t));
+	h = fnv_hash(h, cgids, *ngid * sizeof(gid_t));
+	return (fnv_hash_str(h, path));
+}
+
+/* Find the decision about ${uid}/${gids} and ${path} (with hash ${h}). */
+static struct decision *
+find(struct decisions * D, uint32_t h, uid_t uid, const gid_t * gids,
+    size_t ngid, const char * path)
+{
+	struct decision * d;
+
+	for (d = D->buckets[h % D->nbuckets]; d != NULL; d = d->hnext) {
+		if ((d->hash == h) && (d->uid == uid) && (d->ngid == ngid) &&
+		    (memcmp(d->gids, gids, ngid * sizeof(gid_t)) == 0) &&
+		    (strcmp(d->path, path) == 0))
+			break;
+	}
+	return (d);
+}
+
+/* Pick an entry in ${D} to hold a new decision, evicting one if needed. */
+static struct decision *
+victim(struct decisions * D)
+{
+	struct decision * d;
+	struct decision ** pp;
+
+	/* If we haven't filled the array yet, use the next entry. */
+	if (D->n < D->max)
+		return (&D->ds[D->n++]);
+
+	/* Skip over entries which have been used since we last looked. */
+	while (D->ds[D->hand].ref) {
+		D->ds[D->hand].ref = 0;
+		D->hand = (D->hand + 1) % D->max;
+	}
+	d = &D->ds[D->hand];
+	D->hand = (D->hand + 1) % D->max;
+
+	/* Remove it from its hash chain and free its path. */
+	for (pp = &D->buckets[d->hash % D->nbuckets]; *pp != d;
+	    pp = &(*pp)->hnext)
+		continue;
+	*pp = d->hnext;
+	free(d->path);
+	D->nevicted++;
+
+	/* Return the entry. */
+	return (d);
+}
+
+/**
+ * decisions_init(max):
+ * Create a cache of up to ${max} decisions about whether uid/gids may
+ * request paths.
+ */
+struct decisions *
+decisions_init(size_t max)
+{
+	struct decisions * D;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((D = malloc(sizeof(struct decisions))) == NULL)
+		goto err0;
+	D->max = (max > 0) ? max : 1;
+	D->n = 0;
+	D->hand = 0;
+	D->nhits = D->nmisses = D->nevicted = 0;
+
+	/* Allocate the entries and the hash buckets. */
+	if ((D->ds = malloc(D->max * sizeof(struct decision))) == NULL)
+		goto err1;
+	D->nbuckets = D->max * BUCKETS_PER_ENTRY + 1;
+	if ((D->buckets = calloc(D->nbuckets, sizeof(struct decision *))) ==
+	    NULL)
+		goto err2;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&D->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err3;
+	}
+
+	/* Success! */
+	return (D);
+
+err3:
+	free(D->buckets);
+err2:
+	free(D->ds);
+err1:
+	free(D);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * decisions_get(D, uid, gids, ngid, path, rnum):
+ * If ${D} holds a decision about whether ${uid}/${gids} may request ${path},
+ * return it (nonzero if allowed) and return via ${rnum} the number of the
+ * rule which made it; otherwise, return -1.
+ */
+int
+decisions_get(struct decisions * D, uid_t uid, const gid_t * gids,
+    size_t ngid, const char * path, size_t * rnum)
+{
+	struct decision * d;
+	gid_t cgids[IDENT_NGROUPS];
+	uint32_t h;
+	int allow = -1;
+	int rc;
+
+	/* We never store decisions about more gids than ident can return. */
+	if (ngid > IDENT_NGROUPS)
+		return (-1);
+	h = key(uid, gids, cgids, &ngid, path);
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return (-1);
+	}
+
+	/* Look for the decision. */
+	if ((d = find(D, h, uid, cgids, ngid, path)) != NULL) {
+		d->ref = 1;
+		allow = d->allow;
+		*rnum = d->rnum;
+		D->nhits++;
+	} else {
+		D->nmisses++;
+	}
+
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Return the decision, if we found it. */
+	return (allow);
+}
+
+/**
+ * decisions_put(D, uid, gids, ngid, path, allow, rnum):
+ * Record in ${D} the decision ${allow}, made by rule number ${rnum}, about
+ * whether ${uid}/${gids} may request ${path}, replacing an older decision if
+ * necessary.
+ */
+int
+decisions_put(struct decisions * D, uid_t uid, const gid_t * gids,
+    size_t ngid, const char * path, int allow, size_t rnum)
+{
+	struct decision * d;
+	gid_t cgids[IDENT_NGROUPS];
+	char * p;
+	uint32_t h;
+	int rc;
+
+	/* Don't bother with principals we can't store. */
+	if (ngid > IDENT_NGROUPS)
+		goto done;
+	h = key(uid, gids, cgids, &ngid, path);
+
+	/* Copy the path. */
+	if ((p = strdup(path)) == NULL)
+		goto err0;
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Another thread may have recorded this decision already. */
+	if (find(D, h, uid, cgids, ngid, path) != NULL) {
+		free(p);
+		goto unlock;
+	}
+
+	/* Fill in an entry and add it to the hash table. */
+	d = victim(D);
+	d->uid = uid;
+	memcpy(d->gids, cgids, ngid * sizeof(gid_t));
+	d->ngid = ngid;
+	d->path = p;
+	d->hash = h;
+	d->allow = allow;
+	d->rnum = rnum;
+	d->ref = 0;
+	d->hnext = D->buckets[h % D->nbuckets];
+	D->buckets[h % D->nbuckets] = d;
+
+unlock:
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err1:
+	free(p);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * decisions_stats_log(D):
+ * Log statistics about the decision cache ${D}.
+ */
+void
+decisions_stats_log(struct decisions * D)
+{
+	uint64_t nhits, nmisses, nevicted;
+	size_t n;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nhits = D->nhits;
+	nmisses = D->nmisses;
+	nevicted = D->nevicted;
+	n = D->n;
+	if ((rc = pthread_mutex_unlock(&D->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: decisions: %ju hits, %ju misses "
+	    "(%.1f%% hit ratio); %ju evicted; %zu of %zu entries in use",
+	    (uintmax_t)nhits, (uintmax_t)nmisses,
+	    (nhits + nmisses) ?
+	    100.0 * (double)nhits / (double)(nhits + nmisses) : 0.0,
+	    (uintmax_t)nevicted, n, D->max);
+}
+
+/**
+ * decisions_free(D):
+ * Free the decision cache ${D}.
+ */
+void
+decisions_free(struct decisions * D)
+{
+	size_t i;
+
+	/* Behave consistently with free(NULL). */
+	if (D == NULL)
+		return;
+
+	/* Free the paths, the entries, the buckets, and the structure. */
+	for (i = 0; i < D->n; i++)
+		free(D->ds[i].path);
+	pthread_mutex_destroy(&D->mtx);
+	free(D->buckets);
+	free(D->ds);
+	free(D);
+}
@@ -0,0 +1,1409 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "elasticarray.h"
+#include "events.h"
+#include "monoclock.h"
+#include "network.h"
+#include "sock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * This handles the same work as http_serve, but as a state machine driven
+ * by the events loop, so that a single thread can serve many connections at
+ * once.  Each connection goes through the following stages:
+ * 1. The ident query and the reading of the HTTP request happen in parallel.
+ * 2. Once both have completed, we check the request against the ruleset.
+ * 3. If it is allowed, we wait for the pacer to let us send a request (if
+ *    requests are being paced), then take an idle connection to the IMDS
+ *    from the pool (or make a new one) and send the request.
+ * 4. We relay the response back to the client until it is complete, and
+ *    return the IMDS connection to the pool if it can be reused.  For GET
+ *    requests we instead collect the response in a buffer and send it once
+ *    it is complete, so that it can be cached and handed to any clients
+ *    which made the same request in the meantime (and we can serve a
+ *    response from the cache in its place if the IMDS fails).  If the same
+ *    GET request is already in flight, we wait for its response instead.
+ * 5. If the client can send another request, we go back to reading it (and
+ *    to step 2, since the ident query need only happen once); any pipelined
+ *    requests are already sitting in our buffer.
+ *
+ * Deadlines are enforced with timers: one for reading the request header,
+ * one for handling the request as a whole, and one for the current step of
+ * talking to the IMDS (connecting, or relaying the response without making
+ * progress).  If any of them fires, we drop the connection.
+ */
+
+/* Maximum length of an HTTP request header. */
+#define REQMAX 8192
+
+/* Buffer up to 4kB of response at once. */
+#define BUFLEN 4096
+
+/* Maximum number of connections to accept per readiness event. */
+#define ACCEPT_BATCH 32
+
+/* Response sent for disallowed requests. */
+static const char forbidden[] = "HTTP/1.1 403 Forbidden\r\n"
+    "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* Response sent for requests which exceed a rate limit. */
+static const char toomany[] = "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* Response sent when we are shedding load. */
+static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* State for connection accepting. */
+struct astate {
+	int s;
+	const struct proxy * P;
+};
+
+/* State for one connection. */
+struct cstate {
+	struct astate * as;
+	const struct imds_conf * imdsc;
+	void * rsref;
+	int s;
+	int s_imds;
+	int reused;
+	int retried;
+	int connecting;
+	void * ident_cookie;
+	void * read_cookie;
+	void * write_cookie;
+	void * timer_cookie;
+	void * hdr_timer;
+	void * req_timer;
+	void * up_timer;
+	int up_stage;
+	int timed;
+	int ident_done;
+	int req_done;
+	int keepalive;
+	uid_t uid;
+	gid_t gids[IDENT_NGROUPS];
+	size_t ngid;
+	char * request;
+	char * path;
+	size_t reqlen;
+	size_t hlen;
+	struct response * R;
+	size_t nread;
+	int ttl;
+	int stale;
+	int keepalive_req;
+	int hold;
+	struct elasticarray * cap;
+	uint8_t * wbuf;
+	void * flight;
+	int leader;
+	int prio;
+	int limited;
+	struct limit lim;
+	void * pace_cookie;
+	int inflight;
+	struct timeval t_req;
+	uint8_t reqbuf[REQMAX];
+	uint8_t buf[BUFLEN];
+};
+
+/* Forward declarations. */
+static int callback_done(void *, ssize_t);
+static int callback_relay_read(void *, ssize_t);
+static int callback_relay_write(void *, ssize_t);
+static int callback_request_read(void *, ssize_t);
+static int callback_flight(void *, const uint8_t *, size_t);
+static int collect(struct cstate *);
+static int dispatch(struct cstate *);
+static int pace(struct cstate *);
+static void land(struct cstate *, const uint8_t *, size_t);
+static int nextrequest(struct cstate *);
+static int readrequest(struct cstate *);
+static int sendrequest(struct cstate *);
+static int writerequest(struct cstate *);
+
+/* Cancel the timer ${*timer}, if it is pending. */
+static void
+canceltimer(void ** timer)
+{
+
+	if (*timer != NULL) {
+		events_timer_cancel(*timer);
+		*timer = NULL;
+	}
+}
+
+/*
+ * Start the timer ${*timer}, which calls ${callback} if the deadline for the
+ * stage ${stage} passes; leave it NULL if the stage has no deadline.
+ */
+static int
+settimer(struct cstate * cs, void ** timer, int (* callback)(void *),
+    int stage)
+{
+	int secs;
+
+	/* Does this stage have a deadline? */
+	if ((secs = conf_deadline(cs->imdsc, stage)) == 0)
+		return (0);
+
+	/* Start the timer. */
+	if ((*timer = events_timer_register_double(callback, cs, secs))
+	    == NULL) {
+		warnp("events_timer_register_double");
+		return (-1);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* Drop a connection. */
+static int
+dropconn(struct cstate * cs)
+{
+
+	/* Cancel any pending operations. */
+	if (cs->ident_cookie != NULL)
+		ident_async_cancel(cs->ident_cookie);
+	if (cs->read_cookie != NULL)
+		network_read_cancel(cs->read_cookie);
+	if (cs->write_cookie != NULL)
+		network_write_cancel(cs->write_cookie);
+	if (cs->connecting)
+		events_network_cancel(cs->s_imds, EVENTS_NETWORK_OP_WRITE);
+	if (cs->timer_cookie != NULL)
+		events_timer_cancel(cs->timer_cookie);
+	canceltimer(&cs->hdr_timer);
+	canceltimer(&cs->req_timer);
+	canceltimer(&cs->up_timer);
+	if (cs->pace_cookie != NULL)
+		pacer_cancel(cs->as->P->PC, cs->pace_cookie);
+
+	/* We're not handling a request any more. */
+	if (cs->inflight)
+		shed_finish(cs->as->P->SH);
+
+	/* Stop waiting for a request in flight, or tell its waiters. */
+	if (cs->leader)
+		land(cs, NULL, 0);
+	else if (cs->flight != NULL)
+		flight_cancel(cs->as->P->F, cs->flight);
+
+	/* Close sockets. */
+	if (cs->s_imds != -1)
+		close(cs->s_imds);
+	close(cs->s);
+
+	/* Free response buffers. */
+	elasticarray_free(cs->cap);
+	free(cs->wbuf);
+
+	/* Free the response parser and the request. */
+	response_free(cs->R);
+	free(cs->request);
+	free(cs->path);
+
+	/* Stop using the ruleset, and free the state structure. */
+	ruleset_put(cs->as->P->RS, cs->rsref);
+	free(cs);
+
+	/* Problems with one connection don't stop the events loop. */
+	return (0);
+}
+
+/*
+ * Return nonzero if the ${len} bytes in ${buf} contain a complete HTTP
+ * request header, and return its length via ${hlen}.  As in request_read,
+ * the header ends with the first line after the Request-Line which is empty
+ * once trailing EOL characters have been stripped.
+ */
+static int
+reqcomplete(const uint8_t * buf, size_t len, size_t * hlen)
+{
+	size_t pos;
+	int firstline = 1;
+	int empty = 1;
+
+	/* Scan through the buffer one character at a time. */
+	for (pos = 0; pos < len; pos++) {
+		if (buf[pos] == '\n') {
+			/* Is this the blank line which ends the header? */
+			if (!firstline && empty) {
+				*hlen = pos + 1;
+				return (1);
+			}
+
+			/* Move on to the next line. */
+			firstline = 0;
+			empty = 1;
+		} else if (buf[pos] != '\r') {
+			empty = 0;
+		}
+	}
+
+	/* We haven't seen the end of the header yet. */
+	return (0);
+}
+
+/*
+ * A reused connection to the IMDS failed before we got any of the response;
+ * it was probably closed by the IMDS while idle, so try once more with a new
+ * connection.
+ */
+static int
+retry(struct cstate * cs)
+{
+
+	/* Throw away the dead connection. */
+	canceltimer(&cs->up_timer);
+	close(cs->s_imds);
+	cs->s_imds = -1;
+	cs->reused = 0;
+	cs->retried = 1;
+
+	/* Start again. */
+	return (sendrequest(cs));
+}
+
+/* Send the response ${buf} to the client, and free it once we're done. */
+static int
+sendbuf(struct cstate * cs, uint8_t * buf, size_t len,
+    int (* callback)(void *, ssize_t))
+{
+
+	/* We're responsible for this buffer now. */
+	cs->wbuf = buf;
+
+	/* Send the response. */
+	if ((cs->write_cookie = network_write(cs->s, cs->wbuf, len, len,
+	    callback, cs)) == NULL) {
+		warnp("network_write");
+		return (dropconn(cs));
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * If we made a request which other clients are waiting for, hand them the
+ * response ${buf} (or tell them to make the request themselves).
+ */
+static void
+land(struct cstate * cs, const uint8_t * buf, size_t len)
+{
+
+	/* Nothing to do if we're not leading a request. */
+	if (!cs->leader)
+		return;
+
+	/* Hand the response over. */
+	if (flight_done(cs->as->P->F, cs->flight, buf, len))
+		warn0("Could not hand response to waiting clients");
+	cs->flight = NULL;
+	cs->leader = 0;
+}
+
+/* Send the response we've collected to the client. */
+static int
+sendcap(struct cstate * cs, int (* callback)(void *, ssize_t))
+{
+	uint8_t * buf;
+	size_t len;
+
+	/* Take the data out of the elastic array. */
+	if (elasticarray_export(cs->cap, (void **)&buf, &len, 1)) {
+		warnp("elasticarray_export");
+		return (dropconn(cs));
+	}
+	cs->cap = NULL;
+
+	/* Send it. */
+	return (sendbuf(cs, buf, len, callback));
+}
+
+/*
+ * Look for a stale response to the request we're collecting a response to,
+ * and return it via ${buf} and ${len} if there is one.
+ */
+static int
+getstale(struct cstate * cs, uint8_t ** buf, size_t * len)
+{
+
+	/* We can only do this if we've held back the response. */
+	if (!cs->hold)
+		return (0);
+
+	/* Look in the cache; errors just mean we don't have anything. */
+	return (cache_get(cs->as->P->C, cs->request, 1, buf, len) == 1);
+}
+
+/* Send the stale response ${buf} in place of the one from the IMDS. */
+static int
+servestale(struct cstate * cs, uint8_t * buf, size_t len)
+{
+
+	/* We're done with the IMDS connection. */
+	if (cs->connecting) {
+		events_network_cancel(cs->s_imds, EVENTS_NETWORK_OP_WRITE);
+		cs->connecting = 0;
+	}
+	if (cs->s_imds != -1) {
+		close(cs->s_imds);
+		cs->s_imds = -1;
+	}
+
+	/* Throw away whatever we collected, and send the stale response. */
+	land(cs, buf, len);
+	elasticarray_free(cs->cap);
+	cs->cap = NULL;
+	cs->hold = 0;
+	cs->keepalive = cs->keepalive_req;
+	return (sendbuf(cs, buf, len, callback_done));
+}
+
+/* We failed to get a response from the IMDS. */
+static int
+upstream_failed(struct cstate * cs)
+{
+	uint8_t * buf;
+	size_t len;
+
+	/* Record how long the IMDS took to fail. */
+	shed_latency(cs->as->P->SH, &cs->t_req);
+	canceltimer(&cs->up_timer);
+
+	/* Serve a stale response if we have one; otherwise give up. */
+	if (getstale(cs, &buf, &len))
+		return (servestale(cs, buf, len));
+	return (dropconn(cs));
+}
+
+/* We have a complete response from the IMDS. */
+static int
+finish(struct cstate * cs)
+{
+	uint8_t * buf;
+	size_t len;
+	int status = response_status(cs->R);
+	int shareable = 0;
+
+	/* Record how long the IMDS took. */
+	shed_latency(cs->as->P->SH, &cs->t_req);
+	canceltimer(&cs->up_timer);
+
+	/*
+	 * Return the IMDS connection to the pool if possible; if not, the
+	 * IMDS asked for it to be closed (or closed it), and the client will
+	 * expect the same of us.
+	 */
+	if ((cs->s_imds != -1) && response_keepalive(cs->R)) {
+		upstream_put(cs->as->P->U, cs->s_imds);
+		cs->s_imds = -1;
+		shareable = 1;
+	} else {
+		cs->keepalive = 0;
+	}
+
+	/* If the IMDS is failing, we might have something better. */
+	if (((status == 429) || (status >= 500)) && getstale(cs, &buf, &len))
+		return (servestale(cs, buf, len));
+
+	/*
+	 * Remember successful responses which can be replayed on persistent
+	 * connections; failing to do so isn't fatal.
+	 */
+	if ((cs->cap != NULL) && (cs->ttl > 0) && (status == 200) &&
+	    shareable && cache_put(cs->as->P->C, cs->request,
+	    elasticarray_get(cs->cap, 0, 1), elasticarray_getsize(cs->cap, 1),
+	    cs->ttl, cs->stale))
+		warnp("cache_put");
+
+	/* We can share the response if it doesn't end the connection. */
+	if ((cs->cap != NULL) && shareable)
+		land(cs, elasticarray_get(cs->cap, 0, 1),
+		    elasticarray_getsize(cs->cap, 1));
+	else
+		land(cs, NULL, 0);
+
+	/* Send the response to the client if we held it back. */
+	if (cs->hold) {
+		cs->hold = 0;
+		return (sendcap(cs, callback_done));
+	}
+
+	/* Otherwise we've sent it already. */
+	elasticarray_free(cs->cap);
+	cs->cap = NULL;
+	return (nextrequest(cs));
+}
+
+/*
+ * The response to a request we're leading, which we only kept a copy of in
+ * order to share it, has started to arrive.  If nobody is waiting for it,
+ * stop letting anyone join us and stop keeping a copy.
+ */
+static int
+release(struct cstate * cs)
+{
+	int rc;
+
+	/* Is anyone waiting? */
+	if ((rc = flight_release(cs->as->P->F, cs->flight)) != 1)
+		return (rc);
+	cs->flight = NULL;
+	cs->leader = 0;
+	elasticarray_free(cs->cap);
+	cs->cap = NULL;
+
+	/* Success! */
+	return (0);
+}
+
+/* The client has been idle for too long. */
+static int
+callback_idle(void * cookie)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->timer_cookie = NULL;
+
+	/* Drop the connection. */
+	return (dropconn(cs));
+}
+
+/* The deadline for the stage ${stage} passed; give up on the connection. */
+static int
+timedout(struct cstate * cs, int stage)
+{
+
+	/* Record the timeout. */
+	deadline_expired(cs->as->P->DL, stage);
+
+	/* Drop the connection. */
+	return (dropconn(cs));
+}
+
+/* The client took too long to send the request header. */
+static int
+callback_header_timeout(void * cookie)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->hdr_timer = NULL;
+
+	/* Give up. */
+	return (timedout(cs, DEADLINE_HEADER));
+}
+
+/* The request took too long to handle. */
+static int
+callback_request_timeout(void * cookie)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->req_timer = NULL;
+
+	/* Give up. */
+	return (timedout(cs, DEADLINE_REQUEST));
+}
+
+/* The IMDS took too long to accept our connection or send a response. */
+static int
+callback_upstream_timeout(void * cookie)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->up_timer = NULL;
+
+	/* Give up. */
+	return (timedout(cs, cs->up_stage));
+}
+
+/* Start the deadlines for reading and handling a request. */
+static int
+armrequest(struct cstate * cs)
+{
+
+	/* Don't start them twice. */
+	if (cs->timed)
+		return (0);
+	cs->timed = 1;
+
+	/* Start the timers. */
+	if (settimer(cs, &cs->req_timer, callback_request_timeout,
+	    DEADLINE_REQUEST) ||
+	    settimer(cs, &cs->hdr_timer, callback_header_timeout,
+	    DEADLINE_HEADER))
+		return (-1);
+
+	/* Success! */
+	return (0);
+}
+
+/* Start the deadline for the stage ${stage} of talking to the IMDS. */
+static int
+armupstream(struct cstate * cs, int stage)
+{
+
+	/* Replace any timer for the previous stage. */
+	canceltimer(&cs->up_timer);
+	cs->up_stage = stage;
+	return (settimer(cs, &cs->up_timer, callback_upstream_timeout,
+	    stage));
+}
+
+/* The IMDS connection made progress; push back the relay deadline. */
+static int
+progress(struct cstate * cs)
+{
+
+	/* Nothing to do if there's no deadline. */
+	if (cs->up_timer == NULL)
+		return (0);
+
+	/* Reset the timer. */
+	if (events_timer_reset(cs->up_timer)) {
+		warnp("events_timer_reset");
+		return (-1);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* We have finished with a request; move on to the next one (if any). */
+static int
+nextrequest(struct cstate * cs)
+{
+
+	/* This request is no longer in flight. */
+	if (cs->inflight) {
+		shed_finish(cs->as->P->SH);
+		cs->inflight = 0;
+	}
+
+	/* Its deadlines no longer apply. */
+	canceltimer(&cs->hdr_timer);
+	canceltimer(&cs->req_timer);
+	canceltimer(&cs->up_timer);
+	cs->timed = 0;
+
+	/* If the client can't send another request, we're done. */
+	if (!cs->keepalive)
+		return (dropconn(cs));
+
+	/* Forget about the request we've handled. */
+	free(cs->request);
+	free(cs->path);
+	cs->request = cs->path = NULL;
+	response_free(cs->R);
+	cs->R = NULL;
+	cs->reused = 0;
+	cs->retried = 0;
+	cs->req_done = 0;
+
+	/* Keep any pipelined data which followed it. */
+	memmove(cs->reqbuf, &cs->reqbuf[cs->hlen], cs->reqlen - cs->hlen);
+	cs->reqlen -= cs->hlen;
+
+	/* Don't wait forever for the next request. */
+	if ((cs->timer_cookie = events_timer_register_double(callback_idle,
+	    cs, KEEPALIVE_TIMEOUT)) == NULL) {
+		warnp("events_timer_register_double");
+		return (dropconn(cs));
+	}
+
+	/* Handle the next request once we have it. */
+	return (readrequest(cs));
+}
+
+/* We have finished sending the response (or failed to). */
+static int
+callback_done(void * cookie, ssize_t len)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->write_cookie = NULL;
+
+	/* Did the client go away? */
+	if (len == -1)
+		return (dropconn(cs));
+
+	/* Free any response buffer we sent. */
+	if (cs->wbuf != NULL) {
+		relay_count((size_t)len);
+		free(cs->wbuf);
+		cs->wbuf = NULL;
+	}
+
+	/* Move on to the next request. */
+	return (nextrequest(cs));
+}
+
+/* We have written response data to the client. */
+static int
+callback_relay_write(void * cookie, ssize_t len)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->write_cookie = NULL;
+
+	/* Did the client go away? */
+	if (len == -1)
+		return (dropconn(cs));
+
+	/* Record statistics. */
+	relay_count((size_t)len);
+
+	/* The client is keeping up. */
+	if (progress(cs))
+		return (dropconn(cs));
+
+	/* Free the buffered part of a response which was too large to keep. */
+	free(cs->wbuf);
+	cs->wbuf = NULL;
+
+	/* If that was the end of the response, we're done with it. */
+	if (response_done(cs->R))
+		return (finish(cs));
+
+	/* Read more of the response. */
+	if ((cs->read_cookie = network_read(cs->s_imds, cs->buf, BUFLEN, 1,
+	    callback_relay_read, cs)) == NULL) {
+		warnp("network_read");
+		return (dropconn(cs));
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* We have read response data from the IMDS. */
+static int
+callback_relay_read(void * cookie, ssize_t len)
+{
+	struct cstate * cs = cookie;
+	ssize_t rlen;
+	int status;
+
+	/* This callback is no longer pending. */
+	cs->read_cookie = NULL;
+
+	/* If a reused connection failed immediately, try a new one. */
+	if ((len <= 0) && cs->reused && (cs->nread == 0))
+		return (retry(cs));
+
+	/* Error?  We're done with this connection. */
+	if (len == -1) {
+		warnp("Error reading response from IMDS");
+		return (upstream_failed(cs));
+	}
+
+	/* EOF; complain if it truncated the response. */
+	if (len == 0) {
+		if (response_eof(cs->R)) {
+			warn0("Truncated response from IMDS");
+			return (upstream_failed(cs));
+		}
+
+		/* The response is complete. */
+		close(cs->s_imds);
+		cs->s_imds = -1;
+		return (finish(cs));
+	}
+
+	/* Once the response starts to arrive, see if anyone wants it. */
+	if ((cs->nread == 0) && cs->leader && (cs->ttl == 0) && release(cs))
+		return (dropconn(cs));
+	cs->nread += (size_t)len;
+
+	/* The IMDS is making progress. */
+	if (progress(cs))
+		return (dropconn(cs));
+
+	/* Find out how much of this belongs to the response. */
+	if ((rlen = response_parse(cs->R, cs->buf, (size_t)len)) == -1)
+		return (upstream_failed(cs));
+
+	/* Anything after the response means the IMDS is confused. */
+	if (rlen < len) {
+		warn0("Unexpected data from IMDS after response");
+		return (upstream_failed(cs));
+	}
+
+	/* If we're keeping a copy of the response, add this to it. */
+	if (cs->cap != NULL) {
+		if (elasticarray_append(cs->cap, cs->buf, (size_t)len, 1)) {
+			warnp("elasticarray_append");
+			return (dropconn(cs));
+		}
+
+		/* Give up on keeping (or sharing) a large response. */
+		if (elasticarray_getsize(cs->cap, 1) > CACHE_MAXRESP) {
+			land(cs, NULL, 0);
+			if (cs->hold) {
+				cs->hold = 0;
+				return (sendcap(cs, callback_relay_write));
+			}
+			elasticarray_free(cs->cap);
+			cs->cap = NULL;
+		}
+	}
+
+	/* If we're holding back the response, is it a failure? */
+	if (cs->hold) {
+		status = response_status(cs->R);
+		if ((status == 0) || (status == 429) || (status >= 500)) {
+			/* If we have all of it, we're done with the IMDS. */
+			if (response_done(cs->R))
+				return (finish(cs));
+
+			/* Read more of the response. */
+			if ((cs->read_cookie = network_read(cs->s_imds,
+			    cs->buf, BUFLEN, 1, callback_relay_read, cs))
+			    == NULL) {
+				warnp("network_read");
+				return (dropconn(cs));
+			}
+			return (0);
+		}
+
+		/*
+		 * Send what we've held back; nothing is added to it until
+		 * this has been written.
+		 */
+		cs->hold = 0;
+		if ((cs->write_cookie = network_write(cs->s,
+		    elasticarray_get(cs->cap, 0, 1),
+		    elasticarray_getsize(cs->cap, 1),
+		    elasticarray_getsize(cs->cap, 1), callback_relay_write,
+		    cs)) == NULL) {
+			warnp("network_write");
+			return (dropconn(cs));
+		}
+		return (0);
+	}
+
+	/* Write out the data we read. */
+	if ((cs->write_cookie = network_write(cs->s, cs->buf, (size_t)len,
+	    (size_t)len, callback_relay_write, cs)) == NULL) {
+		warnp("network_write");
+		return (dropconn(cs));
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* We have sent the request to the IMDS. */
+static int
+callback_request_sent(void * cookie, ssize_t len)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->write_cookie = NULL;
+
+	/* Failure?  If this was a reused connection, try a new one. */
+	if (len == -1) {
+		if (cs->reused)
+			return (retry(cs));
+		warnp("Error sending request to IMDS");
+		return (upstream_failed(cs));
+	}
+
+	/* Don't wait forever for the response. */
+	if (armupstream(cs, DEADLINE_RELAY))
+		return (dropconn(cs));
+
+	/* Start reading the response. */
+	if ((cs->read_cookie = network_read(cs->s_imds, cs->buf, BUFLEN, 1,
+	    callback_relay_read, cs)) == NULL) {
+		warnp("network_read");
+		return (dropconn(cs));
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* We have connected (or failed to connect) to the IMDS. */
+static int
+callback_connect(void * cookie)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->connecting = 0;
+	canceltimer(&cs->up_timer);
+
+	/* Send the request; errors connecting will show up here. */
+	return (writerequest(cs));
+}
+
+/* Send the request to the IMDS. */
+static int
+writerequest(struct cstate * cs)
+{
+
+	/* Prepare to parse the response. */
+	response_free(cs->R);
+	if ((cs->R = response_init(strncmp(cs->request, "HEAD ", 5) == 0))
+	    == NULL) {
+		warnp("response_init");
+		return (dropconn(cs));
+	}
+	cs->nread = 0;
+
+	/* Send the request. */
+	if ((cs->write_cookie = network_write(cs->s_imds,
+	    (const uint8_t *)cs->request, strlen(cs->request),
+	    strlen(cs->request), callback_request_sent, cs)) == NULL) {
+		warnp("network_write");
+		return (dropconn(cs));
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* We have the identity of the process which made this connection. */
+static int
+callback_ident(void * cookie, uid_t uid, gid_t * gids, size_t ngid)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->ident_cookie = NULL;
+
+	/* If we couldn't find the owner of the connection, drop it. */
+	if (gids == NULL)
+		return (dropconn(cs));
+
+	/*
+	 * Record the credentials, the priority class they put us in, and the
+	 * rate limit (if any) which our requests count against.
+	 */
+	cs->uid = uid;
+	memcpy(cs->gids, gids, ngid * sizeof(gid_t));
+	cs->ngid = ngid;
+	cs->prio = conf_priority(cs->imdsc, uid, cs->gids, ngid);
+	cs->limited = conf_limit(cs->imdsc, uid, cs->gids, ngid,
+	    &cs->lim);
+	cs->ident_done = 1;
+
+	/* If we have the request already, handle it. */
+	if (cs->req_done)
+		return (dispatch(cs));
+
+	/* Success! */
+	return (0);
+}
+
+/* Parse the HTTP request if we have all of it; otherwise read more. */
+static int
+readrequest(struct cstate * cs)
+{
+	const struct imds_conf * imdsc;
+	FILE * f;
+	int shed = 0;
+	int rc;
+
+	/* Once a request starts to arrive, it has deadlines. */
+	if ((cs->reqlen > 0) && armrequest(cs))
+		return (dropconn(cs));
+
+	/* Do we have the entire request header? */
+	if (!reqcomplete(cs->reqbuf, cs->reqlen, &cs->hlen)) {
+		/* If the buffer is full, give up. */
+		if (cs->reqlen == REQMAX) {
+			warn0("HTTP request header is too long");
+			return (dropconn(cs));
+		}
+
+		/* Read more data. */
+		if ((cs->read_cookie = network_read(cs->s,
+		    &cs->reqbuf[cs->reqlen], REQMAX - cs->reqlen, 1,
+		    callback_request_read, cs)) == NULL) {
+			warnp("network_read");
+			return (dropconn(cs));
+		}
+
+		/* Wait for more data. */
+		return (0);
+	}
+
+	/* The client is no longer idle, and has sent the whole header. */
+	if (cs->timer_cookie != NULL) {
+		events_timer_cancel(cs->timer_cookie);
+		cs->timer_cookie = NULL;
+	}
+	canceltimer(&cs->hdr_timer);
+
+	/* If this is a later request, are we too busy to handle it? */
+	if (!cs->inflight) {
+		shed = shed_check(cs->as->P->SH, 0.0);
+		shed_start(cs->as->P->SH);
+		cs->inflight = 1;
+
+		/* Switch rulesets if the configuration was reloaded. */
+		imdsc = ruleset_refresh(cs->as->P->RS, &cs->rsref);
+		if (imdsc != cs->imdsc) {
+			cs->imdsc = imdsc;
+			cs->prio = conf_priority(imdsc, cs->uid, cs->gids,
+			    cs->ngid);
+			cs->limited = conf_limit(imdsc, cs->uid, cs->gids,
+			    cs->ngid, &cs->lim);
+		}
+	}
+
+	/* Parse the request header with the same code as http_serve. */
+	if ((f = fmemopen(cs->reqbuf, cs->hlen, "r")) == NULL) {
+		warnp("fmemopen");
+		return (dropconn(cs));
+	}
+	rc = request_read(f, &cs->request, &cs->path, &cs->keepalive);
+	fclose(f);
+	if (rc) {
+		warnp("HTTP request read failed");
+		cs->request = cs->path = NULL;
+		return (dropconn(cs));
+	}
+	cs->req_done = 1;
+
+	/* If we're shedding load, refuse it and close the connection. */
+	if (shed) {
+		cs->keepalive = 0;
+		if ((cs->write_cookie = network_write(cs->s,
+		    (const uint8_t *)busy, strlen(busy), strlen(busy),
+		    callback_done, cs)) == NULL) {
+			warnp("network_write");
+			return (dropconn(cs));
+		}
+		return (0);
+	}
+
+	/* If we know who made the request, handle it. */
+	if (cs->ident_done)
+		return (dispatch(cs));
+
+	/* Success! */
+	return (0);
+}
+
+/* We have read (part of) the HTTP request. */
+static int
+callback_request_read(void * cookie, ssize_t len)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->read_cookie = NULL;
+
+	/* Error or EOF before the request was complete? */
+	if (len <= 0)
+		return (dropconn(cs));
+
+	/* Record the data we read. */
+	cs->reqlen += (size_t)len;
+
+	/* Handle the request if we have all of it. */
+	return (readrequest(cs));
+}
+
+/* We have the request and the credentials; decide what to do. */
+static int
+dispatch(struct cstate * cs)
+{
+	const struct proxy * P = cs->as->P;
+	const char * refusal;
+	uint8_t * buf;
+	size_t len;
+	int allowed;
+	int throttled;
+	int rc;
+
+	/* Check whether this process is allowed to make this request. */
+	allowed = conf_check(cs->imdsc, cs->path, cs->uid, cs->gids,
+	    cs->ngid);
+
+	/* If so, has it run out of requests for now? */
+	throttled = allowed && cs->limited &&
+	    (limiter_check(P->L, &cs->lim) != 1);
+
+	/* Log request. */
+	syslog(LOG_INFO, "imds-proxy: %s uid %zu %s",
+	    throttled ? "LIMIT" : (allowed ? "ALLOW" : "DENY"),
+	    (size_t)cs->uid, cs->path);
+
+	/*
+	 * Send a 403 for disallowed requests, or a 429 for throttled ones,
+	 * and close the connection afterwards.
+	 */
+	if (!allowed || throttled) {
+		refusal = throttled ? toomany : forbidden;
+		cs->keepalive = 0;
+		if ((cs->write_cookie = network_write(cs->s,
+		    (const uint8_t *)refusal, strlen(refusal),
+		    strlen(refusal), callback_done, cs)) == NULL) {
+			warnp("network_write");
+			return (dropconn(cs));
+		}
+		return (0);
+	}
+
+	/* Send anything other than a GET straight to the IMDS. */
+	if (strncmp(cs->request, "GET ", 4) != 0)
+		return (pace(cs));
+
+	/* Can responses to this request be cached? */
+	cs->ttl = cs->stale = 0;
+	if (P->C != NULL)
+		conf_cache(cs->imdsc, cs->path, &cs->ttl, &cs->stale);
+
+	/* If so, look for a fresh response. */
+	if (cs->ttl > 0) {
+		if ((rc = cache_get(P->C, cs->request, 0, &buf, &len)) == -1)
+			return (dropconn(cs));
+		if (rc == 1)
+			return (sendbuf(cs, buf, len, callback_done));
+	}
+
+	/* Wait for the same request if it's in flight; or make it. */
+	if ((rc = flight_join(P->F, cs->request, callback_flight, cs,
+	    &cs->flight)) == -1)
+		return (dropconn(cs));
+	if (rc == 0)
+		return (0);
+	cs->leader = 1;
+
+	/* Send the request to the IMDS and collect the response. */
+	return (collect(cs));
+}
+
+/* The pacer has let us send our request. */
+static int
+callback_paced(void * cookie)
+{
+	struct cstate * cs = cookie;
+
+	/* This callback is no longer pending. */
+	cs->pace_cookie = NULL;
+
+	/* Send the request. */
+	return (sendrequest(cs));
+}
+
+/* Send the request to the IMDS once the pacer lets us. */
+static int
+pace(struct cstate * cs)
+{
+	const struct proxy * P = cs->as->P;
+	int rc;
+
+	/* If we're not pacing requests, go right ahead. */
+	if (P->PC == NULL)
+		return (sendrequest(cs));
+
+	/* Wait for our turn if necessary. */
+	if ((rc = pacer_enqueue(P->PC, cs->uid, cs->prio, callback_paced, cs,
+	    &cs->pace_cookie)) == -1)
+		return (dropconn(cs));
+	if (rc == 0)
+		return (0);
+
+	/* Send the request now. */
+	return (sendrequest(cs));
+}
+
+/* Send the GET request to the IMDS, and collect the response. */
+static int
+collect(struct cstate * cs)
+{
+
+	/*
+	 * Keep a copy of the response if we might cache or share it; and if
+	 * we might serve a stale response instead, hold it back until we
+	 * know whether we want to.
+	 */
+	if (((cs->ttl > 0) || cs->leader) &&
+	    ((cs->cap = elasticarray_init(0, 1)) == NULL)) {
+		warnp("elasticarray_init");
+		return (dropconn(cs));
+	}
+	cs->hold = (cs->ttl > 0) && (cs->stale > 0);
+
+	/* If we serve a stale response, we can keep the connection open. */
+	cs->keepalive_req = cs->keepalive;
+
+	/* Send the request to the IMDS. */
+	return (pace(cs));
+}
+
+/* The request we're waiting for is done. */
+static int
+callback_flight(void * cookie, const uint8_t * buf, size_t len)
+{
+	struct cstate * cs = cookie;
+	uint8_t * wbuf;
+
+	/* We're no longer waiting. */
+	cs->flight = NULL;
+
+	/* If the response can't be shared, make the request ourselves. */
+	if (buf == NULL)
+		return (collect(cs));
+
+	/* Make a copy of the response and send it to the client. */
+	if ((wbuf = malloc(len)) == NULL) {
+		warnp("malloc");
+		return (dropconn(cs));
+	}
+	memcpy(wbuf, buf, len);
+	return (sendbuf(cs, wbuf, len, callback_done));
+}
+
+/* Send the request via an idle IMDS connection or a new one. */
+static int
+sendrequest(struct cstate * cs)
+{
+
+	/* Note when we started, so we can tell how fast the IMDS is. */
+	if (!cs->retried && monoclock_get(&cs->t_req)) {
+		warnp("monoclock_get");
+		return (dropconn(cs));
+	}
+
+	/* If we have an idle connection, use it. */
+	if (!cs->retried &&
+	    ((cs->s_imds = upstream_get(cs->as->P->U)) != -1)) {
+		cs->reused = 1;
+		return (writerequest(cs));
+	}
+
+	/* Start connecting to the IMDS. */
+	if ((cs->s_imds = sock_connect_nb(cs->as->P->dst[0])) == -1) {
+		warnp("sock_connect_nb");
+		return (upstream_failed(cs));
+	}
+
+	/* The socket becomes writable upon connecting (or failing to). */
+	if (events_network_register(callback_connect, cs, cs->s_imds,
+	    EVENTS_NETWORK_OP_WRITE)) {
+		warnp("events_network_register");
+		return (dropconn(cs));
+	}
+	cs->connecting = 1;
+
+	/* Don't wait forever for the connection. */
+	if (armupstream(cs, DEADLINE_CONNECT))
+		return (dropconn(cs));
+
+	/* Success! */
+	return (0);
+}
+
+/* Start handling the connection ${s}. */
+static int
+handleconn(struct astate * as, int s)
+{
+	struct cstate * cs;
+
+	/* If we're too busy, refuse the connection straight away. */
+	if (shed_check(as->P->SH, 0.0)) {
+		http_shed(s);
+		goto done;
+	}
+
+	/* Make sure the connection is non-blocking. */
+	if (fcntl(s, F_SETFL, O_NONBLOCK) == -1) {
+		/* Not fatal; just drop the connection. */
+		warnp("Cannot make socket non-blocking");
+		close(s);
+		goto done;
+	}
+
+	/* Allocate a state structure. */
+	if ((cs = malloc(sizeof(struct cstate))) == NULL)
+		goto err0;
+	cs->as = as;
+	cs->s = s;
+	cs->s_imds = -1;
+	cs->reused = 0;
+	cs->retried = 0;
+	cs->connecting = 0;
+	cs->ident_cookie = NULL;
+	cs->read_cookie = NULL;
+	cs->write_cookie = NULL;
+	cs->timer_cookie = NULL;
+	cs->hdr_timer = NULL;
+	cs->req_timer = NULL;
+	cs->up_timer = NULL;
+	cs->up_stage = DEADLINE_CONNECT;
+	cs->timed = 0;
+	cs->ident_done = 0;
+	cs->req_done = 0;
+	cs->keepalive = 0;
+	cs->request = NULL;
+	cs->path = NULL;
+	cs->reqlen = 0;
+	cs->hlen = 0;
+	cs->R = NULL;
+	cs->nread = 0;
+	cs->ttl = 0;
+	cs->stale = 0;
+	cs->keepalive_req = 0;
+	cs->hold = 0;
+	cs->cap = NULL;
+	cs->wbuf = NULL;
+	cs->flight = NULL;
+	cs->leader = 0;
+	cs->prio = PRIO_NORMAL;
+	cs->limited = 0;
+	cs->pace_cookie = NULL;
+
+	/* Handle requests under the current ruleset. */
+	cs->imdsc = ruleset_get(as->P->RS, &cs->rsref);
+
+	/* The first request is in flight from now on. */
+	shed_start(as->P->SH);
+	cs->inflight = 1;
+
+	/* The clock starts as soon as the client connects. */
+	if (armrequest(cs)) {
+		dropconn(cs);
+		goto done;
+	}
+
+	/* Look up the owner of this connection. */
+	if ((cs->ident_cookie = ident_async(as->P->ID, cs->s,
+	    callback_ident, cs)) == NULL) {
+		/* Not fatal; just drop the connection. */
+		dropconn(cs);
+		goto done;
+	}
+
+	/* Start reading the HTTP request. */
+	if ((cs->read_cookie = network_read(cs->s, cs->reqbuf, REQMAX, 1,
+	    callback_request_read, cs)) == NULL) {
+		warnp("network_read");
+		dropconn(cs);
+		goto done;
+	}
+
+done:
+	/* Success! */
+	return (0);
+
+err0:
+	close(s);
+
+	/* Failure! */
+	return (-1);
+}
+
+/* A connection has arrived. */
+static int
+gotconn(void * cookie, int s)
+{
+	struct astate * as = cookie;
+	int i;
+
+	/* If we got a -1 descriptor, something went seriously wrong. */
+	if (s == -1) {
+		warnp("network_accept");
+		goto err0;
+	}
+
+	/* Handle this connection. */
+	if (handleconn(as, s))
+		goto err0;
+
+	/*
+	 * Drain up to ACCEPT_BATCH - 1 more connections from the backlog
+	 * before we go back to the events loop.
+	 */
+	for (i = 1; i < ACCEPT_BATCH; i++) {
+		if ((s = accept(as->s, NULL, NULL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) ||
+			    (errno == EWOULDBLOCK) ||
+			    (errno == ECONNABORTED))
+				break;
+			warnp("accept");
+			goto err0;
+		}
+		if (handleconn(as, s))
+			goto err0;
+	}
+
+	/* Accept more connections. */
+	if (network_accept(as->s, gotconn, as) == NULL) {
+		warnp("network_accept");
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * evproxy_listen(s, P):
+ * Accept connections on the non-blocking listening socket ${s} and handle
+ * them as http_serve does, but asynchronously via the events loop rather
+ * than in a thread per connection.
+ */
+int
+evproxy_listen(int s, const struct proxy * P)
+{
+	struct astate * as;
+
+	/* Allocate a state structure. */
+	if ((as = malloc(sizeof(struct astate))) == NULL)
+		goto err0;
+	as->s = s;
+	as->P = P;
+
+	/* Start accepting connections. */
+	if (network_accept(as->s, gotconn, as) == NULL) {
+		warnp("network_accept");
+		goto err1;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(as);
+err0:
+	/* Failure! */
+	return (-1);
+}
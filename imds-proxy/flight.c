@@ -0,0 +1,468 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * When many clients ask for the same thing at once (e.g., when hundreds of
+ * agents start at the same time), we send a single request to the IMDS and
+ * give the response to all of them.  The first client to ask becomes the
+ * "leader" and makes the request; clients which ask for the same thing
+ * before the leader is done become "waiters", and are handed a copy of the
+ * response when it arrives.  Requests are keyed on the complete request
+ * which we send to the IMDS, which is built from the normalized path and
+ * the forwarded headers, so waiters only ever receive a response to the
+ * request they would have made themselves.
+ *
+ * Waiters register a callback; flight_wait wraps this up for threads which
+ * are happy to block.
+ */
+
+/* Number of hash buckets. */
+#define NBUCKETS 256
+
+/* A client waiting for a response. */
+struct waiter {
+	struct waiter * next;
+	struct waiter * prev;
+	struct inflight * I;
+	int (* callback)(void *, const uint8_t *, size_t);
+	void * cookie;
+};
+
+/* A request in flight. */
+struct inflight {
+	struct inflight * next;
+	uint32_t hash;
+	char * key;
+	struct waiter * waiters;
+};
+
+/* Requests in flight. */
+struct flights {
+	pthread_mutex_t mtx;
+	struct inflight * buckets[NBUCKETS];
+
+	/* Statistics. */
+	uint64_t nleaders;
+	uint64_t nwaiters;
+	uint64_t nfailed;
+};
+
+/* State for a thread blocking in flight_wait. */
+struct blockwait {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	int done;
+	uint8_t * buf;
+	size_t len;
+};
+
+/**
+ * flight_init(void):
+ * Create a table of requests in flight to the IMDS.
+ */
+struct flights *
+flight_init(void)
+{
+	struct flights * F;
+	size_t i;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((F = malloc(sizeof(struct flights))) == NULL)
+		goto err0;
+	for (i = 0; i < NBUCKETS; i++)
+		F->buckets[i] = NULL;
+	F->nleaders = 0;
+	F->nwaiters = 0;
+	F->nfailed = 0;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&F->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Success! */
+	return (F);
+
+err1:
+	free(F);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * flight_join(F, key, callback, cookie, handle):
+ * If no request for ${key} is in flight in ${F}, record that one now is and
+ * return 1; the caller must make the request and then call flight_done with
+ * the handle returned via ${handle}.  Otherwise, arrange for
+ * ${callback}(${cookie}, buf, len) to be called with the response (or with
+ * ${buf} NULL if the request could not be shared) once the request is done
+ * and return zero; the handle returned via ${handle} may be passed to
+ * flight_cancel before then.  Return -1 on error.
+ */
+int
+flight_join(struct flights * F, const char * key,
+    int (* callback)(void *, const uint8_t *, size_t), void * cookie,
+    void ** handle)
+{
+	struct inflight * I;
+	struct waiter * W;
+	uint32_t h = fnv_hash_str(FNV_INIT, key);
+	int leader;
+	int rc;
+
+	/* Lock the table. */
+	if ((rc = pthread_mutex_lock(&F->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Is this request already in flight? */
+	for (I = F->buckets[h % NBUCKETS]; I != NULL; I = I->next) {
+		if ((I->hash == h) && (strcmp(I->key, key) == 0))
+			break;
+	}
+
+	/* If so, join the waiters; otherwise, become the leader. */
+	if (I != NULL) {
+		if ((W = malloc(sizeof(struct waiter))) == NULL)
+			goto err1;
+		W->I = I;
+		W->callback = callback;
+		W->cookie = cookie;
+		W->prev = NULL;
+		W->next = I->waiters;
+		if (I->waiters != NULL)
+			I->waiters->prev = W;
+		I->waiters = W;
+		F->nwaiters++;
+		*handle = W;
+		leader = 0;
+	} else {
+		if ((I = malloc(sizeof(struct inflight))) == NULL)
+			goto err1;
+		if ((I->key = strdup(key)) == NULL) {
+			free(I);
+			goto err1;
+		}
+		I->hash = h;
+		I->waiters = NULL;
+		I->next = F->buckets[h % NBUCKETS];
+		F->buckets[h % NBUCKETS] = I;
+		F->nleaders++;
+		*handle = I;
+		leader = 1;
+	}
+
+	/* Unlock the table. */
+	if ((rc = pthread_mutex_unlock(&F->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Tell the caller whether they are the leader. */
+	return (leader);
+
+err1:
+	pthread_mutex_unlock(&F->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * flight_cancel(F, handle):
+ * Stop waiting for the request which returned ${handle} from flight_join.
+ */
+void
+flight_cancel(struct flights * F, void * handle)
+{
+	struct waiter * W = handle;
+	int rc;
+
+	/* Lock the table. */
+	if ((rc = pthread_mutex_lock(&F->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Remove the waiter from the list. */
+	if (W->prev != NULL)
+		W->prev->next = W->next;
+	else
+		W->I->waiters = W->next;
+	if (W->next != NULL)
+		W->next->prev = W->prev;
+
+	/* Unlock the table. */
+	if ((rc = pthread_mutex_unlock(&F->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+
+	/* Free the waiter. */
+	free(W);
+}
+
+/**
+ * flight_done(F, handle, buf, len):
+ * The request which made the caller the leader via flight_join (returning
+ * ${handle}) is done; hand the ${len}-byte response ${buf} to any waiters,
+ * or tell them to make the request themselves if ${buf} is NULL.  Return
+ * nonzero if any of the waiters' callbacks failed.
+ */
+int
+flight_done(struct flights * F, void * handle, const uint8_t * buf,
+    size_t len)
+{
+	struct inflight * I = handle;
+	struct inflight ** ip;
+	struct waiter * W;
+	int rc;
+	int failed = 0;
+
+	/* Lock the table. */
+	if ((rc = pthread_mutex_lock(&F->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return (-1);
+	}
+
+	/* Remove the request from the table; nobody else can join it now. */
+	for (ip = &F->buckets[I->hash % NBUCKETS]; *ip != I;
+	    ip = &(*ip)->next)
+		continue;
+	*ip = I->next;
+	if ((buf == NULL) && (I->waiters != NULL))
+		F->nfailed++;
+
+	/* Unlock the table. */
+	if ((rc = pthread_mutex_unlock(&F->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+
+	/* Hand the response to the waiters. */
+	while ((W = I->waiters) != NULL) {
+		I->waiters = W->next;
+		if ((W->callback)(W->cookie, buf, len))
+			failed = 1;
+		free(W);
+	}
+
+	/* Free the request. */
+	free(I->key);
+	free(I);
+
+	/* Did anything go wrong? */
+	return (failed ? -1 : 0);
+}
+
+/**
+ * flight_release(F, handle):
+ * If nobody is waiting for the request which made the caller the leader via
+ * flight_join (returning ${handle}), finish it as flight_done would and
+ * return 1; later requests for the same key will be made afresh.  Otherwise
+ * return zero, and the caller must call flight_done as usual.  Return -1 on
+ * error.
+ */
+int
+flight_release(struct flights * F, void * handle)
+{
+	struct inflight * I = handle;
+	struct inflight ** ip;
+	int released = 0;
+	int rc;
+
+	/* Lock the table. */
+	if ((rc = pthread_mutex_lock(&F->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return (-1);
+	}
+
+	/* If nobody has joined the request, remove it from the table. */
+	if (I->waiters == NULL) {
+		for (ip = &F->buckets[I->hash % NBUCKETS]; *ip != I;
+		    ip = &(*ip)->next)
+			continue;
+		*ip = I->next;
+		released = 1;
+	}
+
+	/* Unlock the table. */
+	if ((rc = pthread_mutex_unlock(&F->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+
+	/* Free the request if we removed it. */
+	if (released) {
+		free(I->key);
+		free(I);
+	}
+
+	/* Tell the caller whether we finished the request. */
+	return (released);
+}
+
+/* Callback for flight_wait: copy the response and wake up the thread. */
+static int
+wakeup(void * cookie, const uint8_t * buf, size_t len)
+{
+	struct blockwait * B = cookie;
+	int rc;
+
+	/* Lock the waiting state. */
+	if ((rc = pthread_mutex_lock(&B->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return (-1);
+	}
+
+	/* Make a copy of the response if there is one. */
+	B->buf = NULL;
+	B->len = 0;
+	if ((buf != NULL) && ((B->buf = malloc(len)) != NULL)) {
+		memcpy(B->buf, buf, len);
+		B->len = len;
+	}
+
+	/* Wake up the thread. */
+	B->done = 1;
+	if ((rc = pthread_cond_signal(&B->cv)) != 0)
+		warn0("pthread_cond_signal: %s", strerror(rc));
+
+	/* Unlock the waiting state. */
+	if ((rc = pthread_mutex_unlock(&B->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return (-1);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * flight_wait(F, key, handle, buf, len):
+ * As flight_join, but if a request for ${key} is already in flight, block
+ * until it is done and return a malloced copy of the response via ${buf}
+ * and ${len} (or NULL if the caller must make the request itself).
+ */
+int
+flight_wait(struct flights * F, const char * key, void ** handle,
+    uint8_t ** buf, size_t * len)
+{
+	struct blockwait B;
+	int rc;
+
+	/* Initialize the waiting state. */
+	if ((rc = pthread_mutex_init(&B.mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err0;
+	}
+	if ((rc = pthread_cond_init(&B.cv, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err1;
+	}
+	B.done = 0;
+
+	/* Join the request or become the leader. */
+	if ((rc = flight_join(F, key, wakeup, &B, handle)) == -1)
+		goto err2;
+	if (rc == 1)
+		goto done;
+
+	/* Wait for the leader to finish. */
+	if ((rc = pthread_mutex_lock(&B.mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err3;
+	}
+	while (!B.done) {
+		if ((rc = pthread_cond_wait(&B.cv, &B.mtx)) != 0) {
+			warn0("pthread_cond_wait: %s", strerror(rc));
+			goto err4;
+		}
+	}
+	if ((rc = pthread_mutex_unlock(&B.mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		free(B.buf);
+		goto err2;
+	}
+
+	/* Return the response. */
+	*buf = B.buf;
+	*len = B.len;
+	rc = 0;
+
+done:
+	/* Clean up. */
+	pthread_cond_destroy(&B.cv);
+	pthread_mutex_destroy(&B.mtx);
+
+	/* Return leader or waiter. */
+	return (rc);
+
+err4:
+	pthread_mutex_unlock(&B.mtx);
+err3:
+	/*
+	 * We can't return while the leader might still call us back, and
+	 * there's no sensible way to recover from a broken mutex.
+	 */
+	warn0("Cannot wait for request in flight");
+	exit(1);
+err2:
+	pthread_cond_destroy(&B.cv);
+err1:
+	pthread_mutex_destroy(&B.mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * flight_stats_log(F):
+ * Log statistics about the coalescing of requests in ${F}.
+ */
+void
+flight_stats_log(struct flights * F)
+{
+	uint64_t nleaders, nwaiters, nfailed;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&F->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nleaders = F->nleaders;
+	nwaiters = F->nwaiters;
+	nfailed = F->nfailed;
+	if ((rc = pthread_mutex_unlock(&F->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: coalescing: %ju requests sent, "
+	    "%ju requests coalesced, %ju failed to share",
+	    (uintmax_t)nleaders, (uintmax_t)nwaiters, (uintmax_t)nfailed);
+}
+
+/**
+ * flight_free(F):
+ * Free the table ${F}, which must have no requests in flight.
+ */
+void
+flight_free(struct flights * F)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (F == NULL)
+		return;
+
+	/* Free the mutex and the structure. */
+	pthread_mutex_destroy(&F->mtx);
+	free(F);
+}
@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "imds-proxy.h"
+
+/*
+ * The hash tables in imds-proxy are keyed on short strings and ids, and
+ * FNV-1a is cheap and spreads those well enough.  Keys made of several
+ * parts are hashed by passing the result for each part in as the starting
+ * value for the next.
+ */
+
+/* FNV-1a prime. */
+#define FNV_PRIME 16777619U
+
+/**
+ * fnv_hash(h, buf, len):
+ * Continue the FNV-1a hash ${h} (FNV_INIT for a new hash) over the ${len}
+ * bytes at ${buf}, and return the result.
+ */
+uint32_t
+fnv_hash(uint32_t h, const void * buf, size_t len)
+{
+	const uint8_t * p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * FNV_PRIME;
+	return (h);
+}
+
+/**
+ * fnv_hash_str(h, s):
+ * Continue the FNV-1a hash ${h} (FNV_INIT for a new hash) over the string
+ * ${s}, not including its terminating NUL, and return the result.
+ */
+uint32_t
+fnv_hash_str(uint32_t h, const char * s)
+{
+
+	for (; *s != '\0'; s++)
+		h = (h ^ (uint8_t)*s) * FNV_PRIME;
+	return (h);
+}
@@ -1,117 +1,887 @@
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
+#include "elasticarray.h"
+#include "monoclock.h"
+#include "noeintr.h"
 #include "sock.h"
 #include "warnp.h"
 
 #include "imds-proxy.h"
 
-#define BUFLEN 1024
+/* Response sent for disallowed requests. */
+static const char forbidden[] = "HTTP/1.1 403 Forbidden\r\n"
+    "Content-Length: 0\r\nConnection: close\r\n\r\n";
 
-/**
- * http_proxy(s, dst, id, imdsc):
- * Read an HTTP request from the socket ${s} and forward it to address ${dst},
- * after querying ${id} about the owner of the incoming connection and
- * checking against the ruleset ${imdsc}.
+/* Response sent for requests which exceed a rate limit. */
+static const char toomany[] = "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* Response sent when we are shedding load. */
+static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* Most request data to discard before refusing a connection. */
+#define DISCARDMAX 8192
+
+/* Send the ${len}-byte response ${buf} to the client socket ${s}. */
+static int
+sendbuf(int s, const uint8_t * buf, size_t len)
+{
+
+	if (noeintr_write(s, buf, len) != (ssize_t)len)
+		return (-1);
+	relay_count(len);
+	return (0);
+}
+
+/*
+ * Set a deadline for the stage ${stage} on the sockets ${s1} and ${s2} (or
+ * -1), returning it via ${D}; or set ${D} to NULL if the stage has no limit.
  */
-void
-http_proxy(int s, struct sock_addr * const * dst,
-    struct sock_addr * const * id, const struct imds_conf * imdsc)
+static int
+arm(const struct proxy * P, int s1, int s2, int stage, struct deadline ** D)
+{
+	int secs;
+
+	/* Does this stage have a deadline? */
+	*D = NULL;
+	if ((secs = conf_deadline(P->imdsc, stage)) == 0)
+		return (0);
+
+	/* Set it. */
+	if ((*D = deadline_set(P->DL, s1, s2, stage, secs)) == NULL) {
+		warnp("deadline_set");
+		return (-1);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Connect to the IMDS, giving up if the connection isn't established by the
+ * deadline.  There's nothing for the deadline reaper to shut down until we
+ * have a connection, so we enforce this one by waiting with poll.
+ */
+static int
+connectimds(const struct proxy * P)
+{
+	struct pollfd pfd;
+	socklen_t errlen = sizeof(int);
+	int secs;
+	int err;
+	int rc;
+	int s;
+
+	/* With no deadline, just connect. */
+	if ((secs = conf_deadline(P->imdsc, DEADLINE_CONNECT)) == 0) {
+		if ((s = sock_connect_blocking(P->dst)) == -1)
+			warnp("sock_connect_blocking");
+		return (s);
+	}
+
+	/* Start connecting. */
+	if ((s = sock_connect_nb(P->dst[0])) == -1) {
+		warnp("sock_connect_nb");
+		goto err0;
+	}
+
+	/* The socket becomes writable upon connecting (or failing to). */
+	pfd.fd = s;
+	pfd.events = POLLOUT;
+	while ((rc = poll(&pfd, 1, secs * 1000)) == -1) {
+		if (errno != EINTR) {
+			warnp("poll");
+			goto err1;
+		}
+	}
+	if (rc == 0) {
+		warn0("Timed out connecting to IMDS");
+		deadline_expired(P->DL, DEADLINE_CONNECT);
+		goto err1;
+	}
+
+	/* Did the connection succeed? */
+	if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &errlen)) {
+		warnp("getsockopt(SO_ERROR)");
+		goto err1;
+	}
+	if (err != 0) {
+		errno = err;
+		warnp("Error connecting to IMDS");
+		goto err1;
+	}
+
+	/* We want a blocking socket. */
+	if (fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK) == -1) {
+		warnp("fcntl");
+		goto err1;
+	}
+
+	/* Success! */
+	return (s);
+
+err1:
+	close(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Hand the response ${buf} to clients waiting on ${flight}, if any. */
+static void
+land(const struct proxy * P, void * flight, const uint8_t * buf, size_t len)
+{
+
+	if ((flight != NULL) && flight_done(P->F, flight, buf, len))
+		warn0("Could not hand response to waiting clients");
+}
+
+/*
+ * What we're doing with the response to a GET request besides relaying it.
+ * If ${buf} is not NULL, we're keeping a copy of the response in it, in
+ * order to cache it if ${keep} is non-zero or to share it otherwise.  If
+ * ${flight} is not NULL, we're leading a request which other clients may be
+ * waiting for.  If ${hold} is non-zero, we haven't sent anything to the
+ * client yet, since we might want to replace a failure response from the
+ * IMDS with a stale one.  Once the response is complete, ${status} is its
+ * Status-Code and ${shareable} is non-zero if it can be replayed on a
+ * persistent connection (i.e., it didn't end the connection to the IMDS).
+ */
+struct capture {
+	struct elasticarray * buf;
+	void * flight;
+	int keep;
+	int hold;
+	int status;
+	int shareable;
+};
+
+/* Wait until the socket ${s} has data to read (or has been shut down). */
+static int
+waitread(int s)
+{
+	struct pollfd pfd;
+
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) == -1) {
+		if (errno != EINTR) {
+			warnp("poll");
+			return (-1);
+		}
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/*
+ * Send ${request} to the IMDS via a connection from the pool ${P}->U (or a
+ * new connection if there are none) and relay the response to the client
+ * socket ${s} using the relay state ${RL}.  If a reused connection fails
+ * before we have any of the response, it was probably closed by the IMDS
+ * while idle; retry once with a new connection.  If the end of the response
+ * was marked by the IMDS closing the connection, or the IMDS asked for the
+ * connection to be closed, clear ${keepalive} since the client will expect
+ * us to close too.
+ *
+ * If ${CP} is not NULL, it describes what else to do with the response.  If
+ * we're leading a request which nobody has joined by the time the response
+ * starts to arrive, finish it and stop keeping a copy unless we want one for
+ * the cache.  If we're holding the response back, send it once its header
+ * shows that the IMDS didn't fail.  If the response turns out to be larger
+ * than CACHE_MAXRESP bytes, send anything we've held back, stop keeping a
+ * copy, and tell anyone waiting to make the request themselves.
+ *
+ * The request is made on behalf of ${uid}, whose requests are in priority
+ * class ${prio}; if requests are being paced, wait until it can be sent.
+ * If the response stops making progress for longer than the relay deadline,
+ * give up on it (and on the client connection).
+ */
+static int
+forward(const struct proxy * P, struct relay * RL, uid_t uid, int prio,
+    const char * request, int s, int * keepalive, struct capture * CP)
+{
+	struct capture nocap = {NULL, NULL, 0, 0, 0, 0};
+	struct response * R;
+	struct deadline * D = NULL;
+	struct timeval t_start;
+	size_t reqlen = strlen(request);
+	size_t nread;
+	ssize_t len;
+	int head = (strncmp(request, "HEAD ", 5) == 0);
+	int relaysecs = conf_deadline(P->imdsc, DEADLINE_RELAY);
+	int s_imds;
+	int reused;
+	int retried = 0;
+	int status;
+	int rc;
+
+	/* Relaying is all we do with responses to other requests. */
+	if (CP == NULL)
+		CP = &nocap;
+
+	/* Wait for our turn to send a request, if necessary. */
+	if ((P->PC != NULL) && pacer_wait(P->PC, uid, prio))
+		goto err0;
+
+	/* Note when we started, so we can tell how fast the IMDS is. */
+	if (monoclock_get(&t_start)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+
+retry:
+	/* Use an idle connection if we have one; otherwise make a new one. */
+	if (!retried && ((s_imds = upstream_get(P->U)) != -1)) {
+		reused = 1;
+	} else {
+		reused = 0;
+		if ((s_imds = connectimds(P)) == -1)
+			goto err0;
+	}
+
+	/* Prepare to parse the response. */
+	if ((R = response_init(head)) == NULL) {
+		warnp("response_init");
+		goto err1;
+	}
+
+	/* Send the request. */
+	if (noeintr_write(s_imds, request, reqlen) != (ssize_t)reqlen) {
+		if (reused)
+			goto stale;
+		warnp("Error sending request to IMDS");
+		goto err2;
+	}
+
+	/* Don't wait forever for the IMDS or the client. */
+	if (arm(P, s_imds, s, DEADLINE_RELAY, &D))
+		goto err2;
+
+	/*
+	 * If we're only keeping a copy of the response in order to share it,
+	 * wait until it starts to arrive; if nobody has joined us by then,
+	 * stop letting them do so and relay the response without a copy.
+	 */
+	if ((CP->flight != NULL) && !CP->keep) {
+		if (waitread(s_imds))
+			goto err2;
+		if ((rc = flight_release(P->F, CP->flight)) == -1)
+			goto err2;
+		if (rc == 1) {
+			CP->flight = NULL;
+			elasticarray_free(CP->buf);
+			CP->buf = NULL;
+		}
+	}
+
+	/* Forward the server's response back until it is complete. */
+	nread = 0;
+	do {
+		/* Relay some of the response. */
+		if (relay_step(RL, s_imds, CP->hold ? -1 : s, R, CP->buf,
+		    &len))
+			goto err2;
+
+		/* We made progress, so push back the deadline. */
+		if (D != NULL)
+			deadline_extend(P->DL, D, relaysecs);
+
+		/* Stop holding back the response once it's not a failure. */
+		status = response_status(R);
+		if (CP->hold && (status != 0) && (status != 429) &&
+		    (status < 500)) {
+			if (sendbuf(s, elasticarray_get(CP->buf, 0, 1),
+			    elasticarray_getsize(CP->buf, 1)))
+				goto err2;
+			CP->hold = 0;
+		}
+
+		/* Give up on keeping a copy of a large response. */
+		if ((CP->buf != NULL) &&
+		    (elasticarray_getsize(CP->buf, 1) > CACHE_MAXRESP)) {
+			if (CP->hold && sendbuf(s,
+			    elasticarray_get(CP->buf, 0, 1),
+			    elasticarray_getsize(CP->buf, 1)))
+				goto err2;
+			CP->hold = 0;
+			elasticarray_free(CP->buf);
+			CP->buf = NULL;
+			land(P, CP->flight, NULL, 0);
+			CP->flight = NULL;
+		}
+
+		/* Did reading fail? */
+		if (len == -1) {
+			if (reused && (nread == 0))
+				goto stale;
+			warnp("Error reading response from IMDS");
+			goto err2;
+		}
+
+		/* EOF; this ends the response if it is delimited by EOF. */
+		if (len == 0) {
+			if (reused && (nread == 0))
+				goto stale;
+			if (response_eof(R)) {
+				warn0("Truncated response from IMDS");
+				goto err2;
+			}
+			*keepalive = 0;
+			CP->status = response_status(R);
+			CP->shareable = 0;
+			goto done;
+		}
+		nread += (size_t)len;
+	} while (!response_done(R));
+
+	/* If the deadline passed, the connection has been shut down. */
+	if (deadline_clear(P->DL, D)) {
+		D = NULL;
+		warn0("Timed out relaying response");
+		goto err2;
+	}
+	D = NULL;
+
+	/* The response is complete, whether or not the connection is. */
+	CP->status = response_status(R);
+
+	/* Return the connection to the pool if it can be reused. */
+	if (response_keepalive(R)) {
+		upstream_put(P->U, s_imds);
+		s_imds = -1;
+		CP->shareable = 1;
+	} else {
+		*keepalive = 0;
+		CP->shareable = 0;
+	}
+
+done:
+	/* Record how long the IMDS took. */
+	shed_latency(P->SH, &t_start);
+
+	/* Clean up. */
+	deadline_clear(P->DL, D);
+	response_free(R);
+	if (s_imds != -1)
+		close(s_imds);
+
+	/* Success! */
+	return (0);
+
+stale:
+	/* If the deadline passed, that's why the connection failed. */
+	if (deadline_clear(P->DL, D)) {
+		D = NULL;
+		warn0("Timed out relaying response");
+		goto err2;
+	}
+	D = NULL;
+
+	/* Throw away the dead connection and try again with a new one. */
+	response_free(R);
+	close(s_imds);
+	retried = 1;
+	goto retry;
+
+err2:
+	shed_latency(P->SH, &t_start);
+	deadline_clear(P->DL, D);
+	response_free(R);
+err1:
+	close(s_imds);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Fetch the response to ${request} from the IMDS, as forward() does, and
+ * relay it to the client socket ${s}.  If ${ttl} is non-zero, store a
+ * successful response in the cache for ${ttl} seconds, and if the IMDS
+ * fails, serve a cached response if one is less than ${stale} seconds past
+ * its expiry.  If ${flight} is not NULL, hand the response to any clients
+ * waiting for the same request.  The request is made on behalf of ${uid}
+ * in priority class ${prio}, as for forward().
+ */
+static int
+fetch(const struct proxy * P, struct relay * RL, uid_t uid, int prio,
+    const char * request, int ttl, int stale, void * flight, int s,
+    int * keepalive)
+{
+	struct capture CP;
+	uint8_t * buf = NULL;
+	size_t len;
+	int keepalive_req = *keepalive;
+	int rc, rc2;
+
+	/*
+	 * Keep a copy of the response if we might cache or share it; and if
+	 * we might serve a stale response instead, hold it back until we
+	 * know whether we want to.
+	 */
+	CP.buf = NULL;
+	CP.flight = flight;
+	CP.keep = (ttl > 0);
+	CP.hold = (ttl > 0) && (stale > 0);
+	CP.status = 0;
+	CP.shareable = 0;
+	if ((CP.keep || (CP.flight != NULL)) &&
+	    ((CP.buf = elasticarray_init(0, 1)) == NULL))
+		goto err1;
+	rc = forward(P, RL, uid, prio, request, s, keepalive, &CP);
+
+	/* If the IMDS failed us, use a stale response if we have one. */
+	if (CP.hold && (rc || (CP.status == 429) || (CP.status >= 500))) {
+		if ((rc2 = cache_get(P->C, request, 1, &buf, &len)) == -1)
+			goto err1;
+		if (rc2 == 1) {
+			*keepalive = keepalive_req;
+			land(P, CP.flight, buf, len);
+			if (sendbuf(s, buf, len))
+				goto err2;
+			goto done;
+		}
+	}
+
+	/* If we didn't get a response, there's nothing we can do. */
+	if (rc)
+		goto err1;
+
+	/*
+	 * Remember successful responses which can be replayed on persistent
+	 * connections; failing to do so isn't fatal.
+	 */
+	if (CP.keep && (CP.buf != NULL) && (CP.status == 200) &&
+	    CP.shareable && cache_put(P->C, request,
+	    elasticarray_get(CP.buf, 0, 1), elasticarray_getsize(CP.buf, 1),
+	    ttl, stale))
+		warnp("cache_put");
+
+	/* Hand the response to anyone waiting for it, if we can share it. */
+	if ((CP.buf != NULL) && CP.shareable)
+		land(P, CP.flight, elasticarray_get(CP.buf, 0, 1),
+		    elasticarray_getsize(CP.buf, 1));
+	else
+		land(P, CP.flight, NULL, 0);
+
+	/* Send the response to the client if we held it back. */
+	if (CP.hold && sendbuf(s, elasticarray_get(CP.buf, 0, 1),
+	    elasticarray_getsize(CP.buf, 1)))
+		goto err2;
+
+done:
+	/* Clean up. */
+	free(buf);
+	elasticarray_free(CP.buf);
+
+	/* Success! */
+	return (0);
+
+err1:
+	land(P, CP.flight, NULL, 0);
+err2:
+	free(buf);
+	elasticarray_free(CP.buf);
+
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Handle the allowed GET request ${request}; the other arguments are as for
+ * fetch().  Use a fresh cached response if we have one; otherwise, if the
+ * same request is already in flight, wait for its response rather than
+ * making another request to the IMDS.
+ */
+static int
+forward_get(const struct proxy * P, struct relay * RL, uid_t uid, int prio,
+    const char * request, int ttl, int stale, int s, int * keepalive)
 {
-	char buf[BUFLEN];
+	void * flight;
+	uint8_t * buf;
+	size_t len;
+	int rc;
+
+	/* Do we have a fresh response cached? */
+	if (ttl > 0) {
+		if ((rc = cache_get(P->C, request, 0, &buf, &len)) == -1)
+			goto err0;
+		if (rc == 1)
+			goto send;
+	}
+
+	/* Wait for the same request if it's in flight; or make it. */
+	if ((rc = flight_wait(P->F, request, &flight, &buf, &len)) == -1)
+		goto err0;
+	if (rc == 1)
+		return (fetch(P, RL, uid, prio, request, ttl, stale, flight,
+		    s, keepalive));
+
+	/* If the response couldn't be shared, make the request ourselves. */
+	if (buf == NULL)
+		return (fetch(P, RL, uid, prio, request, ttl, stale, NULL,
+		    s, keepalive));
+
+send:
+	/* Send the response to the client. */
+	if (sendbuf(s, buf, len)) {
+		free(buf);
+		goto err0;
+	}
+	free(buf);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* A client connection, and who owns it. */
+struct client {
+	int s;
+	int flags;
+	FILE * f;
 	uid_t uid;
-	gid_t * gids;
+	gid_t gids[IDENT_NGROUPS];
 	size_t ngid;
-	FILE * client;
+	size_t nreq;
+
+	/* The ruleset, and what it says about this client. */
+	const struct imds_conf * imdsc;
+	void * rsref;
+	int prio;
+	int limited;
+	struct limit lim;
+};
+
+/*
+ * Return 1 if the client ${C} has sent (the start of) another request, 0 if
+ * it hasn't yet, or -1 if it has closed the connection or an error occurred.
+ * Don't wait for the request, since it might never come.
+ */
+static int
+pending(struct client * C)
+{
+	int c;
+	int rc;
+
+	/* Read without blocking, from the buffer or the socket. */
+	if (fcntl(C->s, F_SETFL, C->flags | O_NONBLOCK) == -1) {
+		warnp("Cannot make socket non-blocking");
+		return (-1);
+	}
+	if ((c = getc(C->f)) != EOF) {
+		/* Put back the character for request_read to read. */
+		if (ungetc(c, C->f) == EOF) {
+			warnp("ungetc");
+			rc = -1;
+		} else {
+			rc = 1;
+		}
+	} else if (ferror(C->f) &&
+	    ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+		/* Nothing yet; forget that the read "failed". */
+		clearerr(C->f);
+		rc = 0;
+	} else {
+		/* Closing the connection is not an error. */
+		rc = -1;
+	}
+	if (fcntl(C->s, F_SETFL, C->flags) == -1) {
+		warnp("Cannot make socket blocking");
+		return (-1);
+	}
+
+	/* Return whether we have a request. */
+	return (rc);
+}
+
+/**
+ * http_open(s, P):
+ * Query the ident service about the owner of the connection ${s}, per ${P},
+ * and prepare to read HTTP requests from it.  On failure, close ${s}.
+ */
+struct client *
+http_open(int s, const struct proxy * P)
+{
+	struct client * C;
+
+	/* Allocate a structure. */
+	if ((C = malloc(sizeof(struct client))) == NULL) {
+		warnp("malloc");
+		goto err0;
+	}
+	C->s = s;
+	C->nreq = 0;
+
+	/*
+	 * Look up the owner of this connect.  This can't change during the
+	 * lifetime of the connection, so we only need to do this once.
+	 */
+	if (ident(P->ID, s, &C->uid, C->gids, &C->ngid))
+		goto err1;
+
+	/* Remember the socket flags, for switching in and out of blocking. */
+	if ((C->flags = fcntl(s, F_GETFL)) == -1) {
+		warnp("fcntl");
+		goto err1;
+	}
+
+	/*
+	 * Requests from this connection are all in the same class, unless
+	 * the configuration is reloaded.
+	 */
+	C->imdsc = ruleset_get(P->RS, &C->rsref);
+	C->prio = conf_priority(C->imdsc, C->uid, C->gids, C->ngid);
+	C->limited = conf_limit(C->imdsc, C->uid, C->gids, C->ngid, &C->lim);
+
+	/*
+	 * Wrap the file descriptor into a buffered file for reading requests.
+	 * We write responses directly to the socket, since switching a FILE
+	 * from reading to writing would discard any pipelined requests which
+	 * are sitting in its buffer.
+	 */
+	if ((C->f = fdopen(s, "r")) == NULL) {
+		warnp("fdopen");
+		goto err2;
+	}
+
+	/* Success! */
+	return (C);
+
+err2:
+	ruleset_put(P->RS, C->rsref);
+err1:
+	free(C);
+err0:
+	close(s);
+
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * http_serve(C, shed, P, RL):
+ * Read an HTTP request from the client ${C} and forward it to the IMDS if
+ * the ruleset allows, per ${P}, relaying the response using the relay state
+ * ${RL}; or if ${shed} is non-zero, refuse the request since we're too busy.
+ * Return 1 if the client has sent another request, 0 if it might send one
+ * later, or -1 if the connection should be closed with http_close.  Must
+ * only be called when reading from ${C} won't wait for a request to start.
+ */
+int
+http_serve(struct client * C, int shed, const struct proxy * P,
+    struct relay * RL)
+{
+	struct proxy PR;
+	const struct imds_conf * imdsc;
 	char * request;
 	char * path;
-	int s_imds;
-	FILE * f_imds;
-	size_t len;
+	struct deadline * D_header = NULL;
+	struct deadline * D_request = NULL;
 	int allowed;
+	int throttled;
+	int keepalive;
+	int ttl, stale;
+	int c;
 
-	/* Look up the owner of this connect. */
-	if (ident(s, id, &uid, &gids, &ngid)) {
-		/* Drop the connection. */
-		goto done0;
+	/* A client which has made requests may have closed the connection. */
+	if (C->nreq++ > 0) {
+		if ((c = getc(C->f)) == EOF)
+			goto err0;
+		if (ungetc(c, C->f) == EOF) {
+			warnp("ungetc");
+			goto err0;
+		}
 	}
 
-//	warn0("XXX uid = %d", (int)uid);
-//	warn0("XXX ngid = %zu", ngid);
-//	for (size_t i = 0; i < ngid; i++)
-//		warn0("XXX gid[%zu] = %d", i, gids[i]);
+	/* We have a request in flight until we've answered it. */
+	shed_start(P->SH);
 
-	/* Convert the file descriptor into a buffered file. */
-	if ((client = fdopen(s, "r+")) == NULL) {
-		warnp("fdopen");
-		goto done1;
+	/* Switch rulesets if the configuration was reloaded. */
+	imdsc = ruleset_refresh(P->RS, &C->rsref);
+	if (imdsc != C->imdsc) {
+		C->imdsc = imdsc;
+		C->prio = conf_priority(imdsc, C->uid, C->gids, C->ngid);
+		C->limited = conf_limit(imdsc, C->uid, C->gids, C->ngid,
+		    &C->lim);
 	}
 
+	/* Handle this request under that ruleset. */
+	PR = *P;
+	PR.imdsc = C->imdsc;
+	P = &PR;
+
+//	warn0("XXX uid = %d", (int)C->uid);
+//	warn0("XXX ngid = %zu", C->ngid);
+//	for (size_t i = 0; i < C->ngid; i++)
+//		warn0("XXX gid[%zu] = %d", i, C->gids[i]);
+
+	/*
+	 * Don't let a slow client tie up this thread, either by taking
+	 * forever to send its request or by dragging out the response.
+	 */
+	if (arm(P, C->s, -1, DEADLINE_REQUEST, &D_request) ||
+	    arm(P, C->s, -1, DEADLINE_HEADER, &D_header))
+		goto err1;
+
 	/* Read and parse the request. */
-	if (request_read(client, &request, &path)) {
+	if (request_read(C->f, &request, &path, &keepalive)) {
 		warnp("HTTP request read failed");
-		goto done2;
+		goto err1;
+	}
+
+	/* We have the whole header. */
+	if (deadline_clear(P->DL, D_header)) {
+		D_header = NULL;
+		goto err2;
+	}
+	D_header = NULL;
+
+	/* If we're shedding load, refuse and close the connection. */
+	if (shed) {
+		noeintr_write(C->s, busy, strlen(busy));
+		goto err2;
 	}
 
 //	warn0("XXX HTTP path: ===>%s<===", path);
 //	warn0("XXX HTTP request:\n======\n%s\n=====\n", request);
 
 	/* Check whether this process is allowed to make this request. */
-	allowed = conf_check(imdsc, path, uid, gids, ngid);
+	allowed = conf_check(P->imdsc, path, C->uid, C->gids, C->ngid);
+
+	/* If so, has it run out of requests for now? */
+	throttled = allowed && C->limited &&
+	    (limiter_check(P->L, &C->lim) != 1);
 
 	/* Log request. */
 	syslog(LOG_INFO, "imds-proxy: %s uid %zu %s",
-	    allowed ? "ALLOW" : "DENY", (size_t)uid, path);
+	    throttled ? "LIMIT" : (allowed ? "ALLOW" : "DENY"),
+	    (size_t)C->uid, path);
 
-	/* Drop disallowed requests. */
+	/* Can responses to this request be cached? */
+	ttl = stale = 0;
+	if ((P->C != NULL) && (strncmp(request, "GET ", 4) == 0))
+		conf_cache(P->imdsc, path, &ttl, &stale);
+
+	/*
+	 * Forbid disallowed requests and refuse throttled requests, closing
+	 * the connection so that a client which is being refused can't hang
+	 * on to it; forward other requests, via the cache and sharing with
+	 * concurrent requests if they are GETs.
+	 */
 	if (!allowed) {
-		fprintf(client, "HTTP/1.0 403 Forbidden\r\n\r\n");
-		goto done3;
+		noeintr_write(C->s, forbidden, strlen(forbidden));
+		keepalive = 0;
+	} else if (throttled) {
+		noeintr_write(C->s, toomany, strlen(toomany));
+		keepalive = 0;
+	} else if (strncmp(request, "GET ", 4) == 0) {
+		if (forward_get(P, RL, C->uid, C->prio, request, ttl, stale,
+		    C->s, &keepalive))
+			keepalive = 0;
+	} else if (forward(P, RL, C->uid, C->prio, request, C->s,
+	    &keepalive, NULL)) {
+		keepalive = 0;
 	}
 
-	/* Open a connection to the IMDS and wrap it into a FILE. */
-	if ((s_imds = sock_connect_blocking(dst)) == -1) {
-		warnp("sock_connect_blocking");
-		goto done3;
-	}
-	if ((f_imds = fdopen(s_imds, "r+")) == NULL) {
-		warnp("fdopen");
-		close(s_imds);
-		goto done3;
-	}
+	/* Free this request. */
+	free(request);
+	free(path);
 
-	/* Send the request. */
-	if (fwrite(request, strlen(request), 1, f_imds) != 1) {
-		warnp("fwrite");
-		goto done4;
-	}
+	/* This request is no longer in flight. */
+	shed_finish(P->SH);
 
-	/* Forward the server's response back. */
-	do {
-		if ((len = fread(buf, 1, BUFLEN, f_imds)) == 0)
-			break;
-		if (fwrite(buf, len, 1, client) != 1)
-			break;
-	} while (1);
+	/* If we ran out of time, the connection has been shut down. */
+	if (deadline_clear(P->DL, D_request))
+		keepalive = 0;
+
+	/* Stop if the client can't send another request. */
+	if (!keepalive)
+		goto err0;
 
-	/* No point checking ferror; we don't handle errors anyway. */
+	/* Has the client sent another request? */
+	return (pending(C));
 
-done4:
-	fclose(f_imds);
-done3:
+err2:
 	free(request);
 	free(path);
-done2:
-	fclose(client);
-	s = -1;
-done1:
-	/* Free the list of gids. */
-	free(gids);
-done0:
-	if (s != -1)
-		close(s);
+err1:
+	deadline_clear(P->DL, D_header);
+	deadline_clear(P->DL, D_request);
+	shed_finish(P->SH);
+err0:
+	/* The connection should be closed. */
+	return (-1);
+}
+
+/**
+ * http_fd(C):
+ * Return the socket of the client ${C}, for waiting until it's readable.
+ */
+int
+http_fd(const struct client * C)
+{
+
+	return (C->s);
+}
+
+/**
+ * http_close(C, P):
+ * Close the connection to the client ${C} and free it, releasing its
+ * reference to the ruleset in ${P}.
+ */
+void
+http_close(struct client * C, const struct proxy * P)
+{
+
+	/* Close the connection. */
+	fclose(C->f);
+
+	/* We're done with the ruleset. */
+	ruleset_put(P->RS, C->rsref);
+
+	/* Free the structure. */
+	free(C);
+}
+
+/**
+ * http_shed(s):
+ * Tell the client on the socket ${s} that we are too busy to handle its
+ * request, and close the connection.
+ */
+void
+http_shed(int s)
+{
+	uint8_t buf[DISCARDMAX];
+
+	/*
+	 * Discard any request the client has already sent, without waiting
+	 * for it; closing a socket with unread data resets the connection,
+	 * and the client might never see our response.  Errors don't matter
+	 * since we're about to close the connection anyway.
+	 */
+	recv(s, buf, DISCARDMAX, MSG_DONTWAIT);
+
+	/* Tell the client to come back later; it's gone if this fails. */
+	noeintr_write(s, busy, strlen(busy));
+
+	/* Close the connection. */
+	close(s);
 }
@@ -1,39 +1,142 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <arpa/inet.h>
 #include <netinet/in.h>
 
-#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
+#include <unistd.h>
 
 #include "elasticarray.h"
+#include "events.h"
+#include "network.h"
+#include "noeintr.h"
 #include "sock.h"
 #include "warnp.h"
 
 #include "imds-proxy.h"
 
-/* Elastic array of gids. */
-ELASTICARRAY_DECL(GIDLIST, gidlist, gid_t);
-
-/**
- * ident(s, id, uid, gids, ngid):
- * Query ${id} about the ownership of the process holding the other end of
- * the socket ${s}; return the user ID via ${uid}, a malloced array of group
- * IDs via ${gids}, and the number of group IDs via ${ngid}.
+/*
+ * Rather than connecting to the ident service for every query, we ask it for
+ * persistent channels (by sending a query with zero addresses and ports,
+ * followed by the version of the protocol we want) over which we send
+ * queries tagged with a 4-byte tag.  We ask for version 2, in which queries
+ * are sent in batches of up to IDENT_MAXBATCH, each preceded by a count, and
+ * each batch is answered at once with fixed-size records holding the tag, a
+ * status, the uid, the number of groups, and IDENT_NGROUPS gids, which we
+ * can parse without any allocation.
+ *
+ * Worker threads each need a channel to themselves while they wait for a
+ * response, so we keep a pool of idle channels for them.  In events mode, a
+ * single channel carries all of the queries in flight, and the queries which
+ * are made while we're waiting to write to it are sent together as a batch;
+ * the ident service answers queries in order, so the response to the oldest
+ * query is almost always the next one to arrive.  If a channel fails (e.g.,
+ * because imds-filterd was restarted), the queries which were waiting on it
+ * are retried once on a new channel.
+ *
+ * Before asking the ident service at all, we look for the connection in the
+ * credential table which imds-filterd publishes if it is run with -c; that
+ * takes a single probe of shared memory.
  */
-int
-ident(int s, struct sock_addr * const * id,
-    uid_t * uid, gid_t ** gids, size_t * ngid)
+
+/* Length of a query, and of the tag which precedes it on a channel. */
+#define QUERYLEN 12
+#define TAGLEN 4
+
+/* Version of the protocol, and the length of a response. */
+#define IDENT_VERSION 2
+#define RECLEN (TAGLEN + 12 + IDENT_NGROUPS * 4)
+
+/* Most queries which the ident service accepts in a batch. */
+#define IDENT_MAXBATCH 64
+
+/* Status codes in responses. */
+#define STATUS_OK 0
+#define STATUS_UNKNOWN 1
+
+/* Number of responses which we can buffer on an asynchronous channel. */
+#define NRECBUF 16
+
+/* A channel used for asynchronous queries. */
+struct idchan {
+	struct identd * ID;
+	int s;
+	int connecting;
+	int needhello;
+	void * read_cookie;
+	void * write_cookie;
+	struct elasticarray * obuf;
+	uint8_t * wbuf;
+	struct ident_async * head;
+	struct ident_async * tail;
+	uint8_t rbuf[NRECBUF * RECLEN];
+	size_t rlen;
+};
+
+/* State for an asynchronous ident query. */
+struct ident_async {
+	int (* callback)(void *, uid_t, gid_t *, size_t);
+	void * cookie;
+	struct idchan * C;
+	struct ident_async * prev;
+	struct ident_async * next;
+	uint32_t tag;
+	int retried;
+	uint8_t query[TAGLEN + QUERYLEN];
+	void * immediate_cookie;
+	uid_t uid;
+	gid_t gids[IDENT_NGROUPS];
+	size_t ngid;
+};
+
+/* Connections to the ident service. */
+struct identd {
+	struct sock_addr * const * id;
+
+	/* Credential table published by imds-filterd. */
+	struct credtab * T;
+
+	/* Idle channels, for worker threads. */
+	pthread_mutex_t mtx;
+	int * fds;
+	size_t nidle;
+	size_t nfds;
+	uint32_t nexttag;
+
+	/* Channel for asynchronous queries, or NULL. */
+	struct idchan * C;
+
+	/* Statistics. */
+	uint64_t nqueries;
+	uint64_t ntable;
+	uint64_t nchannels;
+	uint64_t nfailed;
+};
+
+/* Request for a persistent channel. */
+static const uint8_t hello[QUERYLEN] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	(IDENT_VERSION >> 24) & 0xff, (IDENT_VERSION >> 16) & 0xff,
+	(IDENT_VERSION >> 8) & 0xff, IDENT_VERSION & 0xff
+};
+
+/* Forward declarations. */
+static int chan_flush(struct idchan *);
+static int chan_send(struct identd *, struct ident_async *);
+
+/* Construct the ident query for the socket ${s}. */
+static int
+mkquery(int s, uint8_t idreq[QUERYLEN])
 {
 	struct sockaddr_in al;
 	struct sockaddr_in ar;
 	socklen_t alen;
-	uint8_t idreq[12];
-	FILE * f_id;
-	int s_id;
-	intmax_t i;
-	GIDLIST gs;
-	gid_t g;
 
 	/* Look up the local and remote addresses of this connection. */
 	alen = sizeof(struct sockaddr_in);
@@ -63,64 +166,896 @@ ident(int s, struct sock_addr * const * id,
 	memcpy(&idreq[6], &al.sin_addr, 4);
 	memcpy(&idreq[10], &al.sin_port, 2);
 
-	/* Connect to the ident service and wrap into a FILE. */
-	if ((s_id = sock_connect_blocking(id)) == -1) {
-		warnp("sock_connect_blocking");
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Store the 32-bit value ${x} at ${buf} in network byte order. */
+static void
+put32(uint8_t * buf, uint32_t x)
+{
+
+	x = htonl(x);
+	memcpy(buf, &x, 4);
+}
+
+/* Read a 32-bit value in network byte order from ${buf}. */
+static uint32_t
+get32(const uint8_t * buf)
+{
+	uint32_t x;
+
+	memcpy(&x, buf, 4);
+	return (ntohl(x));
+}
+
+/*
+ * Parse the response record ${buf}, returning its tag via ${tag}.  Return 0
+ * and the credentials via ${uid}, ${gids}, and ${ngid}; 1 if the ident
+ * service couldn't identify the connection; or -1 on error.
+ */
+static int
+parserec(const uint8_t * buf, uint32_t * tag,
+    uid_t * uid, gid_t gids[IDENT_NGROUPS], size_t * ngid)
+{
+	uint32_t status;
+	size_t n, i;
+
+	/* The tag comes back exactly as we sent it. */
+	memcpy(tag, buf, TAGLEN);
+	buf += TAGLEN;
+
+	/* Did the ident service find the owner of the connection? */
+	if ((status = get32(&buf[0])) == STATUS_UNKNOWN)
+		return (1);
+	if (status != STATUS_OK) {
+		warn0("Invalid status from ident daemon: %ju",
+		    (uintmax_t)status);
 		goto err0;
 	}
-	if ((f_id = fdopen(s_id, "r+")) == NULL) {
-		warnp("fdopen");
-		close(s_id);
+
+	/* We should have at least one gid, and no more than we can hold. */
+	if (((n = get32(&buf[8])) == 0) || (n > IDENT_NGROUPS)) {
+		warn0("Invalid number of gids from ident daemon: %zu", n);
 		goto err0;
 	}
 
-	/* Write the query. */
-	if (fwrite(idreq, 12, 1, f_id) != 1) {
-		warnp("fwrite");
-		goto err1;
+	/* Copy out the credentials. */
+	*uid = (uid_t)get32(&buf[4]);
+	for (i = 0; i < n; i++)
+		gids[i] = (gid_t)get32(&buf[12 + i * 4]);
+	*ngid = n;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Count a query and return a tag for it. */
+static uint32_t
+newtag(struct identd * ID)
+{
+	uint32_t tag;
+	int rc;
+
+	/* Lock the state. */
+	if ((rc = pthread_mutex_lock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
 	}
 
-	/*
-	 * Read the user ID into an intmax_t; we don't know how large a uid_t
-	 * is so we can't ask fscanf to parse directly into there.
-	 */
-	if (fscanf(f_id, "%jd\n", &i) != 1) {
-		warn0("Could not parse uid from ident daemon!");
+	/* Take the next tag. */
+	tag = ID->nexttag++;
+	ID->nqueries++;
+
+	/* Unlock the state. */
+	if ((rc = pthread_mutex_unlock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Return the tag. */
+	return (tag);
+}
+
+/* Increment the statistic ${n} in ${ID}. */
+static void
+count(struct identd * ID, uint64_t * n)
+{
+	int rc;
+
+	if ((rc = pthread_mutex_lock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	(*n)++;
+	if ((rc = pthread_mutex_unlock(&ID->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/* Take an idle channel from the pool, or return -1 if there are none. */
+static int
+pool_get(struct identd * ID)
+{
+	int s = -1;
+	int rc;
+
+	/* Lock the pool. */
+	if ((rc = pthread_mutex_lock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return (-1);
+	}
+
+	/* Take the most recently used channel. */
+	if (ID->nfds > 0)
+		s = ID->fds[--ID->nfds];
+
+	/* Unlock the pool. */
+	if ((rc = pthread_mutex_unlock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		if (s != -1)
+			close(s);
+		return (-1);
+	}
+
+	/* Return the channel (if any). */
+	return (s);
+}
+
+/* Return the idle channel ${s} to the pool, or close it if it is full. */
+static void
+pool_put(struct identd * ID, int s)
+{
+	int rc;
+
+	/* Lock the pool. */
+	if ((rc = pthread_mutex_lock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		close(s);
+		return;
+	}
+
+	/* Keep the channel if we have space; otherwise close it. */
+	if (ID->nfds < ID->nidle)
+		ID->fds[ID->nfds++] = s;
+	else
+		close(s);
+
+	/* Unlock the pool. */
+	if ((rc = pthread_mutex_unlock(&ID->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/* Open a new channel to the ident service and ask for it to persist. */
+static int
+pool_open(struct identd * ID)
+{
+	int s;
+
+	/* Connect to the ident service. */
+	if ((s = sock_connect_blocking(ID->id)) == -1) {
+		warnp("sock_connect_blocking");
+		goto err0;
+	}
+	count(ID, &ID->nchannels);
+
+	/* Ask for a persistent channel. */
+	if (noeintr_write(s, hello, QUERYLEN) != QUERYLEN) {
+		warnp("Error writing to ident daemon");
 		goto err1;
 	}
-	*uid = (uid_t)i;
 
-	/* Allocate an elastic array of gids. */
-	if ((gs = gidlist_init(0)) == NULL)
+	/* Success! */
+	return (s);
+
+err1:
+	close(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Read a response record from the channel ${s} into ${buf}; return 0 if the
+ * channel failed before any of the response arrived.
+ */
+static ssize_t
+readrec(int s, uint8_t buf[RECLEN])
+{
+	size_t len = 0;
+	ssize_t rlen;
+
+	/* Read until we have the whole record. */
+	do {
+		if ((rlen = read(s, &buf[len], RECLEN - len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (len == 0)
+				return (0);
+			warnp("Error reading from ident daemon");
+			return (-1);
+		}
+		if (rlen == 0) {
+			if (len == 0)
+				return (0);
+			warn0("Truncated response from ident daemon");
+			return (-1);
+		}
+		len += (size_t)rlen;
+	} while (len < RECLEN);
+
+	/* We have the record. */
+	return ((ssize_t)len);
+}
+
+/**
+ * ident_init(id, nidle, credpath):
+ * Prepare to query the ident service at ${id} over persistent channels,
+ * keeping up to ${nidle} idle channels for use by ident.  Look for
+ * connections in the credential table at ${credpath} first.
+ */
+struct identd *
+ident_init(struct sock_addr * const * id, size_t nidle, const char * credpath)
+{
+	struct identd * ID;
+	int rc;
+
+	/* Allocate a structure and space for the idle channels. */
+	if ((ID = malloc(sizeof(struct identd))) == NULL)
+		goto err0;
+	if ((ID->fds = malloc((nidle + 1) * sizeof(int))) == NULL)
 		goto err1;
+	ID->id = id;
+	ID->nidle = nidle;
+	ID->nfds = 0;
+	ID->nexttag = 0;
+	ID->C = NULL;
+	ID->nqueries = 0;
+	ID->ntable = 0;
+	ID->nchannels = 0;
+	ID->nfailed = 0;
+
+	/* Prepare to use the credential table. */
+	if ((ID->T = credtab_open(credpath)) == NULL)
+		goto err2;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&ID->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err3;
+	}
+
+	/* Success! */
+	return (ID);
+
+err3:
+	credtab_close(ID->T);
+err2:
+	free(ID->fds);
+err1:
+	free(ID);
+err0:
+	/* Failure! */
+	return (NULL);
+}
 
-	/* Read the group IDs. */
-	while (fscanf(f_id, "%jd,", &i) == 1) {
-		g = (gid_t)i;
-		if (gidlist_append(gs, &g, 1))
-			goto err2;
+/**
+ * ident(ID, s, uid, gids, ngid):
+ * Query the ident service ${ID} about the ownership of the process holding
+ * the other end of the socket ${s}; return the user ID via ${uid}, the group
+ * IDs via the caller-provided array ${gids}, and the number of group IDs via
+ * ${ngid}.
+ */
+int
+ident(struct identd * ID, int s, uid_t * uid, gid_t gids[IDENT_NGROUPS],
+    size_t * ngid)
+{
+	uint8_t query[4 + TAGLEN + QUERYLEN];
+	uint8_t resp[RECLEN];
+	uint32_t tag, rtag;
+	ssize_t len;
+	int s_id;
+	int reused;
+	int retried = 0;
+	int rc;
+
+	/* Construct the ident query. */
+	if (mkquery(s, &query[4 + TAGLEN]))
+		goto err0;
+
+	/* If imds-filterd published the owner of the connection, use that. */
+	if (credtab_lookup(ID->T, &query[4 + TAGLEN], uid, gids, ngid) == 0) {
+		count(ID, &ID->ntable);
+		return (0);
+	}
+
+	/* Tag the query, and send it as a batch of one. */
+	tag = newtag(ID);
+	put32(query, 1);
+	memcpy(&query[4], &tag, TAGLEN);
+
+retry:
+	/* Use an idle channel if we have one; otherwise open a new one. */
+	if (!retried && ((s_id = pool_get(ID)) != -1)) {
+		reused = 1;
+	} else {
+		reused = 0;
+		if ((s_id = pool_open(ID)) == -1)
+			goto err1;
+	}
+
+	/* Send the query. */
+	if (noeintr_write(s_id, query, sizeof(query)) !=
+	    (ssize_t)sizeof(query)) {
+		if (reused)
+			goto stale;
+		warnp("Error writing to ident daemon");
+		goto err2;
+	}
+
+	/* Read the response. */
+	if ((len = readrec(s_id, resp)) == -1)
+		goto err2;
+	if (len == 0) {
+		if (reused)
+			goto stale;
+		warn0("Ident daemon closed connection");
+		goto err2;
 	}
 
-	/* We should have read at least one gid. */
-	if (gidlist_getsize(gs) == 0) {
-		warn0("Did not read any gids from ident daemon!");
+	/* Parse the response, and check that it answers our query. */
+	if ((rc = parserec(resp, &rtag, uid, gids, ngid)) == -1)
 		goto err2;
+	if (rtag != tag) {
+		warn0("Ident daemon answered the wrong query!");
+		goto err2;
+	}
+
+	/* The channel can be used again. */
+	pool_put(ID, s_id);
+
+	/* Did the ident service find the owner of the connection? */
+	if (rc == 1) {
+		warn0("Ident daemon could not identify connection");
+		goto err1;
+	}
+
+	/* Success! */
+	return (0);
+
+stale:
+	/* The ident service closed the idle channel; try a new one. */
+	close(s_id);
+	retried = 1;
+	goto retry;
+
+err2:
+	close(s_id);
+err1:
+	count(ID, &ID->nfailed);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Remove the query ${IA} from the channel it is waiting on. */
+static void
+unlink_query(struct ident_async * IA)
+{
+	struct idchan * C = IA->C;
+
+	if (IA->prev != NULL)
+		IA->prev->next = IA->next;
+	else
+		C->head = IA->next;
+	if (IA->next != NULL)
+		IA->next->prev = IA->prev;
+	else
+		C->tail = IA->prev;
+	IA->C = NULL;
+}
+
+/* Invoke the callback for the query ${IA}, and free it. */
+static int
+complete(struct ident_async * IA, uid_t uid, gid_t * gids, size_t ngid)
+{
+	int rc;
+
+	/* Invoke the callback. */
+	rc = (IA->callback)(IA->cookie, uid, gids, ngid);
+
+	/* Free the state structure. */
+	free(IA);
+
+	/* Return the callback's status. */
+	return (rc);
+}
+
+/* The query ${IA} was answered from the credential table. */
+static int
+callback_table(void * cookie)
+{
+	struct ident_async * IA = cookie;
+
+	/* This callback is no longer pending. */
+	IA->immediate_cookie = NULL;
+
+	/* Hand the credentials over. */
+	return (complete(IA, IA->uid, IA->gids, IA->ngid));
+}
+
+/*
+ * The channel ${C} has failed; close it, and retry the queries which were
+ * waiting on it (or fail them, if they have already been retried).
+ */
+static int
+chan_fail(struct idchan * C)
+{
+	struct identd * ID = C->ID;
+	struct ident_async * IA;
+	int rc = 0;
+
+	/* This channel can't be used for any new queries. */
+	if (ID->C == C)
+		ID->C = NULL;
+
+	/* Cancel any pending operations and close the channel. */
+	if (C->connecting)
+		events_network_cancel(C->s, EVENTS_NETWORK_OP_WRITE);
+	if (C->read_cookie != NULL)
+		network_read_cancel(C->read_cookie);
+	if (C->write_cookie != NULL)
+		network_write_cancel(C->write_cookie);
+	close(C->s);
+
+	/* Retry or fail each query which was waiting. */
+	while ((IA = C->head) != NULL) {
+		unlink_query(IA);
+		if (!IA->retried) {
+			IA->retried = 1;
+			if (chan_send(ID, IA) == 0)
+				continue;
+		}
+		count(ID, &ID->nfailed);
+		if (complete(IA, 0, NULL, 0))
+			rc = -1;
+	}
+
+	/* Free the channel. */
+	elasticarray_free(C->obuf);
+	free(C->wbuf);
+	free(C);
+
+	/* Return the status of the callbacks. */
+	return (rc);
+}
+
+/* We have read (part of) one or more responses from the ident service. */
+static int
+callback_read(void * cookie, ssize_t len)
+{
+	struct idchan * C = cookie;
+	struct ident_async * IA;
+	uint8_t * rec;
+	uint32_t tag;
+	uid_t uid = 0;
+	gid_t gids[IDENT_NGROUPS];
+	size_t ngid = 0;
+	size_t pos;
+	int rc;
+
+	/* This callback is no longer pending. */
+	C->read_cookie = NULL;
+
+	/* Failure or EOF?  We're done with this channel. */
+	if (len == -1)
+		warnp("Error reading from ident daemon");
+	if (len <= 0)
+		return (chan_fail(C));
+
+	/* Record the data we read. */
+	C->rlen += (size_t)len;
+
+	/* Handle each complete response. */
+	for (pos = 0; C->rlen - pos >= RECLEN; pos += RECLEN) {
+		rec = &C->rbuf[pos];
+
+		/* Parse the response; if we can't, give up on the channel. */
+		if ((rc = parserec(rec, &tag, &uid, gids, &ngid)) == -1)
+			return (chan_fail(C));
+
+		/* Find the query; it was probably the oldest one. */
+		for (IA = C->head; IA != NULL; IA = IA->next) {
+			if (IA->tag == tag)
+				break;
+		}
+
+		/* If the query was cancelled, nobody wants the response. */
+		if (IA == NULL)
+			continue;
+
+		/* Hand the response over. */
+		unlink_query(IA);
+		if (rc == 1) {
+			warn0("Ident daemon could not identify connection");
+			count(C->ID, &C->ID->nfailed);
+			if (complete(IA, 0, NULL, 0))
+				return (-1);
+			continue;
+		}
+		memcpy(IA->gids, gids, ngid * sizeof(gid_t));
+		if (complete(IA, uid, IA->gids, ngid))
+			return (-1);
 	}
 
-	/* Export the array. */
-	gidlist_export(gs, gids, ngid);
+	/* Keep any partial response for next time. */
+	memmove(C->rbuf, &C->rbuf[pos], C->rlen - pos);
+	C->rlen -= pos;
 
-	/* Close the connection to the ident service. */
-	fclose(f_id);
+	/* Read more data. */
+	if ((C->read_cookie = network_read(C->s, &C->rbuf[C->rlen],
+	    sizeof(C->rbuf) - C->rlen, 1, callback_read, C)) == NULL) {
+		warnp("network_read");
+		return (chan_fail(C));
+	}
 
 	/* Success! */
 	return (0);
+}
+
+/* We have written queries to the ident service. */
+static int
+callback_write(void * cookie, ssize_t len)
+{
+	struct idchan * C = cookie;
+
+	/* This callback is no longer pending. */
+	C->write_cookie = NULL;
+	free(C->wbuf);
+	C->wbuf = NULL;
+
+	/* Failure?  We're done with this channel. */
+	if (len == -1) {
+		warnp("Error writing to ident daemon");
+		return (chan_fail(C));
+	}
+
+	/* Send any queries which were made in the meantime. */
+	if (chan_flush(C))
+		return (chan_fail(C));
+
+	/* Success! */
+	return (0);
+}
+
+/* We have connected (or failed to connect) to the ident service. */
+static int
+callback_connect(void * cookie)
+{
+	struct idchan * C = cookie;
+
+	/* This callback is no longer pending. */
+	C->connecting = 0;
+
+	/* Start reading responses. */
+	if ((C->read_cookie = network_read(C->s, C->rbuf, sizeof(C->rbuf), 1,
+	    callback_read, C)) == NULL) {
+		warnp("network_read");
+		return (chan_fail(C));
+	}
+
+	/* Send the queries; errors connecting will show up here. */
+	if (chan_flush(C))
+		return (chan_fail(C));
+
+	/* Success! */
+	return (0);
+}
+
+/* Send the queries queued on the channel ${C}, if we can. */
+static int
+chan_flush(struct idchan * C)
+{
+	const uint8_t * q;
+	uint8_t * p;
+	size_t nq, n, i;
+	size_t len;
+
+	/* Wait if we're still connecting, or already writing. */
+	if (C->connecting || (C->write_cookie != NULL))
+		return (0);
+
+	/* Is there anything to send? */
+	if ((nq = elasticarray_getsize(C->obuf, TAGLEN + QUERYLEN)) == 0)
+		return (0);
+
+	/* Allocate a buffer for the hello (if needed) and the batches. */
+	len = (C->needhello ? QUERYLEN : 0) +
+	    ((nq + IDENT_MAXBATCH - 1) / IDENT_MAXBATCH) * 4 +
+	    nq * (TAGLEN + QUERYLEN);
+	if ((C->wbuf = malloc(len)) == NULL)
+		goto err0;
+	p = C->wbuf;
+
+	/* Ask for a persistent channel, if we haven't already. */
+	if (C->needhello) {
+		memcpy(p, hello, QUERYLEN);
+		p += QUERYLEN;
+		C->needhello = 0;
+	}
+
+	/* Take the queued queries, so that more can be queued meanwhile. */
+	q = elasticarray_get(C->obuf, 0, TAGLEN + QUERYLEN);
+	for (i = 0; i < nq; i += n) {
+		if ((n = nq - i) > IDENT_MAXBATCH)
+			n = IDENT_MAXBATCH;
+		put32(p, (uint32_t)n);
+		memcpy(&p[4], q, n * (TAGLEN + QUERYLEN));
+		p += 4 + n * (TAGLEN + QUERYLEN);
+		q += n * (TAGLEN + QUERYLEN);
+	}
+	if (elasticarray_resize(C->obuf, 0, TAGLEN + QUERYLEN)) {
+		warnp("elasticarray_resize");
+		goto err1;
+	}
+
+	/* Send them. */
+	if ((C->write_cookie = network_write(C->s, C->wbuf, len, len,
+	    callback_write, C)) == NULL) {
+		warnp("network_write");
+		goto err1;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(C->wbuf);
+	C->wbuf = NULL;
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Open a new channel for asynchronous queries. */
+static struct idchan *
+chan_open(struct identd * ID)
+{
+	struct idchan * C;
 
+	/* Allocate a structure. */
+	if ((C = malloc(sizeof(struct idchan))) == NULL)
+		goto err0;
+	C->ID = ID;
+	C->connecting = 0;
+	C->needhello = 1;
+	C->read_cookie = NULL;
+	C->write_cookie = NULL;
+	C->wbuf = NULL;
+	C->head = C->tail = NULL;
+	C->rlen = 0;
+
+	/* Queries wait here until we can send them. */
+	if ((C->obuf = elasticarray_init(0, TAGLEN + QUERYLEN)) == NULL)
+		goto err1;
+
+	/* Start connecting to the ident service. */
+	if ((C->s = sock_connect_nb(ID->id[0])) == -1) {
+		warnp("sock_connect_nb");
+		goto err2;
+	}
+
+	/* The socket becomes writable upon connecting (or failing to). */
+	if (events_network_register(callback_connect, C, C->s,
+	    EVENTS_NETWORK_OP_WRITE)) {
+		warnp("events_network_register");
+		goto err3;
+	}
+	C->connecting = 1;
+	count(ID, &ID->nchannels);
+
+	/* Success! */
+	return (C);
+
+err3:
+	close(C->s);
 err2:
-	gidlist_free(gs);
+	elasticarray_free(C->obuf);
 err1:
-	fclose(f_id);
+	free(C);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Send the query ${IA} over the current channel, opening one if needed. */
+static int
+chan_send(struct identd * ID, struct ident_async * IA)
+{
+	struct idchan * C;
+
+	/* Make sure we have a channel. */
+	if ((ID->C == NULL) && ((ID->C = chan_open(ID)) == NULL))
+		goto err0;
+	C = ID->C;
+
+	/* Queue the query. */
+	if (elasticarray_append(C->obuf, IA->query, 1, TAGLEN + QUERYLEN))
+		goto err0;
+
+	/* Wait for the response. */
+	IA->C = C;
+	IA->next = NULL;
+	IA->prev = C->tail;
+	if (C->tail != NULL)
+		C->tail->next = IA;
+	else
+		C->head = IA;
+	C->tail = IA;
+
+	/* Send the query if we're not busy sending others. */
+	if (chan_flush(C)) {
+		unlink_query(IA);
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
 err0:
 	/* Failure! */
 	return (-1);
 }
+
+/**
+ * ident_async(ID, s, callback, cookie):
+ * Asynchronously query the ident service ${ID} about the ownership of the
+ * process holding the other end of the socket ${s}.  When the query
+ * completes, invoke ${callback}(${cookie}, uid, gids, ngid) with the user ID
+ * and an array of ${ngid} group IDs which is only valid until the callback
+ * returns; or with ${gids} equal to NULL and ${ngid} equal to zero on
+ * failure.  Return a cookie which can be passed
+ * to ident_async_cancel in order to cancel the query.
+ */
+void *
+ident_async(struct identd * ID, int s,
+    int (* callback)(void *, uid_t, gid_t *, size_t), void * cookie)
+{
+	struct ident_async * IA;
+
+	/* Bake a cookie. */
+	if ((IA = malloc(sizeof(struct ident_async))) == NULL)
+		goto err0;
+	IA->callback = callback;
+	IA->cookie = cookie;
+	IA->C = NULL;
+	IA->retried = 0;
+	IA->immediate_cookie = NULL;
+
+	/* Construct the ident query. */
+	if (mkquery(s, &IA->query[TAGLEN]))
+		goto err1;
+
+	/*
+	 * If imds-filterd published the owner of the connection, use that;
+	 * but our caller expects the callback to be invoked later.
+	 */
+	if (credtab_lookup(ID->T, &IA->query[TAGLEN], &IA->uid, IA->gids,
+	    &IA->ngid) == 0) {
+		if ((IA->immediate_cookie = events_immediate_register(
+		    callback_table, IA, 0)) == NULL) {
+			warnp("events_immediate_register");
+			goto err1;
+		}
+		count(ID, &ID->ntable);
+		return (IA);
+	}
+
+	/* Tag the query. */
+	IA->tag = newtag(ID);
+	memcpy(IA->query, &IA->tag, TAGLEN);
+
+	/* Send it. */
+	if (chan_send(ID, IA))
+		goto err2;
+
+	/* Success! */
+	return (IA);
+
+err2:
+	count(ID, &ID->nfailed);
+err1:
+	free(IA);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * ident_async_cancel(cookie):
+ * Cancel the ident query for which ${cookie} was returned by ident_async.
+ * Do not invoke the callback associated with the query.
+ */
+void
+ident_async_cancel(void * cookie)
+{
+	struct ident_async * IA = cookie;
+
+	/* Was the query answered from the credential table? */
+	if (IA->immediate_cookie != NULL)
+		events_immediate_cancel(IA->immediate_cookie);
+
+	/*
+	 * Stop waiting for the response; the query may already have been
+	 * sent, in which case we'll ignore the response when it arrives.
+	 */
+	if (IA->C != NULL)
+		unlink_query(IA);
+
+	/* Free the state structure. */
+	free(IA);
+}
+
+/**
+ * ident_stats_log(ID):
+ * Log statistics about queries made to the ident service ${ID}.
+ */
+void
+ident_stats_log(struct identd * ID)
+{
+	uint64_t nqueries, ntable, nchannels, nfailed;
+	size_t nfds;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nqueries = ID->nqueries;
+	ntable = ID->ntable;
+	nchannels = ID->nchannels;
+	nfailed = ID->nfailed;
+	nfds = ID->nfds;
+	if ((rc = pthread_mutex_unlock(&ID->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: ident: %ju queries (%ju failed) "
+	    "over %ju channels, %zu idle; %ju answered from table",
+	    (uintmax_t)nqueries, (uintmax_t)nfailed, (uintmax_t)nchannels,
+	    nfds, (uintmax_t)ntable);
+}
+
+/**
+ * ident_free(ID):
+ * Close the idle channels to the ident service ${ID} and free it.  There
+ * must be no asynchronous queries in progress.
+ */
+void
+ident_free(struct identd * ID)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (ID == NULL)
+		return;
+
+	/* Close idle channels. */
+	while (ID->nfds > 0)
+		close(ID->fds[--ID->nfds]);
+
+	/* Free the mutex, the credential table, and the structure. */
+	pthread_mutex_destroy(&ID->mtx);
+	credtab_close(ID->T);
+	free(ID->fds);
+	free(ID);
+}
@@ -1,30 +1,318 @@
 #ifndef IMDS_PROXY_H
 #define IMDS_PROXY_H
 
+#include <sys/types.h>
+
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 
-/* Opaque type. */
-struct sock_addr;
+/* Seconds to wait for another request on an idle client connection. */
+#define KEEPALIVE_TIMEOUT 5
+
+/* Priority classes for pacing requests, highest first. */
+#define PRIO_HIGH 0
+#define PRIO_NORMAL 1
+#define PRIO_LOW 2
+#define NPRIO 3
+
+/* Principal types for rate limits. */
+#define LIMIT_UID 0
+#define LIMIT_GID 1
+
+/* A rate limit, and the principal whose requests count against it. */
+struct limit {
+	int type;		/* LIMIT_UID or LIMIT_GID. */
+	id_t id;		/* User or group ID. */
+	int rate;		/* Requests per second. */
+	int burst;		/* Requests at once. */
+};
+
+/* Stages of handling a request which have deadlines. */
+#define DEADLINE_HEADER 0	/* Reading the request header. */
+#define DEADLINE_REQUEST 1	/* Handling the request, start to finish. */
+#define DEADLINE_CONNECT 2	/* Connecting to the IMDS. */
+#define DEADLINE_RELAY 3	/* Relaying the response, without progress. */
+#define NDEADLINE 4
+
+/* Most group IDs which the ident service reports for a process. */
+#define IDENT_NGROUPS 16
+
+/* Largest response which we will buffer in order to cache or share it. */
+#define CACHE_MAXRESP 65536
+
+/* FNV-1a offset basis, for starting a new hash with fnv_hash. */
+#define FNV_INIT 2166136261U
+
+/* Access rule number meaning that no access rule matched a request. */
+#define NORULE ((size_t)(-1))
+
+/* Opaque types. */
+struct cache;
+struct client;
+struct credtab;
+struct deadline;
+struct deadlines;
+struct decisions;
+struct elasticarray;
+struct flights;
+struct identd;
 struct imds_conf;
+struct limiter;
+struct names;
+struct pacer;
+struct pathtrie;
+struct princache;
+struct relay;
+struct response;
+struct ruleset;
+struct shed;
+struct sock_addr;
+struct timeval;
+struct upstream;
+struct workers;
+
+/* Everything needed to handle a connection. */
+struct proxy {
+	struct sock_addr * const * dst;		/* IMDS address. */
+	struct identd * ID;			/* Ident service. */
+	struct ruleset * RS;			/* Configuration. */
+	const struct imds_conf * imdsc;		/* Ruleset, per connection. */
+	struct upstream * U;			/* Idle IMDS connections. */
+	struct cache * C;			/* Cached responses, or NULL. */
+	struct flights * F;			/* Requests in flight. */
+	struct pacer * PC;			/* Request pacer, or NULL. */
+	struct limiter * L;			/* Rate limits. */
+	struct shed * SH;			/* Load shedding. */
+	struct deadlines * DL;			/* Deadlines. */
+};
+
+/**
+ * http_open(s, P):
+ * Query the ident service about the owner of the connection ${s}, per ${P},
+ * and prepare to read HTTP requests from it.  On failure, close ${s}.
+ */
+struct client * http_open(int, const struct proxy *);
+
+/**
+ * http_serve(C, shed, P, RL):
+ * Read an HTTP request from the client ${C} and forward it to the IMDS if
+ * the ruleset allows, per ${P}, relaying the response using the relay state
+ * ${RL}; or if ${shed} is non-zero, refuse the request since we're too busy.
+ * Return 1 if the client has sent another request, 0 if it might send one
+ * later, or -1 if the connection should be closed with http_close.  Must
+ * only be called when reading from ${C} won't wait for a request to start.
+ */
+int http_serve(struct client *, int, const struct proxy *, struct relay *);
+
+/**
+ * http_fd(C):
+ * Return the socket of the client ${C}, for waiting until it's readable.
+ */
+int http_fd(const struct client *);
 
 /**
- * http_proxy(s, dst, id, imdsc):
- * Read an HTTP request from the socket ${s} and forward it to address ${dst},
- * after querying ${id} about the owner of the incoming connection and
- * checking against the ruleset ${imdsc}.
+ * http_close(C, P):
+ * Close the connection to the client ${C} and free it, releasing its
+ * reference to the ruleset in ${P}.
  */
-void http_proxy(int, struct sock_addr * const *, struct sock_addr * const *,
-    const struct imds_conf *);
+void http_close(struct client *, const struct proxy *);
 
 /**
- * request_read(f, req, path):
- * Read an HTTP request from ${f}.  Store an HTTP/1.0 request (which may be
+ * http_shed(s):
+ * Tell the client on the socket ${s} that we are too busy to handle its
+ * request, and close the connection.
+ */
+void http_shed(int);
+
+/**
+ * evproxy_listen(s, P):
+ * Accept connections on the non-blocking listening socket ${s} and handle
+ * them as http_serve does, but asynchronously via the events loop rather
+ * than in a thread per connection.
+ */
+int evproxy_listen(int, const struct proxy *);
+
+/**
+ * workers_init(n, s, nthreads, qlen, P):
+ * Spawn ${nthreads} worker threads which handle connections accepted by
+ * workers_accept from the non-blocking listening socket ${s} by calling
+ * http_serve with ${P}.  Allow up to ${qlen} connections to wait for a
+ * worker.  Statistics are logged as being for listening socket #${n}.
+ */
+struct workers * workers_init(size_t, int, size_t, size_t,
+    const struct proxy *);
+
+/**
+ * workers_accept(W):
+ * Accept connections from the listening socket of the workers ${W} and
+ * queue them to be handled, along with idle clients which have sent another
+ * request.  Return only if an error occurs.
+ */
+int workers_accept(struct workers *);
+
+/**
+ * workers_stats_log(W):
+ * Log statistics about the connections passed to the workers ${W}.
+ */
+void workers_stats_log(struct workers *);
+
+/**
+ * request_read(f, req, path, keepalive):
+ * Read an HTTP request from ${f}.  Store an HTTP/1.1 request (which may be
  * identical or may be reconstructed with the same semantic meaning) in
- * ${req}, and a normalized IMDS request path in ${path}.
+ * ${req}, and a normalized IMDS request path in ${path}.  The request does
+ * not ask for the connection to be closed, so the response must be framed
+ * by the IMDS and the connection can be reused for later requests.  Set
+ * ${keepalive} to non-zero if the client can send another request on the
+ * same connection once the response has been sent.
+ */
+int request_read(FILE *, char **, char **, int *);
+
+/**
+ * http_hastoken(list, tok):
+ * Return non-zero if the comma-separated list of tokens ${list} (e.g., the
+ * value of a Connection header) contains ${tok}, ignoring case.
+ */
+int http_hastoken(const char *, const char *);
+
+/**
+ * response_init(head):
+ * Create a parser for tracking the framing of an HTTP response.  If ${head}
+ * is non-zero, the response is to a HEAD request and has no body.
+ */
+struct response * response_init(int);
+
+/**
+ * response_parse(R, buf, len):
+ * Feed the ${len} bytes in ${buf} through the response parser ${R}.  Return
+ * the number of bytes which form part of this response (which may be fewer
+ * than ${len} if the response ends partway through the buffer), or -1 if the
+ * response is invalid.
+ */
+ssize_t response_parse(struct response *, const uint8_t *, size_t);
+
+/**
+ * response_body(R):
+ * Return the number of bytes which come next in the response tracked by
+ * ${R} and are body data which need not be passed to response_parse, or
+ * SIZE_MAX if the rest of the response is body data running until EOF.
+ * Return zero if the parser needs to see the next bytes.
+ */
+size_t response_body(const struct response *);
+
+/**
+ * response_skip(R, len):
+ * Record that ${len} bytes of body data, which must not be more than
+ * response_body(${R}) returned, have been relayed without being parsed.
+ */
+void response_skip(struct response *, size_t);
+
+/**
+ * response_eof(R):
+ * The connection carrying the response tracked by ${R} has been closed.
+ * Return zero if the response is complete, or -1 if it was truncated.
+ */
+int response_eof(struct response *);
+
+/**
+ * response_done(R):
+ * Return non-zero if the entire response tracked by ${R} has been parsed.
+ */
+int response_done(const struct response *);
+
+/**
+ * response_status(R):
+ * Return the Status-Code of the response tracked by ${R}, or zero if its
+ * header has not been parsed yet.
+ */
+int response_status(const struct response *);
+
+/**
+ * response_keepalive(R):
+ * Return non-zero if the connection carrying the response tracked by ${R}
+ * can be reused for another request once the response is complete.
+ */
+int response_keepalive(const struct response *);
+
+/**
+ * response_free(R):
+ * Free the response parser ${R}.
+ */
+void response_free(struct response *);
+
+/**
+ * relay_init(void):
+ * Create a state for relaying responses from the IMDS to clients within a
+ * single thread.
+ */
+struct relay * relay_init(void);
+
+/**
+ * relay_step(RL, from, to, R, cap, len):
+ * Read some of the response tracked by ${R} from the socket ${from} and
+ * write it to the socket ${to} (unless ${to} is -1), using the relay state
+ * ${RL}; if ${cap} is not NULL, also append it to the elastic array of bytes
+ * ${cap}.
+ * Return the number of bytes read via ${len}, which is zero at EOF or -1 if
+ * reading failed (with errno set).  Return -1 if writing failed or the
+ * response was invalid, or zero otherwise.
+ */
+int relay_step(struct relay *, int, int, struct response *,
+    struct elasticarray *, ssize_t *);
+
+/**
+ * relay_count(len):
+ * Record in the relay statistics that ${len} bytes of response have been
+ * copied to a client through a buffer by code not using relay_step.
+ */
+void relay_count(size_t);
+
+/**
+ * relay_stats_log(void):
+ * Log statistics about the relaying of responses to clients.
+ */
+void relay_stats_log(void);
+
+/**
+ * relay_free(RL):
+ * Free the relay state ${RL}.
+ */
+void relay_free(struct relay *);
+
+/**
+ * upstream_init(nidle):
+ * Create a pool which holds up to ${nidle} idle connections to the IMDS.  If
+ * ${nidle} is zero, connections are never reused.
  */
-int request_read(FILE *, char **, char **);
+struct upstream * upstream_init(size_t);
+
+/**
+ * upstream_get(U):
+ * Return an idle connection to the IMDS from the pool ${U}, or -1 if there
+ * are none; in the latter case the caller should make a new connection.
+ */
+int upstream_get(struct upstream *);
+
+/**
+ * upstream_put(U, s):
+ * Return the connection ${s}, which has finished reading a response and has
+ * nothing else in flight, to the pool ${U}.  If the pool is full, close it.
+ */
+void upstream_put(struct upstream *, int);
+
+/**
+ * upstream_stats_log(U):
+ * Log statistics about the reuse of connections in the pool ${U}.
+ */
+void upstream_stats_log(struct upstream *);
+
+/**
+ * upstream_free(U):
+ * Close all the idle connections in the pool ${U} and free it.
+ */
+void upstream_free(struct upstream *);
 
 /**
  * uri2path(uri, path):
@@ -34,12 +322,112 @@ int request_read(FILE *, char **, char **);
 int uri2path(const char *, char **);
 
 /**
- * ident(s, id, uid, gids, ngid):
- * Query ${id} about the ownership of the process holding the other end of
- * the socket ${s}; return the user ID via ${uid}, a malloced array of group
- * IDs via ${gids}, and the number of group IDs via ${ngid}.
+ * credtab_open(path):
+ * Prepare to look up connections in the credential table which imds-filterd
+ * publishes at ${path}.  The table need not exist yet.
+ */
+struct credtab * credtab_open(const char *);
+
+/**
+ * credtab_lookup(T, query, uid, gids, ngid):
+ * Look up the connection described by the 12-byte ident ${query} in the
+ * credential table ${T}.  If it is there, return the user ID via ${uid},
+ * the group IDs via the caller-provided array ${gids}, and the number of
+ * group IDs via ${ngid}; otherwise, return -1.  This may be called by
+ * several threads at once.
  */
-int ident(int, struct sock_addr * const *, uid_t *, gid_t **, size_t *);
+int credtab_lookup(struct credtab *, const uint8_t *, uid_t *,
+    gid_t[IDENT_NGROUPS], size_t *);
+
+/**
+ * credtab_close(T):
+ * Unmap any credential tables and free ${T}.  There must be no lookups in
+ * progress.
+ */
+void credtab_close(struct credtab *);
+
+/**
+ * ident_init(id, nidle, credpath):
+ * Prepare to query the ident service at ${id} over persistent channels,
+ * keeping up to ${nidle} idle channels for use by ident.  Look for
+ * connections in the credential table at ${credpath} first.
+ */
+struct identd * ident_init(struct sock_addr * const *, size_t, const char *);
+
+/**
+ * ident(ID, s, uid, gids, ngid):
+ * Query the ident service ${ID} about the ownership of the process holding
+ * the other end of the socket ${s}; return the user ID via ${uid}, the group
+ * IDs via the caller-provided array ${gids}, and the number of group IDs via
+ * ${ngid}.
+ */
+int ident(struct identd *, int, uid_t *, gid_t[IDENT_NGROUPS], size_t *);
+
+/**
+ * ident_async(ID, s, callback, cookie):
+ * Asynchronously query the ident service ${ID} about the ownership of the
+ * process holding the other end of the socket ${s}.  When the query
+ * completes, invoke ${callback}(${cookie}, uid, gids, ngid) with the user ID
+ * and an array of ${ngid} group IDs which is only valid until the callback
+ * returns; or with ${gids} equal to NULL and ${ngid} equal to zero on
+ * failure.  Return a cookie which can be passed
+ * to ident_async_cancel in order to cancel the query.
+ */
+void * ident_async(struct identd *, int,
+    int (*)(void *, uid_t, gid_t *, size_t), void *);
+
+/**
+ * ident_async_cancel(cookie):
+ * Cancel the ident query for which ${cookie} was returned by ident_async.
+ * Do not invoke the callback associated with the query.
+ */
+void ident_async_cancel(void *);
+
+/**
+ * ident_stats_log(ID):
+ * Log statistics about queries made to the ident service ${ID}.
+ */
+void ident_stats_log(struct identd *);
+
+/**
+ * ident_free(ID):
+ * Close the idle channels to the ident service ${ID} and free it.  There
+ * must be no asynchronous queries in progress.
+ */
+void ident_free(struct identd *);
+
+/**
+ * names_init(void):
+ * Prepare to look up user and group names, remembering the answers.
+ */
+struct names * names_init(void);
+
+/**
+ * names_uid(N, s, len, uid):
+ * Return via ${uid} the uid of the user named by the ${len} bytes at ${s},
+ * looking it up unless ${N} has already done so.
+ */
+int names_uid(struct names *, const char *, size_t, uid_t *);
+
+/**
+ * names_gid(N, s, len, gid):
+ * Return via ${gid} the gid of the group named by the ${len} bytes at ${s},
+ * looking it up unless ${N} has already done so.
+ */
+int names_gid(struct names *, const char *, size_t, gid_t *);
+
+/**
+ * names_stats(N, nlookups, t):
+ * Return via ${nlookups} the number of names which ${N} has looked up, and
+ * via ${t} the number of seconds spent looking them up.
+ */
+void names_stats(struct names *, size_t *, double *);
+
+/**
+ * names_free(N):
+ * Free ${N} and the names it remembers.
+ */
+void names_free(struct names *);
 
 /**
  * conf_read(path):
@@ -48,6 +436,22 @@ int ident(int, struct sock_addr * const *, uid_t *, gid_t **, size_t *);
  */
 struct imds_conf * conf_read(const char *);
 
+/**
+ * conf_compile(in, out):
+ * Read the imds-proxy configuration file ${in} and write it to ${out} in
+ * compiled form, which conf_load can use without parsing it or looking up
+ * user and group names.
+ */
+int conf_compile(const char *, const char *);
+
+/**
+ * conf_load(path, binpath):
+ * If ${binpath} is not NULL, and is a compiled configuration which is up to
+ * date with the imds-proxy configuration file ${path}, use it; otherwise,
+ * read ${path}.  Return a state as conf_read does.
+ */
+struct imds_conf * conf_load(const char *, const char *);
+
 /**
  * conf_check(imdsc, path, uid, gids, ngid):
  * Check whether the specified uid/gids is allowed to make this request;
@@ -56,10 +460,496 @@ struct imds_conf * conf_read(const char *);
 int conf_check(const struct imds_conf *, const char *,
     uid_t, gid_t *, size_t);
 
+/**
+ * conf_explain(imdsc, path, uid, gids, ngid, rnum):
+ * Check whether the specified uid/gids is allowed to make this request as
+ * conf_check does, but without using or remembering earlier decisions or
+ * counting it in the statistics logged by conf_stats_log; and return via
+ * ${rnum} the number (starting from 0) of the access rule which decided, or
+ * NORULE if no access rule matched.
+ */
+int conf_explain(const struct imds_conf *, const char *,
+    uid_t, gid_t *, size_t, size_t *);
+
+/**
+ * conf_cache(imdsc, path, ttl, stale):
+ * Return via ${ttl} the number of seconds for which responses to requests
+ * for ${path} may be cached, and via ${stale} the number of seconds after
+ * that for which they may be served if the IMDS is failing.
+ */
+void conf_cache(const struct imds_conf *, const char *, int *, int *);
+
+/**
+ * conf_pace(imdsc, rate, burst):
+ * Return via ${rate} the maximum number of requests per second which should
+ * be sent to the IMDS, and via ${burst} the number which may be sent at
+ * once; or zero for both if requests should not be paced.
+ */
+void conf_pace(const struct imds_conf *, int *, int *);
+
+/**
+ * conf_priority(imdsc, uid, gids, ngid):
+ * Return the priority class (PRIO_*) of requests from the specified uid/gids.
+ */
+int conf_priority(const struct imds_conf *, uid_t, gid_t *, size_t);
+
+/**
+ * conf_limit(imdsc, uid, gids, ngid, lim):
+ * If requests from the specified uid/gids are subject to a rate limit, return
+ * it via ${lim} and return nonzero; otherwise, return zero.
+ */
+int conf_limit(const struct imds_conf *, uid_t, gid_t *, size_t,
+    struct limit *);
+
+/**
+ * limiter_init(void):
+ * Create a set of per-principal rate limits.
+ */
+struct limiter * limiter_init(void);
+
+/**
+ * limiter_check(L, lim):
+ * Take a token from the bucket in ${L} for the principal to which the limit
+ * ${lim} applies.  Return 1 if the request may go ahead, zero if it should
+ * be refused, or -1 on error.
+ */
+int limiter_check(struct limiter *, const struct limit *);
+
+/**
+ * limiter_stats_log(L):
+ * Log the number of requests allowed and refused for each principal in ${L}.
+ */
+void limiter_stats_log(struct limiter *);
+
+/**
+ * limiter_free(L):
+ * Free the rate limiter ${L}.
+ */
+void limiter_free(struct limiter *);
+
+/**
+ * shed_init(maxinflight, maxqage, maxlatency):
+ * Create a load-shedding state which sheds requests while ${maxinflight}
+ * are already in flight, connections have waited more than
+ * ${maxqage} seconds for a worker, or the IMDS has recently been taking
+ * more than ${maxlatency} seconds to respond.  Zero disables a threshold.
+ */
+struct shed * shed_init(size_t, double, double);
+
+/**
+ * shed_check(SH, qage):
+ * Return nonzero if a request which has waited ${qage} seconds to be
+ * handled should be refused in order to shed load, per ${SH}.
+ */
+int shed_check(struct shed *, double);
+
+/**
+ * shed_start(SH):
+ * Record in ${SH} that a request is in flight.
+ */
+void shed_start(struct shed *);
+
+/**
+ * shed_finish(SH):
+ * Record in ${SH} that a request passed to shed_start is no longer in
+ * flight.
+ */
+void shed_finish(struct shed *);
+
+/**
+ * shed_latency(SH, t_start):
+ * Record in ${SH} that a request which was sent to the IMDS at ${t_start}
+ * has just finished (successfully or otherwise).
+ */
+void shed_latency(struct shed *, const struct timeval *);
+
+/**
+ * shed_stats_log(SH):
+ * Log statistics about the load and the requests shed per ${SH}.
+ */
+void shed_stats_log(struct shed *);
+
+/**
+ * shed_free(SH):
+ * Free the load-shedding state ${SH}.
+ */
+void shed_free(struct shed *);
+
+/**
+ * conf_deadline(imdsc, stage):
+ * Return the number of seconds allowed for the stage ${stage} (one of the
+ * DEADLINE_* values) of handling a request, or zero if there is no limit.
+ */
+int conf_deadline(const struct imds_conf *, int);
+
+/**
+ * deadline_init(reap):
+ * Create a state for tracking deadlines.  If ${reap} is non-zero, spawn a
+ * thread which enforces the deadlines passed to deadline_set.
+ */
+struct deadlines * deadline_init(int);
+
+/**
+ * deadline_set(DL, s1, s2, stage, secs):
+ * In ${secs} seconds, shut down the socket ${s1} and, unless it is -1, the
+ * socket ${s2}, and record a timeout in the stage ${stage}.  Return a
+ * deadline which must be passed to deadline_clear before the sockets are
+ * closed.
+ */
+struct deadline * deadline_set(struct deadlines *, int, int, int, double);
+
+/**
+ * deadline_extend(DL, D, secs):
+ * Move the deadline ${D} to ${secs} seconds from now, unless it has already
+ * passed; ${secs} must be no less than the value used to set it.
+ */
+void deadline_extend(struct deadlines *, struct deadline *, double);
+
+/**
+ * deadline_clear(DL, D):
+ * Cancel the deadline ${D} and free it.  Return non-zero if it had already
+ * passed.
+ */
+int deadline_clear(struct deadlines *, struct deadline *);
+
+/**
+ * deadline_expired(DL, stage):
+ * Record in ${DL} that a deadline (which was not set via deadline_set) in
+ * the stage ${stage} has passed.
+ */
+void deadline_expired(struct deadlines *, int);
+
+/**
+ * deadline_stats_log(DL):
+ * Log the number of deadlines in each stage which have passed.
+ */
+void deadline_stats_log(struct deadlines *);
+
+/**
+ * pacer_init(rate, burst):
+ * Create a pacer which allows up to ${rate} requests per second to be sent
+ * to the IMDS, with bursts of up to ${burst} requests.
+ */
+struct pacer * pacer_init(int, int);
+
+/**
+ * pacer_enqueue(PC, uid, prio, callback, cookie, handle):
+ * If a request from ${uid} in priority class ${prio} can be sent now, return
+ * 1.  Otherwise, queue it, return zero, and call ${callback}(${cookie}) from
+ * the events loop once it can be sent; the handle returned via ${handle} may
+ * be passed to pacer_cancel before then.  Return -1 on error.
+ */
+int pacer_enqueue(struct pacer *, uid_t, int, int (*)(void *), void *,
+    void **);
+
+/**
+ * pacer_cancel(PC, handle):
+ * Cancel the queued request which returned ${handle} from pacer_enqueue.
+ */
+void pacer_cancel(struct pacer *, void *);
+
+/**
+ * pacer_wait(PC, uid, prio):
+ * Block until a request from ${uid} in priority class ${prio} can be sent.
+ */
+int pacer_wait(struct pacer *, uid_t, int);
+
+/**
+ * pacer_stats_log(PC):
+ * Log statistics about the pacer ${PC}, including histograms of queue
+ * depths and waiting times.
+ */
+void pacer_stats_log(struct pacer *);
+
+/**
+ * pacer_free(PC):
+ * Free the pacer ${PC}, which must have no requests queued.
+ */
+void pacer_free(struct pacer *);
+
+/**
+ * fnv_hash(h, buf, len):
+ * Continue the FNV-1a hash ${h} (FNV_INIT for a new hash) over the ${len}
+ * bytes at ${buf}, and return the result.
+ */
+uint32_t fnv_hash(uint32_t, const void *, size_t);
+
+/**
+ * fnv_hash_str(h, s):
+ * Continue the FNV-1a hash ${h} (FNV_INIT for a new hash) over the string
+ * ${s}, not including its terminating NUL, and return the result.
+ */
+uint32_t fnv_hash_str(uint32_t, const char *);
+
+/**
+ * cache_init(maxmem):
+ * Create a cache of IMDS responses which uses at most ${maxmem} bytes.
+ */
+struct cache * cache_init(size_t);
+
+/**
+ * cache_get(C, key, stale, buf, len):
+ * Look in the cache ${C} for a response to the request ${key} which has not
+ * expired or, if ${stale} is non-zero, which is still within its stale
+ * period.  If one is found, return 1 and a malloced copy of the response via
+ * ${buf} and ${len}; otherwise, return 0.  Return -1 on error.
+ */
+int cache_get(struct cache *, const char *, int, uint8_t **, size_t *);
+
+/**
+ * cache_put(C, key, buf, len, ttl, stale):
+ * Store the ${len}-byte response ${buf} to the request ${key} in the cache
+ * ${C} for ${ttl} seconds, plus a further ${stale} seconds during which it
+ * may be returned by cache_get with ${stale} non-zero.  Evict the least
+ * recently used responses if necessary to keep within the memory limit.
+ */
+int cache_put(struct cache *, const char *, const uint8_t *, size_t, int,
+    int);
+
+/**
+ * cache_stats_log(C):
+ * Log statistics about the cache ${C}.
+ */
+void cache_stats_log(struct cache *);
+
+/**
+ * cache_free(C):
+ * Free the cache ${C}.
+ */
+void cache_free(struct cache *);
+
+/**
+ * flight_init(void):
+ * Create a table of requests in flight to the IMDS.
+ */
+struct flights * flight_init(void);
+
+/**
+ * flight_join(F, key, callback, cookie, handle):
+ * If no request for ${key} is in flight in ${F}, record that one now is and
+ * return 1; the caller must make the request and then call flight_done with
+ * the handle returned via ${handle}.  Otherwise, arrange for
+ * ${callback}(${cookie}, buf, len) to be called with the response (or with
+ * ${buf} NULL if the request could not be shared) once the request is done
+ * and return zero; the handle returned via ${handle} may be passed to
+ * flight_cancel before then.  Return -1 on error.
+ */
+int flight_join(struct flights *, const char *,
+    int (*)(void *, const uint8_t *, size_t), void *, void **);
+
+/**
+ * flight_cancel(F, handle):
+ * Stop waiting for the request which returned ${handle} from flight_join.
+ */
+void flight_cancel(struct flights *, void *);
+
+/**
+ * flight_done(F, handle, buf, len):
+ * The request which made the caller the leader via flight_join (returning
+ * ${handle}) is done; hand the ${len}-byte response ${buf} to any waiters,
+ * or tell them to make the request themselves if ${buf} is NULL.  Return
+ * nonzero if any of the waiters' callbacks failed.
+ */
+int flight_done(struct flights *, void *, const uint8_t *, size_t);
+
+/**
+ * flight_release(F, handle):
+ * If nobody is waiting for the request which made the caller the leader via
+ * flight_join (returning ${handle}), finish it as flight_done would and
+ * return 1; later requests for the same key will be made afresh.  Otherwise
+ * return zero, and the caller must call flight_done as usual.  Return -1 on
+ * error.
+ */
+int flight_release(struct flights *, void *);
+
+/**
+ * flight_wait(F, key, handle, buf, len):
+ * As flight_join, but if a request for ${key} is already in flight, block
+ * until it is done and return a malloced copy of the response via ${buf}
+ * and ${len} (or NULL if the caller must make the request itself).
+ */
+int flight_wait(struct flights *, const char *, void **, uint8_t **,
+    size_t *);
+
+/**
+ * flight_stats_log(F):
+ * Log statistics about the coalescing of requests in ${F}.
+ */
+void flight_stats_log(struct flights *);
+
+/**
+ * flight_free(F):
+ * Free the table ${F}, which must have no requests in flight.
+ */
+void flight_free(struct flights *);
+
+/**
+ * pathtrie_init(prefixes, n):
+ * Compile the ${n} path prefixes ${prefixes} (in which a "*" component
+ * matches any one path component) into a trie.  The prefixes must remain
+ * valid until the trie is freed.
+ */
+struct pathtrie * pathtrie_init(char * const *, size_t);
+
+/**
+ * pathtrie_match(PT, path, filter, cookie, num):
+ * Find the highest-numbered prefix in ${PT} which matches ${path} and for
+ * which ${filter}(${cookie}, num) is non-zero (or any, if ${filter} is
+ * NULL).  Return its number via ${num} and return 1, or return 0 if there
+ * is no such prefix.
+ */
+int pathtrie_match(const struct pathtrie *, const char *,
+    int (*)(void *, size_t), void *, size_t *);
+
+/**
+ * pathtrie_free(PT):
+ * Free the trie ${PT}.
+ */
+void pathtrie_free(struct pathtrie *);
+
+/**
+ * princache_canon(gids, ngid):
+ * Sort the ${ngid} gids ${gids} and remove duplicates, so that the same set
+ * of gids is the same however it was listed; return the number remaining.
+ */
+size_t princache_canon(gid_t *, size_t);
+
+/**
+ * princache_init(max, build, vfree, cookie):
+ * Create a cache of up to ${max} values, each for a principal (a uid and a
+ * set of gids), which are created by ${build}(${cookie}, uid, gids, ngid)
+ * (where the gids are sorted and distinct) and freed by ${vfree}(value).
+ */
+struct princache * princache_init(size_t,
+    void * (*)(void *, uid_t, const gid_t *, size_t), void (*)(void *),
+    void *);
+
+/**
+ * princache_get(PC, uid, gids, ngid, handle):
+ * Return the value in ${PC} for the principal ${uid}/${gids}, building it
+ * if necessary, or NULL on error.  Return via ${handle} a handle which must
+ * be passed to princache_release once the caller is done with the value.
+ * This may be called by several threads at once.
+ */
+void * princache_get(struct princache *, uid_t, const gid_t *, size_t,
+    void **);
+
+/**
+ * princache_release(PC, handle):
+ * Release the value for which ${handle} was returned by princache_get.
+ */
+void princache_release(struct princache *, void *);
+
+/**
+ * princache_free(PC):
+ * Free the cache ${PC} and its values, none of which may be in use.
+ */
+void princache_free(struct princache *);
+
+/**
+ * decisions_init(max):
+ * Create a cache of up to ${max} decisions about whether uid/gids may
+ * request paths.
+ */
+struct decisions * decisions_init(size_t);
+
+/**
+ * decisions_get(D, uid, gids, ngid, path, rnum):
+ * If ${D} holds a decision about whether ${uid}/${gids} may request ${path},
+ * return it (nonzero if allowed) and return via ${rnum} the number of the
+ * rule which made it; otherwise, return -1.
+ */
+int decisions_get(struct decisions *, uid_t, const gid_t *, size_t,
+    const char *, size_t *);
+
+/**
+ * decisions_put(D, uid, gids, ngid, path, allow, rnum):
+ * Record in ${D} the decision ${allow}, made by rule number ${rnum}, about
+ * whether ${uid}/${gids} may request ${path}, replacing an older decision if
+ * necessary.
+ */
+int decisions_put(struct decisions *, uid_t, const gid_t *, size_t,
+    const char *, int, size_t);
+
+/**
+ * decisions_stats_log(D):
+ * Log statistics about the decision cache ${D}.
+ */
+void decisions_stats_log(struct decisions *);
+
+/**
+ * decisions_free(D):
+ * Free the decision cache ${D}.
+ */
+void decisions_free(struct decisions *);
+
+/**
+ * conf_nrules(imdsc):
+ * Return the number of rules of all kinds in ${imdsc}.
+ */
+size_t conf_nrules(const struct imds_conf *);
+
+/**
+ * conf_names(imdsc, nnames, t):
+ * Return via ${nnames} the number of user and group names which were looked
+ * up when ${imdsc} was read, and via ${t} the number of seconds this took.
+ */
+void conf_names(const struct imds_conf *, size_t *, double *);
+
+/**
+ * conf_stats_log(imdsc):
+ * Log statistics about access decisions made using ${imdsc}, and about how
+ * often each access rule was examined, matched, and decided a request.
+ */
+void conf_stats_log(const struct imds_conf *);
+
 /**
  * conf_free(imdsc):
  * Free the configuration state ${imdsc}.
  */
 void conf_free(struct imds_conf *);
 
+/**
+ * ruleset_init(path, binpath):
+ * Load the imds-proxy configuration file ${path} (using the compiled
+ * configuration ${binpath}, if not NULL, as conf_load does), and prepare to
+ * load it again when asked to.
+ */
+struct ruleset * ruleset_init(const char *, const char *);
+
+/**
+ * ruleset_get(RS, ref):
+ * Return the current configuration in ${RS}, and via ${ref} a reference
+ * which must be passed to ruleset_put (or ruleset_refresh) once the caller
+ * is done with it.  This may be called by several threads at once.
+ */
+const struct imds_conf * ruleset_get(struct ruleset *, void **);
+
+/**
+ * ruleset_put(RS, ref):
+ * Release the reference ${ref} returned by ruleset_get.
+ */
+void ruleset_put(struct ruleset *, void *);
+
+/**
+ * ruleset_refresh(RS, ref):
+ * If the configuration for which ${*ref} is a reference is no longer the
+ * current configuration in ${RS}, release it and replace ${*ref} with a
+ * reference to the current one.  Return the configuration ${*ref} is for.
+ */
+const struct imds_conf * ruleset_refresh(struct ruleset *, void **);
+
+/**
+ * ruleset_reload(RS):
+ * Load the configuration again, and make it the current configuration in
+ * ${RS}.  If it can't be read, keep using the current configuration.
+ */
+int ruleset_reload(struct ruleset *);
+
+/**
+ * ruleset_free(RS):
+ * Free ${RS} and its current configuration, which must not be in use.
+ */
+void ruleset_free(struct ruleset *);
+
 #endif /* !IMDS_PROXY_H */
@@ -0,0 +1,257 @@
+#include <sys/time.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Each principal (a user, or a group whose members share a limit) which is
+ * subject to a Limit rule has a token bucket; requests which arrive when
+ * the bucket is empty are refused.  The buckets live in an open-addressed
+ * hash table, since there are typically only a handful of them and we look
+ * one up for every request.
+ */
+
+/* Initial number of slots in the hash table; must be a power of two. */
+#define NSLOTS_INIT 64
+
+/* A token bucket for one principal. */
+struct bucket {
+	double tokens;
+	double t_last;
+	uint64_t nallowed;
+	uint64_t nthrottled;
+	id_t id;
+	int type;
+	int used;
+};
+
+/* Rate limiter. */
+struct limiter {
+	pthread_mutex_t mtx;
+	struct bucket * slots;
+	size_t nslots;
+	size_t nused;
+};
+
+/* Return the current time in seconds, or -1 on failure. */
+static double
+now(void)
+{
+	struct timeval tv;
+
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		return (-1.0);
+	}
+	return ((double)tv.tv_sec + (double)tv.tv_usec * 0.000001);
+}
+
+/* Return the slot in which the bucket for ${type}/${id} is or should be. */
+static struct bucket *
+findslot(struct bucket * slots, size_t nslots, int type, id_t id)
+{
+	size_t i;
+
+	/* Linear probing from the hashed position. */
+	i = ((size_t)id * 2654435761U + (size_t)type) & (nslots - 1);
+	while (slots[i].used &&
+	    ((slots[i].type != type) || (slots[i].id != id)))
+		i = (i + 1) & (nslots - 1);
+	return (&slots[i]);
+}
+
+/* Double the size of the hash table. */
+static int
+grow(struct limiter * L)
+{
+	struct bucket * slots;
+	size_t nslots = L->nslots * 2;
+	size_t i;
+
+	/* Allocate a new table. */
+	if ((slots = calloc(nslots, sizeof(struct bucket))) == NULL)
+		return (-1);
+
+	/* Move the buckets over. */
+	for (i = 0; i < L->nslots; i++) {
+		if (L->slots[i].used)
+			*findslot(slots, nslots, L->slots[i].type,
+			    L->slots[i].id) = L->slots[i];
+	}
+
+	/* Replace the old table. */
+	free(L->slots);
+	L->slots = slots;
+	L->nslots = nslots;
+
+	/* Success! */
+	return (0);
+}
+
+/**
+ * limiter_init(void):
+ * Create a set of per-principal rate limits.
+ */
+struct limiter *
+limiter_init(void)
+{
+	struct limiter * L;
+	int rc;
+
+	/* Allocate a structure and an empty hash table. */
+	if ((L = malloc(sizeof(struct limiter))) == NULL)
+		goto err0;
+	if ((L->slots = calloc(NSLOTS_INIT, sizeof(struct bucket))) == NULL)
+		goto err1;
+	L->nslots = NSLOTS_INIT;
+	L->nused = 0;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&L->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+
+	/* Success! */
+	return (L);
+
+err2:
+	free(L->slots);
+err1:
+	free(L);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * limiter_check(L, lim):
+ * Take a token from the bucket in ${L} for the principal to which the limit
+ * ${lim} applies.  Return 1 if the request may go ahead, zero if it should
+ * be refused, or -1 on error.
+ */
+int
+limiter_check(struct limiter * L, const struct limit * lim)
+{
+	struct bucket * B;
+	double t;
+	int allowed;
+	int rc;
+
+	/* Find out what time it is. */
+	if ((t = now()) < 0)
+		goto err0;
+
+	/* Lock the limiter. */
+	if ((rc = pthread_mutex_lock(&L->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Keep the table no more than 3/4 full. */
+	if (((L->nused + 1) * 4 > L->nslots * 3) && grow(L))
+		goto err1;
+
+	/* Find the bucket, creating a full one if necessary. */
+	B = findslot(L->slots, L->nslots, lim->type, lim->id);
+	if (!B->used) {
+		B->used = 1;
+		B->type = lim->type;
+		B->id = lim->id;
+		B->tokens = lim->burst;
+		B->t_last = t;
+		B->nallowed = 0;
+		B->nthrottled = 0;
+		L->nused++;
+	}
+
+	/* Add tokens for the time since we last looked. */
+	B->tokens += (t - B->t_last) * lim->rate;
+	if (B->tokens > lim->burst)
+		B->tokens = lim->burst;
+	B->t_last = t;
+
+	/* Take a token if there is one. */
+	if (B->tokens >= 1.0) {
+		B->tokens -= 1.0;
+		B->nallowed++;
+		allowed = 1;
+	} else {
+		B->nthrottled++;
+		allowed = 0;
+	}
+
+	/* Unlock the limiter. */
+	if ((rc = pthread_mutex_unlock(&L->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Return the verdict. */
+	return (allowed);
+
+err1:
+	pthread_mutex_unlock(&L->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * limiter_stats_log(L):
+ * Log the number of requests allowed and refused for each principal in ${L}.
+ */
+void
+limiter_stats_log(struct limiter * L)
+{
+	size_t i;
+	int rc;
+
+	/* Lock the limiter. */
+	if ((rc = pthread_mutex_lock(&L->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log each principal. */
+	for (i = 0; i < L->nslots; i++) {
+		if (!L->slots[i].used)
+			continue;
+		syslog(LOG_INFO, "imds-proxy: limit: %s %ju: "
+		    "%ju allowed, %ju throttled",
+		    (L->slots[i].type == LIMIT_GID) ? "group" : "user",
+		    (uintmax_t)L->slots[i].id,
+		    (uintmax_t)L->slots[i].nallowed,
+		    (uintmax_t)L->slots[i].nthrottled);
+	}
+
+	/* Unlock the limiter. */
+	if ((rc = pthread_mutex_unlock(&L->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/**
+ * limiter_free(L):
+ * Free the rate limiter ${L}.
+ */
+void
+limiter_free(struct limiter * L)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (L == NULL)
+		return;
+
+	/* Free the mutex, the table, and the structure. */
+	pthread_mutex_destroy(&L->mtx);
+	free(L->slots);
+	free(L);
+}
@@ -1,52 +1,200 @@
+#define __BSD_VISIBLE	1	/* Needed for SO_REUSEPORT(_LB). */
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include <netinet/in.h>
 
-#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "daemonize.h"
+#include "events.h"
 #include "getopt.h"
+#include "parsenum.h"
 #include "setuidgid.h"
 #include "sock.h"
 #include "warnp.h"
 
 #include "imds-proxy.h"
 
-/* Connection parameters. */
-struct cstate {
+/* Default number of worker threads and length of the connection queue. */
+#define NWORKERS_DEFAULT 16
+#define QLEN_DEFAULT 128
+
+/* Default number of idle connections to the IMDS to keep. */
+#define NIDLE_DEFAULT 8
+
+/* Default amount of memory to use for caching responses. */
+#define CACHEMEM_DEFAULT (1024 * 1024)
+
+/* Maximum milliseconds for the load-shedding thresholds: one hour. */
+#define SHEDMS_MAX 3600000
+
+/* Default listen backlog. */
+#define BACKLOG_DEFAULT 128
+
+/*
+ * Sharing a port between several sockets only spreads the incoming
+ * connections between them if we use SO_REUSEPORT_LB on FreeBSD; other
+ * platforms do this with SO_REUSEPORT.
+ */
+#ifdef SO_REUSEPORT_LB
+#define REUSEPORT SO_REUSEPORT_LB
+#define REUSEPORT_NAME "SO_REUSEPORT_LB"
+#else
+#define REUSEPORT SO_REUSEPORT
+#define REUSEPORT_NAME "SO_REUSEPORT"
+#endif
+
+/* Create a socket listening on 0.0.0.0:80. */
+static int
+mklistener(int backlog, int reuseport)
+{
+	struct sockaddr_in sin;
+	int one = 1;
 	int s;
-	struct sock_addr ** sas_t;
-	struct sock_addr ** sas_id;
-	struct imds_conf * imdsc;
+
+	/* Bind to 0.0.0.0:80. */
+	memset(&sin, 0, sizeof(struct sockaddr_in));
+	sin.sin_len = sizeof(struct sockaddr_in);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons(80);
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		warnp("socket");
+		goto err0;
+	}
+	/* Set SO_REUSEADDR. */
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+		warnp("setsockopt(SO_REUSEADDR)");
+		goto err1;
+	}
+	/* Allow several sockets to share the port if requested. */
+	if (reuseport &&
+	    setsockopt(s, SOL_SOCKET, REUSEPORT, &one, sizeof(one))) {
+		warnp("setsockopt(" REUSEPORT_NAME ")");
+		goto err1;
+	}
+	if (bind(s, (struct sockaddr *)&sin, sin.sin_len)) {
+		warnp("bind");
+		goto err1;
+	}
+	if (listen(s, backlog)) {
+		warnp("listen");
+		goto err1;
+	}
+
+	/* Accept connections in batches without blocking. */
+	if (fcntl(s, F_SETFL, O_NONBLOCK) == -1) {
+		warnp("Cannot make socket non-blocking");
+		goto err1;
+	}
+
+	/* Success! */
+	return (s);
+
+err1:
+	close(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Accept connections and hand them to workers until an error occurs. */
+static void *
+acceptthread(void * cookie)
+{
+	struct workers * W = cookie;
+
+	/* Accept connections. */
+	workers_accept(W);
+
+	/* We can't clean up while worker threads are running; just exit. */
+	exit(1);
+}
+
+/* What the signal-handling thread needs to know about. */
+struct sigstate {
+	struct workers ** Ws;
+	size_t nW;
+	struct upstream * U;
+	struct cache * C;
+	struct flights * F;
+	struct pacer * PC;
+	struct limiter * L;
+	struct shed * SH;
+	struct deadlines * DL;
+	struct identd * ID;
+	struct ruleset * RS;
 };
 
-/* Handle the connection. */
+/* Handle signals which are asking us to do something. */
 static void *
-handleconn(void * cookie)
+sigthread(void * cookie)
 {
-	struct cstate * cs = cookie;
+	struct sigstate * S = cookie;
+	const struct imds_conf * imdsc;
+	sigset_t set;
+	void * ref;
+	size_t i;
+	int sig;
+	int rc;
+
+	/* We're waiting for SIGUSR1 or SIGHUP. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGHUP);
+
+	do {
+		/* Wait for a signal. */
+		if ((rc = sigwait(&set, &sig)) != 0) {
+			warn0("sigwait: %s", strerror(rc));
+			exit(1);
+		}
 
-	/* Do the work for this connection. */
-	http_proxy(cs->s, cs->sas_t, cs->sas_id, cs->imdsc);
+		/* Reread the configuration; on failure, keep the old one. */
+		if (sig == SIGHUP) {
+			ruleset_reload(S->RS);
+			continue;
+		}
 
-	/* Free the state structure. */
-	free(cs);
+		/* Log statistics. */
+		for (i = 0; i < S->nW; i++)
+			workers_stats_log(S->Ws[i]);
+		upstream_stats_log(S->U);
+		relay_stats_log();
+		if (S->C != NULL)
+			cache_stats_log(S->C);
+		flight_stats_log(S->F);
+		if (S->PC != NULL)
+			pacer_stats_log(S->PC);
+		limiter_stats_log(S->L);
+		shed_stats_log(S->SH);
+		deadline_stats_log(S->DL);
+		ident_stats_log(S->ID);
+		imdsc = ruleset_get(S->RS, &ref);
+		conf_stats_log(imdsc);
+		ruleset_put(S->RS, ref);
+	} while (1);
 
-	/* We're done. */
-	return (NULL);
+	/* NOTREACHED */
 }
 
 static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: imds-proxy [-f <conffile>] [-p <pidfile>]\n"
-	    "    [-u <user> | <:group> | <user:group>]\n");
+	fprintf(stderr, "usage: imds-proxy "
+	    "[-e | [-l <nlisteners>] [-w <nworkers>] [-q <qlen>]]\n"
+	    "    [-b <backlog>] [-f <conffile>] [-c <compiledconf>]\n"
+	    "    [-k <nidle>] [-m <cachemem>]\n"
+	    "    [-p <pidfile>] [-u <user> | <:group> | <user:group>]\n"
+	    "    [-s <maxinflight>] [-a <maxqueuems>] [-t <maxlatencyms>]\n"
+	    "       imds-proxy --compile-conf <conffile> <compiledconf>\n");
 	exit(1);
 }
 
@@ -55,41 +203,163 @@ main(int argc, char * argv[])
 {
 	struct sock_addr ** sas_t;
 	struct sock_addr ** sas_id;
-	struct imds_conf * imdsc;
-	struct cstate * cs;
-	struct sockaddr_in sin;
+	struct ruleset * RS;
+	const struct imds_conf * imdsc;
+	struct upstream * U;
+	struct cache * C;
+	struct flights * F;
+	struct pacer * PC;
+	struct limiter * L;
+	struct shed * SH;
+	struct deadlines * DL;
+	struct identd * ID;
+	struct proxy P;
+	struct sigstate S;
+	sigset_t set;
+	void * ref;
 	const char * ch;
+	const char * opt_c = NULL;
 	const char * opt_f = NULL;
 	const char * opt_p = NULL;
 	const char * opt_u = NULL;
+	size_t opt_k = (size_t)(-1);
+	size_t opt_l = 0;
+	size_t opt_m = (size_t)(-1);
+	size_t opt_q = 0;
+	size_t opt_s = 0;
+	size_t opt_w = 0;
 	pthread_t thr;
-	int s;
+	int opt_a = 0;
+	int opt_b = 0;
+	int opt_C = 0;
+	int opt_e = 0;
+	int opt_t = 0;
+	int pace_rate, pace_burst;
+	int * ss;
+	size_t i;
 	int rc;
-	int one = 1;
 
 	WARNP_INIT;
 
 	/* Parse command line. */
 	while ((ch = GETOPT(argc, argv)) != NULL) {
 		GETOPT_SWITCH(ch) {
+		GETOPT_OPTARG("-a"):
+		GETOPT_OPTARG("--shed-queue-age"):
+			if (opt_a != 0)
+				usage();
+			if (PARSENUM(&opt_a, optarg, 1, SHEDMS_MAX)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
+		GETOPT_OPTARG("-b"):
+		GETOPT_OPTARG("--backlog"):
+			if (opt_b != 0)
+				usage();
+			if (PARSENUM(&opt_b, optarg, 1, 65535)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
+		GETOPT_OPTARG("-c"):
+		GETOPT_OPTARG("--compiled-conf"):
+			if (opt_c)
+				usage();
+			opt_c = optarg;
+			break;
+		GETOPT_OPT("--compile-conf"):
+			if (opt_C)
+				usage();
+			opt_C = 1;
+			break;
+		GETOPT_OPT("-e"):
+		GETOPT_OPT("--events"):
+			if (opt_e)
+				usage();
+			opt_e = 1;
+			break;
 		GETOPT_OPTARG("-f"):
 		GETOPT_OPTARG("--conffile"):
 			if (opt_f)
 				usage();
 			opt_f = optarg;
 			break;
+		GETOPT_OPTARG("-k"):
+		GETOPT_OPTARG("--keepalive"):
+			if (opt_k != (size_t)(-1))
+				usage();
+			if (PARSENUM(&opt_k, optarg, 0, 65536)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
+		GETOPT_OPTARG("-l"):
+		GETOPT_OPTARG("--listeners"):
+			if (opt_l != 0)
+				usage();
+			if (PARSENUM(&opt_l, optarg, 1, 1024)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
+		GETOPT_OPTARG("-m"):
+		GETOPT_OPTARG("--cache-memory"):
+			if (opt_m != (size_t)(-1))
+				usage();
+			if (PARSENUM(&opt_m, optarg, 0, SIZE_MAX / 2)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
 		GETOPT_OPTARG("-p"):
 		GETOPT_OPTARG("--pidfile"):
 			if (opt_p)
 				usage();
 			opt_p = optarg;
 			break;
+		GETOPT_OPTARG("-q"):
+		GETOPT_OPTARG("--queue"):
+			if (opt_q != 0)
+				usage();
+			if (PARSENUM(&opt_q, optarg, 1, SIZE_MAX / 64)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
+		GETOPT_OPTARG("-s"):
+		GETOPT_OPTARG("--shed-inflight"):
+			if (opt_s != 0)
+				usage();
+			if (PARSENUM(&opt_s, optarg, 1, SIZE_MAX / 2)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
+		GETOPT_OPTARG("-t"):
+		GETOPT_OPTARG("--shed-latency"):
+			if (opt_t != 0)
+				usage();
+			if (PARSENUM(&opt_t, optarg, 1, SHEDMS_MAX)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
 		GETOPT_OPTARG("-u"):
 		GETOPT_OPTARG("--uidgid"):
 			if (opt_u)
 				usage();
 			opt_u = optarg;
 			break;
+		GETOPT_OPTARG("-w"):
+		GETOPT_OPTARG("--workers"):
+			if (opt_w != 0)
+				usage();
+			if (PARSENUM(&opt_w, optarg, 1, 65536)) {
+				warnp("Invalid option: %s %s", ch, optarg);
+				exit(1);
+			}
+			break;
 		GETOPT_MISSING_ARG:
 			warn0("Missing argument to %s", ch);
 			usage();
@@ -99,10 +369,54 @@ main(int argc, char * argv[])
 		}
 	}
 
+	/* Compile a configuration file, if that's all we're asked to do. */
+	if (opt_C) {
+		if (argc - optind != 2)
+			usage();
+		if (conf_compile(argv[optind], argv[optind + 1]))
+			exit(1);
+		exit(0);
+	}
+
 	/* Check for unused arguments. */
 	if (argc > optind)
 		usage();
 
+	/*
+	 * Acceptor threads and the worker pools (and hence their queues)
+	 * aren't used in events mode; and since the events loop can only run
+	 * in one thread, events mode has a single listening socket.
+	 */
+	if (opt_e &&
+	    ((opt_l != 0) || (opt_w != 0) || (opt_q != 0) || (opt_a != 0)))
+		usage();
+
+	/*
+	 * Default listener and worker pool parameters.  The workers and the
+	 * queue are divided between the listening sockets, each of which has
+	 * its own pool; so each needs at least one worker and queue slot.
+	 */
+	if (opt_b == 0)
+		opt_b = BACKLOG_DEFAULT;
+	if (opt_l == 0)
+		opt_l = 1;
+	if (opt_w == 0)
+		opt_w = (opt_l > NWORKERS_DEFAULT) ? opt_l : NWORKERS_DEFAULT;
+	if (opt_q == 0)
+		opt_q = (opt_l > QLEN_DEFAULT) ? opt_l : QLEN_DEFAULT;
+	if ((opt_w < opt_l) || (opt_q < opt_l)) {
+		warn0("Each listener needs at least one worker and queue slot");
+		usage();
+	}
+
+	/* Default number of idle IMDS connections. */
+	if (opt_k == (size_t)(-1))
+		opt_k = NIDLE_DEFAULT;
+
+	/* Default cache size. */
+	if (opt_m == (size_t)(-1))
+		opt_m = CACHEMEM_DEFAULT;
+
 	/* Default configuration file. */
 	if (opt_f == NULL)
 		opt_f = "/usr/local/etc/imds.conf";
@@ -124,85 +438,217 @@ main(int argc, char * argv[])
 	}
 
 	/* Read the configuration file. */
-	if ((imdsc = conf_read(opt_f)) == NULL) {
+	if ((RS = ruleset_init(opt_f, opt_c)) == NULL) {
 		warnp("Could not read configuration file: %s", opt_f);
 		goto err2;
 	}
 
-	/* Bind to 0.0.0.0:80 and accept connections. */
-	memset(&sin, 0, sizeof(struct sockaddr_in));
-	sin.sin_len = sizeof(struct sockaddr_in);
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(80);
-	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		warnp("socket");
+	/* Create a pool for idle connections to the IMDS. */
+	if ((U = upstream_init(opt_k)) == NULL) {
+		warnp("upstream_init");
 		goto err3;
 	}
-	/* Set SO_REUSEADDR. */
-	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
-		warnp("setsockopt(SO_REUSEADDR)");
+
+	/* Create a response cache, unless caching is disabled. */
+	C = NULL;
+	if ((opt_m > 0) && ((C = cache_init(opt_m)) == NULL)) {
+		warnp("cache_init");
 		goto err4;
 	}
-	if (bind(s, (struct sockaddr *)&sin, sin.sin_len)) {
-		warnp("bind");
-		goto err4;
+
+	/* Create a table for coalescing identical requests. */
+	if ((F = flight_init()) == NULL) {
+		warnp("flight_init");
+		goto err5;
 	}
-	if (listen(s, 10)) {
-		warnp("listen");
-		goto err4;
+
+	/* Create a pacer for requests to the IMDS, if configured. */
+	PC = NULL;
+	imdsc = ruleset_get(RS, &ref);
+	conf_pace(imdsc, &pace_rate, &pace_burst);
+	ruleset_put(RS, ref);
+	if ((pace_rate > 0) &&
+	    ((PC = pacer_init(pace_rate, pace_burst)) == NULL)) {
+		warnp("pacer_init");
+		goto err6;
+	}
+
+	/* Create a table of per-principal rate limits. */
+	if ((L = limiter_init()) == NULL) {
+		warnp("limiter_init");
+		goto err7;
+	}
+
+	/* Create a load-shedding state; thresholds are off by default. */
+	if ((SH = shed_init(opt_s, opt_a * 0.001, opt_t * 0.001)) == NULL) {
+		warnp("shed_init");
+		goto err8;
+	}
+
+	/* Prepare to query the ident service over persistent channels. */
+	if ((ID = ident_init(sas_id, opt_e ? 0 : opt_w,
+	    "/var/run/imds-creds")) == NULL) {
+		warnp("ident_init");
+		goto err9;
+	}
+
+	/* Record what we need for handling connections. */
+	P.dst = sas_t;
+	P.ID = ID;
+	P.RS = RS;
+	P.imdsc = NULL;
+	P.U = U;
+	P.C = C;
+	P.F = F;
+	P.PC = PC;
+	P.L = L;
+	P.SH = SH;
+
+	/*
+	 * Bind to 0.0.0.0:80 and accept connections; if we have more than one
+	 * listening socket they share the port and the kernel spreads incoming
+	 * connections between them.
+	 */
+	if ((ss = malloc(opt_l * sizeof(int))) == NULL)
+		goto err10;
+	for (i = 0; i < opt_l; i++) {
+		if ((ss[i] = mklistener(opt_b, opt_l > 1)) == -1)
+			goto err11;
 	}
 
 	/* Daemonize. */
 	if (daemonize(opt_p)) {
 		warnp("daemonize");
-		goto err4;
+		goto err12;
 	}
 
 	/* Drop privileges (if applicable). */
 	if (opt_u && setuidgid(opt_u, SETUIDGID_SGROUP_LEAVE_WARN)) {
 		warnp("Failed to drop privileges");
-		goto err4;
+		goto err12;
 	}
 
-	/* Accept connections until an error occurs. */
-	do {
-		if ((cs = malloc(sizeof(struct cstate))) == NULL) {
+	/*
+	 * Block SIGUSR1 and SIGHUP before we spawn any threads, so that they
+	 * are only delivered to the thread which handles them.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGHUP);
+	if ((rc = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0) {
+		warn0("pthread_sigmask: %s", strerror(rc));
+		goto err12;
+	}
+
+	/*
+	 * Writing to a connection which the IMDS (or a client) has closed
+	 * should fail with EPIPE rather than killing us.
+	 */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		warnp("signal(SIGPIPE)");
+		goto err12;
+	}
+
+	/*
+	 * Keep track of deadlines; in thread mode, spawn a thread to enforce
+	 * them.  In events mode they're enforced by timers.
+	 */
+	if ((DL = deadline_init(!opt_e)) == NULL) {
+		warnp("Failed to initialize deadlines");
+		goto die;
+	}
+	P.DL = DL;
+
+	/* Spawn worker threads for each listener, unless in events mode. */
+	S.Ws = NULL;
+	S.nW = 0;
+	S.U = U;
+	S.C = C;
+	S.F = F;
+	S.PC = PC;
+	S.L = L;
+	S.SH = SH;
+	S.DL = DL;
+	S.ID = ID;
+	S.RS = RS;
+	if (!opt_e) {
+		if ((S.Ws = malloc(opt_l * sizeof(struct workers *))) == NULL) {
 			warnp("malloc");
 			goto die;
 		}
-		while ((cs->s = accept(s, NULL, NULL)) == -1) {
-			if (errno == EINTR)
-				continue;
-			warnp("accept");
-			goto die;
+		for (i = 0; i < opt_l; i++) {
+			if ((S.Ws[i] = workers_init(i, ss[i],
+			    opt_w / opt_l + (i < opt_w % opt_l),
+			    opt_q / opt_l + (i < opt_q % opt_l), &P)) == NULL) {
+				warnp("Failed to start worker threads");
+				goto die;
+			}
+			S.nW++;
 		}
-		cs->sas_t = sas_t;
-		cs->sas_id = sas_id;
-		cs->imdsc = imdsc;
-		if ((rc = pthread_create(&thr, NULL, handleconn, cs)) != 0) {
+	}
+
+	/* Spawn a thread to log statistics upon receipt of SIGUSR1. */
+	if ((rc = pthread_create(&thr, NULL, sigthread, &S)) != 0) {
+		warn0("pthread_create: %s", strerror(rc));
+		goto die;
+	}
+
+	/* In events mode, handle connections until an error occurs. */
+	if (opt_e) {
+		if (evproxy_listen(ss[0], &P))
+			goto die;
+		do {
+			if (events_run()) {
+				warnp("Error in event loop");
+				goto die;
+			}
+		} while (1);
+	}
+
+	/* Start a thread accepting connections for each pool but the first. */
+	for (i = 1; i < opt_l; i++) {
+		if ((rc = pthread_create(&thr, NULL, acceptthread,
+		    S.Ws[i])) != 0) {
 			warn0("pthread_create: %s", strerror(rc));
 			goto die;
 		}
-	} while (1);
+	}
+
+	/* This thread accepts connections for the first pool. */
+	acceptthread(S.Ws[0]);
 
 	/* NOTREACHED */
 
 die:
 	/*-
-	 * Theoretically we might want to run
-	 * close(cs->s);
-	 * free(cs);
-	 * and then continue with other cleanup; but at this point it's
-	 * possible that threads we spawned are still running, and we need
-	 * to avoid freeing memory out from underneath them -- so instead
-	 * we just exit without worrying about cleaning up.
+	 * Theoretically we might want to continue with other cleanup; but at
+	 * this point it's possible that threads we spawned are still running,
+	 * and we need to avoid freeing memory out from underneath them -- so
+	 * instead we just exit without worrying about cleaning up.
 	 */
 	exit(1);
+err12:
+	i = opt_l;
+err11:
+	while (i-- > 0)
+		close(ss[i]);
+	free(ss);
+err10:
+	ident_free(ID);
+err9:
+	shed_free(SH);
+err8:
+	limiter_free(L);
+err7:
+	pacer_free(PC);
+err6:
+	flight_free(F);
+err5:
+	cache_free(C);
 err4:
-	close(s);
+	upstream_free(U);
 err3:
-	conf_free(imdsc);
+	ruleset_free(RS);
 err2:
 	sock_addr_freelist(sas_id);
 err1:
@@ -0,0 +1,342 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * A configuration file often names the same users and groups in many rules,
+ * and looking a name up can be slow (e.g. if it goes to LDAP), so while we
+ * read a configuration we remember the names we've looked up.  We also keep
+ * track of how long the lookups took, so that a slow load can be blamed on
+ * the right thing.
+ *
+ * The buffer we give to getpwnam_r and getgrnam_r starts at PWBUFLEN bytes
+ * and doubles (up to PWBUFMAX) whenever it turns out to be too small, which
+ * happens for groups with many members.
+ */
+
+/* Initial and maximum buffer length for getpwnam_r and getgrnam_r. */
+#define PWBUFLEN 4096
+#define PWBUFMAX (64 * 1024 * 1024)
+
+/* Types of names. */
+#define NAME_USER 0
+#define NAME_GROUP 1
+
+/* A name, and the uid or gid it refers to. */
+struct name {
+	int type;
+	char * s;
+	size_t len;
+	id_t id;
+	uint32_t hash;
+	struct name * hnext;
+};
+
+/* Names we've looked up. */
+struct names {
+	struct name ** buckets;
+	size_t nbuckets;
+	size_t n;
+	char * buf;
+	size_t buflen;
+
+	/* Statistics. */
+	size_t nlookups;
+	double t;
+};
+
+/* Hash the name ${s} (of length ${len}) of type ${type}. */
+static uint32_t
+hash(int type, const char * s, size_t len)
+{
+
+	return (fnv_hash(fnv_hash(FNV_INIT, &type, sizeof(type)), s, len));
+}
+
+/* Double the number of hash buckets in ${N}. */
+static int
+grow(struct names * N)
+{
+	struct name ** buckets;
+	struct name * E;
+	struct name * next;
+	size_t nbuckets = N->nbuckets * 2;
+	size_t i;
+
+	/* Allocate new buckets. */
+	if ((buckets = calloc(nbuckets, sizeof(struct name *))) == NULL)
+		goto err0;
+
+	/* Move the names into them. */
+	for (i = 0; i < N->nbuckets; i++) {
+		for (E = N->buckets[i]; E != NULL; E = next) {
+			next = E->hnext;
+			E->hnext = buckets[E->hash % nbuckets];
+			buckets[E->hash % nbuckets] = E;
+		}
+	}
+
+	/* Replace the old buckets. */
+	free(N->buckets);
+	N->buckets = buckets;
+	N->nbuckets = nbuckets;
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Look up the user or group (depending on ${type}) ${s}, and return its uid
+ * or gid via ${id}; or return 1 if there's no such user or group.
+ */
+static int
+lookup(struct names * N, int type, const char * s, id_t * id)
+{
+	struct passwd pwd;
+	struct passwd * pw;
+	struct group grp;
+	struct group * gr;
+	struct timeval tv0, tv1;
+	char * buf;
+	int rc;
+
+	/* Note when we started. */
+	if (monoclock_get(&tv0)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+
+	/* Look up the name, making the buffer larger until it fits. */
+	do {
+		if (type == NAME_USER)
+			rc = getpwnam_r(s, &pwd, N->buf, N->buflen, &pw);
+		else
+			rc = getgrnam_r(s, &grp, N->buf, N->buflen, &gr);
+		if (rc != ERANGE)
+			break;
+		if (N->buflen >= PWBUFMAX)
+			break;
+		if ((buf = realloc(N->buf, N->buflen * 2)) == NULL)
+			goto err0;
+		N->buf = buf;
+		N->buflen *= 2;
+	} while (1);
+	if (rc) {
+		errno = rc;
+		warnp("%s(%s)", (type == NAME_USER) ? "getpwnam_r" :
+		    "getgrnam_r", s);
+		goto err0;
+	}
+
+	/* Count the time it took. */
+	if (monoclock_get(&tv1)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+	N->nlookups++;
+	N->t += timeval_diff(tv0, tv1);
+
+	/* Does the user or group exist? */
+	if (type == NAME_USER) {
+		if (pw == NULL)
+			goto notfound;
+		*id = pw->pw_uid;
+	} else {
+		if (gr == NULL)
+			goto notfound;
+		*id = gr->gr_gid;
+	}
+
+	/* Success! */
+	return (0);
+
+notfound:
+	warn0("%s not found: %s", (type == NAME_USER) ? "User" : "Group", s);
+	return (1);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Return via ${id} the uid or gid (depending on ${type}) of the user or
+ * group named by the ${len} bytes at ${s}.
+ */
+static int
+resolve(struct names * N, int type, const char * s, size_t len, id_t * id)
+{
+	struct name * E;
+	uint32_t h = hash(type, s, len);
+
+	/* Have we looked up this name already? */
+	for (E = N->buckets[h % N->nbuckets]; E != NULL; E = E->hnext) {
+		if ((E->hash == h) && (E->type == type) && (E->len == len) &&
+		    (memcmp(E->s, s, len) == 0)) {
+			*id = E->id;
+			return (0);
+		}
+	}
+
+	/* Make room if the hash chains are getting long. */
+	if ((N->n >= N->nbuckets) && grow(N))
+		goto err0;
+
+	/* Create an entry with a NUL-terminated copy of the name. */
+	if ((E = malloc(sizeof(struct name))) == NULL)
+		goto err0;
+	if ((E->s = malloc(len + 1)) == NULL)
+		goto err1;
+	memcpy(E->s, s, len);
+	E->s[len] = '\0';
+	E->len = len;
+	E->type = type;
+	E->hash = h;
+
+	/* Look it up. */
+	if (lookup(N, type, E->s, &E->id))
+		goto err2;
+
+	/* Remember it. */
+	E->hnext = N->buckets[h % N->nbuckets];
+	N->buckets[h % N->nbuckets] = E;
+	N->n++;
+
+	/* Return the id. */
+	*id = E->id;
+
+	/* Success! */
+	return (0);
+
+err2:
+	free(E->s);
+err1:
+	free(E);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * names_init(void):
+ * Prepare to look up user and group names, remembering the answers.
+ */
+struct names *
+names_init(void)
+{
+	struct names * N;
+
+	/* Allocate a structure. */
+	if ((N = malloc(sizeof(struct names))) == NULL)
+		goto err0;
+	N->n = 0;
+	N->nlookups = 0;
+	N->t = 0.0;
+
+	/* Allocate some hash buckets and a buffer for lookups. */
+	N->nbuckets = 64;
+	if ((N->buckets = calloc(N->nbuckets, sizeof(struct name *))) == NULL)
+		goto err1;
+	N->buflen = PWBUFLEN;
+	if ((N->buf = malloc(N->buflen)) == NULL)
+		goto err2;
+
+	/* Success! */
+	return (N);
+
+err2:
+	free(N->buckets);
+err1:
+	free(N);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * names_uid(N, s, len, uid):
+ * Return via ${uid} the uid of the user named by the ${len} bytes at ${s},
+ * looking it up unless ${N} has already done so.
+ */
+int
+names_uid(struct names * N, const char * s, size_t len, uid_t * uid)
+{
+	id_t id;
+
+	if (resolve(N, NAME_USER, s, len, &id))
+		return (-1);
+	*uid = (uid_t)id;
+	return (0);
+}
+
+/**
+ * names_gid(N, s, len, gid):
+ * Return via ${gid} the gid of the group named by the ${len} bytes at ${s},
+ * looking it up unless ${N} has already done so.
+ */
+int
+names_gid(struct names * N, const char * s, size_t len, gid_t * gid)
+{
+	id_t id;
+
+	if (resolve(N, NAME_GROUP, s, len, &id))
+		return (-1);
+	*gid = (gid_t)id;
+	return (0);
+}
+
+/**
+ * names_stats(N, nlookups, t):
+ * Return via ${nlookups} the number of names which ${N} has looked up, and
+ * via ${t} the number of seconds spent looking them up.
+ */
+void
+names_stats(struct names * N, size_t * nlookups, double * t)
+{
+
+	*nlookups = N->nlookups;
+	*t = N->t;
+}
+
+/**
+ * names_free(N):
+ * Free ${N} and the names it remembers.
+ */
+void
+names_free(struct names * N)
+{
+	struct name * E;
+	struct name * next;
+	size_t i;
+
+	/* Behave consistently with free(NULL). */
+	if (N == NULL)
+		return;
+
+	/* Free the names, the buckets, the buffer, and the structure. */
+	for (i = 0; i < N->nbuckets; i++) {
+		for (E = N->buckets[i]; E != NULL; E = next) {
+			next = E->hnext;
+			free(E->s);
+			free(E);
+		}
+	}
+	free(N->buckets);
+	free(N->buf);
+	free(N);
+}
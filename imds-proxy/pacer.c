@@ -0,0 +1,754 @@
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "events.h"
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * The IMDS throttles requests from each network interface, and once it
+ * starts doing so every process on the system sees failures.  To avoid this
+ * we pace the requests we send: a token bucket allows ${rate} requests per
+ * second with bursts of up to ${burst}, and requests which arrive when the
+ * bucket is empty wait in a queue.
+ *
+ * Each uid has its own queue within each priority class.  When a token
+ * becomes available we take a request from the highest priority class which
+ * has any waiting, and within that class we serve uids in round-robin order
+ * -- i.e., deficit round robin with every request costing one unit -- so
+ * that a single busy uid can't starve the others.
+ *
+ * A queue only exists while it has requests waiting; queues are found via a
+ * hash table keyed on uid and priority class, and empty ones are kept on a
+ * free list for reuse rather than being freed.
+ *
+ * In events mode requests are released from a timer; in thread mode the
+ * waiting threads take turns to release requests (possibly each other's).
+ */
+
+/* Number of buckets in histograms. */
+#define NHIST 12
+
+/* Number of buckets in the hash table of queues. */
+#define NBUCKETS 256
+
+/* A request waiting to be sent. */
+struct pwaiter {
+	struct pwaiter * next;
+	struct pqueue * Q;
+	int (* callback)(void *);
+	void * cookie;
+	double t_enqueue;
+	int granted;
+};
+
+/* Requests from one uid in one priority class. */
+struct pqueue {
+	struct pqueue * hnext;
+	struct pqueue * anext;
+	uid_t uid;
+	int prio;
+	int active;
+	struct pwaiter * head;
+	struct pwaiter ** tailp;
+};
+
+/* Request pacer. */
+struct pacer {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	double rate;
+	double burst;
+	double tokens;
+	double t_last;
+	struct pqueue * buckets[NBUCKETS];
+	struct pqueue * freeq;
+	struct pqueue * ahead[NPRIO];
+	struct pqueue ** atailp[NPRIO];
+	size_t depth;
+	void * timer_cookie;
+
+	/* Statistics. */
+	uint64_t nimmediate;
+	uint64_t nqueued;
+	size_t maxdepth;
+	uint64_t depthhist[NHIST];
+	uint64_t waithist[NHIST];
+};
+
+/* Forward declaration. */
+static int callback_timer(void *);
+
+/* Return the current time in seconds, or -1 on failure. */
+static double
+now(void)
+{
+	struct timeval tv;
+
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		return (-1.0);
+	}
+	return ((double)tv.tv_sec + (double)tv.tv_usec * 0.000001);
+}
+
+/* Return the histogram bucket for ${x}: 0, 1, 2-3, 4-7, ..., or more. */
+static size_t
+bucket(size_t x)
+{
+	size_t i;
+
+	for (i = 0; (x > 0) && (i < NHIST - 1); i++)
+		x >>= 1;
+	return (i);
+}
+
+/* Add tokens to the bucket for the time since we last did so. */
+static void
+refill(struct pacer * PC, double t)
+{
+
+	PC->tokens += (t - PC->t_last) * PC->rate;
+	if (PC->tokens > PC->burst)
+		PC->tokens = PC->burst;
+	PC->t_last = t;
+}
+
+/* Return the number of seconds until the next token is available. */
+static double
+delay(struct pacer * PC)
+{
+
+	if (PC->tokens >= 1.0)
+		return (0.0);
+	return ((1.0 - PC->tokens) / PC->rate);
+}
+
+/* Return the hash bucket for the queue for ${uid} in class ${prio}. */
+static struct pqueue **
+hashbucket(struct pacer * PC, uid_t uid, int prio)
+{
+	uint32_t h;
+
+	h = fnv_hash(fnv_hash(FNV_INIT, &uid, sizeof(uid_t)), &prio,
+	    sizeof(int));
+	return (&PC->buckets[h % NBUCKETS]);
+}
+
+/* Find (or create) the queue for ${uid} in class ${prio}. */
+static struct pqueue *
+getqueue(struct pacer * PC, uid_t uid, int prio)
+{
+	struct pqueue ** bp = hashbucket(PC, uid, prio);
+	struct pqueue * Q;
+
+	/* Look for an existing queue. */
+	for (Q = *bp; Q != NULL; Q = Q->hnext) {
+		if ((Q->uid == uid) && (Q->prio == prio))
+			return (Q);
+	}
+
+	/* Reuse an empty queue if we have one; otherwise create a new one. */
+	if ((Q = PC->freeq) != NULL)
+		PC->freeq = Q->hnext;
+	else if ((Q = malloc(sizeof(struct pqueue))) == NULL)
+		return (NULL);
+	Q->uid = uid;
+	Q->prio = prio;
+	Q->active = 0;
+	Q->head = NULL;
+	Q->tailp = &Q->head;
+	Q->hnext = *bp;
+	*bp = Q;
+
+	/* Success! */
+	return (Q);
+}
+
+/* Move the empty queue ${Q} from the hash table to the free list. */
+static void
+putqueue(struct pacer * PC, struct pqueue * Q)
+{
+	struct pqueue ** qp;
+
+	for (qp = hashbucket(PC, Q->uid, Q->prio); *qp != Q;
+	    qp = &(*qp)->hnext)
+		continue;
+	*qp = Q->hnext;
+	Q->hnext = PC->freeq;
+	PC->freeq = Q;
+}
+
+/* Add ${Q} to the end of the list of queues with requests waiting. */
+static void
+activate(struct pacer * PC, struct pqueue * Q)
+{
+
+	Q->anext = NULL;
+	*PC->atailp[Q->prio] = Q;
+	PC->atailp[Q->prio] = &Q->anext;
+	Q->active = 1;
+}
+
+/* Remove ${Q} from the list of queues with requests waiting. */
+static void
+deactivate(struct pacer * PC, struct pqueue * Q)
+{
+	struct pqueue ** qp;
+
+	for (qp = &PC->ahead[Q->prio]; *qp != Q; qp = &(*qp)->anext)
+		continue;
+	*qp = Q->anext;
+	if (PC->atailp[Q->prio] == &Q->anext)
+		PC->atailp[Q->prio] = qp;
+	Q->active = 0;
+}
+
+/* Queue the request ${W}. */
+static void
+push(struct pacer * PC, struct pwaiter * W)
+{
+	struct pqueue * Q = W->Q;
+
+	/* Add it to the end of its queue. */
+	W->next = NULL;
+	*Q->tailp = W;
+	Q->tailp = &W->next;
+
+	/* Make sure the queue is in the round-robin rotation. */
+	if (!Q->active)
+		activate(PC, Q);
+
+	/* Record statistics. */
+	PC->depthhist[bucket(PC->depth)]++;
+	PC->depth++;
+	if (PC->depth > PC->maxdepth)
+		PC->maxdepth = PC->depth;
+	PC->nqueued++;
+}
+
+/* Remove the queued request ${W}. */
+static void
+unqueue(struct pacer * PC, struct pwaiter * W)
+{
+	struct pqueue * Q = W->Q;
+	struct pwaiter ** wp;
+
+	/* Remove it from its queue. */
+	for (wp = &Q->head; *wp != W; wp = &(*wp)->next)
+		continue;
+	*wp = W->next;
+	if (Q->tailp == &W->next)
+		Q->tailp = wp;
+
+	/* If that empties the queue, take it out of the rotation. */
+	if (Q->head == NULL) {
+		deactivate(PC, Q);
+		putqueue(PC, Q);
+	}
+	PC->depth--;
+}
+
+/* Take the next request to send, or return NULL if none are queued. */
+static struct pwaiter *
+pop(struct pacer * PC)
+{
+	struct pqueue * Q;
+	struct pwaiter * W;
+	int prio;
+
+	/* Find the highest priority class with requests queued. */
+	for (prio = 0; prio < NPRIO; prio++) {
+		if ((Q = PC->ahead[prio]) != NULL)
+			break;
+	}
+	if (prio == NPRIO)
+		return (NULL);
+
+	/* Take the first request from the first queue. */
+	W = Q->head;
+	if ((Q->head = W->next) == NULL)
+		Q->tailp = &Q->head;
+	PC->depth--;
+
+	/* Move this queue to the end of the rotation (or out of it). */
+	deactivate(PC, Q);
+	if (Q->head != NULL)
+		activate(PC, Q);
+	else
+		putqueue(PC, Q);
+
+	/* Return the request. */
+	return (W);
+}
+
+/*
+ * Release as many requests as we have tokens for; add any which have
+ * callbacks to the list ${granted}.  Return the number released.
+ */
+static size_t
+grant(struct pacer * PC, double t, struct pwaiter ** granted)
+{
+	struct pwaiter * W;
+	struct pwaiter ** tailp = granted;
+	double ms;
+	size_t n = 0;
+
+	/* Bring the bucket up to date. */
+	refill(PC, t);
+
+	/* Release requests while we have tokens. */
+	while ((PC->tokens >= 1.0) && ((W = pop(PC)) != NULL)) {
+		PC->tokens -= 1.0;
+		W->granted = 1;
+		n++;
+
+		/* Record how long it waited. */
+		ms = (t - W->t_enqueue) * 1000.0;
+		PC->waithist[bucket((ms > 0) ? (size_t)ms : 0)]++;
+
+		/* Events mode requests need their callbacks called. */
+		if (W->callback != NULL) {
+			W->next = NULL;
+			*tailp = W;
+			tailp = &W->next;
+		}
+	}
+
+	/* Return the number of requests released. */
+	return (n);
+}
+
+/* Schedule the timer for the next token, if needed; call with lock held. */
+static int
+schedule(struct pacer * PC)
+{
+
+	/* Nothing to do if nothing is queued or the timer is pending. */
+	if ((PC->depth == 0) || (PC->timer_cookie != NULL))
+		return (0);
+
+	/* Wake up when the next token is available. */
+	if ((PC->timer_cookie = events_timer_register_double(callback_timer,
+	    PC, delay(PC))) == NULL) {
+		warnp("events_timer_register_double");
+		return (-1);
+	}
+
+	/* Success! */
+	return (0);
+}
+
+/* It's time to release more requests (in events mode). */
+static int
+callback_timer(void * cookie)
+{
+	struct pacer * PC = cookie;
+	struct pwaiter * granted = NULL;
+	struct pwaiter * W;
+	double t;
+	int rc;
+	int failed = 0;
+
+	/* Find out what time it is. */
+	if ((t = now()) < 0)
+		goto err0;
+
+	/* Lock the pacer. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* This callback is no longer pending. */
+	PC->timer_cookie = NULL;
+
+	/* Release what we can, and wait for more tokens if necessary. */
+	grant(PC, t, &granted);
+	if (schedule(PC))
+		failed = 1;
+
+	/* Unlock the pacer. */
+	if ((rc = pthread_mutex_unlock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Send the requests we released. */
+	while ((W = granted) != NULL) {
+		granted = W->next;
+		if ((W->callback)(W->cookie))
+			failed = 1;
+		free(W);
+	}
+
+	/* Did anything go wrong? */
+	return (failed ? -1 : 0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Can a request be sent immediately?  Call with lock held. */
+static int
+immediate(struct pacer * PC, double t)
+{
+
+	/* Bring the bucket up to date. */
+	refill(PC, t);
+
+	/* Not if there's anything queued or we don't have a token. */
+	if ((PC->depth > 0) || (PC->tokens < 1.0))
+		return (0);
+
+	/* Use the token. */
+	PC->tokens -= 1.0;
+	PC->nimmediate++;
+	PC->depthhist[0]++;
+	PC->waithist[0]++;
+	return (1);
+}
+
+/**
+ * pacer_init(rate, burst):
+ * Create a pacer which allows up to ${rate} requests per second to be sent
+ * to the IMDS, with bursts of up to ${burst} requests.
+ */
+struct pacer *
+pacer_init(int rate, int burst)
+{
+	struct pacer * PC;
+	size_t i;
+	int prio;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((PC = malloc(sizeof(struct pacer))) == NULL)
+		goto err0;
+	PC->rate = rate;
+	PC->burst = burst;
+	PC->tokens = burst;
+	for (i = 0; i < NBUCKETS; i++)
+		PC->buckets[i] = NULL;
+	PC->freeq = NULL;
+	for (prio = 0; prio < NPRIO; prio++) {
+		PC->ahead[prio] = NULL;
+		PC->atailp[prio] = &PC->ahead[prio];
+	}
+	PC->depth = 0;
+	PC->timer_cookie = NULL;
+	PC->nimmediate = 0;
+	PC->nqueued = 0;
+	PC->maxdepth = 0;
+	for (i = 0; i < NHIST; i++)
+		PC->depthhist[i] = PC->waithist[i] = 0;
+
+	/* Start the clock. */
+	if ((PC->t_last = now()) < 0)
+		goto err1;
+
+	/* Initialize the mutex and condition variable. */
+	if ((rc = pthread_mutex_init(&PC->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err1;
+	}
+	if ((rc = pthread_cond_init(&PC->cv, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err2;
+	}
+
+	/* Success! */
+	return (PC);
+
+err2:
+	pthread_mutex_destroy(&PC->mtx);
+err1:
+	free(PC);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * pacer_enqueue(PC, uid, prio, callback, cookie, handle):
+ * If a request from ${uid} in priority class ${prio} can be sent now, return
+ * 1.  Otherwise, queue it, return zero, and call ${callback}(${cookie}) from
+ * the events loop once it can be sent; the handle returned via ${handle} may
+ * be passed to pacer_cancel before then.  Return -1 on error.
+ */
+int
+pacer_enqueue(struct pacer * PC, uid_t uid, int prio,
+    int (* callback)(void *), void * cookie, void ** handle)
+{
+	struct pwaiter * W;
+	double t;
+	int rc, rc2;
+
+	/* Find out what time it is. */
+	if ((t = now()) < 0)
+		goto err0;
+
+	/* Lock the pacer. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Can we send this request right away? */
+	if (immediate(PC, t)) {
+		rc = 1;
+		goto done;
+	}
+
+	/* Queue the request. */
+	if ((W = malloc(sizeof(struct pwaiter))) == NULL)
+		goto err1;
+	if ((W->Q = getqueue(PC, uid, prio)) == NULL)
+		goto err2;
+	W->callback = callback;
+	W->cookie = cookie;
+	W->t_enqueue = t;
+	W->granted = 0;
+	push(PC, W);
+
+	/* Make sure we'll wake up to release it. */
+	if (schedule(PC))
+		goto err3;
+	*handle = W;
+	rc = 0;
+
+done:
+	/* Unlock the pacer. */
+	if ((rc2 = pthread_mutex_unlock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc2));
+		return (-1);
+	}
+
+	/* Tell the caller whether to go ahead. */
+	return (rc);
+
+err3:
+	unqueue(PC, W);
+err2:
+	free(W);
+err1:
+	pthread_mutex_unlock(&PC->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * pacer_cancel(PC, handle):
+ * Cancel the queued request which returned ${handle} from pacer_enqueue.
+ */
+void
+pacer_cancel(struct pacer * PC, void * handle)
+{
+	struct pwaiter * W = handle;
+	int rc;
+
+	/* Lock the pacer. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Remove the request from its queue. */
+	unqueue(PC, W);
+
+	/* Unlock the pacer. */
+	if ((rc = pthread_mutex_unlock(&PC->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+
+	/* Free the request. */
+	free(W);
+}
+
+/**
+ * pacer_wait(PC, uid, prio):
+ * Block until a request from ${uid} in priority class ${prio} can be sent.
+ */
+int
+pacer_wait(struct pacer * PC, uid_t uid, int prio)
+{
+	struct pwaiter W;
+	struct pwaiter * granted = NULL;
+	struct timespec ts;
+	double t, d;
+	int rc;
+
+	/* Find out what time it is. */
+	if ((t = now()) < 0)
+		goto err0;
+
+	/* Lock the pacer. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Can we send this request right away? */
+	if (immediate(PC, t))
+		goto done;
+
+	/* Queue the request. */
+	if ((W.Q = getqueue(PC, uid, prio)) == NULL)
+		goto err1;
+	W.callback = NULL;
+	W.cookie = NULL;
+	W.t_enqueue = t;
+	W.granted = 0;
+	push(PC, &W);
+
+	/* Release requests (ours or others') until ours is released. */
+	do {
+		/* Release what we can, and wake up anyone we released. */
+		if ((t = now()) < 0)
+			goto err2;
+		if ((grant(PC, t, &granted) > 0) &&
+		    ((rc = pthread_cond_broadcast(&PC->cv)) != 0)) {
+			warn0("pthread_cond_broadcast: %s", strerror(rc));
+			goto err2;
+		}
+		if (W.granted)
+			break;
+
+		/* Wait until the next token, unless someone wakes us. */
+		if (clock_gettime(CLOCK_REALTIME, &ts)) {
+			warnp("clock_gettime");
+			goto err2;
+		}
+		d = delay(PC);
+		ts.tv_sec += (time_t)d;
+		ts.tv_nsec += (long)((d - (double)(time_t)d) * 1000000000.0);
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000;
+		}
+		if (((rc = pthread_cond_timedwait(&PC->cv, &PC->mtx, &ts))
+		    != 0) && (rc != ETIMEDOUT)) {
+			warn0("pthread_cond_timedwait: %s", strerror(rc));
+			goto err2;
+		}
+	} while (!W.granted);
+
+done:
+	/* Unlock the pacer. */
+	if ((rc = pthread_mutex_unlock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err2:
+	if (!W.granted)
+		unqueue(PC, &W);
+err1:
+	pthread_mutex_unlock(&PC->mtx);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Format the histogram ${hist} into ${buf}. */
+static void
+histfmt(char * buf, size_t buflen, const uint64_t * hist)
+{
+	size_t i;
+	size_t pos = 0;
+	int len;
+
+	buf[0] = '\0';
+	for (i = 0; i < NHIST; i++) {
+		len = snprintf(&buf[pos], buflen - pos, "%s%ju",
+		    (i > 0) ? " " : "", (uintmax_t)hist[i]);
+		if ((len < 0) || ((size_t)len >= buflen - pos))
+			break;
+		pos += (size_t)len;
+	}
+}
+
+/**
+ * pacer_stats_log(PC):
+ * Log statistics about the pacer ${PC}, including histograms of queue
+ * depths and waiting times.
+ */
+void
+pacer_stats_log(struct pacer * PC)
+{
+	uint64_t nimmediate, nqueued;
+	uint64_t depthhist[NHIST], waithist[NHIST];
+	size_t depth, maxdepth;
+	char dbuf[NHIST * 21], wbuf[NHIST * 21];
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nimmediate = PC->nimmediate;
+	nqueued = PC->nqueued;
+	depth = PC->depth;
+	maxdepth = PC->maxdepth;
+	memcpy(depthhist, PC->depthhist, sizeof(depthhist));
+	memcpy(waithist, PC->waithist, sizeof(waithist));
+	if ((rc = pthread_mutex_unlock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	histfmt(dbuf, sizeof(dbuf), depthhist);
+	histfmt(wbuf, sizeof(wbuf), waithist);
+	syslog(LOG_INFO, "imds-proxy: pacer: %ju sent immediately, "
+	    "%ju queued; %zu queued now, %zu at most",
+	    (uintmax_t)nimmediate, (uintmax_t)nqueued, depth, maxdepth);
+	syslog(LOG_INFO, "imds-proxy: pacer: queue depth seen "
+	    "(0, 1, 2-3, 4-7, ..., 1024+): %s", dbuf);
+	syslog(LOG_INFO, "imds-proxy: pacer: wait in ms "
+	    "(<1, 1-2, 2-4, 4-8, ..., 1024+): %s", wbuf);
+}
+
+/**
+ * pacer_free(PC):
+ * Free the pacer ${PC}, which must have no requests queued.
+ */
+void
+pacer_free(struct pacer * PC)
+{
+	struct pqueue * Q;
+
+	/* Behave consistently with free(NULL). */
+	if (PC == NULL)
+		return;
+
+	/* Cancel the timer, if any. */
+	if (PC->timer_cookie != NULL)
+		events_timer_cancel(PC->timer_cookie);
+
+	/* Free the per-uid queues, which are all empty. */
+	while ((Q = PC->freeq) != NULL) {
+		PC->freeq = Q->hnext;
+		free(Q);
+	}
+
+	/* Free the synchronization primitives and the structure. */
+	pthread_cond_destroy(&PC->cv);
+	pthread_mutex_destroy(&PC->mtx);
+	free(PC);
+}
@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "imds-proxy.h"
+
+/*
+ * A path prefix matches a path if the prefix is a prefix of the path, except
+ * that a '*' component in the prefix matches any one component of the path.
+ * Splitting both at '/' characters, the prefix [c_0, ..., c_k] matches the
+ * path [s_0, ..., s_m] if k <= m, c_i is s_i or '*' for each i < k, and c_k
+ * is a prefix of s_k or is '*' (which is the same as c_k being empty).
+ *
+ * We store prefixes in a trie of their components: each node has an edge
+ * for each component which follows it (in sorted order), possibly one edge
+ * for '*', and the final components (again in sorted order) of the prefixes
+ * which end there, each with the (ascending) numbers of those prefixes.
+ * To find the prefixes which match a path, we walk the trie one component of
+ * the path at a time, following both the edge for that component and the
+ * '*' edge; at each node, the final components which match are the ones
+ * which are prefixes of the path component, so we look up each of those
+ * prefixes.  Since we're looking for the last matching prefix, we only need
+ * to look at the numbers of each matching final component until we find one
+ * which the caller accepts.
+ */
+
+/* An edge to a child node, labelled with a path component. */
+struct edge {
+	const char * s;
+	size_t len;
+	struct node * child;
+};
+
+/* The final component of one or more prefixes, and their numbers. */
+struct tail {
+	const char * s;
+	size_t len;
+	size_t * nums;
+	size_t nnums;
+};
+
+/* A node in the trie. */
+struct node {
+	struct edge * edges;
+	size_t nedges;
+	struct node * star;
+	struct tail * tails;
+	size_t ntails;
+	size_t maxlen;
+	size_t * nums;
+};
+
+/* Look for final components by scanning if there are at most this many. */
+#define NSCAN 8
+
+/* A trie of path prefixes. */
+struct pathtrie {
+	struct node * root;
+};
+
+/* A prefix, and its number, while we're building the trie. */
+struct ent {
+	const char * s;
+	size_t num;
+};
+
+/* The final component of a prefix, and its number. */
+struct tailent {
+	const char * s;
+	size_t len;
+	size_t num;
+};
+
+/* Compare the ${alen}-byte string ${a} to the ${blen}-byte string ${b}. */
+static int
+cmpstr(const char * a, size_t alen, const char * b, size_t blen)
+{
+	int rc;
+
+	if ((rc = memcmp(a, b, (alen < blen) ? alen : blen)) != 0)
+		return (rc);
+	return ((alen > blen) - (alen < blen));
+}
+
+/* Order prefixes by string, then by number. */
+static int
+cmpent(const void * _a, const void * _b)
+{
+	const struct ent * a = _a;
+	const struct ent * b = _b;
+	int rc;
+
+	if ((rc = strcmp(a->s, b->s)) != 0)
+		return (rc);
+	return ((a->num > b->num) - (a->num < b->num));
+}
+
+/* Order edges by label. */
+static int
+cmpedge(const void * _a, const void * _b)
+{
+	const struct edge * a = _a;
+	const struct edge * b = _b;
+
+	return (cmpstr(a->s, a->len, b->s, b->len));
+}
+
+/* Order final components by string, then by number. */
+static int
+cmptail(const void * _a, const void * _b)
+{
+	const struct tailent * a = _a;
+	const struct tailent * b = _b;
+	int rc;
+
+	if ((rc = cmpstr(a->s, a->len, b->s, b->len)) != 0)
+		return (rc);
+	return ((a->num > b->num) - (a->num < b->num));
+}
+
+/* Free the node ${N} and its descendants. */
+static void
+node_free(struct node * N)
+{
+	size_t i;
+
+	/* Behave consistently with free(NULL). */
+	if (N == NULL)
+		return;
+
+	/* Free the children. */
+	for (i = 0; i < N->nedges; i++)
+		node_free(N->edges[i].child);
+	node_free(N->star);
+
+	/* Free the node. */
+	free(N->edges);
+	free(N->tails);
+	free(N->nums);
+	free(N);
+}
+
+/*
+ * Build a node for the ${n} sorted prefixes ${E}, all of which start with
+ * the same ${off} characters, ending with a '/'.
+ */
+static struct node *
+build(const struct ent * E, size_t n, size_t off)
+{
+	struct node * N;
+	struct tailent * TE;
+	size_t nte = 0;
+	const char * s;
+	const char * sl;
+	size_t i, j;
+
+	/*
+	 * Allocate a node, with enough room for everything we might need
+	 * (plus one, so that we never ask malloc for zero bytes).
+	 */
+	if ((N = malloc(sizeof(struct node))) == NULL)
+		goto err0;
+	N->nedges = N->ntails = N->maxlen = 0;
+	N->star = NULL;
+	N->tails = NULL;
+	N->nums = NULL;
+	if ((N->edges = malloc((n + 1) * sizeof(struct edge))) == NULL)
+		goto err1;
+	if ((TE = malloc((n + 1) * sizeof(struct tailent))) == NULL)
+		goto err1;
+
+	/* Split the prefixes into those ending here and those which go on. */
+	for (i = 0; i < n; i = j) {
+		s = &E[i].s[off];
+
+		/* Does this prefix end here? */
+		if ((sl = strchr(s, '/')) == NULL) {
+			/* A final '*' is equivalent to an empty component. */
+			if (strcmp(s, "*") == 0)
+				s = "";
+			TE[nte].s = s;
+			TE[nte].len = strlen(s);
+			TE[nte].num = E[i].num;
+			if (TE[nte].len > N->maxlen)
+				N->maxlen = TE[nte].len;
+			nte++;
+			j = i + 1;
+			continue;
+		}
+
+		/* Prefixes with the same next component are contiguous. */
+		for (j = i + 1; j < n; j++) {
+			if (strncmp(&E[j].s[off], s, (size_t)(sl - s) + 1))
+				break;
+		}
+
+		/* Build a child for the rest of these prefixes. */
+		if (((size_t)(sl - s) == 1) && (s[0] == '*')) {
+			if ((N->star = build(&E[i], j - i,
+			    off + (size_t)(sl - s) + 1)) == NULL)
+				goto err2;
+		} else {
+			N->edges[N->nedges].s = s;
+			N->edges[N->nedges].len = (size_t)(sl - s);
+			if ((N->edges[N->nedges].child = build(&E[i], j - i,
+			    off + (size_t)(sl - s) + 1)) == NULL)
+				goto err2;
+			N->nedges++;
+		}
+	}
+
+	/*
+	 * Sort the edges; they're almost in order already, but e.g. "a./"
+	 * sorts before "a/".
+	 */
+	qsort(N->edges, N->nedges, sizeof(struct edge), cmpedge);
+
+	/* Sort the final components, and merge the ones which are the same. */
+	qsort(TE, nte, sizeof(struct tailent), cmptail);
+	if (((N->tails = malloc((nte + 1) * sizeof(struct tail))) == NULL) ||
+	    ((N->nums = malloc((nte + 1) * sizeof(size_t))) == NULL))
+		goto err2;
+	for (i = 0; i < nte; i++) {
+		if ((N->ntails == 0) ||
+		    cmpstr(TE[i].s, TE[i].len, N->tails[N->ntails - 1].s,
+		    N->tails[N->ntails - 1].len)) {
+			N->tails[N->ntails].s = TE[i].s;
+			N->tails[N->ntails].len = TE[i].len;
+			N->tails[N->ntails].nums = &N->nums[i];
+			N->tails[N->ntails].nnums = 0;
+			N->ntails++;
+		}
+		N->nums[i] = TE[i].num;
+		N->tails[N->ntails - 1].nnums++;
+	}
+
+	/* We don't need the unmerged final components any more. */
+	free(TE);
+
+	/* Success! */
+	return (N);
+
+err2:
+	free(TE);
+err1:
+	node_free(N);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Find the edge from ${N} labelled with the ${len}-byte string ${s}. */
+static const struct edge *
+findedge(const struct node * N, const char * s, size_t len)
+{
+	size_t lo = 0, hi = N->nedges, mid;
+	int rc;
+
+	/* Binary search. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((rc = cmpstr(s, len, N->edges[mid].s,
+		    N->edges[mid].len)) == 0)
+			return (&N->edges[mid]);
+		if (rc < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	/* Not found. */
+	return (NULL);
+}
+
+/* Find the final component of ${N} which is the ${len}-byte string ${s}. */
+static const struct tail *
+findtail(const struct node * N, const char * s, size_t len)
+{
+	size_t lo = 0, hi = N->ntails, mid;
+	int rc;
+
+	/* Binary search. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((rc = cmpstr(s, len, N->tails[mid].s,
+		    N->tails[mid].len)) == 0)
+			return (&N->tails[mid]);
+		if (rc < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	/* Not found. */
+	return (NULL);
+}
+
+/*
+ * Of the prefixes whose final component is ${T}, find the last one which
+ * the caller accepts, if it is numbered higher than the best one we've found
+ * so far (if any); record it via ${best} and ${found}.
+ */
+static void
+checktail(const struct tail * T, int (* filter)(void *, size_t),
+    void * cookie, size_t * best, int * found)
+{
+	size_t i;
+
+	for (i = T->nnums; i > 0; i--) {
+		if (*found && (T->nums[i - 1] <= *best))
+			break;
+		if ((filter == NULL) || filter(cookie, T->nums[i - 1])) {
+			*best = T->nums[i - 1];
+			*found = 1;
+			break;
+		}
+	}
+}
+
+/*
+ * Look for prefixes under the node ${N} which match the rest of the path,
+ * ${p}, which are accepted by ${filter}, and which are numbered higher than
+ * the best one we've found so far (if any); record them via ${best} and
+ * ${found}.
+ */
+static void
+walk(const struct node * N, const char * p,
+    int (* filter)(void *, size_t), void * cookie, size_t * best,
+    int * found)
+{
+	const struct tail * T;
+	const struct edge * E;
+	size_t seglen = strcspn(p, "/");
+	size_t len, i;
+
+	/*
+	 * Look at the prefixes whose final components are prefixes of this
+	 * component; if there are only a few final components here, check
+	 * each of them, and otherwise look up each prefix of this component.
+	 */
+	if (N->ntails <= NSCAN) {
+		for (i = 0; i < N->ntails; i++) {
+			T = &N->tails[i];
+			if ((T->len <= seglen) && !memcmp(T->s, p, T->len))
+				checktail(T, filter, cookie, best, found);
+		}
+	} else {
+		for (len = 0; (len <= seglen) && (len <= N->maxlen); len++) {
+			if ((T = findtail(N, p, len)) != NULL)
+				checktail(T, filter, cookie, best, found);
+		}
+	}
+
+	/* Is there another component? */
+	if (p[seglen] != '/')
+		return;
+
+	/* Follow the edge for this component, and the '*' edge. */
+	if ((E = findedge(N, p, seglen)) != NULL)
+		walk(E->child, &p[seglen + 1], filter, cookie, best, found);
+	if (N->star != NULL)
+		walk(N->star, &p[seglen + 1], filter, cookie, best, found);
+}
+
+/**
+ * pathtrie_init(prefixes, n):
+ * Compile the ${n} path prefixes ${prefixes} (in which a "*" component
+ * matches any one path component) into a trie.  The prefixes must remain
+ * valid until the trie is freed.
+ */
+struct pathtrie *
+pathtrie_init(char * const * prefixes, size_t n)
+{
+	struct pathtrie * PT;
+	struct ent * E;
+	size_t i;
+
+	/* Allocate a structure. */
+	if ((PT = malloc(sizeof(struct pathtrie))) == NULL)
+		goto err0;
+
+	/* Sort the prefixes, so that ones with common components cluster. */
+	if ((E = malloc((n + 1) * sizeof(struct ent))) == NULL)
+		goto err1;
+	for (i = 0; i < n; i++) {
+		E[i].s = prefixes[i];
+		E[i].num = i;
+	}
+	qsort(E, n, sizeof(struct ent), cmpent);
+
+	/* Build the trie. */
+	if ((PT->root = build(E, n, 0)) == NULL)
+		goto err2;
+
+	/* We don't need the sorted prefixes any more. */
+	free(E);
+
+	/* Success! */
+	return (PT);
+
+err2:
+	free(E);
+err1:
+	free(PT);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * pathtrie_match(PT, path, filter, cookie, num):
+ * Find the highest-numbered prefix in ${PT} which matches ${path} and for
+ * which ${filter}(${cookie}, num) is non-zero (or any, if ${filter} is
+ * NULL).  Return its number via ${num} and return 1, or return 0 if there
+ * is no such prefix.
+ */
+int
+pathtrie_match(const struct pathtrie * PT, const char * path,
+    int (* filter)(void *, size_t), void * cookie, size_t * num)
+{
+	int found = 0;
+
+	/* Walk the trie. */
+	walk(PT->root, path, filter, cookie, num, &found);
+
+	/* Did we find anything? */
+	return (found);
+}
+
+/**
+ * pathtrie_free(PT):
+ * Free the trie ${PT}.
+ */
+void
+pathtrie_free(struct pathtrie * PT)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (PT == NULL)
+		return;
+
+	/* Free the nodes and the structure. */
+	node_free(PT->root);
+	free(PT);
+}
@@ -0,0 +1,366 @@
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * A principal is a uid and a set of gids; we keep the gids sorted and
+ * without duplicates, so that the same principal is found however the gids
+ * were listed.  Values are built by a callback the first time a principal
+ * is seen, and are kept in a chained hash table with a least recently used
+ * list; once there are too many, the least recently used ones are evicted.
+ * Callers hold a reference to a value while they use it, so an evicted
+ * value is only freed once nobody is using it.
+ */
+
+/* Number of hash buckets per entry we're allowed to keep. */
+#define BUCKETS_PER_ENTRY 2
+
+/* A cached value for one principal. */
+struct pcent {
+	uid_t uid;
+	gid_t * gids;
+	size_t ngid;
+	uint32_t hash;
+	void * val;
+	size_t refs;
+	int evicted;
+	struct pcent * hnext;
+	struct pcent * prev;
+	struct pcent * next;
+};
+
+/* A cache of values for principals. */
+struct princache {
+	pthread_mutex_t mtx;
+	void * (* build)(void *, uid_t, const gid_t *, size_t);
+	void (* vfree)(void *);
+	void * cookie;
+	struct pcent ** buckets;
+	size_t nbuckets;
+	size_t n;
+	size_t max;
+	struct pcent * head;
+	struct pcent * tail;
+};
+
+/* Hash the principal ${uid}/${gids}. */
+static uint32_t
+hash(uid_t uid, const gid_t * gids, size_t ngid)
+{
+
+	return (fnv_hash(fnv_hash(FNV_INIT, &uid, sizeof(uid_t)), gids,
+	    ngid * sizeof(gid_t)));
+}
+
+/* Remove ${E} from the LRU list of ${PC}. */
+static void
+lru_unlink(struct princache * PC, struct pcent * E)
+{
+
+	if (E->prev != NULL)
+		E->prev->next = E->next;
+	else
+		PC->head = E->next;
+	if (E->next != NULL)
+		E->next->prev = E->prev;
+	else
+		PC->tail = E->prev;
+}
+
+/* Put ${E} at the head of the LRU list of ${PC}. */
+static void
+lru_push(struct princache * PC, struct pcent * E)
+{
+
+	E->prev = NULL;
+	E->next = PC->head;
+	if (PC->head != NULL)
+		PC->head->prev = E;
+	else
+		PC->tail = E;
+	PC->head = E;
+}
+
+/* Free the entry ${E}. */
+static void
+pcent_free(struct princache * PC, struct pcent * E)
+{
+
+	(PC->vfree)(E->val);
+	free(E->gids);
+	free(E);
+}
+
+/* Remove ${E} from ${PC}, and free it unless it's in use. */
+static void
+evict(struct princache * PC, struct pcent * E)
+{
+	struct pcent ** pp;
+
+	/* Remove it from its hash chain. */
+	for (pp = &PC->buckets[E->hash % PC->nbuckets]; *pp != E;
+	    pp = &(*pp)->hnext)
+		continue;
+	*pp = E->hnext;
+
+	/* Remove it from the LRU list. */
+	lru_unlink(PC, E);
+	PC->n--;
+
+	/* Free it now, or when the last user releases it. */
+	if (E->refs == 0)
+		pcent_free(PC, E);
+	else
+		E->evicted = 1;
+}
+
+/* Find the principal ${uid}/${gids} (with ${h} its hash) in ${PC}. */
+static struct pcent *
+find(struct princache * PC, uint32_t h, uid_t uid, const gid_t * gids,
+    size_t ngid)
+{
+	struct pcent * E;
+
+	for (E = PC->buckets[h % PC->nbuckets]; E != NULL; E = E->hnext) {
+		if ((E->hash == h) && (E->uid == uid) && (E->ngid == ngid) &&
+		    (memcmp(E->gids, gids, ngid * sizeof(gid_t)) == 0))
+			break;
+	}
+	return (E);
+}
+
+/**
+ * princache_canon(gids, ngid):
+ * Sort the ${ngid} gids ${gids} and remove duplicates, so that the same set
+ * of gids is the same however it was listed; return the number remaining.
+ */
+size_t
+princache_canon(gid_t * gids, size_t ngid)
+{
+	size_t i, j;
+	gid_t g;
+
+	/* Insertion sort; there are only a handful of gids. */
+	for (i = 1; i < ngid; i++) {
+		g = gids[i];
+		for (j = i; (j > 0) && (gids[j - 1] > g); j--)
+			gids[j] = gids[j - 1];
+		gids[j] = g;
+	}
+
+	/* Remove duplicates. */
+	for (i = j = 0; i < ngid; i++) {
+		if ((j == 0) || (gids[j - 1] != gids[i]))
+			gids[j++] = gids[i];
+	}
+
+	/* Return the number of distinct gids. */
+	return (j);
+}
+
+/**
+ * princache_init(max, build, vfree, cookie):
+ * Create a cache of up to ${max} values, each for a principal (a uid and a
+ * set of gids), which are created by ${build}(${cookie}, uid, gids, ngid)
+ * (where the gids are sorted and distinct) and freed by ${vfree}(value).
+ */
+struct princache *
+princache_init(size_t max, void * (* build)(void *, uid_t, const gid_t *,
+    size_t), void (* vfree)(void *), void * cookie)
+{
+	struct princache * PC;
+	int rc;
+
+	/* Allocate a structure and the hash buckets. */
+	if ((PC = malloc(sizeof(struct princache))) == NULL)
+		goto err0;
+	PC->build = build;
+	PC->vfree = vfree;
+	PC->cookie = cookie;
+	PC->n = 0;
+	PC->max = max;
+	PC->head = PC->tail = NULL;
+	PC->nbuckets = max * BUCKETS_PER_ENTRY + 1;
+	if ((PC->buckets = calloc(PC->nbuckets, sizeof(struct pcent *))) ==
+	    NULL)
+		goto err1;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&PC->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+
+	/* Success! */
+	return (PC);
+
+err2:
+	free(PC->buckets);
+err1:
+	free(PC);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * princache_get(PC, uid, gids, ngid, handle):
+ * Return the value in ${PC} for the principal ${uid}/${gids}, building it
+ * if necessary, or NULL on error.  Return via ${handle} a handle which must
+ * be passed to princache_release once the caller is done with the value.
+ * This may be called by several threads at once.
+ */
+void *
+princache_get(struct princache * PC, uid_t uid, const gid_t * gids,
+    size_t ngid, void ** handle)
+{
+	struct pcent * E;
+	struct pcent * N;
+	gid_t * cgids;
+	uint32_t h;
+	int rc;
+
+	/* Make a canonical copy of the gids. */
+	if ((cgids = malloc((ngid + 1) * sizeof(gid_t))) == NULL)
+		goto err0;
+	memcpy(cgids, gids, ngid * sizeof(gid_t));
+	ngid = princache_canon(cgids, ngid);
+	h = hash(uid, cgids, ngid);
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Do we have a value for this principal? */
+	if ((E = find(PC, h, uid, cgids, ngid)) != NULL)
+		goto found;
+
+	/* Unlock while we build one, since it may take a while. */
+	if ((rc = pthread_mutex_unlock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err1;
+	}
+	if ((N = malloc(sizeof(struct pcent))) == NULL)
+		goto err1;
+	N->uid = uid;
+	N->gids = cgids;
+	N->ngid = ngid;
+	N->hash = h;
+	N->refs = 0;
+	N->evicted = 0;
+	if ((N->val = (PC->build)(PC->cookie, uid, cgids, ngid)) == NULL)
+		goto err2;
+
+	/* Lock the cache again. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err3;
+	}
+
+	/* If another thread got there first, use its value instead. */
+	if ((E = find(PC, h, uid, cgids, ngid)) != NULL) {
+		pcent_free(PC, N);
+		goto hit;
+	}
+
+	/* Make room if necessary, and add the new value. */
+	while ((PC->n >= PC->max) && (PC->tail != NULL))
+		evict(PC, PC->tail);
+	E = N;
+	E->hnext = PC->buckets[h % PC->nbuckets];
+	PC->buckets[h % PC->nbuckets] = E;
+	lru_push(PC, E);
+	PC->n++;
+	goto gotit;
+
+found:
+	/* We don't need our copy of the gids. */
+	free(cgids);
+
+hit:
+	/* This is now the most recently used value. */
+	lru_unlink(PC, E);
+	lru_push(PC, E);
+
+gotit:
+	/* The caller is using this value. */
+	E->refs++;
+
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Return the value. */
+	*handle = E;
+	return (E->val);
+
+err3:
+	(PC->vfree)(N->val);
+err2:
+	free(N);
+err1:
+	free(cgids);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * princache_release(PC, handle):
+ * Release the value for which ${handle} was returned by princache_get.
+ */
+void
+princache_release(struct princache * PC, void * handle)
+{
+	struct pcent * E = handle;
+	int rc;
+
+	/* Lock the cache. */
+	if ((rc = pthread_mutex_lock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Drop the reference; free the value if it was evicted meanwhile. */
+	if ((--E->refs == 0) && E->evicted)
+		pcent_free(PC, E);
+
+	/* Unlock the cache. */
+	if ((rc = pthread_mutex_unlock(&PC->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+}
+
+/**
+ * princache_free(PC):
+ * Free the cache ${PC} and its values, none of which may be in use.
+ */
+void
+princache_free(struct princache * PC)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (PC == NULL)
+		return;
+
+	/* Free the values. */
+	while (PC->tail != NULL)
+		evict(PC, PC->tail);
+
+	/* Free the mutex, the buckets, and the structure. */
+	pthread_mutex_destroy(&PC->mtx);
+	free(PC->buckets);
+	free(PC);
+}
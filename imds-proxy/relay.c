@@ -0,0 +1,311 @@
+#define _GNU_SOURCE	1	/* Needed for splice(2) on Linux. */
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "elasticarray.h"
+#include "noeintr.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Responses from the IMDS can be large (e.g., user-data), so we relay them
+ * in large chunks.  Where splice(2) is available, body data -- which we
+ * don't need to look at, since the response parser only needs to know how
+ * much of it there is -- is moved from the IMDS connection into a pipe and
+ * from there to the client without ever being copied into userland; the
+ * rest of the response (and everything, on systems without splice) is
+ * copied through a buffer.
+ */
+#ifdef SPLICE_F_MOVE
+#define HAVE_SPLICE
+#endif
+
+/* Size of the relay buffer, and the most we splice at once. */
+#define RELAYBUF 65536
+
+/* Per-thread relaying state. */
+struct relay {
+	uint8_t * buf;
+	int pfd[2];
+};
+
+/* Statistics, shared by all relays. */
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stats_nbytes;
+static uint64_t stats_nspliced;
+static uint64_t stats_nsplices;
+static uint64_t stats_ncopied;
+static uint64_t stats_ncopies;
+
+/* Add to the statistics. */
+static void
+addstats(size_t nspliced, size_t nsplices, size_t ncopied, size_t ncopies)
+{
+	int rc;
+
+	/* Lock the statistics. */
+	if ((rc = pthread_mutex_lock(&stats_mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Add to them. */
+	stats_nbytes += nspliced + ncopied;
+	stats_nspliced += nspliced;
+	stats_nsplices += nsplices;
+	stats_ncopied += ncopied;
+	stats_ncopies += ncopies;
+
+	/* Unlock the statistics. */
+	if ((rc = pthread_mutex_unlock(&stats_mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+#ifdef HAVE_SPLICE
+/* Create the pipe used for splicing; fall back to copying on failure. */
+static void
+openpipe(struct relay * RL)
+{
+
+	if (pipe(RL->pfd)) {
+		warnp("pipe");
+		RL->pfd[0] = RL->pfd[1] = -1;
+	}
+}
+
+/* Close the pipe used for splicing. */
+static void
+closepipe(struct relay * RL)
+{
+
+	if (RL->pfd[0] != -1) {
+		close(RL->pfd[0]);
+		close(RL->pfd[1]);
+	}
+	RL->pfd[0] = RL->pfd[1] = -1;
+}
+
+/* Splice up to ${n} bytes of body data from ${from} to ${to}. */
+static int
+splicebody(struct relay * RL, int from, int to, struct response * R,
+    size_t n, ssize_t * lenp)
+{
+	ssize_t len;
+	ssize_t wlen;
+	size_t off;
+	size_t nsplices = 1;
+
+	/* Move as much as we can from the IMDS connection into the pipe. */
+	if (n > RELAYBUF)
+		n = RELAYBUF;
+	do {
+		len = splice(from, NULL, RL->pfd[1], NULL, n, SPLICE_F_MOVE);
+	} while ((len == -1) && (errno == EINTR));
+
+	/* Error or EOF?  Let the caller handle it. */
+	*lenp = len;
+	if (len <= 0)
+		return (0);
+
+	/* Move it from the pipe to the client. */
+	for (off = 0; off < (size_t)len; off += (size_t)wlen) {
+		if ((wlen = splice(RL->pfd[0], NULL, to, NULL,
+		    (size_t)len - off, SPLICE_F_MOVE)) == -1) {
+			if (errno == EINTR) {
+				wlen = 0;
+				continue;
+			}
+			goto err0;
+		}
+		nsplices++;
+	}
+
+	/* The parser doesn't need to see this data, only to count it. */
+	response_skip(R, (size_t)len);
+
+	/* Record statistics. */
+	addstats((size_t)len, nsplices, 0, 0);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* The pipe has data in it which we don't want; start over. */
+	closepipe(RL);
+	openpipe(RL);
+
+	/* Failure! */
+	return (-1);
+}
+#endif
+
+/**
+ * relay_init(void):
+ * Create a state for relaying responses from the IMDS to clients within a
+ * single thread.
+ */
+struct relay *
+relay_init(void)
+{
+	struct relay * RL;
+
+	/* Allocate a structure and a buffer. */
+	if ((RL = malloc(sizeof(struct relay))) == NULL)
+		goto err0;
+	if ((RL->buf = malloc(RELAYBUF)) == NULL)
+		goto err1;
+
+	/* Create a pipe to splice through, if we can. */
+#ifdef HAVE_SPLICE
+	openpipe(RL);
+#else
+	RL->pfd[0] = RL->pfd[1] = -1;
+#endif
+
+	/* Success! */
+	return (RL);
+
+err1:
+	free(RL);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * relay_step(RL, from, to, R, cap, len):
+ * Read some of the response tracked by ${R} from the socket ${from} and
+ * write it to the socket ${to} (unless ${to} is -1), using the relay state
+ * ${RL}; if ${cap} is not NULL, also append it to the elastic array of bytes
+ * ${cap}.
+ * Return the number of bytes read via ${len}, which is zero at EOF or -1 if
+ * reading failed (with errno set).  Return -1 if writing failed or the
+ * response was invalid, or zero otherwise.
+ */
+int
+relay_step(struct relay * RL, int from, int to, struct response * R,
+    struct elasticarray * cap, ssize_t * len)
+{
+	ssize_t rlen;
+
+	/* Splice body data if we can (and aren't keeping a copy). */
+#ifdef HAVE_SPLICE
+	if ((cap == NULL) && (RL->pfd[0] != -1) && (response_body(R) > 0))
+		return (splicebody(RL, from, to, R, response_body(R), len));
+#endif
+
+	/* Read some data into the buffer. */
+	do {
+		*len = read(from, RL->buf, RELAYBUF);
+	} while ((*len == -1) && (errno == EINTR));
+
+	/* Error or EOF?  Let the caller handle it. */
+	if (*len <= 0)
+		return (0);
+
+	/* Find out how much of this belongs to the response. */
+	if ((rlen = response_parse(R, RL->buf, (size_t)*len)) == -1)
+		goto err0;
+
+	/* Anything after the response means the IMDS is confused. */
+	if (rlen < *len) {
+		warn0("Unexpected data from IMDS after response");
+		goto err0;
+	}
+
+	/* Keep a copy, if we've been asked to. */
+	if ((cap != NULL) &&
+	    elasticarray_append(cap, RL->buf, (size_t)rlen, 1))
+		goto err0;
+
+	/* Send it to the client, unless we're holding it back. */
+	if (to == -1)
+		return (0);
+	if (noeintr_write(to, RL->buf, (size_t)rlen) != rlen)
+		goto err0;
+
+	/* Record statistics. */
+	addstats(0, 0, (size_t)rlen, 1);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * relay_count(len):
+ * Record in the relay statistics that ${len} bytes of response have been
+ * copied to a client through a buffer by code not using relay_step.
+ */
+void
+relay_count(size_t len)
+{
+
+	addstats(0, 0, len, 1);
+}
+
+/**
+ * relay_stats_log(void):
+ * Log statistics about the relaying of responses to clients.
+ */
+void
+relay_stats_log(void)
+{
+	uint64_t nbytes, nspliced, nsplices, ncopied, ncopies;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&stats_mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nbytes = stats_nbytes;
+	nspliced = stats_nspliced;
+	nsplices = stats_nsplices;
+	ncopied = stats_ncopied;
+	ncopies = stats_ncopies;
+	if ((rc = pthread_mutex_unlock(&stats_mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: relay: %ju bytes relayed; "
+	    "%ju bytes spliced in %ju splice calls; "
+	    "%ju bytes copied in %ju read/write pairs",
+	    (uintmax_t)nbytes, (uintmax_t)nspliced, (uintmax_t)nsplices,
+	    (uintmax_t)ncopied, (uintmax_t)ncopies);
+}
+
+/**
+ * relay_free(RL):
+ * Free the relay state ${RL}.
+ */
+void
+relay_free(struct relay * RL)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (RL == NULL)
+		return;
+
+	/* Close the pipe (if any) and free the buffer and structure. */
+	if (RL->pfd[0] != -1) {
+		close(RL->pfd[0]);
+		close(RL->pfd[1]);
+	}
+	free(RL->buf);
+	free(RL);
+}
@@ -11,6 +11,9 @@
 
 #include "imds-proxy.h"
 
+/* Host header sent to the IMDS. */
+#define IMDS_HOST "169.254.169.254"
+
 /**
  * We have two goals here:
  * 1. Valid HTTP requests get the right response.
@@ -82,13 +85,49 @@ err0:
 }
 
 /**
- * request_read(f, req, path):
- * Read an HTTP request from ${f}.  Store an HTTP/1.0 request (which may be
+ * http_hastoken(list, tok):
+ * Return non-zero if the comma-separated list of tokens ${list} (e.g., the
+ * value of a Connection header) contains ${tok}, ignoring case.
+ */
+int
+http_hastoken(const char * list, const char * tok)
+{
+	size_t toklen = strlen(tok);
+	const char * p = list;
+
+	/* Look at each element of the list in turn. */
+	while (*p != '\0') {
+		/* Skip whitespace and commas. */
+		while ((*p == ' ') || (*p == '\t') || (*p == ','))
+			p++;
+
+		/* Is this the token we're looking for? */
+		if ((strncasecmp(p, tok, toklen) == 0) &&
+		    ((p[toklen] == '\0') || (p[toklen] == ',') ||
+		     (p[toklen] == ' ') || (p[toklen] == '\t')))
+			return (1);
+
+		/* Move on to the next element. */
+		while ((*p != '\0') && (*p != ','))
+			p++;
+	}
+
+	/* Not found. */
+	return (0);
+}
+
+/**
+ * request_read(f, req, path, keepalive):
+ * Read an HTTP request from ${f}.  Store an HTTP/1.1 request (which may be
  * identical or may be reconstructed with the same semantic meaning) in
- * ${req}, and a normalized IMDS request path in ${path}.
+ * ${req}, and a normalized IMDS request path in ${path}.  The request does
+ * not ask for the connection to be closed, so the response must be framed
+ * by the IMDS and the connection can be reused for later requests.  Set
+ * ${keepalive} to non-zero if the client can send another request on the
+ * same connection once the response has been sent.
  */
 int
-request_read(FILE * f, char ** req, char ** path)
+request_read(FILE * f, char ** req, char ** path, int * keepalive)
 {
 	char * line = NULL;
 	size_t linecap = 0;
@@ -142,6 +181,13 @@ request_read(FILE * f, char ** req, char ** path)
 		goto err3;
 	}
 
+	/*
+	 * Connections are persistent by default from HTTP/1.1 onwards.  We
+	 * don't attempt to support HTTP/1.0 keep-alive.
+	 */
+	*keepalive = (strncmp(s, "HTTP/1.", 7) == 0) &&
+	    (s[7] >= '1') && (s[7] <= '9');
+
 	/* PUT/POST have bodies; GET/HEAD don't. */
 	if ((strcmp(method, "PUT") == 0) ||
 	    (strcmp(method, "POST") == 0))
@@ -213,21 +259,37 @@ request_read(FILE * f, char ** req, char ** path)
 		GETHDR("X-aws-ec2-metadata-token", hdr_token);
 		GETHDR("X-aws-ec2-metadata-token-ttl-seconds", hdr_token_ttl);
 #undef GETHDR
+
+		/* Does the client want us to close the connection? */
+		if ((strcasecmp(line, "Connection") == 0) &&
+		    http_hastoken(val, "close"))
+			*keepalive = 0;
+
+		/*
+		 * We never forward request bodies, so we don't know where the
+		 * next request would start if this one had a body; rather than
+		 * risk interpreting a body as a request, close the connection.
+		 */
+		if ((strcasecmp(line, "Transfer-Encoding") == 0) ||
+		    ((strcasecmp(line, "Content-Length") == 0) &&
+		     (strcmp(val, "0") != 0)))
+			*keepalive = 0;
 	}
 
 	/* Percent-encode the request path. */
 	if ((encpath = urlencode(*path)) == NULL)
 		goto err4;
 
-	/* Construct an HTTP/1.0 request. */
+	/* Construct an HTTP/1.1 request. */
 	if (asprintf(req,
-	    "%s %s HTTP/1.0"
+	    "%s %s HTTP/1.1"
+	    "\r\nHost:" IMDS_HOST
 	    "%s%s"
 	    "%s%s"
 	    "%s%s"
 	    "%s%s"
 	    "%s"
-	    "\r\nConnection: Close\r\n\r\n",
+	    "\r\n\r\n",
 	    method, encpath,
 #define DOHDR(name, var) var ? "\r\n" name ":" : "", var ? var : ""
 	    DOHDR("Forwarded", hdr_forwarded),
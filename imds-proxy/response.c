@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * We need to know where each response from the IMDS ends, so that we can
+ * tell when we've relayed the entire response and whether the connection
+ * can be reused for another request.  We track this by running the response
+ * through a small state machine which parses the status line and headers
+ * and then follows the body as delimited by Content-Length, by the chunked
+ * transfer coding, or by the connection being closed, per RFC 7230 3.3.3.
+ * The bytes themselves are relayed untouched.
+ */
+
+/* Maximum length of a response header block. */
+#define HDRMAX 8192
+
+/* Maximum length of a chunk-size or trailer line. */
+#define LINEMAX 256
+
+/* State of a response parser. */
+struct response {
+	int head;
+	int state;
+#define RS_HEADER	0
+#define RS_BODY_LENGTH	1
+#define RS_BODY_EOF	2
+#define RS_CHUNK_SIZE	3
+#define RS_CHUNK_DATA	4
+#define RS_CHUNK_CRLF	5
+#define RS_TRAILER	6
+#define RS_DONE		7
+	int status;
+	int keepalive;
+	uint64_t left;
+	size_t hlen;
+	char hbuf[HDRMAX];
+	size_t llen;
+	char lbuf[LINEMAX];
+};
+
+/* Parse the header block in ${R}->hbuf and figure out how the body ends. */
+static int
+parseheader(struct response * R)
+{
+	char * line;
+	char * eol;
+	char * val;
+	char * p;
+	int vminor;
+	int chunked = 0;
+	int haslen = 0;
+	int nobody;
+	uint64_t clen = 0;
+	uint64_t len;
+
+	/* NUL-terminate the header block; we know there's room. */
+	R->hbuf[R->hlen] = '\0';
+
+	/* Parse the Status-Line. */
+	if ((strncmp(R->hbuf, "HTTP/1.", 7) != 0) ||
+	    (R->hbuf[7] < '0') || (R->hbuf[7] > '9') ||
+	    (R->hbuf[8] != ' ') ||
+	    (R->hbuf[9] < '1') || (R->hbuf[9] > '5') ||
+	    (R->hbuf[10] < '0') || (R->hbuf[10] > '9') ||
+	    (R->hbuf[11] < '0') || (R->hbuf[11] > '9')) {
+		warn0("Invalid Status-Line from IMDS");
+		goto err0;
+	}
+	vminor = R->hbuf[7] - '0';
+	R->status = (R->hbuf[9] - '0') * 100 + (R->hbuf[10] - '0') * 10 +
+	    (R->hbuf[11] - '0');
+
+	/* Persistent connections are the default only in HTTP/1.1. */
+	R->keepalive = (vminor >= 1);
+
+	/* Look at the headers. */
+	for (line = strchr(R->hbuf, '\n') + 1; *line != '\0'; line = eol + 1) {
+		/* Find the end of this line and strip the EOL characters. */
+		eol = strchr(line, '\n');
+		for (p = eol; (p > line) && ((p[-1] == '\r')); p--)
+			continue;
+		*p = '\0';
+
+		/* Split into field-name and field-value. */
+		if ((val = strchr(line, ':')) == NULL)
+			continue;
+		*val++ = '\0';
+		while ((*val == ' ') || (*val == '\t'))
+			val++;
+
+		/* Is this a header we care about? */
+		if (strcasecmp(line, "Content-Length") == 0) {
+			/* Parse the length. */
+			for (len = 0, p = val; (*p >= '0') && (*p <= '9');
+			    p++) {
+				if (len > (UINT64_MAX - 9) / 10)
+					goto badlen;
+				len = len * 10 + (uint64_t)(*p - '0');
+			}
+			while ((*p == ' ') || (*p == '\t'))
+				p++;
+			if ((p == val) || (*p != '\0'))
+				goto badlen;
+
+			/* Conflicting lengths are fatal. */
+			if (haslen && (len != clen))
+				goto badlen;
+			haslen = 1;
+			clen = len;
+		} else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+			/* We only understand "chunked". */
+			chunked = http_hastoken(val, "chunked") ? 1 : -1;
+		} else if (strcasecmp(line, "Connection") == 0) {
+			if (http_hastoken(val, "close"))
+				R->keepalive = 0;
+			else if (http_hastoken(val, "keep-alive"))
+				R->keepalive = 1;
+		}
+	}
+
+	/* Interim responses are followed by another header block. */
+	if ((R->status >= 100) && (R->status < 200)) {
+		R->hlen = 0;
+		return (0);
+	}
+
+	/* Figure out how the body is delimited. */
+	nobody = R->head || (R->status == 204) || (R->status == 304);
+	if (nobody) {
+		R->state = RS_DONE;
+	} else if (chunked == 1) {
+		R->state = RS_CHUNK_SIZE;
+		R->llen = 0;
+	} else if ((chunked == 0) && haslen) {
+		R->left = clen;
+		R->state = (clen > 0) ? RS_BODY_LENGTH : RS_DONE;
+	} else {
+		/* The body runs until the connection is closed. */
+		R->state = RS_BODY_EOF;
+		R->keepalive = 0;
+	}
+
+	/* Success! */
+	return (0);
+
+badlen:
+	warn0("Invalid Content-Length from IMDS");
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Parse the chunk-size line in ${R}->lbuf. */
+static int
+parsechunksize(struct response * R)
+{
+	uint64_t len = 0;
+	size_t i;
+	int d;
+
+	/* Parse hex digits. */
+	for (i = 0; i < R->llen; i++) {
+		if ((R->lbuf[i] >= '0') && (R->lbuf[i] <= '9'))
+			d = R->lbuf[i] - '0';
+		else if ((R->lbuf[i] >= 'a') && (R->lbuf[i] <= 'f'))
+			d = R->lbuf[i] - 'a' + 10;
+		else if ((R->lbuf[i] >= 'A') && (R->lbuf[i] <= 'F'))
+			d = R->lbuf[i] - 'A' + 10;
+		else
+			break;
+		if (len > (UINT64_MAX >> 4))
+			goto err0;
+		len = (len << 4) + (uint64_t)d;
+	}
+
+	/* We need at least one digit; anything else must be an extension. */
+	if ((i == 0) || ((i < R->llen) && (R->lbuf[i] != ';') &&
+	    (R->lbuf[i] != ' ') && (R->lbuf[i] != '\t') &&
+	    (R->lbuf[i] != '\r')))
+		goto err0;
+
+	/* The last chunk is followed by trailers; others by data. */
+	if (len == 0) {
+		R->state = RS_TRAILER;
+	} else {
+		R->left = len;
+		R->state = RS_CHUNK_DATA;
+	}
+	R->llen = 0;
+
+	/* Success! */
+	return (0);
+
+err0:
+	warn0("Invalid chunk-size line from IMDS");
+
+	/* Failure! */
+	return (-1);
+}
+
+/* Record that ${len} bytes of the body or current chunk have gone past. */
+static void
+skipbody(struct response * R, size_t len)
+{
+
+	/* A body which runs until EOF has no end to reach. */
+	if (R->state == RS_BODY_EOF)
+		return;
+
+	/* Move on if we've finished this body or chunk. */
+	R->left -= len;
+	if (R->left == 0) {
+		if (R->state == RS_BODY_LENGTH) {
+			R->state = RS_DONE;
+		} else {
+			R->state = RS_CHUNK_CRLF;
+			R->llen = 0;
+		}
+	}
+}
+
+/**
+ * response_init(head):
+ * Create a parser for tracking the framing of an HTTP response.  If ${head}
+ * is non-zero, the response is to a HEAD request and has no body.
+ */
+struct response *
+response_init(int head)
+{
+	struct response * R;
+
+	/* Allocate a structure. */
+	if ((R = malloc(sizeof(struct response))) == NULL)
+		goto err0;
+
+	/* We haven't seen anything yet. */
+	R->head = head;
+	R->state = RS_HEADER;
+	R->status = 0;
+	R->keepalive = 0;
+	R->left = 0;
+	R->hlen = 0;
+	R->llen = 0;
+
+	/* Success! */
+	return (R);
+
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * response_parse(R, buf, len):
+ * Feed the ${len} bytes in ${buf} through the response parser ${R}.  Return
+ * the number of bytes which form part of this response (which may be fewer
+ * than ${len} if the response ends partway through the buffer), or -1 if the
+ * response is invalid.
+ */
+ssize_t
+response_parse(struct response * R, const uint8_t * buf, size_t len)
+{
+	size_t pos = 0;
+	size_t n;
+	char c;
+
+	/* Keep going until we run out of data or reach the end. */
+	while ((pos < len) && (R->state != RS_DONE)) {
+		switch (R->state) {
+		case RS_HEADER:
+			/* Buffer the header, leaving room for a NUL. */
+			if (R->hlen == HDRMAX - 1) {
+				warn0("Response header from IMDS is too long");
+				goto err0;
+			}
+			c = (char)buf[pos++];
+			if (c == '\0') {
+				warn0("Response header from IMDS contains NUL");
+				goto err0;
+			}
+			R->hbuf[R->hlen++] = c;
+
+			/* Have we reached an empty line? */
+			if (c != '\n')
+				break;
+			for (n = R->hlen - 1; n > 0; n--) {
+				if (R->hbuf[n - 1] != '\r')
+					break;
+			}
+			if ((n == 0) || (R->hbuf[n - 1] != '\n'))
+				break;
+
+			/* We have the entire header block. */
+			if (parseheader(R))
+				goto err0;
+			break;
+		case RS_BODY_LENGTH:
+		case RS_CHUNK_DATA:
+			/* Consume as much of the body as we can. */
+			n = len - pos;
+			if (n > R->left)
+				n = (size_t)R->left;
+			pos += n;
+			skipbody(R, n);
+			break;
+		case RS_BODY_EOF:
+			/* Everything up to EOF is part of the body. */
+			pos = len;
+			break;
+		case RS_CHUNK_CRLF:
+			/* Chunk data is followed by CRLF (or a bare LF). */
+			c = (char)buf[pos++];
+			if (c == '\n') {
+				R->state = RS_CHUNK_SIZE;
+				R->llen = 0;
+			} else if ((c != '\r') || (R->llen++ > 0)) {
+				warn0("Invalid chunk framing from IMDS");
+				goto err0;
+			}
+			break;
+		case RS_CHUNK_SIZE:
+		case RS_TRAILER:
+			/* Buffer a line. */
+			c = (char)buf[pos++];
+			if (c != '\n') {
+				if (R->llen == LINEMAX) {
+					warn0("Chunk line from IMDS is too "
+					    "long");
+					goto err0;
+				}
+				R->lbuf[R->llen++] = c;
+				break;
+			}
+
+			/* Strip a trailing CR. */
+			if ((R->llen > 0) && (R->lbuf[R->llen - 1] == '\r'))
+				R->llen--;
+
+			/* Process the line. */
+			if (R->state == RS_CHUNK_SIZE) {
+				if (parsechunksize(R))
+					goto err0;
+			} else if (R->llen == 0) {
+				/* An empty line ends the trailers. */
+				R->state = RS_DONE;
+			} else {
+				/* Ignore this trailer. */
+				R->llen = 0;
+			}
+			break;
+		}
+	}
+
+	/* Return the number of bytes consumed. */
+	return ((ssize_t)pos);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * response_body(R):
+ * Return the number of bytes which come next in the response tracked by
+ * ${R} and are body data which need not be passed to response_parse, or
+ * SIZE_MAX if the rest of the response is body data running until EOF.
+ * Return zero if the parser needs to see the next bytes.
+ */
+size_t
+response_body(const struct response * R)
+{
+
+	switch (R->state) {
+	case RS_BODY_LENGTH:
+	case RS_CHUNK_DATA:
+		return ((R->left > SIZE_MAX) ? SIZE_MAX : (size_t)R->left);
+	case RS_BODY_EOF:
+		return (SIZE_MAX);
+	default:
+		return (0);
+	}
+}
+
+/**
+ * response_skip(R, len):
+ * Record that ${len} bytes of body data, which must not be more than
+ * response_body(${R}) returned, have been relayed without being parsed.
+ */
+void
+response_skip(struct response * R, size_t len)
+{
+
+	skipbody(R, len);
+}
+
+/**
+ * response_eof(R):
+ * The connection carrying the response tracked by ${R} has been closed.
+ * Return zero if the response is complete, or -1 if it was truncated.
+ */
+int
+response_eof(struct response * R)
+{
+
+	/* A body which runs until EOF is now complete. */
+	if (R->state == RS_BODY_EOF)
+		R->state = RS_DONE;
+
+	/* Is the response complete? */
+	return ((R->state == RS_DONE) ? 0 : -1);
+}
+
+/**
+ * response_done(R):
+ * Return non-zero if the entire response tracked by ${R} has been parsed.
+ */
+int
+response_done(const struct response * R)
+{
+
+	return (R->state == RS_DONE);
+}
+
+/**
+ * response_status(R):
+ * Return the Status-Code of the response tracked by ${R}, or zero if its
+ * header has not been parsed yet.
+ */
+int
+response_status(const struct response * R)
+{
+
+	return (R->status);
+}
+
+/**
+ * response_keepalive(R):
+ * Return non-zero if the connection carrying the response tracked by ${R}
+ * can be reused for another request once the response is complete.
+ */
+int
+response_keepalive(const struct response * R)
+{
+
+	return (R->keepalive);
+}
+
+/**
+ * response_free(R):
+ * Free the response parser ${R}.
+ */
+void
+response_free(struct response * R)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (R == NULL)
+		return;
+
+	/* Free the structure. */
+	free(R);
+}
@@ -0,0 +1,314 @@
+#include <sys/time.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * The configuration can be read again (on SIGHUP) while requests are being
+ * handled.  Each configuration we've read is a version with a reference
+ * count; the current version holds one reference, and each connection holds
+ * one for the version it's using.  Reloading reads the new configuration
+ * without holding any locks, then swaps it in as the current version; a
+ * connection keeps using the version it has until it starts its next
+ * request, so requests in progress finish under the rules they started
+ * with.  Each version is freed once nothing is using it.
+ *
+ * Connections check whether the current version has changed with a single
+ * atomic load; the mutex is only taken when a connection starts using a
+ * version or stops using one.
+ */
+
+/* A version of the configuration. */
+struct rsver {
+	struct imds_conf * imdsc;
+	size_t refs;
+};
+
+/* The configuration, and where it came from. */
+struct ruleset {
+	char * path;
+	char * binpath;
+	struct rsver * cur;
+	pthread_mutex_t mtx;
+};
+
+/* Create a version holding the configuration ${imdsc}. */
+static struct rsver *
+rsver_init(struct imds_conf * imdsc)
+{
+	struct rsver * V;
+
+	/* Allocate a structure; the current version holds a reference. */
+	if ((V = malloc(sizeof(struct rsver))) == NULL)
+		return (NULL);
+	V->imdsc = imdsc;
+	V->refs = 1;
+
+	/* Success! */
+	return (V);
+}
+
+/* Free the version ${V}. */
+static void
+rsver_free(struct rsver * V)
+{
+
+	conf_free(V->imdsc);
+	free(V);
+}
+
+/* Lock ${RS}. */
+static void
+lock(struct ruleset * RS)
+{
+	int rc;
+
+	if ((rc = pthread_mutex_lock(&RS->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+}
+
+/* Unlock ${RS}. */
+static void
+unlock(struct ruleset * RS)
+{
+	int rc;
+
+	if ((rc = pthread_mutex_unlock(&RS->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+}
+
+/*
+ * Log that ${RS} has ${what} its configuration ${imdsc}, taking ${t} seconds;
+ * including how much of that time was spent looking up user and group names,
+ * since a slow name service can make loading the configuration slow.
+ */
+static void
+report(struct ruleset * RS, const char * what,
+    const struct imds_conf * imdsc, double t)
+{
+	size_t nnames;
+	double nametime;
+
+	conf_names(imdsc, &nnames, &nametime);
+	syslog(LOG_INFO, "imds-proxy: %s %s: %zu rules in %.3f ms "
+	    "(%zu names looked up in %.3f ms)", what, RS->path,
+	    conf_nrules(imdsc), t * 1000.0, nnames, nametime * 1000.0);
+}
+
+/**
+ * ruleset_init(path, binpath):
+ * Load the imds-proxy configuration file ${path} (using the compiled
+ * configuration ${binpath}, if not NULL, as conf_load does), and prepare to
+ * load it again when asked to.
+ */
+struct ruleset *
+ruleset_init(const char * path, const char * binpath)
+{
+	struct ruleset * RS;
+	struct imds_conf * imdsc;
+	struct timeval tv0, tv1;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((RS = malloc(sizeof(struct ruleset))) == NULL)
+		goto err0;
+	if ((RS->path = strdup(path)) == NULL)
+		goto err1;
+	RS->binpath = NULL;
+	if ((binpath != NULL) && ((RS->binpath = strdup(binpath)) == NULL))
+		goto err2;
+
+	/* Load the configuration, timing how long it takes. */
+	if (monoclock_get(&tv0)) {
+		warnp("monoclock_get");
+		goto err3;
+	}
+	if ((imdsc = conf_load(path, binpath)) == NULL)
+		goto err3;
+	if (monoclock_get(&tv1)) {
+		warnp("monoclock_get");
+		goto err4;
+	}
+	if ((RS->cur = rsver_init(imdsc)) == NULL)
+		goto err4;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&RS->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err5;
+	}
+
+	/* Report what we read and how long it took. */
+	report(RS, "loaded", imdsc, timeval_diff(tv0, tv1));
+
+	/* Success! */
+	return (RS);
+
+err5:
+	free(RS->cur);
+err4:
+	conf_free(imdsc);
+err3:
+	free(RS->binpath);
+err2:
+	free(RS->path);
+err1:
+	free(RS);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * ruleset_get(RS, ref):
+ * Return the current configuration in ${RS}, and via ${ref} a reference
+ * which must be passed to ruleset_put (or ruleset_refresh) once the caller
+ * is done with it.  This may be called by several threads at once.
+ */
+const struct imds_conf *
+ruleset_get(struct ruleset * RS, void ** ref)
+{
+	struct rsver * V;
+
+	/* Take a reference to the current version. */
+	lock(RS);
+	V = RS->cur;
+	V->refs++;
+	unlock(RS);
+
+	/* Return the configuration. */
+	*ref = V;
+	return (V->imdsc);
+}
+
+/**
+ * ruleset_put(RS, ref):
+ * Release the reference ${ref} returned by ruleset_get.
+ */
+void
+ruleset_put(struct ruleset * RS, void * ref)
+{
+	struct rsver * V = ref;
+	size_t refs;
+
+	/* Drop the reference. */
+	lock(RS);
+	refs = --V->refs;
+	unlock(RS);
+
+	/* If that was the last one, this is an old version; free it. */
+	if (refs == 0)
+		rsver_free(V);
+}
+
+/**
+ * ruleset_refresh(RS, ref):
+ * If the configuration for which ${*ref} is a reference is no longer the
+ * current configuration in ${RS}, release it and replace ${*ref} with a
+ * reference to the current one.  Return the configuration ${*ref} is for.
+ */
+const struct imds_conf *
+ruleset_refresh(struct ruleset * RS, void ** ref)
+{
+	struct rsver * V = *ref;
+
+	/* Nothing to do if this is still the current version. */
+	if (__atomic_load_n(&RS->cur, __ATOMIC_ACQUIRE) == V)
+		return (V->imdsc);
+
+	/* Switch to the current version. */
+	ruleset_put(RS, V);
+	return (ruleset_get(RS, ref));
+}
+
+/**
+ * ruleset_reload(RS):
+ * Load the configuration again, and make it the current configuration in
+ * ${RS}.  If it can't be read, keep using the current configuration.
+ */
+int
+ruleset_reload(struct ruleset * RS)
+{
+	struct imds_conf * imdsc;
+	struct rsver * V;
+	struct rsver * O;
+	struct timeval tv0, tv1;
+	int rate, burst, orate, oburst;
+	size_t refs;
+
+	/* Load the configuration, timing how long it takes. */
+	if (monoclock_get(&tv0)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+	if ((imdsc = conf_load(RS->path, RS->binpath)) == NULL) {
+		warnp("Could not reload configuration file: %s", RS->path);
+		goto err0;
+	}
+	if (monoclock_get(&tv1)) {
+		warnp("monoclock_get");
+		goto err1;
+	}
+	if ((V = rsver_init(imdsc)) == NULL)
+		goto err1;
+
+	/* Make it the current version. */
+	lock(RS);
+	O = RS->cur;
+	conf_pace(O->imdsc, &orate, &oburst);
+	__atomic_store_n(&RS->cur, V, __ATOMIC_RELEASE);
+	refs = --O->refs;
+	unlock(RS);
+
+	/* Pacing is set up when we start, so we can't change it now. */
+	conf_pace(imdsc, &rate, &burst);
+	if ((rate != orate) || (burst != oburst))
+		warn0("Pace changes take effect when imds-proxy restarts");
+
+	/* Free the old version if nothing is using it. */
+	if (refs == 0)
+		rsver_free(O);
+
+	/* Report what we read and how long it took. */
+	report(RS, "reloaded", imdsc, timeval_diff(tv0, tv1));
+
+	/* Success! */
+	return (0);
+
+err1:
+	conf_free(imdsc);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * ruleset_free(RS):
+ * Free ${RS} and its current configuration, which must not be in use.
+ */
+void
+ruleset_free(struct ruleset * RS)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (RS == NULL)
+		return;
+
+	/* Free the current version, the mutex, and the structure. */
+	rsver_free(RS->cur);
+	pthread_mutex_destroy(&RS->mtx);
+	free(RS->binpath);
+	free(RS->path);
+	free(RS);
+}
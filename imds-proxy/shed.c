@@ -0,0 +1,284 @@
+#include <sys/time.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * When the IMDS or imds-filterd is slow, every request we accept ties up
+ * resources until it completes, and accepting more requests only makes the
+ * ones already in progress slower.  Past configured thresholds -- on the
+ * number of requests in flight, on how long connections have waited for a
+ * worker, and on how long the IMDS has recently been taking to respond --
+ * we refuse new requests immediately, so the ones in progress can finish.
+ *
+ * IMDS latency is tracked as an exponentially weighted moving average of
+ * response times; since we stop sending requests once it is too high, an
+ * average which hasn't been updated for SHED_WINDOW seconds is ignored, so
+ * that we try again once the requests which were in progress are done.
+ */
+
+/* Weight given to each new latency sample. */
+#define LATENCY_WEIGHT 0.125
+
+/* Seconds for which a latency measurement is considered current. */
+#define SHED_WINDOW 1.0
+
+/* Load-shedding state. */
+struct shed {
+	pthread_mutex_t mtx;
+
+	/* Thresholds; zero means "no limit". */
+	size_t maxinflight;
+	double maxqage;
+	double maxlatency;
+
+	/* Current load. */
+	size_t inflight;
+	double latency;
+	struct timeval t_latency;
+	int havelatency;
+
+	/* Statistics. */
+	size_t maxseen;
+	uint64_t nshed_inflight;
+	uint64_t nshed_qage;
+	uint64_t nshed_latency;
+};
+
+/**
+ * shed_init(maxinflight, maxqage, maxlatency):
+ * Create a load-shedding state which sheds requests while ${maxinflight}
+ * are already in flight, connections have waited more than
+ * ${maxqage} seconds for a worker, or the IMDS has recently been taking
+ * more than ${maxlatency} seconds to respond.  Zero disables a threshold.
+ */
+struct shed *
+shed_init(size_t maxinflight, double maxqage, double maxlatency)
+{
+	struct shed * SH;
+	int rc;
+
+	/* Allocate a structure. */
+	if ((SH = malloc(sizeof(struct shed))) == NULL)
+		goto err0;
+	SH->maxinflight = maxinflight;
+	SH->maxqage = maxqage;
+	SH->maxlatency = maxlatency;
+	SH->inflight = 0;
+	SH->latency = 0.0;
+	SH->havelatency = 0;
+	SH->maxseen = 0;
+	SH->nshed_inflight = 0;
+	SH->nshed_qage = 0;
+	SH->nshed_latency = 0;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&SH->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* Success! */
+	return (SH);
+
+err1:
+	free(SH);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * shed_check(SH, qage):
+ * Return nonzero if a request which has waited ${qage} seconds to be
+ * handled should be refused in order to shed load, per ${SH}.
+ */
+int
+shed_check(struct shed * SH, double qage)
+{
+	struct timeval tv;
+	int shed = 0;
+	int rc;
+
+	/* Find out what time it is. */
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		return (0);
+	}
+
+	/* Lock the state. */
+	if ((rc = pthread_mutex_lock(&SH->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return (0);
+	}
+
+	/* Check each threshold in turn. */
+	if ((SH->maxinflight > 0) && (SH->inflight >= SH->maxinflight)) {
+		SH->nshed_inflight++;
+		shed = 1;
+	} else if ((SH->maxqage > 0.0) && (qage > SH->maxqage)) {
+		SH->nshed_qage++;
+		shed = 1;
+	} else if ((SH->maxlatency > 0.0) && SH->havelatency &&
+	    (SH->latency > SH->maxlatency) &&
+	    (timeval_diff(SH->t_latency, tv) < SHED_WINDOW)) {
+		SH->nshed_latency++;
+		shed = 1;
+	}
+
+	/* Unlock the state. */
+	if ((rc = pthread_mutex_unlock(&SH->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+
+	/* Return the verdict. */
+	return (shed);
+}
+
+/**
+ * shed_start(SH):
+ * Record in ${SH} that a request is in flight.
+ */
+void
+shed_start(struct shed * SH)
+{
+	int rc;
+
+	/* Lock the state. */
+	if ((rc = pthread_mutex_lock(&SH->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Count the request. */
+	SH->inflight++;
+	if (SH->inflight > SH->maxseen)
+		SH->maxseen = SH->inflight;
+
+	/* Unlock the state. */
+	if ((rc = pthread_mutex_unlock(&SH->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/**
+ * shed_finish(SH):
+ * Record in ${SH} that a request passed to shed_start is no longer in
+ * flight.
+ */
+void
+shed_finish(struct shed * SH)
+{
+	int rc;
+
+	/* Lock the state. */
+	if ((rc = pthread_mutex_lock(&SH->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Stop counting the request. */
+	if (SH->inflight > 0)
+		SH->inflight--;
+
+	/* Unlock the state. */
+	if ((rc = pthread_mutex_unlock(&SH->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/**
+ * shed_latency(SH, t_start):
+ * Record in ${SH} that a request which was sent to the IMDS at ${t_start}
+ * has just finished (successfully or otherwise).
+ */
+void
+shed_latency(struct shed * SH, const struct timeval * t_start)
+{
+	struct timeval tv;
+	double t;
+	int rc;
+
+	/* How long did it take? */
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		return;
+	}
+	t = timeval_diff((*t_start), tv);
+
+	/* Lock the state. */
+	if ((rc = pthread_mutex_lock(&SH->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+
+	/* Fold it into the average. */
+	if (SH->havelatency)
+		SH->latency += (t - SH->latency) * LATENCY_WEIGHT;
+	else
+		SH->latency = t;
+	SH->havelatency = 1;
+	SH->t_latency = tv;
+
+	/* Unlock the state. */
+	if ((rc = pthread_mutex_unlock(&SH->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/**
+ * shed_stats_log(SH):
+ * Log statistics about the load and the requests shed per ${SH}.
+ */
+void
+shed_stats_log(struct shed * SH)
+{
+	uint64_t nshed_inflight, nshed_qage, nshed_latency;
+	size_t inflight, maxseen;
+	double latency;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&SH->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nshed_inflight = SH->nshed_inflight;
+	nshed_qage = SH->nshed_qage;
+	nshed_latency = SH->nshed_latency;
+	inflight = SH->inflight;
+	maxseen = SH->maxseen;
+	latency = SH->latency;
+	if ((rc = pthread_mutex_unlock(&SH->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: load: %zu requests in flight (max %zu), "
+	    "IMDS latency %.3f ms; shed %ju (in flight), %ju (queue age), "
+	    "%ju (latency)",
+	    inflight, maxseen, latency * 1000.0, (uintmax_t)nshed_inflight,
+	    (uintmax_t)nshed_qage, (uintmax_t)nshed_latency);
+}
+
+/**
+ * shed_free(SH):
+ * Free the load-shedding state ${SH}.
+ */
+void
+shed_free(struct shed * SH)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (SH == NULL)
+		return;
+
+	/* Free the mutex and the structure. */
+	pthread_mutex_destroy(&SH->mtx);
+	free(SH);
+}
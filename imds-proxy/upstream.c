@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Connections to the IMDS go via imds-filterd, which makes a new TCP
+ * connection to the IMDS for each connection we make to it; so rather than
+ * closing connections after each response, we keep up to ${nidle} of them
+ * around and reuse them for later requests.  The IMDS may close an idle
+ * connection at any time; we catch most such connections when we take them
+ * out of the pool, but callers must be prepared for a reused connection to
+ * fail before any response arrives, and retry with a new connection.
+ */
+
+/* Pool of idle connections to the IMDS. */
+struct upstream {
+	pthread_mutex_t mtx;
+	int * fds;
+	size_t nidle;
+	size_t nfds;
+
+	/* Statistics. */
+	uint64_t nreused;
+	uint64_t nmissed;
+	uint64_t nstale;
+	uint64_t nreturned;
+	uint64_t ndiscarded;
+};
+
+/* Is the idle connection ${s} still usable? */
+static int
+isalive(int s)
+{
+	struct pollfd pfd;
+
+	/*
+	 * An idle connection should have nothing to read; if it is readable
+	 * then the IMDS has closed it (or sent us something unexpected).
+	 */
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) == -1) {
+		if (errno != EINTR)
+			return (0);
+	}
+	return ((pfd.revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) == 0);
+}
+
+/**
+ * upstream_init(nidle):
+ * Create a pool which holds up to ${nidle} idle connections to the IMDS.  If
+ * ${nidle} is zero, connections are never reused.
+ */
+struct upstream *
+upstream_init(size_t nidle)
+{
+	struct upstream * U;
+	int rc;
+
+	/* Allocate a structure and space for the idle connections. */
+	if ((U = malloc(sizeof(struct upstream))) == NULL)
+		goto err0;
+	if ((U->fds = malloc((nidle + 1) * sizeof(int))) == NULL)
+		goto err1;
+	U->nidle = nidle;
+	U->nfds = 0;
+	U->nreused = 0;
+	U->nmissed = 0;
+	U->nstale = 0;
+	U->nreturned = 0;
+	U->ndiscarded = 0;
+
+	/* Initialize the mutex. */
+	if ((rc = pthread_mutex_init(&U->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err2;
+	}
+
+	/* Success! */
+	return (U);
+
+err2:
+	free(U->fds);
+err1:
+	free(U);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/**
+ * upstream_get(U):
+ * Return an idle connection to the IMDS from the pool ${U}, or -1 if there
+ * are none; in the latter case the caller should make a new connection.
+ */
+int
+upstream_get(struct upstream * U)
+{
+	int s = -1;
+	int rc;
+
+	/* Lock the pool. */
+	if ((rc = pthread_mutex_lock(&U->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return (-1);
+	}
+
+	/* Take the most recently used connection which is still alive. */
+	while (U->nfds > 0) {
+		s = U->fds[--U->nfds];
+		if (isalive(s))
+			break;
+		U->nstale++;
+		close(s);
+		s = -1;
+	}
+
+	/* Record whether we found one. */
+	if (s != -1)
+		U->nreused++;
+	else
+		U->nmissed++;
+
+	/* Unlock the pool. */
+	if ((rc = pthread_mutex_unlock(&U->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		if (s != -1)
+			close(s);
+		return (-1);
+	}
+
+	/* Return the connection (if any). */
+	return (s);
+}
+
+/**
+ * upstream_put(U, s):
+ * Return the connection ${s}, which has finished reading a response and has
+ * nothing else in flight, to the pool ${U}.  If the pool is full, close it.
+ */
+void
+upstream_put(struct upstream * U, int s)
+{
+	int rc;
+
+	/* Lock the pool. */
+	if ((rc = pthread_mutex_lock(&U->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		close(s);
+		return;
+	}
+
+	/* Keep the connection if we have space; otherwise close it. */
+	if (U->nfds < U->nidle) {
+		U->fds[U->nfds++] = s;
+		U->nreturned++;
+	} else {
+		U->ndiscarded++;
+		close(s);
+	}
+
+	/* Unlock the pool. */
+	if ((rc = pthread_mutex_unlock(&U->mtx)) != 0)
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+}
+
+/**
+ * upstream_stats_log(U):
+ * Log statistics about the reuse of connections in the pool ${U}.
+ */
+void
+upstream_stats_log(struct upstream * U)
+{
+	uint64_t nreused, nmissed, nstale, nreturned, ndiscarded;
+	size_t nfds;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&U->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nreused = U->nreused;
+	nmissed = U->nmissed;
+	nstale = U->nstale;
+	nreturned = U->nreturned;
+	ndiscarded = U->ndiscarded;
+	nfds = U->nfds;
+	if ((rc = pthread_mutex_unlock(&U->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: upstream: %ju reused, %ju new, "
+	    "%ju stale; %ju returned to pool, %ju closed (pool full), "
+	    "%zu idle",
+	    (uintmax_t)nreused, (uintmax_t)nmissed, (uintmax_t)nstale,
+	    (uintmax_t)nreturned, (uintmax_t)ndiscarded, nfds);
+}
+
+/**
+ * upstream_free(U):
+ * Close all the idle connections in the pool ${U} and free it.
+ */
+void
+upstream_free(struct upstream * U)
+{
+
+	/* Behave consistently with free(NULL). */
+	if (U == NULL)
+		return;
+
+	/* Close idle connections. */
+	while (U->nfds > 0)
+		close(U->fds[--U->nfds]);
+
+	/* Free the mutex and the structure. */
+	pthread_mutex_destroy(&U->mtx);
+	free(U->fds);
+	free(U);
+}
@@ -0,0 +1,637 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * A worker handles requests from a client until the client has no request
+ * ready to be read (or until other connections are waiting for a worker,
+ * in which case the client goes to the back of the queue).  A client which
+ * has gone idle is handed back to the acceptor, which watches it along with
+ * the listening socket and queues it for a worker when it sends another
+ * request, or closes it after KEEPALIVE_TIMEOUT seconds; so a client which
+ * is slow to send its next request doesn't tie up a worker.
+ */
+
+/* Maximum number of connections to accept per readiness event. */
+#define ACCEPT_BATCH 32
+
+/* Maximum number of idle clients per listening socket. */
+#define MAXIDLE 1024
+
+/* A connection waiting for a worker, or a client waiting for a request. */
+struct qent {
+	int s;			/* New connection, or -1. */
+	struct client * C;	/* Client which has made requests, or NULL. */
+	struct timeval t;	/* When it started waiting. */
+};
+
+/* State shared by the workers and the acceptor for one listening socket. */
+struct workers {
+	/* What the workers need to handle connections. */
+	const struct proxy * P;
+
+	/* The listening socket, and its number for logging. */
+	int s;
+	size_t n;
+
+	/* Circular queue of connections waiting for a worker. */
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	struct qent * q;
+	size_t qlen;
+	size_t qhead;
+	size_t qcount;
+
+	/*
+	 * Clients which have gone idle but which the acceptor hasn't picked
+	 * up yet, and the number of idle clients in total.  Workers write to
+	 * the pipe to wake up the acceptor when they add clients here.
+	 */
+	struct qent * parked;
+	size_t nparked;
+	size_t nidle;
+	int wake[2];
+
+	/* Idle clients which the acceptor is watching, oldest first. */
+	struct qent * idle;
+	size_t nwatched;
+	struct pollfd * pfds;
+
+	/* Statistics. */
+	uint64_t nqueued;
+	uint64_t nserved;
+	uint64_t nrejected;
+	uint64_t nidlefull;
+	double waitsum;
+	double waitmax;
+};
+
+/*
+ * If other connections are waiting for a worker, put the client ${C} (which
+ * has another request ready) at the back of the queue and return non-zero;
+ * otherwise, return zero so that the caller handles the request itself.
+ */
+static int
+requeue(struct workers * W, struct client * C)
+{
+	struct timeval tv;
+	int queued = 0;
+	int rc;
+
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Take our turn if anyone is waiting and there is room. */
+	if ((W->qcount > 0) && (W->qcount < W->qlen)) {
+		if (monoclock_get(&tv)) {
+			warnp("monoclock_get");
+			exit(1);
+		}
+		W->q[(W->qhead + W->qcount) % W->qlen].s = -1;
+		W->q[(W->qhead + W->qcount) % W->qlen].C = C;
+		W->q[(W->qhead + W->qcount) % W->qlen].t = tv;
+		W->qcount++;
+		W->nqueued++;
+		queued = 1;
+
+		/* Wake up a worker. */
+		if ((rc = pthread_cond_signal(&W->cv)) != 0) {
+			warn0("pthread_cond_signal: %s", strerror(rc));
+			exit(1);
+		}
+	}
+
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Tell the caller whether to handle the request. */
+	return (queued);
+}
+
+/* Hand the idle client ${C} to the acceptor to watch. */
+static void
+park(struct workers * W, struct client * C)
+{
+	int rc;
+
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* If we have too many idle clients, close this one. */
+	if (W->nidle == MAXIDLE) {
+		W->nidlefull++;
+		if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+			warn0("pthread_mutex_unlock: %s", strerror(rc));
+			exit(1);
+		}
+		http_close(C, W->P);
+		return;
+	}
+
+	/*
+	 * Add the client to those waiting to be picked up, noting the time
+	 * while we hold the lock so that clients are kept in the order in
+	 * which they went idle.
+	 */
+	if (monoclock_get(&W->parked[W->nparked].t)) {
+		warnp("monoclock_get");
+		exit(1);
+	}
+	W->parked[W->nparked].s = -1;
+	W->parked[W->nparked].C = C;
+	W->nparked++;
+	W->nidle++;
+
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		exit(1);
+	}
+
+	/* Wake up the acceptor; if the pipe is full, it's awake already. */
+	if ((write(W->wake[1], "", 1) == -1) &&
+	    (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+		warnp("write");
+		exit(1);
+	}
+}
+
+/* Pull connections from the queue and handle them. */
+static void *
+workthread(void * cookie)
+{
+	struct workers * W = cookie;
+	struct relay * RL;
+	struct client * C;
+	struct timeval tv;
+	double wait;
+	int shed;
+	int rc;
+	int s;
+
+	/* Each worker has its own buffer (etc.) for relaying responses. */
+	if ((RL = relay_init()) == NULL) {
+		warnp("relay_init");
+		exit(1);
+	}
+
+	do {
+		/* Wait for a connection to arrive. */
+		if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+			warn0("pthread_mutex_lock: %s", strerror(rc));
+			exit(1);
+		}
+		while (W->qcount == 0) {
+			if ((rc = pthread_cond_wait(&W->cv, &W->mtx)) != 0) {
+				warn0("pthread_cond_wait: %s", strerror(rc));
+				exit(1);
+			}
+		}
+
+		/* Take the connection from the head of the queue. */
+		s = W->q[W->qhead].s;
+		C = W->q[W->qhead].C;
+		if (monoclock_get(&tv)) {
+			warnp("monoclock_get");
+			wait = 0.0;
+		} else {
+			wait = timeval_diff(W->q[W->qhead].t, tv);
+		}
+		W->qhead = (W->qhead + 1) % W->qlen;
+		W->qcount--;
+
+		/* Record how long it was waiting. */
+		W->nserved++;
+		W->waitsum += wait;
+		if (wait > W->waitmax)
+			W->waitmax = wait;
+
+		/* Let other threads at the queue. */
+		if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+			warn0("pthread_mutex_unlock: %s", strerror(rc));
+			exit(1);
+		}
+
+		/*
+		 * Refuse this connection if it has waited so long (or we are
+		 * so busy) that we shouldn't handle it.  For a new connection
+		 * we don't even need to know who it's from.
+		 */
+		shed = shed_check(W->P->SH, wait);
+		if (C == NULL) {
+			if (shed) {
+				http_shed(s);
+				continue;
+			}
+			if ((C = http_open(s, W->P)) == NULL)
+				continue;
+		}
+
+		/* Handle requests until the client goes idle or must wait. */
+		do {
+			rc = http_serve(C, shed, W->P, RL);
+			shed = shed_check(W->P->SH, 0.0);
+		} while ((rc == 1) && !requeue(W, C));
+
+		/* Watch an idle client, or close a client which is done. */
+		if (rc == 0)
+			park(W, C);
+		else if (rc == -1)
+			http_close(C, W->P);
+	} while (1);
+
+	/* NOTREACHED */
+}
+
+/**
+ * workers_init(n, s, nthreads, qlen, P):
+ * Spawn ${nthreads} worker threads which handle connections accepted by
+ * workers_accept from the non-blocking listening socket ${s} by calling
+ * http_serve with ${P}.  Allow up to ${qlen} connections to wait for a
+ * worker.  Statistics are logged as being for listening socket #${n}.
+ */
+struct workers *
+workers_init(size_t n, int s, size_t nthreads, size_t qlen,
+    const struct proxy * P)
+{
+	struct workers * W;
+	pthread_t thr;
+	size_t i;
+	int rc;
+
+	/* Allocate a state structure and the queue. */
+	if ((W = malloc(sizeof(struct workers))) == NULL)
+		goto err0;
+	W->P = P;
+	W->s = s;
+	W->n = n;
+	if ((W->q = malloc(qlen * sizeof(struct qent))) == NULL)
+		goto err1;
+	W->qlen = qlen;
+	W->qhead = 0;
+	W->qcount = 0;
+	W->nqueued = 0;
+	W->nserved = 0;
+	W->nrejected = 0;
+	W->nidlefull = 0;
+	W->waitsum = 0.0;
+	W->waitmax = 0.0;
+
+	/* Allocate space for idle clients. */
+	if ((W->parked = malloc(MAXIDLE * sizeof(struct qent))) == NULL)
+		goto err2;
+	if ((W->idle = malloc(MAXIDLE * sizeof(struct qent))) == NULL)
+		goto err3;
+	if ((W->pfds = malloc((MAXIDLE + 2) * sizeof(struct pollfd))) == NULL)
+		goto err4;
+	W->nparked = 0;
+	W->nidle = 0;
+	W->nwatched = 0;
+
+	/* Create a pipe for waking up the acceptor; neither end blocks. */
+	if (pipe(W->wake)) {
+		warnp("pipe");
+		goto err5;
+	}
+	if ((fcntl(W->wake[0], F_SETFL, O_NONBLOCK) == -1) ||
+	    (fcntl(W->wake[1], F_SETFL, O_NONBLOCK) == -1)) {
+		warnp("Cannot make pipe non-blocking");
+		goto err6;
+	}
+
+	/* Initialize the mutex and condition variable. */
+	if ((rc = pthread_mutex_init(&W->mtx, NULL)) != 0) {
+		warn0("pthread_mutex_init: %s", strerror(rc));
+		goto err6;
+	}
+	if ((rc = pthread_cond_init(&W->cv, NULL)) != 0) {
+		warn0("pthread_cond_init: %s", strerror(rc));
+		goto err7;
+	}
+
+	/*
+	 * Spawn the workers.  They never exit, so we detach them rather than
+	 * keeping their thread IDs around; and if we fail to spawn one we
+	 * can't clean up the state they're using, so the caller will have to
+	 * exit.
+	 */
+	for (i = 0; i < nthreads; i++) {
+		if ((rc = pthread_create(&thr, NULL, workthread, W)) != 0) {
+			warn0("pthread_create: %s", strerror(rc));
+			goto err0;
+		}
+		if ((rc = pthread_detach(thr)) != 0) {
+			warn0("pthread_detach: %s", strerror(rc));
+			goto err0;
+		}
+	}
+
+	/* Success! */
+	return (W);
+
+err7:
+	pthread_mutex_destroy(&W->mtx);
+err6:
+	close(W->wake[1]);
+	close(W->wake[0]);
+err5:
+	free(W->pfds);
+err4:
+	free(W->idle);
+err3:
+	free(W->parked);
+err2:
+	free(W->q);
+err1:
+	free(W);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/*
+ * Queue the connection ${s}, or the client ${C} if ${s} is -1, to be handled
+ * by one of the workers ${W}.  If the queue is full, close the connection
+ * and record it as rejected; if we are shedding load, refuse a new
+ * connection with http_shed.
+ */
+static int
+submit(struct workers * W, int s, struct client * C)
+{
+	struct timeval tv;
+	int rc;
+
+	/* If we're too busy, don't make a new connection wait to find out. */
+	if ((s != -1) && shed_check(W->P->SH, 0.0)) {
+		http_shed(s);
+		return (0);
+	}
+
+	/* Grab the time before we wait for the lock. */
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		goto err1;
+	}
+
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err1;
+	}
+
+	/* If the queue is full, drop the connection. */
+	if (W->qcount == W->qlen) {
+		W->nrejected++;
+		if (s != -1)
+			close(s);
+		else
+			http_close(C, W->P);
+		goto unlock;
+	}
+
+	/* Add the connection to the tail of the queue. */
+	W->q[(W->qhead + W->qcount) % W->qlen].s = s;
+	W->q[(W->qhead + W->qcount) % W->qlen].C = C;
+	W->q[(W->qhead + W->qcount) % W->qlen].t = tv;
+	W->qcount++;
+	W->nqueued++;
+
+	/* Wake up a worker. */
+	if ((rc = pthread_cond_signal(&W->cv)) != 0) {
+		warn0("pthread_cond_signal: %s", strerror(rc));
+		pthread_mutex_unlock(&W->mtx);
+		goto err0;
+	}
+
+unlock:
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err1:
+	if (s != -1)
+		close(s);
+	else
+		http_close(C, W->P);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Queue idle clients which have become readable, close those which have
+ * been idle for too long, and pick up clients which have gone idle.
+ */
+static int
+watch(struct workers * W, int woken)
+{
+	struct timeval tv;
+	uint8_t buf[64];
+	size_t i, j;
+	int rc;
+
+	/* Check the idle clients, keeping the ones which are still idle. */
+	if (monoclock_get(&tv)) {
+		warnp("monoclock_get");
+		goto err0;
+	}
+	for (i = j = 0; i < W->nwatched; i++) {
+		if (W->pfds[i + 2].revents != 0) {
+			if (submit(W, -1, W->idle[i].C))
+				goto err0;
+		} else if (timeval_diff(W->idle[i].t, tv) >=
+		    KEEPALIVE_TIMEOUT) {
+			http_close(W->idle[i].C, W->P);
+		} else {
+			W->idle[j++] = W->idle[i];
+		}
+	}
+
+	/* Nothing more to do if no clients came or went. */
+	if ((j == W->nwatched) && !woken)
+		return (0);
+
+	/* Empty the wakeup pipe. */
+	while (read(W->wake[0], buf, sizeof(buf)) > 0)
+		continue;
+
+	/* Lock the queue. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Forget the clients we're done with, and pick up new idle ones. */
+	W->nidle -= W->nwatched - j;
+	memcpy(&W->idle[j], W->parked, W->nparked * sizeof(struct qent));
+	W->nwatched = j + W->nparked;
+	W->nparked = 0;
+
+	/* Unlock the queue. */
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		goto err0;
+	}
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * workers_accept(W):
+ * Accept connections from the listening socket of the workers ${W} and
+ * queue them to be handled, along with idle clients which have sent another
+ * request.  Return only if an error occurs.
+ */
+int
+workers_accept(struct workers * W)
+{
+	struct timeval tv;
+	double t;
+	size_t i;
+	int timeout;
+	int s_conn;
+	int flags;
+
+	do {
+		/* Watch the listening socket, the pipe, and idle clients. */
+		W->pfds[0].fd = W->s;
+		W->pfds[0].events = POLLIN;
+		W->pfds[1].fd = W->wake[0];
+		W->pfds[1].events = POLLIN;
+		for (i = 0; i < W->nwatched; i++) {
+			W->pfds[i + 2].fd = http_fd(W->idle[i].C);
+			W->pfds[i + 2].events = POLLIN;
+		}
+
+		/* Stop waiting when the oldest idle client times out. */
+		timeout = -1;
+		if (W->nwatched > 0) {
+			if (monoclock_get(&tv)) {
+				warnp("monoclock_get");
+				goto err0;
+			}
+			t = KEEPALIVE_TIMEOUT - timeval_diff(W->idle[0].t, tv);
+			timeout = (t > 0.0) ? (int)(t * 1000.0) + 1 : 0;
+		}
+
+		/* Wait for something to happen. */
+		if (poll(W->pfds, W->nwatched + 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			warnp("poll");
+			goto err0;
+		}
+
+		/* Deal with idle clients. */
+		if (watch(W, W->pfds[1].revents != 0))
+			goto err0;
+
+		/* Drain up to ACCEPT_BATCH connections from the backlog. */
+		if (W->pfds[0].revents == 0)
+			continue;
+		for (i = 0; i < ACCEPT_BATCH; i++) {
+			if ((s_conn = accept(W->s, NULL, NULL)) == -1) {
+				if (errno == EINTR)
+					continue;
+				if ((errno == EAGAIN) ||
+				    (errno == EWOULDBLOCK) ||
+				    (errno == ECONNABORTED))
+					break;
+				warnp("accept");
+				goto err0;
+			}
+
+			/* Connections must be blocking for http_serve. */
+			if (((flags = fcntl(s_conn, F_GETFL)) == -1) ||
+			    (fcntl(s_conn, F_SETFL,
+			    flags & ~O_NONBLOCK) == -1)) {
+				warnp("Cannot make socket blocking");
+				close(s_conn);
+				continue;
+			}
+
+			/* Hand the connection to a worker. */
+			if (submit(W, s_conn, NULL))
+				goto err0;
+		}
+	} while (1);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/**
+ * workers_stats_log(W):
+ * Log statistics about the connections passed to the workers ${W}.
+ */
+void
+workers_stats_log(struct workers * W)
+{
+	uint64_t nqueued, nserved, nrejected, nidlefull;
+	double waitsum, waitmax;
+	size_t qcount, nidle;
+	int rc;
+
+	/* Take a snapshot of the statistics. */
+	if ((rc = pthread_mutex_lock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_lock: %s", strerror(rc));
+		return;
+	}
+	nqueued = W->nqueued;
+	nserved = W->nserved;
+	nrejected = W->nrejected;
+	nidlefull = W->nidlefull;
+	waitsum = W->waitsum;
+	waitmax = W->waitmax;
+	qcount = W->qcount;
+	nidle = W->nidle;
+	if ((rc = pthread_mutex_unlock(&W->mtx)) != 0) {
+		warn0("pthread_mutex_unlock: %s", strerror(rc));
+		return;
+	}
+
+	/* Log them. */
+	syslog(LOG_INFO, "imds-proxy: workers (listener %zu): %ju queued, "
+	    "%ju rejected (queue full), %zu waiting; "
+	    "%zu idle clients, %ju closed (too many idle); "
+	    "queue wait mean %.3f ms, max %.3f ms", W->n,
+	    (uintmax_t)nqueued, (uintmax_t)nrejected, qcount,
+	    nidle, (uintmax_t)nidlefull,
+	    nserved ? waitsum * 1000.0 / (double)nserved : 0.0,
+	    waitmax * 1000.0);
+}
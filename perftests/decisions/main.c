@@ -0,0 +1,219 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <grp.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "asprintf.h"
+#include "monoclock.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Measure how long conf_check takes to decide whether a request is allowed,
+ * with a cold decision cache (each uid/gids and path seen for the first
+ * time) and a warm one (the same requests again).  The configuration has
+ * rules naming our user and our group as well as rules which apply to
+ * everyone, and requests come from several principals.
+ */
+
+/* Defaults for the number of rules and paths, and warm passes. */
+#define NRULES 100
+#define NPATHS 1000
+#define NPASSES 10
+
+/* Number of principals making requests. */
+#define NPRINC 4
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: decisions [nrules [npaths]]\n");
+	exit(1);
+}
+
+/* Write a configuration with ${nrules} rules to a temporary file. */
+static char *
+mkconf(size_t nrules)
+{
+	struct passwd * pw;
+	struct group * gr;
+	char * path;
+	FILE * f;
+	size_t i;
+	int fd;
+
+	/* We need names for our user and group. */
+	if ((pw = getpwuid(getuid())) == NULL) {
+		warnp("getpwuid");
+		goto err0;
+	}
+	if ((gr = getgrgid(getgid())) == NULL) {
+		warnp("getgrgid");
+		goto err0;
+	}
+
+	/* Create a temporary file. */
+	if ((path = strdup("/tmp/decisions.XXXXXX")) == NULL) {
+		warnp("strdup");
+		goto err0;
+	}
+	if ((fd = mkstemp(path)) == -1) {
+		warnp("mkstemp");
+		goto err1;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		warnp("fdopen");
+		close(fd);
+		goto err2;
+	}
+
+	/* Write the rules. */
+	fprintf(f, "Allow \"/\"\n");
+	for (i = 0; i < nrules; i++) {
+		switch (i % 3) {
+		case 0:
+			fprintf(f, "Deny user %s \"/p%zu/\"\n",
+			    pw->pw_name, i);
+			break;
+		case 1:
+			fprintf(f, "Allow group %s \"/p%zu/*/x\"\n",
+			    gr->gr_name, i);
+			break;
+		case 2:
+			fprintf(f, "Deny \"/p%zu/secret\"\n", i);
+			break;
+		}
+	}
+	if (fclose(f)) {
+		warnp("fclose");
+		goto err2;
+	}
+
+	/* Success! */
+	return (path);
+
+err2:
+	unlink(path);
+err1:
+	free(path);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Make ${npaths} requests from each principal, and return the time taken. */
+static int
+pass(struct imds_conf * imdsc, char ** paths, size_t npaths,
+    double * t)
+{
+	struct timeval tv0, tv1;
+	gid_t gids[2];
+	uid_t uid;
+	size_t i, j;
+	int nallowed = 0;
+
+	/* Make the requests. */
+	if (monoclock_get(&tv0))
+		goto err0;
+	for (j = 0; j < NPRINC; j++) {
+		uid = (j == 0) ? getuid() : (uid_t)(60000 + j);
+		gids[0] = (j < 2) ? getgid() : (gid_t)(60000 + j);
+		gids[1] = (gid_t)(61000 + j);
+		for (i = 0; i < npaths; i++)
+			nallowed += conf_check(imdsc, paths[i], uid, gids, 2);
+	}
+	if (monoclock_get(&tv1))
+		goto err0;
+
+	/* Make sure the compiler can't skip the requests. */
+	if (nallowed < 0)
+		goto err0;
+
+	/* Return the time taken. */
+	*t = timeval_diff(tv0, tv1);
+
+	/* Success! */
+	return (0);
+
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	struct imds_conf * imdsc;
+	size_t nrules = NRULES;
+	size_t npaths = NPATHS;
+	char ** paths;
+	char * conf;
+	double t, t_cold, t_warm;
+	size_t i;
+
+	WARNP_INIT;
+
+	/* Parse the command line. */
+	if (argc > 3)
+		usage();
+	if ((argc > 1) && ((nrules = strtoul(argv[1], NULL, 0)) == 0))
+		usage();
+	if ((argc > 2) && ((npaths = strtoul(argv[2], NULL, 0)) == 0))
+		usage();
+
+	/* Construct the paths to request. */
+	if ((paths = malloc(npaths * sizeof(char *))) == NULL) {
+		warnp("malloc");
+		exit(1);
+	}
+	for (i = 0; i < npaths; i++) {
+		if (asprintf(&paths[i], "/p%zu/d%zu/x", i % nrules,
+		    i / nrules) == -1) {
+			warnp("asprintf");
+			exit(1);
+		}
+	}
+
+	/* Write and read the configuration. */
+	if ((conf = mkconf(nrules)) == NULL)
+		exit(1);
+	if ((imdsc = conf_read(conf)) == NULL) {
+		warnp("Could not read configuration");
+		exit(1);
+	}
+
+	/* Time requests with a cold cache, then with a warm one. */
+	if (pass(imdsc, paths, npaths, &t_cold))
+		exit(1);
+	t_warm = 0.0;
+	for (i = 0; i < NPASSES; i++) {
+		if (pass(imdsc, paths, npaths, &t))
+			exit(1);
+		t_warm += t;
+	}
+
+	/* Print the results. */
+	printf("%zu rules, %zu decisions: %.0f ns/decision cold, "
+	    "%.0f ns/decision warm\n", nrules, npaths * NPRINC,
+	    t_cold * 1000000000.0 / (double)(npaths * NPRINC),
+	    t_warm * 1000000000.0 / (double)(npaths * NPRINC * NPASSES));
+
+	/* Clean up. */
+	conf_free(imdsc);
+	unlink(conf);
+	free(conf);
+	for (i = 0; i < npaths; i++)
+		free(paths[i]);
+	free(paths);
+
+	/* Success! */
+	exit(0);
+}
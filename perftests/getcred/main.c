@@ -0,0 +1,354 @@
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "monoclock.h"
+#include "noeintr.h"
+#include "warnp.h"
+
+#include "imds-filterd.h"
+
+/*
+ * Measure how long getcred_lookup takes to identify the owner of a new TCP
+ * connection, with and without its cache, while another process holds a
+ * large number of other sockets.  Since the ident service is asked about
+ * each connection to imds-proxy once, each lookup is for a connection which
+ * has just been made, by a process which has made connections before.
+ */
+
+/* Defaults for the number of sockets held and the number of lookups. */
+#define NSOCKETS 10000
+#define NQUERIES 1000
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: getcred [nsockets [nqueries]]\n");
+	exit(1);
+}
+
+/* Create a listening socket on 127.0.0.1 and return its port via ${port}. */
+static int
+listener(uint16_t * port)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int s;
+
+	/* Create and bind a socket, and find out which port it got. */
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		warnp("socket");
+		goto err0;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)&sin, sizeof(sin))) {
+		warnp("bind");
+		goto err1;
+	}
+	if (listen(s, 128)) {
+		warnp("listen");
+		goto err1;
+	}
+	if (getsockname(s, (struct sockaddr *)&sin, &len)) {
+		warnp("getsockname");
+		goto err1;
+	}
+	*port = sin.sin_port;
+
+	/* Success! */
+	return (s);
+
+err1:
+	close(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Connect to 127.0.0.1 on ${port}, and return our port via ${lport}. */
+static int
+connectto(uint16_t port, uint16_t * lport)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int s;
+
+	/* Connect, and find out which port we connected from. */
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		warnp("socket");
+		goto err0;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = port;
+	if (connect(s, (struct sockaddr *)&sin, sizeof(sin))) {
+		warnp("connect");
+		goto err1;
+	}
+	if (getsockname(s, (struct sockaddr *)&sin, &len)) {
+		warnp("getsockname");
+		goto err1;
+	}
+	*lport = sin.sin_port;
+
+	/* Success! */
+	return (s);
+
+err1:
+	close(s);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Hold ${npairs} connections open until ${fd} is closed. */
+static void
+holder(size_t npairs, int fd)
+{
+	uint16_t port, lport;
+	size_t i;
+	char c;
+	int s;
+
+	/* Connect to ourself, repeatedly. */
+	if ((s = listener(&port)) == -1)
+		exit(1);
+	for (i = 0; i < npairs; i++) {
+		if (connectto(port, &lport) == -1)
+			exit(1);
+		if (accept(s, NULL, NULL) == -1) {
+			warnp("accept");
+			exit(1);
+		}
+	}
+
+	/* Tell our parent we're ready, and wait for it to finish. */
+	c = 0;
+	if (noeintr_write(fd, &c, 1) != 1) {
+		warnp("write");
+		exit(1);
+	}
+	while (read(fd, &c, 1) == 1)
+		continue;
+	exit(0);
+}
+
+/* Make a new connection to ${port} each time we're asked via ${fd}. */
+static void
+client(size_t port, int fd)
+{
+	uint16_t lport;
+	char c;
+	int s = -1;
+
+	/* Each byte we read is a request for a new connection. */
+	while (read(fd, &c, 1) == 1) {
+		if (s != -1)
+			close(s);
+		if ((s = connectto((uint16_t)port, &lport)) == -1)
+			exit(1);
+		if (noeintr_write(fd, &lport, 2) != 2) {
+			warnp("write");
+			exit(1);
+		}
+	}
+	exit(0);
+}
+
+/* Fork a child which runs ${func}(${arg}, fd), and return our end of fd. */
+static int
+spawn(void (* func)(size_t, int), size_t arg, pid_t * pid)
+{
+	int fds[2];
+
+	/* Create a socket pair for talking to the child. */
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		warnp("socketpair");
+		goto err0;
+	}
+
+	/* Fork the child. */
+	switch ((*pid = fork())) {
+	case -1:
+		warnp("fork");
+		goto err1;
+	case 0:
+		close(fds[0]);
+		func(arg, fds[1]);
+		/* NOTREACHED */
+	}
+
+	/* We only need one end. */
+	close(fds[1]);
+
+	/* Success! */
+	return (fds[0]);
+
+err1:
+	close(fds[0]);
+	close(fds[1]);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Look up the owners of ${nqueries} new connections made by the client on
+ * ${fd} to the listening socket ${s} at ${port}, using a cache if ${cache} is
+ * non-zero, and return the mean time per lookup via ${mean}.
+ */
+static int
+bench(int cache, int s, uint16_t port, int fd, size_t nqueries,
+    double * mean)
+{
+	struct getcred * G;
+	struct getcred_cred cred;
+	struct timeval tv0, tv1;
+	uint8_t query[12];
+	uint32_t lo = htonl(INADDR_LOOPBACK);
+	uint16_t lport;
+	double total = 0.0;
+	size_t i;
+	char c = 0;
+	int a;
+
+	/* Prepare to look up the owners of connections. */
+	if ((G = getcred_init(cache)) == NULL) {
+		warnp("getcred_init");
+		goto err0;
+	}
+
+	for (i = 0; i < nqueries; i++) {
+		/* Ask the client to make a new connection. */
+		if ((noeintr_write(fd, &c, 1) != 1) ||
+		    (read(fd, &lport, 2) != 2)) {
+			warnp("Error talking to client");
+			goto err1;
+		}
+		if ((a = accept(s, NULL, NULL)) == -1) {
+			warnp("accept");
+			goto err1;
+		}
+
+		/* Construct the query from the client's point of view. */
+		memcpy(&query[0], &lo, 4);
+		memcpy(&query[4], &lport, 2);
+		memcpy(&query[6], &lo, 4);
+		memcpy(&query[10], &port, 2);
+
+		/* Time the lookup. */
+		if (monoclock_get(&tv0))
+			goto err2;
+		if (getcred_lookup(G, query, &cred)) {
+			warn0("getcred_lookup failed");
+			goto err2;
+		}
+		if (monoclock_get(&tv1))
+			goto err2;
+		total += timeval_diff(tv0, tv1);
+
+		/* We're done with this connection. */
+		close(a);
+	}
+
+	/* Clean up. */
+	getcred_free(G);
+
+	/* Return the mean. */
+	*mean = total / (double)nqueries;
+
+	/* Success! */
+	return (0);
+
+err2:
+	close(a);
+err1:
+	getcred_free(G);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+int
+main(int argc, char * argv[])
+{
+	struct rlimit rl;
+	size_t nsockets = NSOCKETS;
+	size_t nqueries = NQUERIES;
+	double t_nocache, t_cache;
+	uint16_t port;
+	pid_t pid_h, pid_c;
+	int fd_h, fd_c;
+	int s;
+	char c;
+
+	WARNP_INIT;
+
+	/* Parse the command line. */
+	if (argc > 3)
+		usage();
+	if ((argc > 1) && ((nsockets = strtoul(argv[1], NULL, 0)) < 2))
+		usage();
+	if ((argc > 2) && ((nqueries = strtoul(argv[2], NULL, 0)) == 0))
+		usage();
+
+	/* We need a lot of file descriptors. */
+	if (getrlimit(RLIMIT_NOFILE, &rl)) {
+		warnp("getrlimit");
+		exit(1);
+	}
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		warnp("setrlimit");
+		exit(1);
+	}
+
+	/* Start a process holding the sockets, and wait until it's ready. */
+	if ((fd_h = spawn(holder, nsockets / 2, &pid_h)) == -1)
+		exit(1);
+	if (read(fd_h, &c, 1) != 1) {
+		warn0("Could not open %zu sockets", nsockets);
+		exit(1);
+	}
+
+	/* Start a process to make connections for us to look up. */
+	if ((s = listener(&port)) == -1)
+		exit(1);
+	if ((fd_c = spawn(client, port, &pid_c)) == -1)
+		exit(1);
+
+	/* Time lookups with and without the cache. */
+	if (bench(0, s, port, fd_c, nqueries, &t_nocache))
+		exit(1);
+	if (bench(1, s, port, fd_c, nqueries, &t_cache))
+		exit(1);
+
+	/* Print the results. */
+	printf("%zu sockets, %zu lookups: %.1f us/lookup without cache, "
+	    "%.1f us/lookup with cache\n", nsockets, nqueries,
+	    t_nocache * 1000000.0, t_cache * 1000000.0);
+
+	/* Shut down the children. */
+	close(fd_c);
+	close(fd_h);
+	waitpid(pid_c, NULL, 0);
+	waitpid(pid_h, NULL, 0);
+	close(s);
+
+	/* Success! */
+	exit(0);
+}
@@ -0,0 +1,399 @@
+#define __BSD_VISIBLE	1	/* Needed for RTLD_NEXT. */
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elasticarray.h"
+#include "monoclock.h"
+#include "parsenum.h"
+#include "warnp.h"
+
+#include "imds-proxy.h"
+
+/*
+ * Replay a corpus of requests against an imds-proxy configuration, to see
+ * what a change to the configuration (or to the code which evaluates it)
+ * does to the time taken to decide whether requests are allowed.  Each line
+ * of the corpus holds a uid, a comma-separated list of gids (or "-" for
+ * none), and a Request-URI, separated by whitespace; blank lines and lines
+ * starting with '#' are ignored.
+ *
+ * Each request goes through uri2path and conf_check, as it would in
+ * imds-proxy.  The first pass starts from a freshly read configuration, so
+ * it shows the cost of decisions which haven't been made before; later
+ * passes show the cost once the decisions have been remembered.  We count
+ * the allocations made while doing this, and report which access rules
+ * decided the requests.
+ */
+
+/* Default number of passes over the corpus after the first. */
+#define NPASSES 10
+
+/* A request. */
+struct req {
+	uid_t uid;
+	gid_t gids[IDENT_NGROUPS];
+	size_t ngid;
+	char * uri;
+};
+
+ELASTICARRAY_DECL(REQLIST, reqlist, struct req);
+
+/* Allocation functions we're wrapping, and the number of allocations. */
+static void * (* real_malloc)(size_t);
+static void * (* real_calloc)(size_t, size_t);
+static void * (* real_realloc)(void *, size_t);
+static int counting = 0;
+static uint64_t nallocs = 0;
+
+/* Count allocations made via malloc, calloc, and realloc. */
+void *
+malloc(size_t size)
+{
+
+	if (real_malloc == NULL)
+		real_malloc = (void * (*)(size_t))dlsym(RTLD_NEXT, "malloc");
+	if (counting)
+		nallocs++;
+	return (real_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+
+	if (real_calloc == NULL)
+		real_calloc = (void * (*)(size_t, size_t))dlsym(RTLD_NEXT,
+		    "calloc");
+	if (counting)
+		nallocs++;
+	return (real_calloc(nmemb, size));
+}
+
+void *
+realloc(void * ptr, size_t size)
+{
+
+	if (real_realloc == NULL)
+		real_realloc = (void * (*)(void *, size_t))dlsym(RTLD_NEXT,
+		    "realloc");
+	if (counting)
+		nallocs++;
+	return (real_realloc(ptr, size));
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: replay conffile corpus [npasses]\n");
+	exit(1);
+}
+
+/* Parse the corpus line ${line} into ${R}. */
+static int
+parseline(char * line, struct req * R)
+{
+	char * p = line;
+	char * s;
+	char * g;
+
+	/* The uid. */
+	while (((s = strsep(&p, " \t")) != NULL) && (*s == '\0'))
+		continue;
+	if ((s == NULL) || PARSENUM(&R->uid, s))
+		goto err0;
+
+	/* The gids. */
+	while (((s = strsep(&p, " \t")) != NULL) && (*s == '\0'))
+		continue;
+	if (s == NULL)
+		goto err0;
+	R->ngid = 0;
+	if (strcmp(s, "-") != 0) {
+		while ((g = strsep(&s, ",")) != NULL) {
+			if (R->ngid == IDENT_NGROUPS)
+				goto err0;
+			if (PARSENUM(&R->gids[R->ngid], g))
+				goto err0;
+			R->ngid++;
+		}
+	}
+
+	/* The Request-URI. */
+	while (((s = strsep(&p, " \t")) != NULL) && (*s == '\0'))
+		continue;
+	if (s == NULL)
+		goto err0;
+	if ((R->uri = strdup(s)) == NULL) {
+		warnp("strdup");
+		goto err0;
+	}
+
+	/* There should be nothing else on the line. */
+	while (((s = strsep(&p, " \t")) != NULL) && (*s == '\0'))
+		continue;
+	if (s != NULL)
+		goto err1;
+
+	/* Success! */
+	return (0);
+
+err1:
+	free(R->uri);
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/*
+ * Read the corpus ${path}, and return via ${nskipped} the number of requests
+ * skipped because their Request-URIs were invalid.
+ */
+static REQLIST
+readcorpus(const char * path, size_t * nskipped)
+{
+	REQLIST reqs;
+	struct req R;
+	FILE * f;
+	char * line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	size_t lineno = 0;
+	char * path2;
+	size_t i;
+
+	/* Make an empty list of requests. */
+	*nskipped = 0;
+	if ((reqs = reqlist_init(0)) == NULL) {
+		warnp("reqlist_init");
+		goto err0;
+	}
+
+	/* Open the file. */
+	if ((f = fopen(path, "r")) == NULL) {
+		warnp("fopen(%s)", path);
+		goto err1;
+	}
+
+	/* Read requests. */
+	while ((linelen = getline(&line, &linecap, f)) != -1) {
+		lineno++;
+
+		/* Strip the newline; skip blank lines and comments. */
+		if ((linelen > 0) && (line[linelen - 1] == '\n'))
+			line[--linelen] = '\0';
+		if ((linelen == 0) || (line[0] == '#'))
+			continue;
+
+		/* Parse the line. */
+		if (parseline(line, &R)) {
+			warn0("Invalid request on line %zu of %s", lineno,
+			    path);
+			goto err2;
+		}
+
+		/* Skip requests which imds-proxy would reject as invalid. */
+		if (uri2path(R.uri, &path2)) {
+			(*nskipped)++;
+			free(R.uri);
+			continue;
+		}
+		free(path2);
+
+		/* Add it to the list. */
+		if (reqlist_append(reqs, &R, 1)) {
+			warnp("reqlist_append");
+			free(R.uri);
+			goto err2;
+		}
+	}
+	if (ferror(f)) {
+		warnp("Error reading %s", path);
+		goto err2;
+	}
+
+	/* Clean up. */
+	free(line);
+	fclose(f);
+
+	/* Success! */
+	return (reqs);
+
+err2:
+	free(line);
+	fclose(f);
+err1:
+	for (i = 0; i < reqlist_getsize(reqs); i++)
+		free(reqlist_get(reqs, i)->uri);
+	reqlist_free(reqs);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+/* Handle each request in ${reqs} once, and return the time taken. */
+static int
+pass(struct imds_conf * imdsc, REQLIST reqs, double * t, size_t * nallowed)
+{
+	struct timeval tv0, tv1;
+	struct req * R;
+	char * path;
+	size_t i;
+
+	/* Handle the requests. */
+	*nallowed = 0;
+	if (monoclock_get(&tv0))
+		goto err0;
+	counting = 1;
+	for (i = 0; i < reqlist_getsize(reqs); i++) {
+		R = reqlist_get(reqs, i);
+		if (uri2path(R->uri, &path))
+			goto err1;
+		if (conf_check(imdsc, path, R->uid, R->gids, R->ngid))
+			(*nallowed)++;
+		free(path);
+	}
+	counting = 0;
+	if (monoclock_get(&tv1))
+		goto err0;
+
+	/* Return the time taken. */
+	*t = timeval_diff(tv0, tv1);
+
+	/* Success! */
+	return (0);
+
+err1:
+	counting = 0;
+err0:
+	/* Failure! */
+	return (-1);
+}
+
+/* Count the requests in ${reqs} which each access rule decides. */
+static size_t *
+explain(struct imds_conf * imdsc, REQLIST reqs, size_t * nnone)
+{
+	size_t * counts;
+	struct req * R;
+	char * path;
+	size_t i, rnum;
+
+	/* Allocate counts for every access rule; conf_nrules is enough. */
+	if ((counts = calloc(conf_nrules(imdsc) + 1, sizeof(size_t))) ==
+	    NULL) {
+		warnp("calloc");
+		goto err0;
+	}
+	*nnone = 0;
+
+	/* Find out which rule decides each request. */
+	for (i = 0; i < reqlist_getsize(reqs); i++) {
+		R = reqlist_get(reqs, i);
+		if (uri2path(R->uri, &path))
+			goto err1;
+		conf_explain(imdsc, path, R->uid, R->gids, R->ngid, &rnum);
+		if (rnum == NORULE)
+			(*nnone)++;
+		else
+			counts[rnum]++;
+		free(path);
+	}
+
+	/* Success! */
+	return (counts);
+
+err1:
+	free(counts);
+err0:
+	/* Failure! */
+	return (NULL);
+}
+
+int
+main(int argc, char * argv[])
+{
+	struct imds_conf * imdsc;
+	REQLIST reqs;
+	size_t npasses = NPASSES;
+	size_t nreqs, nskipped, nallowed, nnone;
+	size_t * counts;
+	uint64_t nallocs_cold;
+	double t, t_cold, t_warm;
+	size_t i;
+
+	WARNP_INIT;
+
+	/* Parse the command line. */
+	if ((argc < 3) || (argc > 4))
+		usage();
+	if ((argc > 3) && (PARSENUM(&npasses, argv[3]) || (npasses == 0)))
+		usage();
+
+	/* Read the configuration and the corpus. */
+	if ((imdsc = conf_read(argv[1])) == NULL) {
+		warnp("Could not read configuration");
+		exit(1);
+	}
+	if ((reqs = readcorpus(argv[2], &nskipped)) == NULL)
+		exit(1);
+	if ((nreqs = reqlist_getsize(reqs)) == 0) {
+		warn0("No requests in %s", argv[2]);
+		exit(1);
+	}
+
+	/* Replay the requests once with nothing remembered. */
+	if (pass(imdsc, reqs, &t_cold, &nallowed))
+		exit(1);
+	nallocs_cold = nallocs;
+
+	/* And again, with the decisions remembered. */
+	nallocs = 0;
+	t_warm = 0.0;
+	for (i = 0; i < npasses; i++) {
+		if (pass(imdsc, reqs, &t, &nallowed))
+			exit(1);
+		t_warm += t;
+	}
+
+	/* Find out which rules decided the requests. */
+	if ((counts = explain(imdsc, reqs, &nnone)) == NULL)
+		exit(1);
+
+	/* Print the results. */
+	printf("%zu rules, %zu requests (%zu allowed, %zu invalid skipped), "
+	    "%zu passes\n", conf_nrules(imdsc), nreqs, nallowed, nskipped,
+	    npasses + 1);
+	printf("first pass: %.0f ns/request, %.2f allocations/request\n",
+	    t_cold * 1000000000.0 / (double)nreqs,
+	    (double)nallocs_cold / (double)nreqs);
+	printf("later passes: %.0f ns/request, %.2f allocations/request\n",
+	    t_warm * 1000000000.0 / (double)(nreqs * npasses),
+	    (double)nallocs / (double)(nreqs * npasses));
+	printf("access rule (counting Allow and Deny lines from 1): "
+	    "requests decided\n");
+	for (i = 0; i < conf_nrules(imdsc); i++) {
+		if (counts[i] == 0)
+			continue;
+		printf("%8zu: %zu (%.1f%%)\n", i + 1, counts[i],
+		    100.0 * (double)counts[i] / (double)nreqs);
+	}
+	printf("    none: %zu (%.1f%%)\n", nnone,
+	    100.0 * (double)nnone / (double)nreqs);
+
+	/* Clean up. */
+	free(counts);
+	for (i = 0; i < nreqs; i++)
+		free(reqlist_get(reqs, i)->uri);
+	reqlist_free(reqs);
+	conf_free(imdsc);
+
+	/* Success! */
+	exit(0);
+}